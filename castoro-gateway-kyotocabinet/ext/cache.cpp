@@ -18,19 +18,219 @@
  *
  */
 
+#include <unistd.h>
 #include "cache.hxx"
 #include "memory.hxx"
+#ifdef HAVE_RUBY_THREAD_H
+# include "ruby/thread.h"
+#endif
+
+/**
+ * check [[peer, content, type, rev], ...] or [[content, type, rev], ...]
+ * before allocating anything, returns the number of tuples.
+ */
+static long
+checkTuples(VALUE _a, bool withPeer)
+{
+  Check_Type(_a, T_ARRAY);
+  long len = RARRAY_LEN(_a);
+  long ofs = withPeer ? 1 : 0;
+
+  for (long i = 0; i < len; i++) {
+    VALUE e = rb_ary_entry(_a, i);
+    Check_Type(e, T_ARRAY);
+    if (RARRAY_LEN(e) != 3+ofs) {
+      rb_raise(rb_eArgError, "wrong number of tuple values (%ld for %ld)", RARRAY_LEN(e), 3+ofs);
+    }
+    if (withPeer) Check_Type(rb_ary_entry(e, 0), T_STRING);
+    NUM2ULL(rb_ary_entry(e, ofs));
+    NUM2UINT(rb_ary_entry(e, ofs+1));
+    NUM2UINT(rb_ary_entry(e, ofs+2));
+  }
+  return len;
+}
+
+// records of a file other than baskets, whose keys are not Key::SIZE bytes.
+static const char META_FORMAT[] = "castoro:format";
+static const char META_PEERS[] = "castoro:peers";
+
+// version of records in a file.
+// 1: { uint64 content, uint32 type, uint32 0 } => { Revision, uint64 peers[] }
+// 2: packed keys, and 16 bits handles of peers.
+static const uint32_t FORMAT_VERSION = 2;
+
+/**
+ * a content of a call, converted with GVL. The handle of the peer is
+ * given by the dictionary after that.
+ */
+struct Tuple
+{
+  Key key;
+  PeerId id;
+  PeerHandle peer;
+  Revision rev;
+};
+
+static void
+toTuples(VALUE _a, bool withPeer, Tuple* tuples, long len)
+{
+  long ofs = withPeer ? 1 : 0;
+
+  for (long i = 0; i < len; i++) {
+    VALUE e = rb_ary_entry(_a, i);
+    tuples[i].key = Key(NUM2ULL(rb_ary_entry(e, ofs)), NUM2UINT(rb_ary_entry(e, ofs+1)));
+    tuples[i].id = withPeer ? rb_to_id(rb_ary_entry(e, 0)) : 0;
+    tuples[i].peer = 0;
+    tuples[i].rev = Val::toRev(NUM2UINT(rb_ary_entry(e, ofs+2)));
+  }
+}
+
+/**
+ * visits the record of each tuple, without GVL. Never calls ruby.
+ */
+class RecordVisitor : public kc::DB::Visitor
+{
+  public:
+    virtual void set(const Tuple& t, size_t i) = 0;  // before the i-th tuple.
+};
+
+/**
+ * copies peers of the revision out of the record bytes in place, 0 for
+ * empty slots or another revision, to peerSize slots of each tuple.
+ * Nothing is allocated.
+ */
+class FindVisitor : public RecordVisitor
+{
+  public:
+    FindVisitor(uint8_t peerSize, PeerHandle* found) { _peerSize = peerSize; _found = found; _peers = found; }
+
+    void set(const Tuple& t, size_t i) {
+      _rev = t.rev;
+      _peers = _found + i * _peerSize;
+      for (uint8_t j = 0; j < _peerSize; j++) _peers[j] = 0;
+    }
+    const char* visit_full(const char* kbuf, size_t ksiz, const char* vbuf, size_t vsiz, size_t* sp) {
+      if (vsiz != Val::getSize(_peerSize)) return NOP;
+      ValView v(vbuf, _peerSize);
+      if (!v.isFound(_rev)) return NOP;
+      for (uint8_t j = 0; j < _peerSize; j++) _peers[j] = v.getPeer(j);
+      return NOP;
+    }
+
+  private:
+    uint8_t _peerSize;
+    Revision _rev;
+    PeerHandle* _found;
+    PeerHandle* _peers;
+};
+
+/**
+ * inserts or removes a peer of the record, which is rewritten from the
+ * inline buffer, or removed if no peers are left. Nothing is allocated.
+ * A peer without a handle is skipped.
+ */
+class UpdateVisitor : public RecordVisitor
+{
+  public:
+    UpdateVisitor(uint8_t peerSize, bool insert) : _val(peerSize) { _valsiz = Val::getSize(peerSize); _insert = insert; }
+
+    void set(const Tuple& t, size_t i) {
+      _peer = t.peer;
+      _rev = t.rev;
+    }
+    const char* visit_full(const char* kbuf, size_t ksiz, const char* vbuf, size_t vsiz, size_t* sp) {
+      if (_peer == 0) return NOP;
+      if (vsiz == _valsiz) _val.deserialize(vbuf); else _val.clear();
+      if (_insert) return insert(sp);
+
+      if (_val.getRev() != _rev) return NOP;
+      _val.removePeer(_peer);
+      if (_val.isEmpty()) return REMOVE;
+      _val.serialize(_buf);
+      *sp = _valsiz;
+      return _buf;
+    }
+    const char* visit_empty(const char* kbuf, size_t ksiz, size_t* sp) {
+      if (!_insert || _peer == 0) return NOP;
+      _val.clear();
+      return insert(sp);
+    }
+
+  private:
+    Val _val;
+    size_t _valsiz;
+    char _buf[Val::MAX_SIZE];
+    PeerHandle _peer;
+    Revision _rev;
+    bool _insert;
+
+    const char* insert(size_t* sp) {
+      _val.setRev(_rev);
+      _val.insertPeer(_peer);
+      _val.serialize(_buf);
+      *sp = _valsiz;
+      return _buf;
+    }
+};
+
+struct AcceptRequest
+{
+  kc::PolyDB* db;
+  const Tuple* tuples;
+  long len;
+  RecordVisitor* visitor;
+  bool writable;
+  bool ret;
+  uint64_t finished;
+};
+
+static void*
+acceptWithoutGvl(void* data)
+{
+  AcceptRequest* req = (AcceptRequest*)data;
+
+  char kbuf[Key::SIZE];
+
+  req->ret = true;
+  for (long i = 0; req->ret && i < req->len; i++) {
+    req->tuples[i].key.serialize(kbuf);
+    req->visitor->set(req->tuples[i], i);
+    req->ret = req->db->accept(kbuf, Key::SIZE, req->visitor, req->writable);
+  }
+  req->finished = Histogram::now();
+  return NULL;
+}
+
+/**
+ * visits records of the tuples without GVL, so that calls of threads
+ * overlap. kc locks each record by itself, an update of a record is done
+ * in one accept. The wait for GVL after that is recorded.
+ */
+static bool
+accept(kc::PolyDB* db, const Tuple* tuples, long len, RecordVisitor* visitor, bool writable, Histogram& wait)
+{
+  AcceptRequest req = { db, tuples, len, visitor, writable, true, 0 };
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(acceptWithoutGvl, &req, NULL, NULL);
+  wait.record(Histogram::now() - req.finished);
+#else
+  acceptWithoutGvl(&req);
+  wait.record(0);
+#endif
+  return req.ret;
+}
 
 Cache::Cache()
 {
   _db = (kc::PolyDB*)ruby_xmalloc(sizeof(kc::PolyDB));
   new( (void*)_db ) kc::PolyDB;
+  _persistent = false;
   _expire = 15;
   _peerSize = 3;
   _logger = NULL;
-  _locker = NULL;
   _requests = 0;
   _hits = 0;
+  _seed = ((uint64_t)time(NULL) << 20) ^ (uint64_t)(uintptr_t)this;
 }
 
 Cache::~Cache()
@@ -62,20 +262,165 @@ Cache::init(VALUE size, VALUE options)
   }
   VALUE peerSize = rb_hash_aref(options, sym_peer_size);
   if (RTEST(peerSize)) {
-    if (RTEST(rb_funcall(peerSize, id_less_eql, 1, INT2NUM(0)))) {
-      rb_throw("peer_size must be > 0", rb_eArgError);
+    if (RTEST(rb_funcall(peerSize, id_less_eql, 1, INT2NUM(0))) ||
+        !RTEST(rb_funcall(peerSize, id_less_eql, 1, INT2NUM(PEER_SIZE_MAX)))) {
+      rb_throw("peer_size must be 1..8", rb_eArgError);
     }
     _peerSize = NUM2UINT(peerSize);
   }
   _valsiz = Val::getSize(_peerSize);
 
-  VALUE format = rb_str_new2("*#capsiz=%d");
-  VALUE arg = rb_funcall(format, id_format, 1, size);
+  _peers.init();
+  open(size, options);
+}
+
+/**
+ * appends "#name=value" of a tuning parameter of kc, if it is given.
+ */
+static void
+appendTuning(std::string* arg, const char* name, VALUE value)
+{
+  char buf[64];
 
-  _locker = rb_class_new_instance(0, NULL, cls_mutex);
-  if (!_db->open(StringValuePtr(arg))) raiseOnError();
+  if (NIL_P(value)) return;
+  if (NUM2LL(value) < 0) {
+    snprintf(buf, sizeof(buf), "%s must be >= 0", name);
+    rb_throw(buf, rb_eArgError);
+  }
+  snprintf(buf, sizeof(buf), "#%s=%lld", name, NUM2LL(value));
+  arg->append(buf);
+}
 
-  _peers.init();
+/**
+ * records are kept in a file of kc by options[:path], HashDB of *.kch or
+ * TreeDB of *.kct tuned by the options, so that the gateway restarts with
+ * them. Otherwise in memory of CacheDB, size bytes at most.
+ *
+ * A file which is broken, or of another format or peer_size, is recreated
+ * unless options[:recover] is false.
+ */
+void
+Cache::open(VALUE size, VALUE options)
+{
+  VALUE path = rb_hash_aref(options, sym_path);
+  if (!RTEST(path)) {
+    VALUE format = rb_str_new2("*#capsiz=%d");
+    VALUE arg = rb_funcall(format, id_format, 1, size);
+    if (!_db->open(StringValuePtr(arg))) raiseOnError();
+    return;
+  }
+
+  std::string file(StringValueCStr(path));
+  std::string ext = (file.size() > 4) ? file.substr(file.size() - 4) : "";
+  if (ext != ".kch" && ext != ".kct") {
+    rb_throw("path must be *.kch or *.kct", rb_eArgError);
+  }
+
+  VALUE opts = rb_hash_aref(options, sym_opts);
+  if (!NIL_P(opts)) {
+    StringValue(opts);
+    if (strspn(StringValueCStr(opts), "slc") != (size_t)RSTRING_LEN(opts)) {
+      rb_throw("opts must be of s, l and c", rb_eArgError);
+    }
+  }
+  VALUE msiz = rb_hash_aref(options, sym_msiz);
+
+  std::string arg(file);
+  appendTuning(&arg, "bnum", rb_hash_aref(options, sym_bnum));
+  appendTuning(&arg, "apow", rb_hash_aref(options, sym_apow));
+  appendTuning(&arg, "fpow", rb_hash_aref(options, sym_fpow));
+  appendTuning(&arg, "msiz", NIL_P(msiz) ? size : msiz);
+  appendTuning(&arg, "dfunit", rb_hash_aref(options, sym_dfunit));
+  if (!NIL_P(opts)) arg.append("#opts=").append(StringValueCStr(opts));
+
+  bool recover = (rb_hash_aref(options, sym_recover) != Qfalse);
+  uint32_t mode = kc::PolyDB::OWRITER | kc::PolyDB::OCREATE;
+  if (!recover) mode |= kc::PolyDB::ONOREPAIR;
+
+  if (!_db->open(arg, mode)) {
+    if (!recover || _db->error().code() != kc::PolyDB::Error::BROKEN) raiseOnError();
+    warn("kc file is broken, recreated.");
+    unlink(file.c_str());
+    if (!_db->open(arg, mode)) raiseOnError();
+  }
+  _persistent = true;
+
+  if (!checkFormat() || !loadPeers()) {
+    if (!recover) rb_raise(cls_err_invalid, "%s: another format or peer_size", file.c_str());
+    warn("kc file is of another format or peer_size, cleared.");
+    _dictionary.clear();
+    if (!_db->clear()) raiseOnError();
+  }
+
+  uint32_t format[3] = { FORMAT_VERSION, _peerSize, sizeof(Revision) };
+  if (!_db->set(META_FORMAT, sizeof(META_FORMAT)-1, (const char*)format, sizeof(format))) raiseOnError();
+}
+
+/**
+ * a new file, or one which has the same format and peer_size.
+ */
+bool
+Cache::checkFormat()
+{
+  uint32_t expected[3] = { FORMAT_VERSION, _peerSize, sizeof(Revision) };
+  uint32_t stored[3];
+
+  int32_t n = _db->get(META_FORMAT, sizeof(META_FORMAT)-1, (char*)stored, sizeof(stored));
+  if (n < 0) return _db->count() == 0;
+  return n == sizeof(stored) && memcmp(stored, expected, sizeof(stored)) == 0;
+}
+
+bool
+Cache::loadPeers()
+{
+  size_t size;
+  char* stream = _db->get(META_PEERS, sizeof(META_PEERS)-1, &size);
+  if (!stream) return true;
+
+  bool ret = _dictionary.deserialize(stream, size, _peers);
+  delete[] stream;
+  return ret;
+}
+
+/**
+ * the dictionary is written when a peer is added, since records refer to
+ * it by handles, and statuses of peers are written with it at close, to
+ * be restored by the next process of the file.
+ */
+void
+Cache::savePeers()
+{
+  if (!_persistent) return;
+
+  std::string stream;
+  _dictionary.serialize(&stream, _peers);
+  if (!_db->set(META_PEERS, sizeof(META_PEERS)-1, stream.data(), stream.size())) raiseOnError();
+}
+
+/**
+ * a peer is given a handle when it is inserted, 0 for others.
+ */
+PeerHandle
+Cache::toHandle(PeerId id, bool intern)
+{
+  if (!intern) return _dictionary.find(id);
+
+  bool added;
+  PeerHandle handle = _dictionary.intern(id, &added);
+  if (added) savePeers();
+  return handle;
+}
+
+void
+Cache::toHandles(Tuple* tuples, long len, bool intern)
+{
+  for (long i = 0; i < len; i++) tuples[i].peer = toHandle(tuples[i].id, intern);
+}
+
+void
+Cache::warn(const char* message) const
+{
+  if (_logger) rb_funcall(_logger, id_warn, 1, rb_str_new2(message));
 }
 
 void
@@ -83,29 +428,28 @@ Cache::mark()
 {
   _peers.mark();
   if (_logger) rb_gc_mark(_logger);
-  if (_locker) rb_gc_mark(_locker);
 }
 
 VALUE
 Cache::find(VALUE _c, VALUE _t, VALUE _r)
 {
+  Stopwatch sw(_histograms[HIST_FIND]);
   VALUE result = rb_ary_new();
   bool hit = false;
 
   _requests++;
 
-  Key k(NUM2ULL(_c), NUM2UINT(_t));
-  Val v(_peerSize);
+  Tuple t = { Key(NUM2ULL(_c), NUM2UINT(_t)), 0, 0, Val::toRev(NUM2UINT(_r)) };
+  PeerHandle p[PEER_SIZE_MAX];
+  FindVisitor visitor(_peerSize, p);
 
-  if (!get(k, &v, true)) return result;
+  if (!accept(_db, &t, 1, &visitor, false, _histograms[HIST_LOCK_WAIT])) raiseOnError();
 
-  if (NUM2UINT(_r) != v.getRev()) return result;
-
-  PeerId* p = v.getPeers();
   for (uint8_t i = 0; i < _peerSize; i++) {
-    if (*(p+i) != 0 && _peers.getStatus(*(p+i)).isReadable(_expire)) {
+    PeerId id = _dictionary.getId(p[i]);
+    if (id != 0 && _peers.getStatus(id).isReadable(_expire)) {
       hit = true;
-      rb_ary_push(result, rb_funcall(ID2SYM(*(p+i)), id_to_s, 0));
+      rb_ary_push(result, rb_funcall(ID2SYM(id), id_to_s, 0));
     }
   }
 
@@ -141,48 +485,140 @@ Cache::findPeers(VALUE requireSpaces)
   return ret;
 }
 
+VALUE
+Cache::selectPeers(VALUE requireSpaces, VALUE count, VALUE candidates)
+{
+  VALUE ret = rb_ary_new();
+  uint64_t want = NUM2ULL(count);
+  uint64_t space = NUM2ULL(requireSpaces);
+  Peers::PeerList allowed;
+
+  if (!NIL_P(candidates)) {
+    Check_Type(candidates, T_ARRAY);
+    for (long i = 0; i < RARRAY_LEN(candidates); i++) {
+      allowed.push_back(rb_to_id(rb_ary_entry(candidates, i)));
+    }
+    std::sort(allowed.begin(), allowed.end());
+  }
+  if (want == 0) return ret;
+
+  uint64_t peerCount = _peers.getCount();
+  if (want > peerCount) want = peerCount;
+  Memory<ID> peers(want + 1);
+  _seed += 0x2545F4914F6CDD1DULL;
+
+  _peers.select(peers.pointer(), &want, want, _expire, space, _seed, NIL_P(candidates) ? NULL : &allowed);
+  for (uint64_t i = 0; i < want; i++) {
+    rb_ary_push(ret, rb_funcall(ID2SYM(*(peers.pointer()+i)), id_to_s, 0));
+  }
+  return ret;
+}
+
 void
 Cache::insertElement(VALUE _p, VALUE _c, VALUE _t, VALUE _r)
 {
-  uint8_t r = (uint8_t)(NUM2UINT(_r) & 255);
-  Key k(NUM2ULL(_c), NUM2UINT(_t));
-  Val v(_peerSize);
-  PeerId p = rb_to_id(_p);
-  Memory<char> m(_valsiz);
-  bool ret;
+  Stopwatch sw(_histograms[HIST_INSERT]);
+  Tuple t = { Key(NUM2ULL(_c), NUM2UINT(_t)), rb_to_id(_p), 0, Val::toRev(NUM2UINT(_r)) };
+  UpdateVisitor visitor(_peerSize, true);
 
-  rb_mutex_lock(_locker);
-  get(k, &v, false);
-  v.setRev(r);
-  v.insertPeer(p);
-  v.serialize(m.pointer());
-  ret = _db->set((const char*)&k, sizeof(k), m.pointer(), _valsiz);
-  rb_mutex_unlock(_locker);
+  toHandles(&t, 1, true);
 
-  if (!ret) raiseOnError();
+  if (!accept(_db, &t, 1, &visitor, true, _histograms[HIST_LOCK_WAIT])) raiseOnError();
 }
 
 void
 Cache::eraseElement(VALUE _p, VALUE _c, VALUE _t, VALUE _r)
 {
-  char r = (char)(NUM2UINT(_r) & 255);
-  Key k(NUM2ULL(_c), NUM2UINT(_t));
-  Val v(_peerSize);
-  PeerId p = rb_to_id(_p);
-  Memory<char> m(_valsiz);
-  bool ret = true;
-
-  rb_mutex_lock(_locker);
-  if (get(k, &v, false) && r == v.getRev()) {
-    v.removePeer(p);
-    if (v.isEmpty()) {
-      ret = _db->remove((const char*)&k, sizeof(k));
-    } else {
-      v.serialize(m.pointer());
-      ret = _db->set((const char*)&k, sizeof(k), m.pointer(), _valsiz);
+  Stopwatch sw(_histograms[HIST_REMOVE]);
+  Tuple t = { Key(NUM2ULL(_c), NUM2UINT(_t)), rb_to_id(_p), 0, Val::toRev(NUM2UINT(_r)) };
+  UpdateVisitor visitor(_peerSize, false);
+
+  toHandles(&t, 1, false);
+  if (t.peer == 0) return;
+
+  if (!accept(_db, &t, 1, &visitor, true, _histograms[HIST_LOCK_WAIT])) raiseOnError();
+}
+
+/**
+ * tuples are converted with GVL at once, and records are visited in
+ * place without GVL. The peers found are copied to one buffer.
+ */
+VALUE
+Cache::findMany(VALUE _a)
+{
+  long len = checkTuples(_a, false);
+  Stopwatch sw(_histograms[HIST_FIND]);
+  VALUE result = rb_ary_new2(len);
+  bool ret;
+
+  {
+    Memory<Tuple> tuples(len + 1);
+    Memory<PeerHandle> found(len * _peerSize + 1);
+    FindVisitor visitor(_peerSize, found.pointer());
+
+    toTuples(_a, false, tuples.pointer(), len);
+    ret = accept(_db, tuples.pointer(), len, &visitor, false, _histograms[HIST_LOCK_WAIT]);
+
+    for (long i = 0; ret && i < len; i++) {
+      VALUE peers = rb_ary_new();
+      PeerHandle* p = found.pointer() + i * _peerSize;
+      bool hit = false;
+      _requests++;
+
+      for (uint8_t j = 0; j < _peerSize; j++) {
+        PeerId id = _dictionary.getId(p[j]);
+        if (id != 0 && _peers.getStatus(id).isReadable(_expire)) {
+          hit = true;
+          rb_ary_push(peers, rb_funcall(ID2SYM(id), id_to_s, 0));
+        }
+      }
+
+      if (hit) _hits++;
+      rb_ary_push(result, peers);
     }
   }
-  rb_mutex_unlock(_locker);
+
+  if (!ret) raiseOnError();
+  return result;
+}
+
+void
+Cache::insertMany(VALUE _a)
+{
+  long len = checkTuples(_a, true);
+  Stopwatch sw(_histograms[HIST_INSERT]);
+  bool ret;
+
+  {
+    Memory<Tuple> tuples(len + 1);
+    UpdateVisitor visitor(_peerSize, true);
+
+    toTuples(_a, true, tuples.pointer(), len);
+    toHandles(tuples.pointer(), len, true);
+    ret = accept(_db, tuples.pointer(), len, &visitor, true, _histograms[HIST_LOCK_WAIT]);
+  }
+
+  if (!ret) raiseOnError();
+}
+
+/**
+ * empty records are removed, others are rewritten.
+ */
+void
+Cache::eraseMany(VALUE _a)
+{
+  long len = checkTuples(_a, true);
+  Stopwatch sw(_histograms[HIST_REMOVE]);
+  bool ret;
+
+  {
+    Memory<Tuple> tuples(len + 1);
+    UpdateVisitor visitor(_peerSize, false);
+
+    toTuples(_a, true, tuples.pointer(), len);
+    toHandles(tuples.pointer(), len, false);
+    ret = accept(_db, tuples.pointer(), len, &visitor, true, _histograms[HIST_LOCK_WAIT]);
+  }
 
   if (!ret) raiseOnError();
 }
@@ -202,34 +638,59 @@ Cache::setPeerStatus(VALUE _p, VALUE _s)
 {
   VALUE a = rb_hash_aref(_s, sym_available);
   VALUE s = rb_hash_aref(_s, sym_status);
+  PeerId id = rb_to_id(_p);
 
   if (RTEST(a) && RTEST(s)) {
-    _peers.set(rb_to_id(_p), (uint64_t)NUM2ULL(a), (uint32_t)NUM2UINT(s));
+    _peers.set(id, (uint64_t)NUM2ULL(a), (uint32_t)NUM2UINT(s));
   } else if (RTEST(a)) {
-    _peers.set(rb_to_id(_p), (uint64_t)NUM2ULL(a));
+    _peers.set(id, (uint64_t)NUM2ULL(a));
   } else if (RTEST(s)) {
-    _peers.set(rb_to_id(_p), (uint32_t)NUM2UINT(s));
+    _peers.set(id, (uint32_t)NUM2UINT(s));
+  } else {
+    return;
   }
+
+  if (_persistent) toHandle(id, true);
 }
 
-void
-Cache::dump(VALUE _f)
+/**
+ * peers to dump as an array, or nil for all. All are checked at first,
+ * not to raise after allocation.
+ */
+static VALUE
+dumpPeers(VALUE _p)
 {
-  Traverser tr(_db, _locker, _peerSize, _valsiz);
-
-  tr.traverse(Dumper(_f));
-  raiseOnError();
-  rb_funcall(_f, id_puts, 0);
+  if (!RTEST(_p)) return Qnil;
+  VALUE a = rb_check_array_type(_p);
+  if (NIL_P(a)) a = rb_ary_new3(1, _p);
+  for (long i = 0; i < RARRAY_LEN(a); i++) rb_to_id(rb_ary_entry(a, i));
+  return a;
 }
 
+/**
+ * native dump by a parallel scan without GVL, to the file descriptor, or
+ * through memory to io if fd < 0.
+ */
 void
-Cache::dump(VALUE _f, VALUE _p)
+Cache::dump(VALUE _f, VALUE _p, int fd, bool binary)
 {
-  Traverser tr(_db, _locker, _peerSize, _valsiz);
-
-  tr.traverse(FilteredDumper(_f, _p));
-  raiseOnError();
-  rb_funcall(_f, id_puts, 0);
+  VALUE a = dumpPeers(_p);
+  VALUE str = Qnil;
+  bool ret;
+  int err;
+  {
+    DumpPeers peers(_dictionary, a);
+    DumpSink sink(fd);
+    Dumper dumper(sink, peers, binary, _peerSize, _valsiz);
+    Traverser tr(_db);
+
+    ret = tr.traverse(dumper);
+    err = sink.getErrno();
+    if (ret && fd < 0) str = rb_str_new(sink.getString().data(), sink.getString().size());
+  }
+  if (err) rb_syserr_fail(err, "dump");
+  if (!ret) raiseOnError();
+  if (!NIL_P(str)) rb_io_write(_f, str);
 }
 
 VALUE
@@ -273,6 +734,40 @@ Cache::stat(VALUE _k)
   return ULL2NUM(ret);
 }
 
+/**
+ * latency summaries by usec, of each call of a content or a batch.
+ * lock_wait is the wait for GVL after kc is called without it.
+ */
+VALUE
+Cache::histograms(bool clear)
+{
+  static const char* names[HIST_COUNT] = { "find", "insert", "remove", "lock_wait" };
+  VALUE ret = rb_hash_new();
+
+  for (int i = 0; i < HIST_COUNT; i++) {
+    rb_hash_aset(ret, ID2SYM(rb_intern(names[i])), _histograms[i].toHash());
+    if (clear) _histograms[i].clear();
+  }
+  return ret;
+}
+
+/**
+ * statuses of peers are saved only here, at exit unless closed before.
+ */
+void
+Cache::close()
+{
+  savePeers();
+  _persistent = false;
+  if (!_db->close()) raiseOnError();
+}
+
+bool
+Cache::isPersistent() const
+{
+  return _persistent;
+}
+
 void
 Cache::raiseOnError() const
 {
@@ -306,26 +801,5 @@ Cache::raiseOnError() const
   default:
     return;
   }
-  if (rb_mutex_locked_p(_locker)) rb_mutex_unlock(_locker);
   rb_raise(klass, "%u: %s", code, message);
 }
-
-bool
-Cache::get(const Key& k, Val* v, bool lock) const
-{
-  bool ret;
-  Memory<char> m(_valsiz);
-
-  if (lock) rb_mutex_lock(_locker);
-  ret = _db->get((const char*)&k, sizeof(k), m.pointer(), _valsiz) != -1;
-  if (lock) rb_mutex_unlock(_locker);
-
-  if (ret) {
-    v->deserialize(m.pointer());
-  } else {
-    raiseOnError();
-  } 
-
-  return ret;
-}
-
@@ -25,12 +25,24 @@
 #include "key.hxx"
 #include "val.hxx"
 #include "peers.hxx"
+#include "dictionary.hxx"
 #include "status.hxx"
 #include "traverse.hxx"
+#include "histogram.hxx"
+
+struct Tuple;
 
 class Cache
 {
   public:
+    enum {
+      HIST_FIND = 0,
+      HIST_INSERT,
+      HIST_REMOVE,
+      HIST_LOCK_WAIT,
+      HIST_COUNT
+    };
+
     Cache();
     virtual ~Cache();
 
@@ -39,29 +51,44 @@ class Cache
     VALUE find(VALUE _c, VALUE _t, VALUE _r);
     VALUE findPeers();
     VALUE findPeers(VALUE requireSpaces);
+    VALUE selectPeers(VALUE requireSpaces, VALUE count, VALUE candidates);
     void  insertElement(VALUE _p, VALUE _c, VALUE _t, VALUE _r);
     void  eraseElement(VALUE _p, VALUE _c, VALUE _t, VALUE _r);
+    VALUE findMany(VALUE _a);
+    void  insertMany(VALUE _a);
+    void  eraseMany(VALUE _a);
     VALUE getPeerStatus(VALUE _p);
     void  setPeerStatus(VALUE _p, VALUE _s);
-    void  dump(VALUE _f);
-    void  dump(VALUE _f, VALUE _p);
+    void  dump(VALUE _f, VALUE _p, int fd, bool binary);
     VALUE stat(VALUE _k);
+    VALUE histograms(bool clear);
+    void  close();
+    bool  isPersistent() const;
 
     void raiseOnError() const;
 
   private:
     kc::PolyDB* _db;
     Peers _peers;
+    PeerDictionary _dictionary;
+    bool _persistent;
     time_t _expire;
     uint8_t _peerSize;
     size_t _valsiz;
     VALUE _logger;
-    VALUE _locker;
 
     uint64_t _requests;
     uint64_t _hits;
+    uint64_t _seed;
+    mutable Histogram _histograms[HIST_COUNT];
 
-    bool get(const Key& k, Val* v, bool lock) const;
+    void open(VALUE size, VALUE options);
+    bool checkFormat();
+    bool loadPeers();
+    void savePeers();
+    PeerHandle toHandle(PeerId id, bool intern);
+    void toHandles(Tuple* tuples, long len, bool intern);
+    void warn(const char* message) const;
 };
 
 #endif // _INCLUDE_CACHE_H_
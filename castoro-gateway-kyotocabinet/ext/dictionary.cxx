@@ -0,0 +1,123 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dictionary.hxx"
+
+PeerDictionary::PeerDictionary()
+{
+}
+
+PeerHandle
+PeerDictionary::find(PeerId id) const
+{
+  Handles::const_iterator it = _handles.find(id);
+  return (it == _handles.end()) ? 0 : it->second;
+}
+
+PeerHandle
+PeerDictionary::intern(PeerId id, bool* added)
+{
+  PeerHandle handle = find(id);
+
+  *added = false;
+  if (handle == 0 && _ids.size() < HANDLE_MAX) {
+    _ids.push_back(id);
+    handle = (PeerHandle)_ids.size();
+    _handles[id] = handle;
+    *added = true;
+  }
+  return handle;
+}
+
+PeerId
+PeerDictionary::getId(PeerHandle handle) const
+{
+  return (handle > 0 && handle <= _ids.size()) ? _ids[handle-1] : 0;
+}
+
+uint64_t
+PeerDictionary::getCount() const
+{
+  return _ids.size();
+}
+
+void
+PeerDictionary::clear()
+{
+  _handles.clear();
+  _ids.clear();
+}
+
+void
+PeerDictionary::serialize(std::string* stream, Peers& peers) const
+{
+  uint32_t count = _ids.size();
+
+  stream->clear();
+  stream->append((const char*)&count, sizeof(count));
+  for (uint32_t i = 0; i < count; i++) {
+    Status st = peers.getStatus(_ids[i]);
+    uint64_t available = st.getAvailable();
+    uint32_t status = st.getStatus();
+    const char* name = rb_id2name(_ids[i]);
+    uint32_t len = strlen(name);
+
+    stream->append((const char*)&available, sizeof(available));
+    stream->append((const char*)&status, sizeof(status));
+    stream->append((const char*)&len, sizeof(len));
+    stream->append(name, len);
+  }
+}
+
+/**
+ * peers which had a status are readable again until watchdog_limit, as
+ * if their last status was just received.
+ */
+bool
+PeerDictionary::deserialize(const char* stream, size_t size, Peers& peers)
+{
+  const char* end = stream + size;
+  const size_t head = sizeof(uint64_t) + sizeof(uint32_t) * 2;
+  uint32_t count;
+
+  if (size < sizeof(count)) return false;
+  memcpy(&count, stream, sizeof(count));
+  stream += sizeof(count);
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t available;
+    uint32_t status, len;
+    bool added;
+
+    if ((size_t)(end - stream) < head) return false;
+    memcpy(&available, stream, sizeof(available));
+    memcpy(&status, stream + 8, sizeof(status));
+    memcpy(&len, stream + 12, sizeof(len));
+    stream += head;
+    if ((size_t)(end - stream) < len) return false;
+
+    PeerId id = rb_intern2(stream, len);
+    stream += len;
+    intern(id, &added);
+    if (!added) return false;
+    if (status != 0) peers.set(id, available, status);
+  }
+  return true;
+}
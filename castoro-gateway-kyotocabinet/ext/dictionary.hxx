@@ -0,0 +1,61 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_DICTIONARY_H_
+#define _INCLUDE_DICTIONARY_H_
+
+#include "stdinc.hxx"
+#include "peers.hxx"
+#include "allocator.hxx"
+
+/**
+ * handles of peers kept in records instead of ruby IDs, which differ by
+ * processes and take 8 bytes, so that records of a file outlive the
+ * gateway. Handles are from 1 in the order peers are seen, 0 is no peer.
+ *
+ * serialized: uint32 count, and then { uint64 available, uint32 status,
+ * uint32 bytes of the name, name } of each handle in order.
+ */
+class PeerDictionary
+{
+  private:
+    typedef std::map<PeerId, PeerHandle, std::less<PeerId>, Allocator<std::pair<const PeerId, PeerHandle> > > Handles;
+    typedef std::vector<PeerId, Allocator<PeerId> > Ids;
+
+  public:
+    static const PeerHandle HANDLE_MAX = 0xffff;
+
+    PeerDictionary();
+
+    PeerHandle find(PeerId id) const;         // 0 if it has no handle.
+    PeerHandle intern(PeerId id, bool* added);  // 0 if HANDLE_MAX peers have handles.
+    PeerId getId(PeerHandle handle) const;    // 0 for no peer.
+    uint64_t getCount() const;
+    void clear();
+
+    void serialize(std::string* stream, Peers& peers) const;
+    bool deserialize(const char* stream, size_t size, Peers& peers);  // restores statuses too.
+
+  private:
+    Handles _handles;
+    Ids _ids;  // by handle - 1.
+};
+
+#endif // _INCLUDE_DICTIONARY_H_
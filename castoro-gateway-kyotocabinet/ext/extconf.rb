@@ -40,6 +40,17 @@ kclibs = "-lkyotocabinet -lz -lstdc++ -lrt -lpthread -lm -lc" if(kclibs.length <
 Config::CONFIG["CPP"] = "g++ -E"
 
 $CFLAGS = "-I. #{kccflags} -Wall #{$CFLAGS} -O2"
+
+# kc is called without GVL, it locks records by itself.
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# bits of revisions kept in records, 8, 16 or 32.
+revision_bits = with_config('revision-bits', '16')
+unless %w(8 16 32).include?(revision_bits.to_s)
+  abort "--with-revision-bits must be 8, 16 or 32."
+end
+$defs.push("-DREVISION_BITS=#{revision_bits}")
 $LDFLAGS = "#{$LDFLAGS} -L. #{kcldflags}"
 $libs = "#{$libs} #{kclibs}"
 
@@ -0,0 +1,135 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+#include "histogram.hxx"
+
+Histogram::Histogram()
+{
+  clear();
+}
+
+void
+Histogram::record(uint64_t nsec)
+{
+  __sync_fetch_and_add(&_counts[bucket(nsec)], 1);
+  if (nsec == 0) return;
+  __sync_fetch_and_add(&_sum, nsec);
+  for (uint64_t m = _max; nsec > m; m = _max) {
+    if (__sync_bool_compare_and_swap(&_max, m, nsec)) break;
+  }
+}
+
+void
+Histogram::clear()
+{
+  memset(_counts, 0, sizeof(_counts));
+  _sum = 0;
+  _max = 0;
+}
+
+uint64_t
+Histogram::getCount() const
+{
+  uint64_t ret = 0;
+  for (size_t i = 0; i < BUCKETS; i++) ret += _counts[i];
+  return ret;
+}
+
+uint64_t
+Histogram::getSum() const
+{
+  return _sum;
+}
+
+uint64_t
+Histogram::getMax() const
+{
+  return _max;
+}
+
+/**
+ * the upper bound of the bucket which has the p percent value, never over the max.
+ */
+uint64_t
+Histogram::getPercentile(double p) const
+{
+  uint64_t total = getCount();
+  if (total == 0) return 0;
+  uint64_t rank = (uint64_t)(total * p / 100.0 + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > total) rank = total;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += _counts[i];
+    if (seen >= rank) return (upper(i) < _max) ? upper(i) : _max;
+  }
+  return _max;
+}
+
+/**
+ * { :count, :mean, :p50, :p90, :p99, :p999, :max } by usec.
+ */
+VALUE
+Histogram::toHash() const
+{
+  uint64_t count = getCount();
+  VALUE ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("count")), ULL2NUM(count));
+  rb_hash_aset(ret, ID2SYM(rb_intern("mean")), rb_float_new(count ? _sum / 1000.0 / count : 0.0));
+  rb_hash_aset(ret, ID2SYM(rb_intern("p50")), rb_float_new(getPercentile(50.0) / 1000.0));
+  rb_hash_aset(ret, ID2SYM(rb_intern("p90")), rb_float_new(getPercentile(90.0) / 1000.0));
+  rb_hash_aset(ret, ID2SYM(rb_intern("p99")), rb_float_new(getPercentile(99.0) / 1000.0));
+  rb_hash_aset(ret, ID2SYM(rb_intern("p999")), rb_float_new(getPercentile(99.9) / 1000.0));
+  rb_hash_aset(ret, ID2SYM(rb_intern("max")), rb_float_new(_max / 1000.0));
+  return ret;
+}
+
+uint64_t
+Histogram::now()
+{
+  struct timespec ts = { 0, 0 };
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t
+Histogram::bucket(uint64_t nsec)
+{
+  if (nsec < SUB_BUCKETS) return (size_t)nsec;
+  int shift = 63 - __builtin_clzll(nsec) - SUB_BITS;
+  return (size_t)(shift + 1) * SUB_BUCKETS + ((nsec >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t
+Histogram::lower(size_t bucket)
+{
+  if (bucket < SUB_BUCKETS) return bucket;
+  size_t shift = bucket / SUB_BUCKETS - 1;
+  return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+uint64_t
+Histogram::upper(size_t bucket)
+{
+  return (bucket + 1 < BUCKETS) ? lower(bucket + 1) - 1 : ~0ULL;
+}
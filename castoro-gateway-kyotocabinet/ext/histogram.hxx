@@ -0,0 +1,77 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INCLUDE_HISTOGRAM_H_
+#define _INCLUDE_HISTOGRAM_H_
+
+#include "stdinc.hxx"
+
+/**
+ * log-linear histogram of latencies by nsec.
+ *
+ * a value is counted in the bucket of its highest bit and the next
+ * SUB_BITS bits, so that a bucket is within 1/SUB_BUCKETS of its values.
+ */
+class Histogram
+{
+  public:
+    enum {
+      SUB_BITS = 3,
+      SUB_BUCKETS = 1 << SUB_BITS,
+      BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS
+    };
+
+    Histogram();
+
+    void record(uint64_t nsec);
+    void clear();
+
+    uint64_t getCount() const;
+    uint64_t getSum() const;
+    uint64_t getMax() const;
+    uint64_t getPercentile(double p) const;
+    VALUE toHash() const;
+
+    static uint64_t now();
+    static size_t bucket(uint64_t nsec);
+    static uint64_t lower(size_t bucket);
+    static uint64_t upper(size_t bucket);
+
+  private:
+    uint64_t _counts[BUCKETS];
+    uint64_t _sum;
+    uint64_t _max;
+};
+
+/**
+ * records the time from construction to destruction.
+ */
+class Stopwatch
+{
+  public:
+    Stopwatch(Histogram& h) : _histogram(h), _start(Histogram::now()) {};
+    ~Stopwatch() { _histogram.record(Histogram::now() - _start); };
+
+  private:
+    Histogram& _histogram;
+    uint64_t _start;
+};
+
+#endif // _INCLUDE_HISTOGRAM_H_
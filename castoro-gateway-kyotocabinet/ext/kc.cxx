@@ -21,6 +21,12 @@
 #include "stdinc.hxx"
 #include "cache.hxx"
 
+// formats of #dump, the same as Castoro::Cache.
+enum { DUMP_TEXT = 0, DUMP_BINARY = 1 };
+
+// caches of options[:path] to close at exit, not marked to be collected.
+static std::vector<Cache*> persistent_caches;
+
 static Cache*
 cache_get(VALUE self)
 {
@@ -32,6 +38,7 @@ cache_get(VALUE self)
 static void
 cache_free(Cache* p)
 {
+  persistent_caches.erase(std::remove(persistent_caches.begin(), persistent_caches.end(), p), persistent_caches.end());
   p->~Cache();
   ruby_xfree(p);
 }
@@ -50,10 +57,23 @@ cache_alloc(VALUE klass)
   return Data_Wrap_Struct(klass, cache_mark, cache_free, p);
 }
 
+/**
+ * closes caches of options[:path] at exit, to save statuses of peers.
+ */
+static void
+cache_close_at_exit(VALUE arg)
+{
+  for (size_t i = 0; i < persistent_caches.size(); i++) {
+    if (persistent_caches[i]->isPersistent()) persistent_caches[i]->close();
+  }
+  persistent_caches.clear();
+}
+
 /**
  * Castoro::Cache::KyotoCabinet#initialize(size, options = {}) -> self
  *
- * options: :logger :watchdog_limit
+ * options: :logger :watchdog_limit :peer_size
+ *          :path :bnum :msiz :apow :fpow :opts :dfunit :recover
  */
 static VALUE
 rb_kc_init(int argc, VALUE* argv, VALUE self)
@@ -67,6 +87,7 @@ rb_kc_init(int argc, VALUE* argv, VALUE self)
   Check_Type(opt, T_HASH);
 
   p->init(size, opt);
+  if (p->isPersistent()) persistent_caches.push_back(p);
 
   return Qnil;
 }
@@ -96,6 +117,18 @@ rb_kc_find_peers(int argc, VALUE* argv, VALUE self)
   }
 }
 
+/**
+ * Castoro::Cache::KyotoCabinet#select_peers(require_spaces, count, candidates = nil) -> array of peer(s).
+ */
+static VALUE
+rb_kc_select_peers(int argc, VALUE* argv, VALUE self)
+{
+  Cache* p = cache_get(self);
+  VALUE require_spaces, count, candidates;
+  rb_scan_args(argc, argv, "21", &require_spaces, &count, &candidates);
+  return p->selectPeers(require_spaces, count, candidates);
+}
+
 /**
  * Castoro::Cache::KyotoCabinet#insert_element(peer, content, type, rev) -> self
  */
@@ -120,6 +153,38 @@ rb_kc_erase_element(VALUE self, VALUE _p, VALUE _c, VALUE _t, VALUE _r)
   return self;
 }
 
+/**
+ * Castoro::Cache::KyotoCabinet#find_many([[content, type, rev], ...]) -> array of array of peer(s).
+ */
+static VALUE
+rb_kc_find_many(VALUE self, VALUE _a)
+{
+  Cache* p = cache_get(self);
+  return p->findMany(_a);
+}
+
+/**
+ * Castoro::Cache::KyotoCabinet#insert_many([[peer, content, type, rev], ...]) -> self
+ */
+static VALUE
+rb_kc_insert_many(VALUE self, VALUE _a)
+{
+  Cache* p = cache_get(self);
+  p->insertMany(_a);
+  return self;
+}
+
+/**
+ * Castoro::Cache::KyotoCabinet#erase_many([[peer, content, type, rev], ...]) -> self
+ */
+static VALUE
+rb_kc_erase_many(VALUE self, VALUE _a)
+{
+  Cache* p = cache_get(self);
+  p->eraseMany(_a);
+  return self;
+}
+
 /**
  * Castoro::Cache::KyotoCabinet#get_peer_status(peer) -> array of status
  */
@@ -145,22 +210,31 @@ rb_kc_set_peer_status(VALUE self, VALUE _p, VALUE _h)
 }
 
 /**
- * Castoro::Cache::KyotoCabinet#dump(io, peers = nil) -> self
+ * Castoro::Cache::KyotoCabinet#dump(io, peers = nil, format = DUMP_TEXT) -> self
+ *
+ * written natively without GVL, through memory unless io is a file,
+ * DUMP_BINARY needs a file.
  */
 static VALUE
 rb_kc_dump(int argc, VALUE* argv, VALUE self)
 {
   Cache* p = cache_get(self);
-  VALUE file, peer;
-  if (rb_scan_args(argc, argv, "11", &file, &peer) == 1) {
-    peer = Qnil;
+  VALUE file, peer, format;
+  rb_scan_args(argc, argv, "12", &file, &peer, &format);
+  bool binary = RTEST(format) && NUM2INT(format) == DUMP_BINARY;
+  if (RTEST(format) && NUM2INT(format) != DUMP_TEXT && !binary) {
+    rb_raise(rb_eArgError, "unknown dump format %d.", NUM2INT(format));
   }
 
-  if (RTEST(peer)) {
-    p->dump(file, peer);
-  } else {
-    p->dump(file);
+  // straight to the file descriptor if the io is a file.
+  VALUE fd = rb_respond_to(file, rb_intern("fileno")) ? rb_funcall(file, rb_intern("fileno"), 0) : Qnil;
+  if (!NIL_P(fd)) {
+    rb_funcall(file, rb_intern("flush"), 0);
+  } else if (binary) {
+    rb_raise(rb_eArgError, "binary dump needs io with a file descriptor.");
   }
+
+  p->dump(file, peer, NIL_P(fd) ? -1 : NUM2INT(fd), binary);
   return self;
 }
 
@@ -175,6 +249,33 @@ rb_kc_stat(VALUE self, VALUE _k)
   return p->stat(_k);
 }
 
+/**
+ * Castoro::Cache::Kyotocabinet#histograms(clear = false) -> latency summaries
+ *
+ * { :find => { :count, :mean, :p50, :p90, :p99, :p999, :max }, ... } by usec.
+ */
+static VALUE
+rb_kc_histograms(int argc, VALUE* argv, VALUE self)
+{
+  Cache* p = cache_get(self);
+  VALUE clear;
+  rb_scan_args(argc, argv, "01", &clear);
+  return p->histograms(RTEST(clear));
+}
+
+/**
+ * Castoro::Cache::KyotoCabinet#close -> nil
+ *
+ * writes the file of options[:path] out, the cache can't be used after this.
+ */
+static VALUE
+rb_kc_close(VALUE self)
+{
+  Cache* p = cache_get(self);
+  p->close();
+  return Qnil;
+}
+
 extern "C" void
 Init_kyotocabinet()
 {
@@ -203,12 +304,21 @@ Init_kyotocabinet()
   rb_define_private_method(kc, "initialize", RUBY_METHOD_FUNC(rb_kc_init), -1);
   rb_define_method(kc, "find", RUBY_METHOD_FUNC(rb_kc_find), 3);
   rb_define_method(kc, "find_peers", RUBY_METHOD_FUNC(rb_kc_find_peers), -1);
+  rb_define_method(kc, "select_peers", RUBY_METHOD_FUNC(rb_kc_select_peers), -1);
   rb_define_method(kc, "insert_element", RUBY_METHOD_FUNC(rb_kc_insert_element), 4);
   rb_define_method(kc, "erase_element", RUBY_METHOD_FUNC(rb_kc_erase_element), 4);
+  rb_define_method(kc, "find_many", RUBY_METHOD_FUNC(rb_kc_find_many), 1);
+  rb_define_method(kc, "insert_many", RUBY_METHOD_FUNC(rb_kc_insert_many), 1);
+  rb_define_method(kc, "erase_many", RUBY_METHOD_FUNC(rb_kc_erase_many), 1);
   rb_define_method(kc, "get_peer_status", RUBY_METHOD_FUNC(rb_kc_get_peer_status), 1);
   rb_define_method(kc, "set_peer_status", RUBY_METHOD_FUNC(rb_kc_set_peer_status), 2);
   rb_define_method(kc, "dump", RUBY_METHOD_FUNC(rb_kc_dump), -1);
   rb_define_method(kc, "stat", RUBY_METHOD_FUNC(rb_kc_stat), 1);
+  rb_define_method(kc, "histograms", RUBY_METHOD_FUNC(rb_kc_histograms), -1);
+  rb_define_method(kc, "close", RUBY_METHOD_FUNC(rb_kc_close), 0);
+  rb_define_const(kc, "DUMP_TEXT", INT2NUM(DUMP_TEXT));
+  rb_define_const(kc, "DUMP_BINARY", INT2NUM(DUMP_BINARY));
+  rb_set_end_proc(cache_close_at_exit, Qnil);
 
   // exceptions
   VALUE err = rb_define_class_under(kc, "Error", cerror);
@@ -226,18 +336,23 @@ Init_kyotocabinet()
 
   // id
   id_equal    = rb_intern("==");
-  id_puts     = rb_intern("puts");
   id_to_s     = rb_intern("to_s");
   id_format   = rb_intern("%");
-  id_to_ary   = rb_intern("to_ary");
-  id_to_a     = rb_intern("to_a");
-  id_size     = rb_intern("size");
   id_less_eql = rb_intern("<=");
+  id_warn     = rb_intern("warn");
 
   // symvol
   sym_watchdog_limit = ID2SYM(rb_intern("watchdog_limit"));
   sym_peer_size      = ID2SYM(rb_intern("peer_size"));
   sym_logger         = ID2SYM(rb_intern("logger"));
+  sym_path           = ID2SYM(rb_intern("path"));
+  sym_bnum           = ID2SYM(rb_intern("bnum"));
+  sym_msiz           = ID2SYM(rb_intern("msiz"));
+  sym_apow           = ID2SYM(rb_intern("apow"));
+  sym_fpow           = ID2SYM(rb_intern("fpow"));
+  sym_opts           = ID2SYM(rb_intern("opts"));
+  sym_dfunit         = ID2SYM(rb_intern("dfunit"));
+  sym_recover        = ID2SYM(rb_intern("recover"));
   sym_available      = ID2SYM(rb_intern("available"));
   sym_status         = ID2SYM(rb_intern("status"));
 
@@ -71,3 +71,21 @@ Key::getType() const
   return _t;
 }
 
+
+void
+Key::serialize(char* stream) const
+{
+  uint8_t* p = (uint8_t*)stream;
+  for (int i = 0; i < 8; i++) p[i] = (uint8_t)(_c >> (56 - i*8));
+  for (int i = 0; i < 4; i++) p[8+i] = (uint8_t)(_t >> (24 - i*8));
+}
+
+void
+Key::deserialize(const char* stream)
+{
+  const uint8_t* p = (const uint8_t*)stream;
+  _c = 0;
+  _t = 0;
+  for (int i = 0; i < 8; i++) _c = (_c << 8) | p[i];
+  for (int i = 0; i < 4; i++) _t = (_t << 8) | p[8+i];
+}
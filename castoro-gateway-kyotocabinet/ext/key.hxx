@@ -23,9 +23,15 @@
 
 #include "stdinc.hxx"
 
+/**
+ * a key in kc is packed to SIZE bytes, { uint64 content, uint32 type } in
+ * big endian, so that TreeDB keeps baskets in order of contents.
+ */
 class Key
 {
   public:
+    static const size_t SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
     Key();
     Key(uint64_t c, uint32_t t);
     Key(const Key& other);
@@ -37,6 +43,9 @@ class Key
     uint64_t getContent() const;
     uint32_t getType() const;
 
+    void serialize(char* stream) const;  // stream has SIZE bytes.
+    void deserialize(const char* stream);
+
   private:
     uint64_t _c;
     uint32_t _t;
@@ -19,6 +19,7 @@
  */
 
 #include "peers.hxx"
+#include <math.h>
 
 Peers::Peers()
 {
@@ -42,6 +43,7 @@ Peers::set(PeerId peer, uint64_t available)
 {
   rb_mutex_lock(_locker);
   _map[peer].set(available);
+  relink(peer);
   rb_mutex_unlock(_locker);
 }
 
@@ -50,6 +52,7 @@ Peers::set(PeerId peer, uint32_t status)
 {
   rb_mutex_lock(_locker);
   _map[peer].set(status);
+  relink(peer);
   rb_mutex_unlock(_locker);
 }
 
@@ -58,6 +61,7 @@ Peers::set(PeerId peer, uint64_t available, uint32_t status)
 {
   rb_mutex_lock(_locker);
   _map[peer].set(available, status);
+  relink(peer);
   rb_mutex_unlock(_locker);
 }
 
@@ -139,3 +143,60 @@ Peers::find(PeerId* peers, uint64_t* count, time_t expire, uint64_t space) const
   rb_mutex_unlock(_locker);
 }
 
+/**
+ * writable peers which have enough spaces, at most want peers.
+ * peers are sampled at random weighted by available spaces (A-Res),
+ * each peer gets key log(u)/available and the largest keys win.
+ */
+void
+Peers::select(PeerId* peers, uint64_t* count, uint64_t want, time_t expire, uint64_t space,
+              uint64_t seed, const PeerList* allowed) const
+{
+  typedef std::pair<double, PeerId> Key;
+  std::vector<Key, Allocator<Key> > keys;
+
+  *count = 0;
+  if (want == 0) return;
+  keys.reserve(want + 1);
+
+  rb_mutex_lock(_locker);
+  for (PeerList::const_iterator it = _bySpace.begin(); it != _bySpace.end(); it++) {
+    const Status& s = (*_map.find(*it)).second;
+    if (s.getAvailable() < space) break;
+    if (!s.isEnoughSpaces(expire, space)) continue;
+    if (allowed && !std::binary_search(allowed->begin(), allowed->end(), *it)) continue;
+
+    // splitmix64.
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    double u = ((z >> 11) + 0.5) / 9007199254740992.0;
+    double key = log(u) / ((double)s.getAvailable() + 1.0);
+    if (keys.size() >= want && key <= keys.back().first) continue;
+
+    std::vector<Key, Allocator<Key> >::iterator k = keys.begin();
+    while (k != keys.end() && (*k).first >= key) k++;
+    keys.insert(k, Key(key, *it));
+    if (keys.size() > want) keys.pop_back();
+  }
+  rb_mutex_unlock(_locker);
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    *(peers+(*count)) = keys[i].second;
+    *count = *count + 1;
+  }
+}
+
+void
+Peers::relink(PeerId peer)
+{
+  PeerList::iterator it = std::find(_bySpace.begin(), _bySpace.end(), peer);
+  if (it != _bySpace.end()) _bySpace.erase(it);
+
+  uint64_t available = _map[peer].getAvailable();
+  for (it = _bySpace.begin(); it != _bySpace.end(); it++) {
+    if (_map[*it].getAvailable() < available) break;
+  }
+  _bySpace.insert(it, peer);
+}
@@ -31,6 +31,8 @@ class Peers
     typedef std::map<PeerId, Status, std::less<PeerId>, Allocator<std::pair<const PeerId, Status> > > PeerStatus;
 
   public:
+    typedef std::vector<PeerId, Allocator<PeerId> > PeerList;
+
     Peers();
 
     void init();
@@ -48,10 +50,15 @@ class Peers
 
     void find(PeerId* peers, uint64_t* count) const;
     void find(PeerId* peers, uint64_t* count, time_t expire, uint64_t space) const;
+    void select(PeerId* peers, uint64_t* count, uint64_t want, time_t expire, uint64_t space,
+                uint64_t seed, const PeerList* allowed) const;
 
   private:
     PeerStatus _map;
+    PeerList _bySpace;  // peers by available descending.
     VALUE _locker;
+
+    void relink(PeerId peer);
 };
 
 #endif // _INCLUDE_PEERS_H_
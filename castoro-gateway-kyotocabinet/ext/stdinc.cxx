@@ -35,18 +35,23 @@ VALUE cls_err_misc;
 
 // id
 ID id_equal;
-ID id_puts;
 ID id_to_s;
 ID id_format;
-ID id_to_ary;
-ID id_to_a;
-ID id_size;
 ID id_less_eql;
+ID id_warn;
 
 // symvol
 VALUE sym_watchdog_limit;
 VALUE sym_peer_size;
 VALUE sym_logger;
+VALUE sym_path;
+VALUE sym_bnum;
+VALUE sym_msiz;
+VALUE sym_apow;
+VALUE sym_fpow;
+VALUE sym_opts;
+VALUE sym_dfunit;
+VALUE sym_recover;
 VALUE sym_available;
 VALUE sym_status;
 
@@ -23,6 +23,9 @@
 
 #include <sys/time.h>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <string>
 #include <kcpolydb.h>
 #include <ruby.h>
 
@@ -43,18 +46,23 @@ extern VALUE cls_err_misc;
 
 // id
 extern ID id_equal;
-extern ID id_puts;
 extern ID id_to_s;
 extern ID id_format;
-extern ID id_to_ary;
-extern ID id_to_a;
-extern ID id_size;
 extern ID id_less_eql;
+extern ID id_warn;
 
 // symvol
 extern VALUE sym_watchdog_limit;
 extern VALUE sym_peer_size;
 extern VALUE sym_logger;
+extern VALUE sym_path;
+extern VALUE sym_bnum;
+extern VALUE sym_msiz;
+extern VALUE sym_apow;
+extern VALUE sym_fpow;
+extern VALUE sym_opts;
+extern VALUE sym_dfunit;
+extern VALUE sym_recover;
 extern VALUE sym_available;
 extern VALUE sym_status;
 
@@ -75,6 +83,21 @@ extern VALUE cls_mutex;
 
 // typedef
 typedef ID PeerId;
+typedef uint16_t PeerHandle;  // a peer in records, by the dictionary.
+
+// revision kept in records, by extconf.rb --with-revision-bits.
+#ifndef REVISION_BITS
+#define REVISION_BITS 16
+#endif
+#if REVISION_BITS == 32
+typedef uint32_t Revision;
+#elif REVISION_BITS == 16
+typedef uint16_t Revision;
+#elif REVISION_BITS == 8
+typedef uint8_t Revision;
+#else
+# error "REVISION_BITS must be 8, 16 or 32."
+#endif
 
 #endif // _STDINC_H_
 
@@ -18,131 +18,356 @@
  *
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "traverse.hxx"
-#include "memory.hxx"
+#ifdef HAVE_RUBY_THREAD_H
+# include "ruby/thread.h"
+#endif
 
-Dumper::Dumper(VALUE io)
+/**
+ * the array of peers is checked before by rb_to_id, not to raise here.
+ */
+DumpPeers::DumpPeers(const PeerDictionary& dictionary, VALUE peers)
+{
+  std::vector<PeerId> ids;
+  uint64_t count = dictionary.getCount();
+  uint32_t number = 0;
+
+  if (!NIL_P(peers)) {
+    for (long i = 0; i < RARRAY_LEN(peers); i++) ids.push_back(rb_to_id(rb_ary_entry(peers, i)));
+    std::sort(ids.begin(), ids.end());
+  }
+
+  _numbers.assign(count + 1, 0);
+  _names.resize(count + 1);
+  for (uint64_t h = 1; h <= count; h++) {
+    PeerId id = dictionary.getId((PeerHandle)h);
+    if (!NIL_P(peers) && !std::binary_search(ids.begin(), ids.end(), id)) continue;
+
+    VALUE s = rb_id2str(id);
+    _names[h].assign(RSTRING_PTR(s), RSTRING_LEN(s));
+    _numbers[h] = ++number;
+  }
+}
+
+uint32_t
+DumpPeers::getNumber(PeerHandle handle) const
 {
-  _io = io;
+  return (handle < _numbers.size()) ? _numbers[handle] : 0;
 }
 
-void
-Dumper::operator()(const Key& key, const Val& val) const
+const std::string&
+DumpPeers::getName(PeerHandle handle) const
 {
-  VALUE format = rb_str_new2("  %s: %d.%d.%d");
+  return _names[handle];
+}
 
-  PeerId* p = val.getPeers();
-  for (uint8_t i = 0; i < val.getPeerSize(); i++) {
-    if (*(p+i) != 0) {
-      VALUE peer = ID2SYM(*(p+i));
-      VALUE c    = ULL2NUM(key.getContent());
-      VALUE t    = UINT2NUM(key.getType());
-      VALUE r    = UINT2NUM(val.getRev());
-      VALUE args = rb_ary_new3(4, peer, c, t, r);
-      VALUE line = rb_funcall(format, id_format, 1, args);
+size_t
+DumpPeers::getSize() const
+{
+  return _numbers.size();
+}
+
+DumpSink::DumpSink(int fd)
+{
+  _fd = fd;
+  _errno = 0;
+  _interrupted = false;
+  pthread_mutex_init(&_mutex, NULL);
+}
+
+DumpSink::~DumpSink()
+{
+  pthread_mutex_destroy(&_mutex);
+}
+
+/**
+ * poll() times out to see interrupt() while the fd is full.
+ */
+bool
+DumpSink::write(const char* p, size_t n)
+{
+  bool ret = true;
 
-      rb_funcall(_io, id_puts, 1, line);
+  pthread_mutex_lock(&_mutex);
+  if (_interrupted && !_errno) _errno = EINTR;
+  if (_errno) {
+    ret = false;
+  } else if (_fd < 0) {
+    _string.append(p, n);
+  } else {
+    while (n > 0) {
+      if (_interrupted) {
+        _errno = EINTR;
+        ret = false;
+        break;
+      }
+      ssize_t len = ::write(_fd, p, n);
+      if (len < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          struct pollfd pfd = { _fd, POLLOUT, 0 };
+          if (poll(&pfd, 1, 100) >= 0 || errno == EINTR) continue;
+        }
+        _errno = errno;
+        ret = false;
+        break;
+      }
+      p += len;
+      n -= len;
     }
   }
+  pthread_mutex_unlock(&_mutex);
+  return ret;
 }
 
-FilteredDumper::FilteredDumper(VALUE io, VALUE peers)
+/**
+ * called from another thread without the mutex.
+ */
+void
+DumpSink::interrupt()
 {
-  _io = io;
-  _ids = NULL;
-  _size = 0;
+  _interrupted = true;
+}
 
-  VALUE a;
-  switch (TYPE(peers)) {
-    case T_ARRAY:
-      a = peers;
-      break;
+int
+DumpSink::getErrno() const
+{
+  if (_errno) return _errno;
+  return _interrupted ? EINTR : 0;
+}
 
-    default:
-      if (rb_respond_to(peers, id_to_ary)) {
-        a = rb_funcall(peers, id_to_ary, 0);
-      } else if (rb_respond_to(peers, id_to_a)) {
-        a = rb_funcall(peers, id_to_a, 0);
-      } else {
-        a = rb_ary_new3(1, peers);
-      }
-      break;
+const std::string&
+DumpSink::getString() const
+{
+  return _string;
+}
+
+/**
+ * buffers are of malloc, since workers can't call ruby.
+ */
+Dumper::Dumper(DumpSink& sink, const DumpPeers& peers, bool binary, uint8_t peerSize, size_t valsiz)
+  : _sink(sink), _peers(peers)
+{
+  _binary = binary;
+  _peerSize = peerSize;
+  _valsiz = valsiz;
+  _workers = 0;
+  memset(_buffers, 0, sizeof(_buffers));
+  pthread_mutex_init(&_mutex, NULL);
+}
+
+Dumper::~Dumper()
+{
+  for (size_t i = 0; i < WORKERS_MAX; i++) free(_buffers[i].data);
+  pthread_mutex_destroy(&_mutex);
+}
+
+bool
+Dumper::begin()
+{
+  if (!_binary) return true;
+
+  char header[16];
+  uint32_t version = VERSION, bytes = 20;
+  memcpy(header, "CSTRDUMP", 8);
+  memcpy(header+8, &version, 4);
+  memcpy(header+12, &bytes, 4);
+  if (!_sink.write(header, sizeof(header))) return false;
+
+  for (size_t h = 1; h < _peers.getSize(); h++) {
+    uint32_t number = _peers.getNumber((PeerHandle)h);
+    if (number == 0) continue;
+
+    const std::string& name = _peers.getName((PeerHandle)h);
+    char rec[20];
+    uint64_t c = number;
+    uint32_t t = name.size(), r = 0, p = PEER_NAME;
+    memcpy(rec, &c, 8);
+    memcpy(rec+8, &t, 4);
+    memcpy(rec+12, &r, 4);
+    memcpy(rec+16, &p, 4);
+    if (!_sink.write(rec, sizeof(rec)) || !_sink.write(name.data(), name.size())) return false;
   }
-  _size = NUM2UINT(rb_funcall(a, id_size, 0));
+  return true;
+}
+
+/**
+ * called by workers at once, records are only read. A record of an
+ * overflowed revision is skipped, not to be dumped as another revision.
+ */
+const char*
+Dumper::visit_full(const char* kbuf, size_t ksiz, const char* vbuf, size_t vsiz, size_t* sp)
+{
+  if (ksiz != Key::SIZE || vsiz != _valsiz) return NOP;
+
+  ValView v(vbuf, _peerSize);
+  if (!ValBase::isExact(v.getRev())) return NOP;
+
+  Key key;
+  key.deserialize(kbuf);
+  uint32_t revision = ValBase::toRevision(v.getRev());
+  Buffer* b = getBuffer();
 
-  if (_size) {
-    _ids = (PeerId*)ruby_xmalloc(sizeof(PeerId) * _size);
-    for (uint32_t i = 0; i < _size; i++) {
-      *(_ids+i) = rb_to_id(rb_ary_entry(a, i));
+  for (uint8_t i = 0; i < _peerSize; i++) {
+    PeerHandle h = v.getPeer(i);
+    if (_peers.getNumber(h) == 0) continue;
+    size_t need = _peers.getName(h).size() + 64;
+
+    if (b && b->used + need > BUFFER_SIZE) {
+      _sink.write(b->data, b->used);
+      b->used = 0;
+    }
+    if (b && need <= BUFFER_SIZE) {
+      b->used += format(b->data + b->used, key, revision, h);
+    } else {
+      std::string line(need, '\0');
+      _sink.write(&line[0], format(&line[0], key, revision, h));
     }
   }
+  return NOP;
 }
 
-FilteredDumper::~FilteredDumper()
+/**
+ * buffers are written out, and an empty line terminates a text dump.
+ */
+bool
+Dumper::finish()
 {
-  if (_ids) ruby_xfree(_ids);
+  for (size_t i = 0; i < _workers; i++) {
+    if (_buffers[i].used > 0) _sink.write(_buffers[i].data, _buffers[i].used);
+    _buffers[i].used = 0;
+  }
+  if (!_binary) _sink.write("\n", 1);
+  return _sink.getErrno() == 0;
 }
 
 void
-FilteredDumper::operator()(const Key& key, const Val& val) const
+Dumper::interrupt()
 {
-  VALUE format = rb_str_new2("  %s: %d.%d.%d");
+  _sink.interrupt();
+}
 
-  PeerId* p = val.getPeers();
-  for (uint8_t i = 0; i < val.getPeerSize(); i++) {
-    if (*(p+i) != 0 && isInclude(*(p+i))) {
-      VALUE peer = ID2SYM(*(p+i));
-      VALUE c    = ULL2NUM(key.getContent());
-      VALUE t    = UINT2NUM(key.getType());
-      VALUE r    = UINT2NUM(val.getRev());
-      VALUE args = rb_ary_new3(4, peer, c, t, r);
-      VALUE line = rb_funcall(format, id_format, 1, args);
+bool
+Dumper::isFailed() const
+{
+  return _sink.getErrno() != 0;
+}
+
+/**
+ * the buffer of the calling worker, claimed at its first record. NULL if
+ * WORKERS_MAX buffers are claimed by others.
+ */
+Dumper::Buffer*
+Dumper::getBuffer()
+{
+  pthread_t self = pthread_self();
+  Buffer* b = NULL;
+
+  for (size_t i = 0; i < _workers; i++) {
+    if (pthread_equal(_buffers[i].owner, self)) return &_buffers[i];
+  }
 
-      rb_funcall(_io, id_puts, 1, line);
+  pthread_mutex_lock(&_mutex);
+  if (_workers < WORKERS_MAX) {
+    b = &_buffers[_workers];
+    b->data = (char*)malloc(BUFFER_SIZE);
+    if (b->data) {
+      b->owner = self;
+      b->used = 0;
+      __sync_synchronize();
+      _workers++;
+    } else {
+      b = NULL;
     }
   }
+  pthread_mutex_unlock(&_mutex);
+  return b;
 }
 
-bool
-FilteredDumper::isInclude(PeerId id) const
+/**
+ * a record of the peer to p, which has getName(peer).size() + 64 bytes.
+ */
+size_t
+Dumper::format(char* p, const Key& key, uint32_t revision, PeerHandle peer) const
 {
-  for (uint32_t i = 0; i < _size; i++) {
-    if (*(_ids+i) == id) return true;
+  if (_binary) {
+    uint64_t c = key.getContent();
+    uint32_t t = key.getType(), n = _peers.getNumber(peer);
+    memcpy(p, &c, 8);
+    memcpy(p+8, &t, 4);
+    memcpy(p+12, &revision, 4);
+    memcpy(p+16, &n, 4);
+    return 20;
   }
-  return false;
+
+  const std::string& name = _peers.getName(peer);
+  memcpy(p, "  ", 2);
+  memcpy(p+2, name.data(), name.size());
+  return 2 + name.size() + sprintf(p + 2 + name.size(), ": %llu.%u.%u\n",
+                                   (unsigned long long)key.getContent(), key.getType(), revision);
 }
 
-Traverser::Traverser(kc::PolyDB* db, VALUE locker, uint8_t peerSize, size_t valsiz)
+/**
+ * called by workers for each record, to stop the scan.
+ */
+class ScanChecker : public kc::DB::ProgressChecker
 {
-  _db = db;
-  _cur = _db->cursor();
-  _locker = locker;
-  _peerSize = peerSize;
-  _valsiz = valsiz;
+  public:
+    ScanChecker(const Dumper& dumper) : _dumper(dumper) {}
+
+    bool check(const char* name, const char* message, int64_t curcnt, int64_t allcnt)
+    {
+      return !_dumper.isFailed();
+    }
+
+  private:
+    const Dumper& _dumper;
+};
+
+struct ScanRequest
+{
+  kc::PolyDB* db;
+  Dumper* dumper;
+  bool ret;
+};
+
+static void*
+scanWithoutGvl(void* data)
+{
+  ScanRequest* req = (ScanRequest*)data;
+  ScanChecker checker(*req->dumper);
+  req->ret = req->dumper->begin() &&
+    req->db->scan_parallel(req->dumper, Traverser::THREADS, &checker) &&
+    req->dumper->finish();
+  return NULL;
 }
 
-Traverser::~Traverser()
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void
+unblockScan(void* data)
 {
-  if (_cur) delete _cur;
-  if (RTEST(rb_mutex_locked_p(_locker))) rb_mutex_unlock(_locker);
+  ((ScanRequest*)data)->dumper->interrupt();
 }
+#endif
 
-void
-Traverser::traverse(const TraverseLogic& logic)
-{
-  Key* k;
-  Val v(_peerSize);
-  Memory<char> m(_valsiz);
-  char* p = m.pointer();
-  size_t ksiz, vsiz;
-
-  rb_mutex_lock(_locker);
-  if (_cur->jump()) {
-    while(k = (Key*)_cur->get(&ksiz, (const char**)&p, &vsiz, true)) {
-      v.deserialize(p);
-      logic(*k, v);
-    }
-  }
-  rb_mutex_unlock(_locker);
+Traverser::Traverser(kc::PolyDB* db)
+{
+  _db = db;
 }
 
+bool
+Traverser::traverse(Dumper& dumper)
+{
+  ScanRequest req = { _db, &dumper, false };
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(scanWithoutGvl, &req, unblockScan, &req);
+#else
+  scanWithoutGvl(&req);
+#endif
+  return req.ret;
+}
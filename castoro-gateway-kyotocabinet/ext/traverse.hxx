@@ -21,56 +21,121 @@
 #ifndef _INCLUDE_TRAVERSE_H_
 #define _INCLUDE_TRAVERSE_H_
 
+#include <pthread.h>
 #include "stdinc.hxx"
 #include "key.hxx"
 #include "val.hxx"
+#include "dictionary.hxx"
 
-class TraverseLogic
+/**
+ * peers of a dump by handles, resolved with GVL before a scan, so that
+ * workers filter and name them by index without ruby.
+ */
+class DumpPeers
 {
   public:
-    virtual void operator()(const Key& key, const Val& val) const = 0;
+    DumpPeers(const PeerDictionary& dictionary, VALUE peers);  // peers is an array, or nil for all.
+
+    uint32_t getNumber(PeerHandle handle) const;  // from 1, 0 if it isn't dumped.
+    const std::string& getName(PeerHandle handle) const;
+    size_t getSize() const;  // handles to look up, including 0.
+
+  private:
+    std::vector<uint32_t> _numbers;  // by handle.
+    std::vector<std::string> _names;
 };
 
-class Dumper : public TraverseLogic
+/**
+ * writes buffers of workers to a file descriptor one at a time, or keeps
+ * them in memory if fd < 0. Thread safe.
+ *
+ * a non-blocking fd is waited by poll() while it is full. interrupt() is
+ * the unblocking function of a dump, the rest fails with EINTR.
+ */
+class DumpSink
 {
   public:
-    Dumper(VALUE io);
-    void operator()(const Key& key, const Val& val) const;
+    DumpSink(int fd);
+    ~DumpSink();
+
+    bool write(const char* p, size_t n);
+    void interrupt();
+    int getErrno() const;
+    const std::string& getString() const;
 
   private:
-    VALUE _io;
+    int _fd;
+    volatile int _errno;
+    volatile bool _interrupted;
+    std::string _string;
+    pthread_mutex_t _mutex;
 };
 
-class FilteredDumper : public TraverseLogic
+/**
+ * formats records visited by workers of a parallel scan, each into a
+ * buffer of its own, which is written to the sink when it is full.
+ *
+ * text: "  peer: content.type.revision" lines, and an empty line.
+ *
+ * binary: "CSTRDUMP", uint32 version, uint32 bytes of a record, and then
+ * records of { uint64 content, uint32 type, uint32 revision, uint32 peer }.
+ * All peers are defined before records, by a record of peer = 0xffffffff,
+ * content = the peer number, type = bytes of the name, followed by the
+ * name. The same format as Castoro::Cache#dump.
+ */
+class Dumper : public kc::DB::Visitor
 {
   public:
-    FilteredDumper(VALUE io, VALUE peers);
-    ~FilteredDumper();
-    void operator()(const Key& key, const Val& val) const;
+    static const uint32_t VERSION = 1;
+    static const uint32_t PEER_NAME = 0xffffffff;
+    static const size_t BUFFER_SIZE = 256*1024;
+    static const size_t WORKERS_MAX = 16;  // buffers, records of others are written one by one.
+
+    Dumper(DumpSink& sink, const DumpPeers& peers, bool binary, uint8_t peerSize, size_t valsiz);
+    ~Dumper();
+
+    bool begin();
+    const char* visit_full(const char* kbuf, size_t ksiz, const char* vbuf, size_t vsiz, size_t* sp);
+    bool finish();
+    void interrupt();
+    bool isFailed() const;
 
   private:
-    VALUE _io;
-    PeerId* _ids;
-    uint32_t _size;
+    struct Buffer {
+      pthread_t owner;
+      char* data;
+      size_t used;
+    };
+
+    DumpSink& _sink;
+    const DumpPeers& _peers;
+    bool _binary;
+    uint8_t _peerSize;
+    size_t _valsiz;
+    Buffer _buffers[WORKERS_MAX];
+    volatile size_t _workers;
+    pthread_mutex_t _mutex;
 
-    bool isInclude(PeerId id) const;
+    Buffer* getBuffer();
+    size_t format(char* p, const Key& key, uint32_t revision, PeerHandle peer) const;
 };
 
+/**
+ * visits all records by a parallel scan of kc without GVL, nothing is
+ * locked so that the cache serves requests during a dump. The scan is
+ * stopped by its progress checker when the dump failed or was interrupted.
+ */
 class Traverser
 {
   public:
-    Traverser(kc::PolyDB* db, VALUE locker, uint8_t peerSize, size_t valsiz);
-    virtual ~Traverser();
+    static const size_t THREADS = 4;
+
+    Traverser(kc::PolyDB* db);
 
-    void traverse(const TraverseLogic& logic);
+    bool traverse(Dumper& dumper);
 
   private:
     kc::PolyDB* _db;
-    kc::DB::Cursor* _cur;
-    VALUE _locker;
-    uint8_t _peerSize;
-    size_t _valsiz;
 };
 
 #endif // _INCLUDE_TRAVERSE_H_
-
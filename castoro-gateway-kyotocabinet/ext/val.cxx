@@ -20,117 +20,48 @@
 
 #include "val.hxx"
 
-size_t Val::getSize(uint8_t peerSize)
-{
-  return sizeof(uint8_t) + sizeof(PeerId)*peerSize;
-}
-
-Val::Val(uint8_t peerSize)
-{
-  _peerSize = peerSize;
-  _peers = (PeerId*)ruby_xmalloc(sizeof(PeerId)*_peerSize);
-  clear();
-}
-
-void
-Val::clear()
-{
-  _rev = 0;
-  for (uint8_t i = 0; i < _peerSize; i++) *(_peers+i) = 0;
-}
+/**
+ * Unless Revision has 32 bits, the most significant bit marks revisions
+ * which don't fit in the rest of bits. They are kept but never found,
+ * so that revision 1 and 257 are never confused as a false hit.
+ */
+static const uint32_t REV_OVERFLOWED = (uint32_t)1 << (sizeof(Revision)*8-1);
+static const uint32_t REV_MASK = REV_OVERFLOWED-1;
 
-uint8_t
-Val::getRev() const
+size_t
+ValBase::getSize(uint8_t peerSize)
 {
-  return _rev;
+  return sizeof(Revision) + sizeof(PeerHandle)*peerSize;
 }
 
-void
-Val::setRev(uint8_t rev)
+Revision
+ValBase::toRev(uint32_t revision)
 {
-  if (_rev != rev) clear();
-  _rev = rev;
+  if (sizeof(Revision) >= sizeof(uint32_t)) return (Revision)revision;
+  return (revision > REV_MASK) ? (Revision)((revision & REV_MASK) | REV_OVERFLOWED) : (Revision)revision;
 }
 
-bool
-Val::isInclude(PeerId peer) const
+/**
+ * revision of an exact one, see isExact().
+ */
+uint32_t
+ValBase::toRevision(Revision rev)
 {
-  for (uint8_t i = 0; i < _peerSize; i++) {
-    if (*(_peers+i) == peer) return true;
-  }
-  return false;
+  if (sizeof(Revision) >= sizeof(uint32_t)) return rev;
+  return rev & REV_MASK;
 }
 
+/**
+ * false if the revision overflowed, it is unknown.
+ */
 bool
-Val::isFull() const
+ValBase::isExact(Revision rev)
 {
-  for (uint8_t i = 0; i < _peerSize; i++) {
-    if (*(_peers+i) == 0) return false;
-  }
-  return true;
+  return (sizeof(Revision) >= sizeof(uint32_t)) || !(rev & REV_OVERFLOWED);
 }
 
 bool
-Val::isEmpty() const
-{
-  for (uint8_t i = 0; i < _peerSize; i++) {
-    if (*(_peers+i) != 0) return false;
-  }
-  return true;
-}
-
-void
-Val::insertPeer(PeerId peer)
+ValBase::isFound(Revision stored, Revision rev)
 {
-  if (isInclude(peer)) return;
-
-  for (uint8_t i = 0; i < _peerSize; i++) {
-    if (*(_peers+i) == 0) {
-      *(_peers+i) = peer;
-      return;
-    }
-  }
-  *(_peers + (_peerSize-1)) = peer;
+  return (stored == rev) && isExact(rev);
 }
-
-void
-Val::removePeer(PeerId peer)
-{
-  for (uint8_t i = 0; i < _peerSize; i++) {
-    if (*(_peers+i) == peer) {
-      *(_peers+i) = 0;
-      return;
-    }
-  }
-}
-
-PeerId*
-Val::getPeers() const
-{
-  return _peers;
-}
-
-uint8_t
-Val::getPeerSize() const
-{
-  return _peerSize;
-}
-
-void
-Val::serialize(void* stream) const
-{
-  memcpy(stream, &_rev, sizeof(_rev));
-  stream = ((uint8_t*)stream) + 1;
-  memcpy(stream, _peers, sizeof(PeerId) * _peerSize);
-}
-
-void
-Val::deserialize(const void* stream)
-{
-  const void* p = stream;
-
-  clear();
-  _rev = *((uint8_t*)p); p = ((uint8_t*)p) + 1;
-  memcpy(_peers, p, sizeof(PeerId) * _peerSize);
-}
-
@@ -23,32 +23,128 @@
 
 #include "stdinc.hxx"
 
-class Val
+// peers kept in a record at most, by options[:peer_size].
+static const uint8_t PEER_SIZE_MAX = 8;
+
+/**
+ * layout of a record, { Revision rev, PeerHandle peers[peerSize] }
+ * unaligned, and revisions in it.
+ */
+class ValBase
 {
   public:
     static size_t getSize(uint8_t peerSize);
+    static Revision toRev(uint32_t revision);
+    static uint32_t toRevision(Revision rev);
+    static bool isExact(Revision rev);
+    static bool isFound(Revision stored, Revision rev);
+};
 
-    Val(uint8_t peerSize);
+/**
+ * a record with inline peers of P, N at most, so that it is never
+ * allocated and is serialized to a buffer on the stack.
+ */
+template<typename P, uint8_t N>
+class ValOf : public ValBase
+{
+  public:
+    static const size_t MAX_SIZE = sizeof(Revision) + sizeof(P)*N;
+
+    ValOf(uint8_t peerSize) { _peerSize = (peerSize < N) ? peerSize : N; clear(); }
 
-    void clear();
-    uint8_t getRev() const;
-    void setRev(uint8_t rev);
-    bool isInclude(PeerId peer) const;
-    bool isFull() const;
-    bool isEmpty() const;
-    void insertPeer(PeerId peer);
-    void removePeer(PeerId peer);
-    PeerId* getPeers() const;
-    uint8_t getPeerSize() const;
+    void clear() {
+      _rev = 0;
+      for (uint8_t i = 0; i < _peerSize; i++) _peers[i] = 0;
+    }
+    Revision getRev() const { return _rev; }
+    uint32_t getRevision() const { return toRevision(_rev); }
+    void setRev(Revision rev) {
+      if (_rev != rev) clear();
+      _rev = rev;
+    }
+    bool isFound(Revision rev) const { return ValBase::isFound(_rev, rev); }
+    bool isInclude(P peer) const {
+      for (uint8_t i = 0; i < _peerSize; i++) {
+        if (_peers[i] == peer) return true;
+      }
+      return false;
+    }
+    bool isFull() const {
+      for (uint8_t i = 0; i < _peerSize; i++) {
+        if (_peers[i] == 0) return false;
+      }
+      return true;
+    }
+    bool isEmpty() const {
+      for (uint8_t i = 0; i < _peerSize; i++) {
+        if (_peers[i] != 0) return false;
+      }
+      return true;
+    }
+    void insertPeer(P peer) {
+      if (isInclude(peer)) return;
+      for (uint8_t i = 0; i < _peerSize; i++) {
+        if (_peers[i] == 0) {
+          _peers[i] = peer;
+          return;
+        }
+      }
+      _peers[_peerSize-1] = peer;
+    }
+    void removePeer(P peer) {
+      for (uint8_t i = 0; i < _peerSize; i++) {
+        if (_peers[i] == peer) {
+          _peers[i] = 0;
+          return;
+        }
+      }
+    }
+    const P* getPeers() const { return _peers; }
+    uint8_t getPeerSize() const { return _peerSize; }
 
-    void serialize(void* stream) const;
-    void deserialize(const void* stream);
+    // stream has sizeof(Revision) + sizeof(P)*getPeerSize() bytes.
+    void serialize(void* stream) const {
+      memcpy(stream, &_rev, sizeof(_rev));
+      memcpy(((uint8_t*)stream) + sizeof(_rev), _peers, sizeof(P) * _peerSize);
+    }
+    void deserialize(const void* stream) {
+      memcpy(&_rev, stream, sizeof(_rev));
+      memcpy(_peers, ((const uint8_t*)stream) + sizeof(_rev), sizeof(P) * _peerSize);
+    }
 
   private:
-    uint8_t _rev;
+    Revision _rev;
     uint8_t _peerSize;
-    PeerId* _peers;
+    P _peers[N];
 };
 
-#endif // _INCLUDE_RECORD_H_
+typedef ValOf<PeerHandle, PEER_SIZE_MAX> Val;
+
+/**
+ * a read only view of record bytes, e.g. in a visitor of kc, without
+ * copying them. Valid while the bytes are.
+ */
+class ValView : public ValBase
+{
+  public:
+    ValView(const char* buf, uint8_t peerSize) { _buf = buf; _peerSize = peerSize; }
 
+    Revision getRev() const {
+      Revision rev;
+      memcpy(&rev, _buf, sizeof(rev));
+      return rev;
+    }
+    bool isFound(Revision rev) const { return ValBase::isFound(getRev(), rev); }
+    PeerHandle getPeer(uint8_t i) const {
+      PeerHandle peer;
+      memcpy(&peer, _buf + sizeof(Revision) + sizeof(PeerHandle)*i, sizeof(peer));
+      return peer;
+    }
+    uint8_t getPeerSize() const { return _peerSize; }
+
+  private:
+    const char* _buf;
+    uint8_t _peerSize;
+};
+
+#endif // _INCLUDE_RECORD_H_
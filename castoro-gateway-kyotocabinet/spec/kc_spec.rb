@@ -20,6 +20,9 @@
 require File.dirname(__FILE__) + '/spec_helper.rb'
 
 require 'stringio'
+require 'tmpdir'
+require 'tempfile'
+require 'fileutils'
 
 describe Castoro::Cache::KyotoCabinet do
   describe "#initialize" do
@@ -46,6 +49,95 @@ describe Castoro::Cache::KyotoCabinet do
         }
       end
     end
+
+    context "given 9 to options[:peer_size]" do
+      it "should raise ArgumentError" do
+        Proc.new {
+          Castoro::Cache::KyotoCabinet.new 1024*1024*1024, :peer_size => 9
+        }.should raise_error(ArgumentError)
+      end
+    end
+  end
+
+  describe "given options[:path]" do
+    before do
+      @dir = Dir.mktmpdir
+      @path = File.join(@dir, "cache.kch")
+    end
+
+    it "should raise ArgumentError unless *.kch or *.kct" do
+      Proc.new {
+        Castoro::Cache::KyotoCabinet.new 1024*1024, :path => File.join(@dir, "cache.db")
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should raise ArgumentError given negative number to options[:bnum]" do
+      Proc.new {
+        Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path, :bnum => -1
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should raise ArgumentError given 'x' to options[:opts]" do
+      Proc.new {
+        Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path, :opts => "x"
+      }.should raise_error(ArgumentError)
+    end
+
+    context "insert p1>1.2.3, p2>4.5.6 and p1,p2 are active, and close" do
+      before do
+        c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path, :bnum => 1000, :watchdog_limit => 2
+        c.set_peer_status "p1", :status => 30
+        c.set_peer_status "p2", :status => 30
+        c.insert_element "p1", 1, 2, 3
+        c.insert_element "p2", 4, 5, 6
+        c.close
+      end
+
+      it "should find them after reopened" do
+        c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path, :watchdog_limit => 2
+        c.find(1,2,3).should == ["p1"]
+        c.find(4,5,6).should == ["p2"]
+        c.close
+      end
+
+      it "should not find them after watchdog_limit unless statuses are received" do
+        c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path, :watchdog_limit => 2
+        sleep 3
+        c.find(1,2,3).should == []
+        c.set_peer_status "p1", :status => 30
+        c.find(1,2,3).should == ["p1"]
+        c.close
+      end
+
+      it "should restore the last statuses saved by close" do
+        c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path
+        c.set_peer_status "p1", :status => 30, :available => 5000
+        c.close
+        c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path
+        c.get_peer_status("p1").should == { :status => 30, :available => 5000 }
+        c.close
+      end
+
+      it "should clear them reopened by another peer_size" do
+        c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => @path, :peer_size => 4
+        c.set_peer_status "p1", :status => 30
+        c.find(1,2,3).should == []
+        c.close
+      end
+    end
+
+    it "should dump baskets in order of contents given *.kct" do
+      c = Castoro::Cache::KyotoCabinet.new 1024*1024, :path => File.join(@dir, "cache.kct")
+      [65536, 1, 256].each { |i| c.insert_element "p1", i, 2, 3 }
+      io = StringIO.new
+      c.dump io
+      io.string.should == "  p1: 1.2.3\n  p1: 256.2.3\n  p1: 65536.2.3\n\n"
+      c.close
+    end
+
+    after do
+      FileUtils.rm_rf @dir
+    end
   end
 
   describe "instance." do
@@ -66,6 +158,17 @@ describe Castoro::Cache::KyotoCabinet do
         @c.insert_element "p3", 7, 8, 9 
       end
 
+      it "#histograms should count each call" do
+        @c.find 1, 2, 3
+        h = @c.histograms
+        h.keys.should == [:find, :insert, :remove, :lock_wait]
+        h[:insert][:count].should == 9
+        h[:find][:count].should == 1
+        h[:find][:p50].should <= h[:find][:max]
+        @c.histograms(true)[:insert][:count].should == 9
+        @c.histograms[:insert][:count].should == 0
+      end
+
       context "given status p1={30}, p2={20}, p3={10}" do
         before do
           @c.set_peer_status "p1", :status => 30
@@ -160,6 +263,36 @@ describe Castoro::Cache::KyotoCabinet do
       end
     end
 
+    describe "batched" do
+      context "given insert_many p1>1.2.3, p2>1.2.3, p1>4.5.6, and p1,p2 are active" do
+        before do
+          @c.insert_many [["p1", 1, 2, 3], ["p2", 1, 2, 3], ["p1", 4, 5, 6]]
+          @c.set_peer_status "p1", :status => 30
+          @c.set_peer_status "p2", :status => 30
+        end
+
+        it "#find_many should return each result of #find" do
+          @c.find_many([[1, 2, 3], [4, 5, 6], [9, 9, 9]]).should == [["p1", "p2"], ["p1"], []]
+        end
+
+        context "erase_many p1>1.2.3, p1>4.5.6" do
+          before do
+            @c.erase_many [["p1", 1, 2, 3], ["p1", 4, 5, 6]]
+          end
+
+          it "#find_many should return [[p2], []]" do
+            @c.find_many([[1, 2, 3], [4, 5, 6]]).should == [["p2"], []]
+          end
+        end
+
+        it "#insert_many with short tuple should raise ArgumentError" do
+          Proc.new {
+            @c.insert_many [["p1", 1, 2]]
+          }.should raise_error(ArgumentError)
+        end
+      end
+    end
+
     describe "peer capacity" do
       context "given status p1={30,123},p2={30,50},p3={20,123}" do
         before do
@@ -269,6 +402,16 @@ describe Castoro::Cache::KyotoCabinet do
           ]
         end
 
+        it "#dump(file) should write the same lines as #dump(io)" do
+          io = StringIO.new
+          @c.dump io
+          file = Tempfile.new("dump")
+          @c.dump file
+          file.rewind
+          file.read.split(/\n/).sort.should == io.string.split(/\n/).sort
+          file.close!
+        end
+
         context "erase p1>1.2.3, p2>4.5.6, p3>7.8.9" do
           before do
             @c.erase_element "p1", 1, 2, 3
@@ -410,6 +553,23 @@ describe Castoro::Cache::KyotoCabinet do
     end
   end
 
+  describe "instance given insert p1*1.2.1" do
+    before do
+      @c = Castoro::Cache::KyotoCabinet.new 1024*1024*1024
+      @c.set_peer_status "p1", :status => 30
+      @c.insert_element "p1", 1, 2, 1
+    end
+
+    it "#find(1,2,257) should NOT return p1 which shares the lower 8 bits." do
+      @c.find(1,2,1).should == ["p1"]
+      @c.find(1,2,257).should == []
+    end
+
+    after do
+      @c = nil
+    end
+  end
+
   describe "instance with peer_size=>2" do
     before do
       @c = Castoro::Cache::KyotoCabinet.new 1024*1024*1024, :peer_size => 2
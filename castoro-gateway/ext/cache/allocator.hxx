@@ -22,9 +22,13 @@
 #define __INCLUDE_GATEWAY_ALLOCATOR_H__
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <limits>
+#include <new>
 
+#ifndef __TEST__
 #include "ruby.h"
+#endif
 
 namespace Castoro {
 namespace Gateway {
@@ -89,6 +93,71 @@ namespace Gateway {
   template <class T1, class T2>
   bool operator!=(const RbAllocator<T1>&, const RbAllocator<T2>&) throw() { return false; }
 
+
+  // by malloc, throws std::bad_alloc instead of NoMemoryError. For the
+  // containers modified under locks, callers catch it, unlock, and raise.
+  template <class T>
+  class MallocAllocator
+  {
+    public:
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef T value_type;
+
+      template <class U>
+      struct rebind
+      {
+        typedef MallocAllocator<U> other;
+      };
+
+      // constructor
+      MallocAllocator() throw() {}
+      MallocAllocator(const MallocAllocator&) throw() {}
+      template <class U> MallocAllocator(const MallocAllocator<U>&) throw() {}
+
+      // destructor
+      ~MallocAllocator() throw() {}
+
+      // allocate
+      pointer allocate(size_type num, MallocAllocator<T>::const_pointer hint = 0)
+      {
+        void* p = malloc(num * sizeof(T));
+        if(!p) throw std::bad_alloc();
+        return (pointer)p;
+      }
+      void construct(pointer p, const_reference value)
+      {
+        new( (void*)p ) T(value);
+      }
+
+      // deallocate
+      void deallocate(pointer p, size_type num)
+      {
+        free((void*)p);
+      }
+      void destroy(pointer p)
+      {
+        p->~T();
+      }
+
+      pointer address(reference value) const { return &value; }
+      const_pointer address(const_reference value) const { return &value; }
+
+      size_type max_size() const throw()
+      {
+        return std::numeric_limits<size_t>::max() / sizeof(T);
+      }
+  };
+
+  template <class T1, class T2>
+  bool operator==(const MallocAllocator<T1>&, const MallocAllocator<T2>&) throw() { return true; }
+  template <class T1, class T2>
+  bool operator!=(const MallocAllocator<T1>&, const MallocAllocator<T2>&) throw() { return false; }
+
 }
 }
 
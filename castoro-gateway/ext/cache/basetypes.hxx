@@ -24,15 +24,43 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <algorithm>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #ifdef __TEST__
+  // without ruby, for test/bench.cxx. Memory by malloc, errors abort.
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdarg.h>
+# include <stddef.h>
+# include <string.h>
   typedef uint32_t  ID;
+# define rb_eArgError (0)
+  inline void* ruby_xmalloc(size_t bytes) { void* p = malloc(bytes); if(!p) abort(); return p; }
+  inline void ruby_xfree(void* p) { free(p); }
+  inline void rb_memerror() { fputs("failed to allocate memory.\n", stderr); abort(); }
+  inline void rb_raise(int, const char* fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+    fputc('\n', stderr);
+    abort();
+  }
 #else
 # include <ruby.h>
 #endif
 
 #define CACHEPAGE_SIZE  (4096)    // Must be 2^n
+#define CACHEPAGE_UNITS (32)      // units of a page, a sparse page takes one. Must be <= 64
+#define CACHEPOOL_HUGEPAGE_SIZE (2*1024*1024) // Must be 2^n
+#ifndef CACHEPAGE_REVISION_BITS
+#define CACHEPAGE_REVISION_BITS (16)   // 8, 16 or 32, by extconf.rb --with-revision-bits
+#endif
 #define attr_reader(type, member) inline type member##_r() { return member; }
 #define attr_reader_ref(type, member) inline type* member##_r() { return &member; }
 
@@ -44,6 +72,41 @@ namespace Gateway {
   // for Result of Database#find(require_space).
   typedef std::vector<ID, RbAllocator<ID> > ArrayOfId;
 
+  // fixed capacity array, which never allocates memory.
+  // for Result of Database#find(content) without GVL.
+  template<class T, size_t N> class FixedArray {
+  public:
+    inline FixedArray() { m_size = 0; };
+    inline ~FixedArray() {}; // NOT virtual.
+    inline void push_back(const T& value) { if(m_size<N) m_array[m_size++] = value; };
+    inline void clear() { m_size = 0; };
+    inline size_t size() const { return m_size; };
+    inline bool empty() const { return (m_size==0); };
+    inline const T& at(size_t idx) const { return m_array[idx]; };
+    inline const T& operator[](size_t idx) const { return m_array[idx]; };
+
+  private:
+    T       m_array[N];
+    size_t  m_size;
+  };
+
+  // coarse wall clock by sec.
+  // CLOCK_REALTIME_COARSE is refreshed by the kernel tick and read from
+  // vDSO without a syscall, precise enough for expires of peers.
+  class CoarseClock {
+  public:
+    static inline time_t now() {
+#ifdef CLOCK_REALTIME_COARSE
+      struct timespec ts = { 0, 0 };
+      clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+      return ts.tv_sec;
+#else
+      return time(NULL);
+#endif
+    };
+  };
+
+
   // for Database#set_status().
   typedef enum {
     DS_UNKNOWN   = 0,
@@ -69,6 +132,17 @@ namespace Gateway {
       if(type==y.type)  return (content_id == y.content_id);
       return (type == y.type);
     };
+    // 64bit hash of the page, low bits for CachePageIndex, high bits for shards.
+    static inline uint64_t hash(uint64_t content_id, uint32_t type) {
+      uint64_t h = (content_id / CACHEPAGE_SIZE) ^ ((uint64_t)type << 40);
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return h;
+    };
+    inline uint64_t hash() const { return hash(content_id, type); };
 
   public:
     uint64_t  content_id;
@@ -19,6 +19,12 @@
  */
 
 #include "cache.hxx"
+#ifdef HAVE_RUBY_THREAD_H
+# include "ruby/thread.h"
+#endif
+#ifndef HAVE_RB_ARY_NEW_CAPA
+# define rb_ary_new_capa(n) rb_ary_new2(n)
+#endif
 
 static VALUE rb_cCastoro, rb_cCache, rb_cPeers, rb_cPeer;
 
@@ -122,6 +128,10 @@ public:
     if (peers) ruby_xfree(peers);
   };
 
+  void ids(ArrayOfId& result) const {
+    for (uint32_t i = 0; i < size; i++) result.push_back(*(peers+i));
+  }
+
   bool included(ID peer) {
     for (uint32_t i = 0; i < size; i++) {
       if (*(peers+i) == peer) return true;
@@ -145,6 +155,27 @@ private:
 };
 
 
+////////////////////////////////////////////////
+//
+// Implement of PeerName
+//
+////////////////////////////////////////////////
+class PeerName: public PeerNameAbstract
+{
+public:
+  inline PeerName() {};
+  virtual inline ~PeerName() {};
+
+  virtual std::string name(ID peer) {
+    VALUE s = rb_id2str(peer);
+    return std::string(RSTRING_PTR(s), RSTRING_LEN(s));
+  };
+  virtual ID id(const std::string& name) {
+    return rb_intern2(name.data(), name.size());
+  };
+};
+
+
 /////////////////////////////////////////////////////////////
 //
 // Implements of Castoro::Gateway::Cache
@@ -160,12 +191,22 @@ VALUE Cache::define_class(VALUE _p)
 
   rb_define_alloc_func(c, (rb_alloc_func_t)rb_alloc);
   rb_define_method(c, "initialize", RUBY_METHOD_FUNC(rb_init), -1);
+  rb_define_singleton_method(c, "page_size", RUBY_METHOD_FUNC(rb_page_size), 1);
   rb_define_method(c, "find",   RUBY_METHOD_FUNC(rb_find), 3);
+  rb_define_method(c, "find_many", RUBY_METHOD_FUNC(rb_find_many), 1);
+  rb_define_method(c, "insert_many", RUBY_METHOD_FUNC(rb_insert_many), 1);
+  rb_define_method(c, "erase_many", RUBY_METHOD_FUNC(rb_erase_many), 1);
+  rb_define_method(c, "relay", RUBY_METHOD_FUNC(rb_relay), 3);
+  rb_define_method(c, "save", RUBY_METHOD_FUNC(rb_save), 1);
+  rb_define_method(c, "load", RUBY_METHOD_FUNC(rb_load), 1);
   rb_define_method(c, "watchdog_limit", RUBY_METHOD_FUNC(rb_get_expire), 0);
   rb_define_method(c, "stat",   RUBY_METHOD_FUNC(rb_stat), 1);
+  rb_define_method(c, "histograms", RUBY_METHOD_FUNC(rb_histograms), -1);
   rb_define_method(c, "peers",  RUBY_METHOD_FUNC(rb_alloc_peers), 0);
   rb_define_method(c, "dump",  RUBY_METHOD_FUNC(rb_dump), -1);
+  rb_define_singleton_method(c, "dump_snapshot", RUBY_METHOD_FUNC(rb_dump_snapshot), -1);
   rb_define_method(c, "find_peers", RUBY_METHOD_FUNC(rb_find_peers), -1);
+  rb_define_method(c, "select_peers", RUBY_METHOD_FUNC(rb_select_peers), -1);
   rb_define_method(c, "insert_element", RUBY_METHOD_FUNC(rb_insert_element), 4);
   rb_define_method(c, "erase_element", RUBY_METHOD_FUNC(rb_erase_element), 4);
   rb_define_method(c, "get_peer_status", RUBY_METHOD_FUNC(rb_get_peer_status), 1);
@@ -176,23 +217,56 @@ VALUE Cache::define_class(VALUE _p)
   rb_eval_string(make_nfs_path);
   rb_eval_string(member_puts);
 
-  rb_define_const(c, "PAGE_SIZE", INT2NUM((sizeof(CachePage)+4096)&(~4095)));
+  rb_define_const(c, "PAGE_SIZE", rb_page_size(c, INT2NUM(PEER_SLOTS_DEFAULT)));
+  rb_define_const(c, "PEER_SLOTS_MIN", INT2NUM(PEER_SLOTS_MIN));
+  rb_define_const(c, "PEER_SLOTS_MAX", INT2NUM(PEER_SLOTS_MAX));
+  rb_define_const(c, "PEER_SLOTS_DEFAULT", INT2NUM(PEER_SLOTS_DEFAULT));
+  rb_define_const(c, "REVISION_BITS", INT2NUM(CACHEPAGE_REVISION_BITS));
+  rb_define_const(c, "DUMP_TEXT", INT2NUM(DumpWriter::FORMAT_TEXT));
+  rb_define_const(c, "DUMP_BINARY", INT2NUM(DumpWriter::FORMAT_BINARY));
   #define DEFINE_CONST(k, value)  rb_define_const(k, #value, INT2NUM(Database::value))
   DEFINE_CONST(c, DSTAT_CACHE_EXPIRE);
   DEFINE_CONST(c, DSTAT_CACHE_REQUESTS);
   DEFINE_CONST(c, DSTAT_CACHE_HITS);
   DEFINE_CONST(c, DSTAT_CACHE_COUNT_CLEAR);
+  DEFINE_CONST(c, DSTAT_SHARDS);
+  DEFINE_CONST(c, DSTAT_PEER_SLOTS);
   DEFINE_CONST(c, DSTAT_ALLOCATE_PAGES);
   DEFINE_CONST(c, DSTAT_FREE_PAGES);
   DEFINE_CONST(c, DSTAT_ACTIVE_PAGES);
+  DEFINE_CONST(c, DSTAT_EVICTED_PAGES);
+  DEFINE_CONST(c, DSTAT_ARENA_BYTES);
+  DEFINE_CONST(c, DSTAT_ARENA_HUGEPAGES);
+  DEFINE_CONST(c, DSTAT_SPARSE_PAGES);
+  DEFINE_CONST(c, DSTAT_DENSE_PAGES);
+  DEFINE_CONST(c, DSTAT_CONTENTS);
+  DEFINE_CONST(c, DSTAT_PAGE_OCCUPANCY);
   DEFINE_CONST(c, DSTAT_HAVE_STATUS_PEERS);
   DEFINE_CONST(c, DSTAT_ACTIVE_PEERS);
   DEFINE_CONST(c, DSTAT_READABLE_PEERS);
+  DEFINE_CONST(c, DSTAT_NEGATIVE_TTL);
+  DEFINE_CONST(c, DSTAT_NEGATIVE_ENTRIES);
+  DEFINE_CONST(c, DSTAT_NEGATIVE_RELAYS);
+  DEFINE_CONST(c, DSTAT_NEGATIVE_SUPPRESSED);
+  DEFINE_CONST(c, DSTAT_NEGATIVE_CLEARED);
+  DEFINE_CONST(c, DSTAT_REPLACEMENT);
+  DEFINE_CONST(c, DSTAT_ADMISSION);
+  DEFINE_CONST(c, DSTAT_PROTECTED_PAGES);
+  DEFINE_CONST(c, DSTAT_REJECTED_PAGES);
   #undef DEFINE_CONST
 
   return c;
 }
 
+//
+// mark the peer name table.
+//
+void Cache::gc_mark(void* self)
+{
+  rb_gc_mark(((Cache*)self)->m_peer_names);
+}
+
+
 //////////////////////////////////////
 // ruby Binding methods
 //////////////////////////////////////
@@ -206,8 +280,15 @@ VALUE Cache::rb_init(int argc, VALUE* argv, VALUE self)
     opt = rb_hash_new();
   }
 
+  // peer slots, for each replica of a content.
+  VALUE slots = rb_hash_aref(opt, ID2SYM(rb_intern("peer_size")));
+  if (!RTEST(slots)) slots = INT2NUM(PEER_SLOTS_DEFAULT);
+  if (NUM2INT(slots) < PEER_SLOTS_MIN || NUM2INT(slots) > PEER_SLOTS_MAX) {
+    rb_throw("peer_size must be 2..8.", rb_eArgError);
+  }
+
   VALUE klass     = rb_funcall(self, rb_intern("class"), 0);
-  VALUE page_size = rb_funcall(klass, rb_intern("const_get"), 1, rb_str_new2("PAGE_SIZE"));
+  VALUE page_size = rb_funcall(klass, rb_intern("page_size"), 1, slots);
   VALUE page_num  = rb_funcall(size, rb_intern("/"), 1, page_size);
 
   ssize_t pages = NUM2LL(page_num);
@@ -215,10 +296,43 @@ VALUE Cache::rb_init(int argc, VALUE* argv, VALUE self)
     rb_throw("Page size must be > 0.", rb_eArgError);
   }
 
+  // page pool options.
+  int pool_flags = 0;
+  if (RTEST(rb_hash_aref(opt, ID2SYM(rb_intern("hugepages"))))) pool_flags |= CachePagePool::POOL_HUGEPAGES;
+  if (RTEST(rb_hash_aref(opt, ID2SYM(rb_intern("prefault"))))) pool_flags |= CachePagePool::POOL_PREFAULT;
+  if (rb_hash_aref(opt, ID2SYM(rb_intern("sparse_pages"))) == Qfalse) pool_flags |= CachePagePool::POOL_DENSE;
+
+  // page replacement policy, and admission of new pages.
+  VALUE replacement = rb_hash_aref(opt, ID2SYM(rb_intern("replacement")));
+  if (RTEST(replacement)) {
+    VALUE name = rb_obj_as_string(replacement);
+    if (strcmp(StringValueCStr(name), "clock") == 0) pool_flags |= CachePagePool::POOL_CLOCK;
+    else if (strcmp(StringValueCStr(name), "slru") == 0) pool_flags |= CachePagePool::POOL_SLRU;
+    else if (strcmp(StringValueCStr(name), "lru") != 0) {
+      rb_throw("replacement must be lru, clock or slru.", rb_eArgError);
+    }
+  }
+  VALUE admission = rb_hash_aref(opt, ID2SYM(rb_intern("admission")));
+  if (RTEST(admission)) {
+    VALUE name = rb_obj_as_string(admission);
+    if (admission != Qtrue && strcmp(StringValueCStr(name), "tinylfu") != 0) {
+      rb_throw("admission must be true or tinylfu.", rb_eArgError);
+    }
+    pool_flags |= CachePagePool::POOL_ADMISSION;
+  }
+
+  // shards.
+  VALUE shards = rb_hash_aref(opt, ID2SYM(rb_intern("shards")));
+  if (!RTEST(shards)) shards = INT2NUM(1);
+  if (NUM2INT(shards) <= 0) {
+    rb_throw("Shards must be > 0.", rb_eArgError);
+  }
+
   Cache* c = get_self(self);
   Database* pdb = (Database*)ruby_xmalloc(sizeof(Database));
-  new( (void*)pdb ) Database(pages);
+  new( (void*)pdb ) Database(pages, pool_flags, NUM2INT(shards), NUM2INT(slots));
   c->m_db = pdb;
+  c->m_peer_names = rb_ary_new();
 
   operator_locker = rb_intern("locker");
   operator_synchronize = rb_intern("synchronize");
@@ -242,40 +356,282 @@ VALUE Cache::rb_init(int argc, VALUE* argv, VALUE self)
   if (!RTEST(watchdog_limit)) watchdog_limit = INT2NUM(15);
   c->set_expire(NUM2UINT(watchdog_limit));
 
+  // negative cache of relayed misses, by sec.
+  VALUE negative_ttl = rb_hash_aref(opt, ID2SYM(rb_intern("negative_ttl")));
+  if (RTEST(negative_ttl) && NUM2DBL(negative_ttl) > 0) {
+    VALUE grace = rb_hash_aref(opt, ID2SYM(rb_intern("negative_grace")));
+    VALUE entries = rb_hash_aref(opt, ID2SYM(rb_intern("negative_entries")));
+    if (!RTEST(grace)) grace = rb_float_new(0.1);
+    if (!RTEST(entries)) entries = INT2NUM(65536);
+    if (NUM2DBL(grace) < 0 || NUM2LL(entries) <= 0) {
+      rb_throw("negative_grace must be >= 0, negative_entries must be > 0.", rb_eArgError);
+    }
+    pdb->set_negative(NUM2LL(entries), (uint64_t)(NUM2DBL(negative_ttl) * 1e9), (uint64_t)(NUM2DBL(grace) * 1e9));
+  }
+
   return self;
 }
 
 
 //
-//  public Cache.find()
+// public  self.page_size(peer_size)
 //
-VALUE Cache::rb_find(VALUE self, VALUE _c, VALUE _t, VALUE _r)
+VALUE Cache::rb_page_size(VALUE self, VALUE _s)
 {
-  return rb_iterate(synchronize, self, RUBY_METHOD_FUNC(find_internal), rb_ary_new3(4, self, _c, _t, _r));
+  size_t bytes = CachePageBase::size_of(NUM2INT(_s));
+  if (bytes == 0) {
+    rb_raise(rb_eArgError, "Peer slots must be %d..%d.", PEER_SLOTS_MIN, PEER_SLOTS_MAX);
+  }
+  return INT2NUM((bytes+4096)&(~4095));
 }
 
-VALUE Cache::find_internal(VALUE block_arg, VALUE data, VALUE self)
+
+//
+// content handlings.
+//
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+class FindRequest
 {
-  VALUE _self = rb_ary_entry(data, 0);
-  VALUE _c    = rb_ary_entry(data, 1);
-  VALUE _t    = rb_ary_entry(data, 2);
-  VALUE _r    = rb_ary_entry(data, 3);
+public:
+  inline FindRequest(Database& d, uint64_t c, uint32_t t, uint32_t r, FoundIds& a, bool& k)
+    :db(d), result(a), removed(k) { content_id = c; type = t; revision = r; };
+  inline ~FindRequest() {}; // NOT virtual.
+
+  Database& db;
+  uint64_t content_id;
+  uint32_t type;
+  uint32_t revision;
+  FoundIds& result;
+  bool& removed;
+};
 
-  ArrayOfId a;
+static void* find_without_gvl(void* data)
+{
+  FindRequest* req = (FindRequest*)data;
+  req->db.find(req->content_id, req->type, req->revision, req->result, req->removed);
+  return NULL;
+}
+
+class FindManyRequest
+{
+public:
+  inline FindManyRequest(Database& d, const ArrayOfElement& e, const ArrayOfIndex& o, ArrayOfFound& a)
+    :db(d), elements(e), order(o), result(a) {};
+  inline ~FindManyRequest() {}; // NOT virtual.
+
+  Database& db;
+  const ArrayOfElement& elements;
+  const ArrayOfIndex& order;
+  ArrayOfFound& result;
+};
+
+static void* find_many_without_gvl(void* data)
+{
+  FindManyRequest* req = (FindManyRequest*)data;
+  req->db.find(req->elements, req->order, req->result);
+  return NULL;
+}
+#endif
+
+void Cache::find(uint64_t c, uint32_t t, uint32_t r, FoundIds& a, bool& k)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  FindRequest req(*m_db, c, t, r, a, k);
+  rb_thread_call_without_gvl(find_without_gvl, &req, NULL, NULL);
+#else
+  m_db->find(c, t, r, a, k);
+#endif
+}
+
+void Cache::find(const ArrayOfElement& e, ArrayOfFound& a)
+{
+  // allocate everything with GVL.
+  ArrayOfIndex o;
+  m_db->order(e, o);
+  a.resize(e.size());
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  FindManyRequest req(*m_db, e, o, a);
+  rb_thread_call_without_gvl(find_many_without_gvl, &req, NULL, NULL);
+#else
+  m_db->find(e, o, a);
+#endif
+}
+
+
+//
+// [[content_id, type, revision], ...] or
+// [[peer, content_id, type, revision], ...] to elements.
+//
+static void to_elements(VALUE _a, bool with_peer, ArrayOfElement& result)
+{
+  Check_Type(_a, T_ARRAY);
+  long len = RARRAY_LEN(_a);
+  long ofs = with_peer ? 1 : 0;
+
+  // check all at first, not to raise after allocation.
+  for(long i=0; i<len; i++) {
+    VALUE e = rb_ary_entry(_a, i);
+    Check_Type(e, T_ARRAY);
+    if(RARRAY_LEN(e)!=(3+ofs)) {
+      rb_raise(rb_eArgError, "wrong number of element values (%ld for %ld)", RARRAY_LEN(e), 3+ofs);
+    }
+    if(with_peer) rb_to_id(rb_ary_entry(e, 0));
+    NUM2ULL(rb_ary_entry(e, ofs));
+    NUM2INT(rb_ary_entry(e, ofs+1));
+    NUM2INT(rb_ary_entry(e, ofs+2));
+  }
+
+  result.reserve(len);
+  for(long i=0; i<len; i++) {
+    VALUE e = rb_ary_entry(_a, i);
+    result.push_back(Element(NUM2ULL(rb_ary_entry(e, ofs)),
+                             NUM2INT(rb_ary_entry(e, ofs+1)),
+                             NUM2INT(rb_ary_entry(e, ofs+2)),
+                             with_peer ? rb_to_id(rb_ary_entry(e, 0)) : 0));
+  }
+}
+
+//
+// peer names are interned by PEERH, and reused by every find.
+//
+VALUE Cache::peer_name(PEERH h, ID peer)
+{
+  VALUE name = rb_ary_entry(m_peer_names, h);
+  if(NIL_P(name)) {
+    name = rb_str_dup(rb_id2str(peer));
+    rb_obj_freeze(name);
+    rb_ary_store(m_peer_names, h, name);
+  }
+  return name;
+}
+
+VALUE Cache::found_to_ary(const FoundIds& a)
+{
+  VALUE result = rb_ary_new_capa(a.size());
+  for(unsigned int i=0; i<a.size(); i++) {
+    rb_ary_push(result, peer_name(a.handle(i), a.at(i)));
+  }
+  return result;
+}
+
+
+//
+//  public Cache.find()
+//
+// Not synchronized by the locker, Database#find runs without GVL,
+// so that lookups scale with the worker threads.
+//
+VALUE Cache::rb_find(VALUE self, VALUE _c, VALUE _t, VALUE _r)
+{
+  FoundIds a;
   bool removed = false;
 
-  get_self(_self)->find(NUM2ULL(_c), NUM2INT(_t), NUM2INT(_r), a, removed);
+  get_self(self)->find(NUM2ULL(_c), NUM2INT(_t), NUM2INT(_r), a, removed);
   if(removed) return Qnil;
 
-  VALUE result = rb_class_new_instance(0, &stub, rb_cArray);
-  for(unsigned int i=0; i<a.size(); i++) {
-    ID peer = a.at(i);
-    rb_funcall(result, operator_push, 1, rb_funcall(ID2SYM(peer), rb_intern("to_s"), 0));
+  return get_self(self)->found_to_ary(a);
+}
+
+
+//
+//  public Cache.find_many()
+//
+// Same as Cache.find() for each of [[content_id, type, revision], ...].
+//
+VALUE Cache::rb_find_many(VALUE self, VALUE _a)
+{
+  ArrayOfElement e;
+  ArrayOfFound a;
+  to_elements(_a, false, e);
+
+  Cache* c = get_self(self);
+  c->find(e, a);
+
+  VALUE result = rb_ary_new_capa(a.size());
+  for(ArrayOfFound::iterator it=a.begin(); it!=a.end(); it++) {
+    rb_ary_push(result, (*it).removed ? Qnil : c->found_to_ary((*it).peers));
   }
   return result;
 }
 
 
+//
+//  public Cache.insert_many()
+//
+// Same as Cache.insert_element() for each of [[peer, content_id, type, revision], ...].
+// Not synchronized by the locker, the Database locks each shard once.
+//
+VALUE Cache::rb_insert_many(VALUE self, VALUE _a)
+{
+  ArrayOfElement e;
+  to_elements(_a, true, e);
+
+  get_self(self)->insert(e);
+  return Qnil;
+}
+
+
+//
+//  public Cache.erase_many()
+//
+// Same as Cache.erase_element() for each of [[peer, content_id, type, revision], ...].
+//
+VALUE Cache::rb_erase_many(VALUE self, VALUE _a)
+{
+  ArrayOfElement e;
+  to_elements(_a, true, e);
+
+  get_self(self)->remove(e);
+  return Qnil;
+}
+
+
+//
+//  public Cache.relay()
+//
+// Called when Cache.find() missed, true if the Get should be relayed to
+// peers. false while the relay of the key got no answers, until
+// :negative_ttl after the relay. Always true unless :negative_ttl is set.
+// Not synchronized by the locker.
+//
+VALUE Cache::rb_relay(VALUE self, VALUE _c, VALUE _t, VALUE _r)
+{
+  return get_self(self)->relay(NUM2ULL(_c), NUM2INT(_t), NUM2INT(_r)) ? Qtrue : Qfalse;
+}
+
+
+//
+//  public Cache.save()
+//
+// Write a snapshot of the cache to the path, for warm restart.
+//
+VALUE Cache::rb_save(VALUE self, VALUE _path)
+{
+  PeerName names;
+  DatabaseSnapshot snapshot(*(get_self(self)->m_db));
+  const char* path = StringValueCStr(_path);
+
+  if(!snapshot.save(path, names)) rb_sys_fail(path);
+  return ULL2NUM(snapshot.m_pages_r());
+}
+
+
+//
+//  public Cache.load()
+//
+// Read a snapshot into the empty cache, false if it is missing or invalid.
+//
+VALUE Cache::rb_load(VALUE self, VALUE _path)
+{
+  PeerName names;
+  DatabaseSnapshot snapshot(*(get_self(self)->m_db));
+
+  if(snapshot.load(StringValueCStr(_path), names)) return Qtrue;
+  if(errno==ENOMEM) rb_memerror();
+  return Qfalse;
+}
+
+
 //
 //  public Cache.watchdog_limit()
 //
@@ -308,6 +664,53 @@ VALUE Cache::stat_internal(VALUE block_arg, VALUE data, VALUE self)
 }
 
 
+//
+//  public Cache.histograms()
+//
+// histograms(clear = false)
+// Latency summaries of find, insert, remove by a call of a content or a
+// batch, and lock_wait of the locks of shards and peers.
+// { :find => { :count, :mean, :p50, :p90, :p99, :p999, :max }, ... }
+// by usec. Not synchronized by the locker, histograms are lock free.
+//
+static VALUE histogram_summary(LatencyHistogram& h)
+{
+  static const struct { const char* name; double p; } PERCENTILES[] = {
+    { "p50", 50.0 }, { "p90", 90.0 }, { "p99", 99.0 }, { "p999", 99.9 }
+  };
+  uint64_t count = h.count();
+  VALUE result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("count")), ULL2NUM(count));
+  rb_hash_aset(result, ID2SYM(rb_intern("mean")), rb_float_new(count ? h.m_sum_r() / 1000.0 / count : 0.0));
+  for(size_t i=0; i<sizeof(PERCENTILES)/sizeof(PERCENTILES[0]); i++) {
+    rb_hash_aset(result, ID2SYM(rb_intern(PERCENTILES[i].name)), rb_float_new(h.percentile(PERCENTILES[i].p) / 1000.0));
+  }
+  rb_hash_aset(result, ID2SYM(rb_intern("max")), rb_float_new(h.m_max_r() / 1000.0));
+  return result;
+}
+
+VALUE Cache::rb_histograms(int argc, VALUE* argv, VALUE self)
+{
+  static const struct { const char* name; Database::DatabaseHistogram key; } HISTOGRAMS[] = {
+    { "find", Database::DHIST_FIND },
+    { "insert", Database::DHIST_INSERT },
+    { "remove", Database::DHIST_REMOVE },
+    { "lock_wait", Database::DHIST_LOCK_WAIT }
+  };
+  VALUE _clear;
+  rb_scan_args(argc, argv, "01", &_clear);
+
+  Cache* c = get_self(self);
+  VALUE result = rb_hash_new();
+  for(size_t i=0; i<sizeof(HISTOGRAMS)/sizeof(HISTOGRAMS[0]); i++) {
+    LatencyHistogram h;
+    c->m_db->histogram(HISTOGRAMS[i].key, h, RTEST(_clear));
+    rb_hash_aset(result, ID2SYM(rb_intern(HISTOGRAMS[i].name)), histogram_summary(h));
+  }
+  return result;
+}
+
+
 //
 //  public Cache.peers()
 //
@@ -325,19 +728,157 @@ VALUE Cache::alloc_peers_internal(VALUE block_arg, VALUE data, VALUE self)
   return Data_Wrap_Struct(rb_cPeers, Peers::gc_mark, Peers::free, pp);
 }
 
+//
+// native dump to the file descriptor of io, without GVL.
+//
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+class DumpRequest
+{
+public:
+  inline DumpRequest(Database& d, DumpWriter& w, const ArrayOfId* p) :db(d), writer(w), peers(p) { result = false; };
+  inline ~DumpRequest() {}; // NOT virtual.
+
+  Database& db;
+  DumpWriter& writer;
+  const ArrayOfId* peers; // NULL for all.
+  bool result;
+};
+
+static void* dump_without_gvl(void* data)
+{
+  DumpRequest* req = (DumpRequest*)data;
+  req->result = req->writer.begin() &&
+    (req->peers ? req->db.dump(req->writer, *(req->peers)) : req->db.dump(req->writer)) &&
+    req->writer.finish();
+  return NULL;
+}
+
+// unblocking function, the dump stops at the next element or write.
+static void dump_ubf(void* data)
+{
+  ((DumpRequest*)data)->writer.interrupt();
+}
+#endif
+
+// file descriptor of io, or -1 if io is not a file such as StringIO.
+static int dump_fd(VALUE _f)
+{
+  if(!rb_respond_to(_f, rb_intern("fileno"))) return -1;
+  VALUE fd = rb_funcall(_f, rb_intern("fileno"), 0);
+  if(NIL_P(fd)) return -1;
+  rb_funcall(_f, rb_intern("flush"), 0);
+  return NUM2INT(fd);
+}
+
+// peers to dump as an array, or nil for all known peers.
+// check all at first, not to raise after allocation.
+static VALUE dump_peers(VALUE _p)
+{
+  if(!RTEST(_p)) return Qnil;
+  VALUE a = rb_check_array_type(_p);
+  if(NIL_P(a)) a = rb_ary_new3(1, _p);
+  for(long i=0; i<RARRAY_LEN(a); i++) rb_to_id(rb_ary_entry(a, i));
+  return a;
+}
+
+// returns errno, 0 if succeeded.
+// With peers, only pages of the peers are visited.
+static int dump_natively(Database& db, int fd, int format, VALUE peers)
+{
+  PeerName names;
+  ArrayOfId ids;
+  if(NIL_P(peers)) {
+    db.known_peers(ids);
+  } else {
+    for(long i=0; i<RARRAY_LEN(peers); i++) ids.push_back(rb_to_id(rb_ary_entry(peers, i)));
+  }
+
+  DumpWriter writer(fd, (DumpWriter::Format)format);
+  for(ArrayOfId::iterator it=ids.begin(); it!=ids.end(); it++) writer.add_peer(*it, names.name(*it));
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  DumpRequest req(db, writer, NIL_P(peers) ? NULL : &ids);
+  rb_thread_call_without_gvl(dump_without_gvl, &req, dump_ubf, &req);
+  bool ok = req.result;
+#else
+  bool ok = writer.begin() && (NIL_P(peers) ? db.dump(writer) : db.dump(writer, ids)) && writer.finish();
+#endif
+  return ok ? 0 : (writer.m_errno_r() ? writer.m_errno_r() : EIO);
+}
+
+static int dump_format(VALUE _fmt)
+{
+  int format = NIL_P(_fmt) ? DumpWriter::FORMAT_TEXT : NUM2INT(_fmt);
+  if(format!=DumpWriter::FORMAT_TEXT && format!=DumpWriter::FORMAT_BINARY) {
+    rb_raise(rb_eArgError, "unknown dump format %d.", format);
+  }
+  return format;
+}
+
+
 //
 //  public Cache.dump()
 //
+// dump(io, peers = nil, format = DUMP_TEXT)
+// Not synchronized by the locker if io is a file, the Database is dumped
+// natively page by page without GVL. Otherwise by member_puts, as text.
+//
 VALUE Cache::rb_dump(int argc, VALUE* argv, VALUE self)
 {
-  VALUE _f, _p;
-  int num = rb_scan_args(argc, argv, "11", &_f, &_p);
+  VALUE _f, _p, _fmt;
+  int num = rb_scan_args(argc, argv, "12", &_f, &_p, &_fmt);
+  int format = dump_format(_fmt);
+
+  int fd = dump_fd(_f);
+  if(fd>=0) {
+    int err = dump_natively(*(get_self(self)->m_db), fd, format, dump_peers(_p));
+    if(err) rb_syserr_fail(err, "dump");
+    return Qtrue;
+  }
+  if(format!=DumpWriter::FORMAT_TEXT) {
+    rb_raise(rb_eArgError, "binary dump needs io with a file descriptor.");
+  }
+
   VALUE args = rb_ary_new3(2, self, _f);
-  if (num == 2) rb_ary_push(args, _p);
+  if (num >= 2) rb_ary_push(args, _p);
 
   return rb_iterate(synchronize, self, RUBY_METHOD_FUNC(dump_internal), args);
 }
 
+
+//
+//  public self.dump_snapshot()
+//
+// dump_snapshot(path, io, peers = nil, format = DUMP_TEXT)
+// Dump a snapshot saved by #save, a point-in-time copy of a cache,
+// without touching any live cache. io must have a file descriptor.
+//
+VALUE Cache::rb_dump_snapshot(int argc, VALUE* argv, VALUE klass)
+{
+  VALUE _path, _f, _p, _fmt;
+  rb_scan_args(argc, argv, "22", &_path, &_f, &_p, &_fmt);
+  const char* path = StringValueCStr(_path);
+  int format = dump_format(_fmt);
+  VALUE peers = dump_peers(_p);
+  int fd = dump_fd(_f);
+  if(fd<0) rb_raise(rb_eArgError, "dump_snapshot needs io with a file descriptor.");
+
+  Database* db = DatabaseSnapshot::create(path);
+  if(!db) rb_sys_fail(path);
+
+  // load with names, nothing raises until the Database is destroyed.
+  PeerName names;
+  DatabaseSnapshot snapshot(*db);
+  int err = snapshot.load(path, names) ? 0 : errno;
+  bool loaded = (err==0);
+  if(loaded) err = dump_natively(*db, fd, format, peers);
+  db->~Database();
+  ruby_xfree((void*)db);
+
+  if(!loaded) rb_syserr_fail(err, path);
+  if(err) rb_syserr_fail(err, "dump");
+  return Qtrue;
+}
+
 VALUE Cache::dump_internal(VALUE block_arg, VALUE data, VALUE self)
 {
   VALUE _self = rb_ary_entry(data, 0);
@@ -348,7 +889,9 @@ VALUE Cache::dump_internal(VALUE block_arg, VALUE data, VALUE self)
   bool result;
   if (RTEST(_p)) {
     FilteredDumper dumper(_self, _f, _p);
-    result = (c->m_db->dump(dumper));
+    ArrayOfId ids;
+    dumper.ids(ids);
+    result = (c->m_db->dump(dumper, ids));
   } else {
     Dumper dumper(_self, _f);
     result = (c->m_db->dump(dumper));
@@ -384,6 +927,36 @@ VALUE Cache::find_peers_internal(VALUE block_arg, VALUE data, VALUE self)
 }
 
 
+//
+//  public Cache.select_peers()
+//
+// Writable peers which have require_spaces, at most count of them, in
+// order of preference. Sampled at random weighted by available spaces,
+// and only from candidates, an Array of peer names, if it is given.
+// Not synchronized by the locker, the Database locks peers once.
+//
+VALUE Cache::rb_select_peers(int argc, VALUE* argv, VALUE self)
+{
+  VALUE _r, _n, _c;
+  rb_scan_args(argc, argv, "21", &_r, &_n, &_c);
+  uint64_t require_spaces = NUM2ULL(_r);
+  long count = NUM2LONG(_n);
+
+  ArrayOfId candidates, a;
+  if(!NIL_P(_c)) {
+    Check_Type(_c, T_ARRAY);
+    for(long i=0; i<RARRAY_LEN(_c); i++) candidates.push_back(rb_to_id(rb_ary_entry(_c, i)));
+  }
+  if(count>0) get_self(self)->select(require_spaces, count, NIL_P(_c) ? NULL : &candidates, a);
+
+  VALUE result = rb_ary_new_capa(a.size());
+  for(ArrayOfId::iterator it = a.begin(); it != a.end(); it++) {
+    rb_ary_push(result, rb_id2str(*it));
+  }
+  return result;
+}
+
+
 //
 // public Cache.insert_element()
 //
@@ -589,6 +1162,7 @@ VALUE Peer::define_class(VALUE _p)
   rb_define_method(c, "erase",  RUBY_METHOD_FUNC(rb_remove), 3);
   rb_define_method(c, "status=", RUBY_METHOD_FUNC(rb_set_status), 1);
   rb_define_method(c, "status",  RUBY_METHOD_FUNC(rb_get_status), 0);
+  rb_define_method(c, "purge",   RUBY_METHOD_FUNC(rb_purge), 0);
   rb_define_method(c, "unlink",   RUBY_METHOD_FUNC(rb_unlink), 0);
 
   rb_define_const(c, "MAINTENANCE",  INT2NUM(DS_MAINTENANCE));
@@ -658,12 +1232,27 @@ VALUE Peer::rb_get_status(VALUE self)
 }
 
 
+//
+// public Peer.purge()
+//
+// removes the peer from all contents, returns the removed entries.
+//
+VALUE Peer::rb_purge(VALUE self)
+{
+  Peer* p = get_self(self);
+  return ULL2NUM(p->m_cache->purge(p->m_peer));
+}
+
+
 //
 // public Peer.unlink()
 //
+// forgets the status, and the contents not to route to the peer.
+//
 VALUE Peer::rb_unlink(VALUE self)
 {
   Peer* p = get_self(self);
+  p->m_cache->purge(p->m_peer);
   p->m_cache->remove(p->m_peer);
   return Qnil;
 }
@@ -23,6 +23,8 @@
 
 #include "ruby.h"
 #include "database.hxx"
+#include "snapshot.hxx"
+#include "dump.hxx"
 
 // C++/Ruby Wrapper template.
 template<class T> class RubyWrapper
@@ -57,7 +59,7 @@ namespace Gateway {
 class Cache :public RubyWrapper<Cache>
 {
 public:
-  inline Cache() { m_db = NULL; };
+  inline Cache() { m_db = NULL; m_peer_names = Qnil; };
   inline virtual ~Cache() {
     try{
       if(m_db) {
@@ -69,10 +71,12 @@ public:
 
   // content handlings.
   inline void insert(uint64_t c, uint32_t t, uint32_t r, ID p) { m_db->insert(c, t, r, p); };
-  inline void find(uint64_t c, uint32_t t, uint32_t r, ArrayOfId& a, bool& k) {
-    m_db->find(c, t, r, a, k);
-  };
+  void find(uint64_t c, uint32_t t, uint32_t r, FoundIds& a, bool& k);
   inline void remove(uint64_t c, uint32_t t, uint32_t r, ID p) { m_db->remove(c, t, r, p); };
+  inline void insert(const ArrayOfElement& e) { m_db->insert(e); };
+  void find(const ArrayOfElement& e, ArrayOfFound& a);
+  inline void remove(const ArrayOfElement& e) { m_db->remove(e); };
+  inline bool relay(uint64_t c, uint32_t t, uint32_t r) { return m_db->relay(c, t, r); };
 
   // Peer handlings.
   // These method is called by Peer class. 
@@ -80,7 +84,9 @@ public:
   inline bool get_status(ID p, PeerStatus& s) { return m_db->get_status(p, s); };
   inline void find(ArrayOfId& a) { m_db->find(a); };
   inline void find(uint64_t r, ArrayOfId& a) { m_db->find(r, a); };
+  inline void select(uint64_t r, size_t n, const ArrayOfId* c, ArrayOfId& a) { m_db->select(r, n, c, a); };
   inline void remove(ID p) { m_db->remove(p); };
+  inline size_t purge(ID p) { return m_db->purge(p); };
 
   // global stats.
   inline void set_expire(uint32_t e) { m_db->set_expire(e); };
@@ -89,18 +95,33 @@ public:
 
   // Ruby bindings.
   static VALUE define_class(VALUE _p);
+  static void gc_mark(void* self);
 
 private:
   Database* m_db;
+  VALUE m_peer_names; // PEERH => frozen peer name String.
+
+  VALUE peer_name(PEERH h, ID peer);
+  VALUE found_to_ary(const FoundIds& a);
 
   // Ruby bindings.
   static VALUE rb_init(int argc, VALUE* argv, VALUE self);
+  static VALUE rb_page_size(VALUE self, VALUE _s);
   static VALUE rb_find(VALUE self, VALUE _c, VALUE _t, VALUE _r);
+  static VALUE rb_find_many(VALUE self, VALUE _a);
+  static VALUE rb_insert_many(VALUE self, VALUE _a);
+  static VALUE rb_erase_many(VALUE self, VALUE _a);
+  static VALUE rb_relay(VALUE self, VALUE _c, VALUE _t, VALUE _r);
+  static VALUE rb_save(VALUE self, VALUE _path);
+  static VALUE rb_load(VALUE self, VALUE _path);
   static VALUE rb_get_expire(VALUE self);
   static VALUE rb_stat(VALUE self, VALUE _k);
+  static VALUE rb_histograms(int argc, VALUE* argv, VALUE self);
   static VALUE rb_alloc_peers(VALUE self);
   static VALUE rb_dump(int argc, VALUE* argv, VALUE self);
+  static VALUE rb_dump_snapshot(int argc, VALUE* argv, VALUE klass);
   static VALUE rb_find_peers(int argc, VALUE* argv, VALUE self);
+  static VALUE rb_select_peers(int argc, VALUE* argv, VALUE self);
   static VALUE rb_insert_element(VALUE self, VALUE _p, VALUE _c, VALUE _t, VALUE _r);
   static VALUE rb_erase_element(VALUE self, VALUE _p, VALUE _c, VALUE _t, VALUE _r);
   static VALUE rb_get_peer_status(VALUE self, VALUE _p);
@@ -112,7 +133,6 @@ private:
   // these method is internal to
   // 
   static VALUE synchronize(VALUE self);
-  static VALUE find_internal(VALUE block_arg, VALUE data, VALUE self);
   static VALUE get_expire_internal(VALUE block_arg, VALUE data, VALUE self);
   static VALUE stat_internal(VALUE block_arg, VALUE data, VALUE self);
   static VALUE alloc_peers_internal(VALUE block_arg, VALUE data, VALUE self);
@@ -164,6 +184,7 @@ public:
   static VALUE rb_remove(VALUE self, VALUE _c, VALUE _t, VALUE _r);
   static VALUE rb_set_status(VALUE self, VALUE _s);
   static VALUE rb_get_status(VALUE self);
+  static VALUE rb_purge(VALUE self);
   static VALUE rb_unlink(VALUE self);
 };
 }
@@ -19,180 +19,1042 @@
  */
 
 #include "database.hxx"
+#include <math.h>
 
 
 namespace Castoro {
 namespace Gateway {
 
 
+// prefer writers, they are waiting for the lock with GVL.
+static void init_rwlock(pthread_rwlock_t* lock)
+{
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+
 //
-// class Database
+// class PeerStatusTable
 //
-Database::Database(size_t pages)
+PeerStatusTable::PeerStatusTable()
+{
+  m_count = 0;
+  m_refreshed = 0;
+}
+
+
+// everything is grown first, so that nothing is changed by std::bad_alloc.
+void PeerStatusTable::set(PEERH h, const PeerStatus& status)
+{
+  size_t w = h/64;
+  uint64_t bit = 1ULL << (h%64);
+  if(h>=m_status.size()) m_status.resize(h+1);
+  if(w>=m_present.size()) m_present.resize(w+1, 0);
+  if(w>=m_readable.size()) m_readable.resize(w+1, 0);
+  if(w>=m_writable.size()) m_writable.resize(w+1, 0);
+  m_by_space.reserve(m_count+1);
+
+  if(!has(h)) {
+    m_present[w] |= bit;
+    m_count++;
+  } else {
+    unlink_space(h);
+  }
+  m_status[h] = status;
+  link_space(h);
+  m_readable[w] &= ~bit;
+  m_writable[w] &= ~bit;
+  if(status.is_valid(CoarseClock::now())) mark(h);
+}
+
+
+void PeerStatusTable::remove(PEERH h)
+{
+  if(!has(h)) return;
+  uint64_t bit = 1ULL << (h%64);
+  m_present[h/64] &= ~bit;
+  m_readable[h/64] &= ~bit;
+  m_writable[h/64] &= ~bit;
+  unlink_space(h);
+  m_status[h] = PeerStatus();
+  m_count--;
+}
+
+
+bool PeerStatusTable::get(PEERH h, PeerStatus& status) const
+{
+  if(!has(h)) return false;
+  status = m_status[h];
+  return true;
+}
+
+
+// under rdlock(), the status itself is not changed.
+void PeerStatusTable::touch(PEERH h, time_t expire)
+{
+  if(!has(h)) return;
+  __sync_lock_test_and_set(&(m_status[h].expire), expire);
+  mark(h);
+}
+
+
+// under rdlock(), by one of readers once a second.
+void PeerStatusTable::refresh(time_t now)
+{
+  time_t last = m_refreshed;
+  if(last>=now) return;
+  if(!__sync_bool_compare_and_swap(&m_refreshed, last, now)) return;
+
+  for(size_t w=0; w<m_readable.size(); w++) {
+    uint64_t bits = m_readable[w] | m_writable[w];
+    while(bits) {
+      int b = __builtin_ctzll(bits);
+      bits &= bits-1;
+      PEERH h = (PEERH)(w*64 + b);
+      if(m_status[h].is_valid(now)) continue;
+      __sync_fetch_and_and(&m_readable[w], ~(1ULL << b));
+      __sync_fetch_and_and(&m_writable[w], ~(1ULL << b));
+      // touch() may extend the expire meanwhile.
+      if(m_status[h].is_valid(now)) mark(h);
+    }
+  }
+}
+
+
+void PeerStatusTable::mark(PEERH h)
+{
+  const PeerStatus& s = m_status[h];
+  uint64_t bit = 1ULL << (h%64);
+  if(s.readable_status()) __sync_fetch_and_or(&m_readable[h/64], bit);
+  if(s.writable_status()) __sync_fetch_and_or(&m_writable[h/64], bit);
+}
+
+
+size_t PeerStatusTable::count(const BITMAP& bits)
+{
+  size_t result = 0;
+  for(size_t w=0; w<bits.size(); w++) result += __builtin_popcountll(bits[w]);
+  return result;
+}
+
+size_t PeerStatusTable::count_readable() const { return count(m_readable); }
+size_t PeerStatusTable::count_writable() const { return count(m_writable); }
+
+
+void PeerStatusTable::link_space(PEERH h)
+{
+  uint64_t available = m_status[h].available;
+  PEERH_VECTOR::iterator it = m_by_space.begin();
+  while((it!=m_by_space.end()) && (m_status[*it].available>=available)) it++;
+  m_by_space.insert(it, h);
+}
+
+void PeerStatusTable::unlink_space(PEERH h)
+{
+  PEERH_VECTOR::iterator it = std::find(m_by_space.begin(), m_by_space.end(), h);
+  if(it!=m_by_space.end()) m_by_space.erase(it);
+}
+
+
+// splitmix64.
+static inline uint64_t next_random(uint64_t& state)
+{
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// A-Res of Efraimidis and Spirakis, each peer gets key log(u)/weight and
+// the largest keys win, in order of the keys. Candidates are visited in
+// order of available spaces, and the rest never have require_space.
+void PeerStatusTable::select(uint64_t require_space, size_t count, uint64_t seed,
+                             const ArrayOfPeerH* allowed, SelectKeys& keys, ArrayOfPeerH& result) const
+{
+  typedef std::pair<double, PEERH> KEY;
+  keys.clear();
+  if(keys.capacity()==0) return;
+  if(count>keys.capacity()-1) count = keys.capacity()-1;
+  if(count>result.capacity()-result.size()) count = result.capacity()-result.size();
+  if(count==0) return;
+
+  for(PEERH_VECTOR::const_iterator it=m_by_space.begin(); it!=m_by_space.end(); it++) {
+    const PeerStatus& s = m_status[*it];
+    if(s.available<require_space) break;
+    if(!is_writable(*it)) continue;
+    if(allowed && !std::binary_search(allowed->begin(), allowed->end(), *it)) continue;
+
+    double u = ((next_random(seed) >> 11) + 0.5) / 9007199254740992.0;   // (0, 1)
+    double key = log(u) / ((double)s.available + 1.0);
+    if((keys.size()>=count) && (key<=keys.back().first)) continue;
+
+    // keep the largest count keys in descending order.
+    SelectKeys::iterator k = keys.begin();
+    while((k!=keys.end()) && ((*k).first>=key)) k++;
+    keys.insert(k, KEY(key, *it));
+    if(keys.size()>count) keys.pop_back();
+  }
+
+  for(size_t i=0; i<keys.size(); i++) result.push_back(keys[i].second);
+}
+
+
+
+//
+// class DatabaseShard
+//
+template<int N> static DatabaseShard* new_shard(size_t pages, int pool_flags)
+{
+  DatabaseShardOf<N>* p = (DatabaseShardOf<N>*)ruby_xmalloc(sizeof(DatabaseShardOf<N>));
+  new( (void*)p ) DatabaseShardOf<N>(pages, pool_flags);
+  return p;
+}
+
+DatabaseShard* DatabaseShard::create(size_t slots, size_t pages, int pool_flags)
+{
+  switch(slots) {
+  case 2: return new_shard<2>(pages, pool_flags);
+  case 3: return new_shard<3>(pages, pool_flags);
+  case 4: return new_shard<4>(pages, pool_flags);
+  case 5: return new_shard<5>(pages, pool_flags);
+  case 6: return new_shard<6>(pages, pool_flags);
+  case 7: return new_shard<7>(pages, pool_flags);
+  case 8: return new_shard<8>(pages, pool_flags);
+  default:
+    rb_raise(rb_eArgError, "Peer slots must be %d..%d.", PEER_SLOTS_MIN, PEER_SLOTS_MAX);
+  }
+  return NULL;
+}
+
+void DatabaseShard::destroy(DatabaseShard* shard)
+{
+  shard->~DatabaseShard();
+  ruby_xfree((void*)shard);
+}
+
+
+DatabaseShard::DatabaseShard(size_t pages, size_t page_bytes, int pool_flags, size_t units)
 {
-  m_expire = 15;
   m_requests = 0;
   m_hits = 0;
+  m_contents = 0;
+  m_nomem = false;
+  m_negative = NULL;
+  init_rwlock(&m_lock);
+  pthread_mutex_init(&m_lru_lock, NULL);
+
   m_pool = (CachePagePool*)ruby_xmalloc(sizeof(CachePagePool));
-  new( (void*)m_pool ) CachePagePool(pages);
+  new( (void*)m_pool ) CachePagePool(pages, page_bytes, pool_flags, units);
   m_pool->init();
+  m_pool->listen(this);
+  m_table = (CachePageIndex*)ruby_xmalloc(sizeof(CachePageIndex));
+  new( (void*)m_table ) CachePageIndex(pages * m_pool->m_units_r(), m_pool->m_arena_r(), m_pool->m_unit_bytes_r());
+  m_peers = (PeerPageIndex*)ruby_xmalloc(sizeof(PeerPageIndex));
+  new( (void*)m_peers ) PeerPageIndex(pages * m_pool->m_units_r());
 }
 
-Database::~Database()
+DatabaseShard::~DatabaseShard()
 {
   try {
+    set_negative(NULL);
+    m_peers->~PeerPageIndex();
+    ruby_xfree((void*)m_peers);
+    m_table->~CachePageIndex();
+    ruby_xfree((void*)m_table);
     m_pool->~CachePagePool();
     ruby_xfree((void*)m_pool);
+    pthread_mutex_destroy(&m_lru_lock);
+    pthread_rwlock_destroy(&m_lock);
   }
   catch(...) {}
 }
 
 
-// insert
-void Database::insert(uint64_t content_id, uint32_t type, uint32_t revision, ID peer)
+// map pages of a snapshot, on the shard which is never used.
+bool DatabaseShard::restore(int fd, off_t offset, size_t pages, const PAGEH* lru, size_t count)
+{
+  if(!m_pool->map(fd, offset, pages)) return false;
+  if(!m_pool->restore(pages, lru, count)) return false;
+  for(size_t i=0; i<count; i++) {
+    CachePageBase* p = m_pool->at(lru[i]);
+    if(!m_table->insert(p->m_magic_r(), p)) {
+      m_pool->drop(p);
+    } else {
+      m_contents += p->m_contains_r();
+      if(!index(p)) drop(p);
+    }
+  }
+  return true;
+}
+
+
+// true if the page is allocated and indexed.
+bool DatabaseShard::is_active(CachePageBase* page) const
+{
+  return (m_table->find(page->m_magic_r())==page);
+}
+
+
+// replace the negative cache, the old one is destroyed.
+void DatabaseShard::set_negative(NegativeCache* negative)
+{
+  if(m_negative) {
+    m_negative->~NegativeCache();
+    ruby_xfree((void*)m_negative);
+  }
+  m_negative = negative;
+}
+
+
+// forget the page dropped forcely by the pool.
+void DatabaseShard::evicted(CachePageBase* page)
+{
+  if(m_table->erase(page->m_magic_r(), page)) m_contents -= page->m_contains_r();
+  m_peers->erase_page(m_pool->handle(page));
+}
+
+
+// drop the indexed page.
+void DatabaseShard::drop(CachePageBase* page)
+{
+  if(m_table->erase(page->m_magic_r(), page)) m_contents -= page->m_contains_r();
+  m_peers->erase_page(m_pool->handle(page));
+  m_pool->drop(page);
+}
+
+
+// set the peers of all entries of the page, which is copied or restored.
+// false if out of memory, then callers drop the page, which could never
+// be purged.
+bool DatabaseShard::index(CachePageBase* page)
+{
+  PAGEH h = m_pool->handle(page);
+  uint32_t ofs, rev;
+  bool exact;
+  PeerSlotArray ids;
+  for(size_t idx=0; entry(page, idx, ofs, rev, exact, ids); idx++) {
+    for(size_t i=0; i<ids.size(); i++) {
+      if(!m_peers->set(ids.at(i), h)) {
+        m_nomem = true;
+        return false;
+      }
+    }
+    ids.clear();
+  }
+  return true;
+}
+
+
+
+//
+// class DatabaseShardOf
+//
+template<int N> DatabaseShardOf<N>::DatabaseShardOf(size_t pages, int pool_flags)
+  : DatabaseShard(pages, PageLayout<N>::PAGE_BYTES, pool_flags, (pool_flags & CachePagePool::POOL_DENSE) ? 1 : CACHEPAGE_UNITS)
+{
+}
+
+template<int N> DatabaseShardOf<N>::~DatabaseShardOf()
+{
+}
+
+
+// insert, false if the page is dropped.
+template<int N> bool DatabaseShardOf<N>::insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
 {
   ContentIdWithType ct(content_id, type);
+  if(m_negative) m_negative->erase(NegativeCache::key(content_id, type, revision));
 
-  CachePageMap::iterator it = m_table.find(ct);
-  if(it==m_table.end()) {
-    // alloc and insert new page.
-    CachePage* p = m_pool->alloc();
-    p->init(content_id, type);
-    std::pair<CachePageMap::iterator, bool> r = m_table.insert(std::make_pair(ct, p));
-    if(!r.second) {
+  CachePageBase* p = m_table->find(ct);
+  if(!p) {
+    // alloc and insert new page, sparse one if possible.
+    if(!m_pool->admit(ct, !is_sparse_pool())) return false;
+    if(is_sparse_pool()) {
+      Sparse* sp = (Sparse*)m_pool->alloc_unit();
+      sp->init(content_id, type);
+      p = sp;
+    } else {
+      Page* dp = (Page*)m_pool->alloc();
+      dp->init(content_id, type);
+      p = dp;
+    }
+    if(!m_table->insert(ct, p)) {
       // insert failed.
       m_pool->drop(p);
-      return;
+      return false;
     }
-    it = r.first;
+  } else {
+    m_pool->update(p);
   }
 
   // insert {content_id, type, revision, peer}.
-  CachePage* p = (*it).second;
-  if(!(p->insert(content_id, type, revision, fromID(peer)))) {
-    // drop page because of page is full.
+  uint16_t contains = p->m_contains_r();
+  bool inserted;
+  if(p->is_sparse()) {
+    inserted = ((Sparse*)p)->insert(content_id, type, revision, peer);
+    if(!inserted && ((Sparse*)p)->full()) {
+      p = promote((Sparse*)p);
+      if(!p) return false;
+      contains = p->m_contains_r();
+      inserted = ((Page*)p)->insert(content_id, type, revision, peer);
+    }
+  } else {
+    inserted = ((Page*)p)->insert(content_id, type, revision, peer);
+  }
+  if(!inserted) {
+    // drop page because of page is broken.
+    drop(p);
+    return false;
+  }
+  m_contents += p->m_contains_r();
+  m_contents -= contains;
+  if(!m_peers->set(peer, m_pool->handle(p))) {
+    // out of memory, drop page not to leave the peer unindexed.
+    m_nomem = true;
+    drop(p);
+    return false;
+  }
+  return true;
+}
+
+
+// find may run concurrently under rdlock(), without GVL.
+template<int N> bool DatabaseShardOf<N>::find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed)
+{
+  ContentIdWithType ct(content_id, type);
+
+  CachePageBase* p = m_table->find(ct);
+  if(!p) {
+    // count the miss for admission, unless other readers are counting.
+    if(m_pool->counting() && trylock_lru()) {
+      m_pool->missed(ct);
+      unlock_lru();
+    }
+    return false;
+  }
+
+  bool found = p->is_sparse() ?
+    ((Sparse*)p)->find(content_id, type, revision, result, removed) :
+    ((Page*)p)->find(content_id, type, revision, result, removed);
+  if(!found) {
+    return false; // page is brocken, but it can't be dropped under rdlock().
+  }
+
+  // tell the replacement policy, unless other readers are doing it.
+  if(trylock_lru()) {
+    m_pool->touch(p);
+    unlock_lru();
+  }
+  return true;
+}
+
+
+template<int N> void DatabaseShardOf<N>::remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
+{
+  ContentIdWithType ct(content_id, type);
+
+  CachePageBase* p = m_table->find(ct);
+  if(!p) return; // nothing to do.
+
+  uint16_t contains = p->m_contains_r();
+  bool remained = p->is_sparse() ?
+    ((Sparse*)p)->remove(content_id, type, revision, peer) :
+    ((Page*)p)->remove(content_id, type, revision, peer);
+  m_contents -= contains;
+  m_contents += p->m_contains_r();
+
+  if(!remained) {
+    // drop page because of page is empty.
+    drop(p);
+  } else if(!p->is_sparse() && is_sparse_pool() && (p->m_contains_r() <= Sparse::CAPACITY/2)) {
+    demote((Page*)p);
+  }
+}
+
+
+// an entry of the page for dump, false if idx is out of the page.
+// revision is unknown if it isn't exact, overflowed.
+template<int N> bool DatabaseShardOf<N>::entry(const CachePageBase* page, size_t idx, uint32_t& offset, uint32_t& revision, bool& exact, PeerSlotArray& result) const
+{
+  REVH h;
+  if(page->is_sparse()) {
+    Sparse* sp = (Sparse*)page;
+    if(idx>=sp->m_entries_r()) return false;
+    offset = sp->offset_at(idx);
+    h = sp->slot_at(idx).revision();
+    sp->slot_at(idx).pushall(result);
+  } else {
+    Page* dp = (Page*)page;
+    if(idx>=CACHEPAGE_SIZE) return false;
+    offset = idx;
+    h = dp->slot_at(idx).revision();
+    dp->slot_at(idx).pushall(result);
+  }
+  exact = RevisionHash::is_exact(h);
+  revision = RevisionHash::to_revision(h);
+  return true;
+}
+
+
+// removes the peer from all pages which may have it, returns the entries.
+template<int N> size_t DatabaseShardOf<N>::purge(PEERH peer)
+{
+  ArrayOfPageH pages;
+  size_t result = 0;
+  m_peers->pages(peer, pages);
+  m_peers->erase_peer(peer);
+
+  for(ArrayOfPageH::iterator it=pages.begin(); it!=pages.end(); it++) {
+    CachePageBase* p = m_pool->at(*it);
+    if(!is_active(p)) continue;
+
+    uint16_t contains = p->m_contains_r();
+    result += p->is_sparse() ? ((Sparse*)p)->purge(peer) : ((Page*)p)->purge(peer);
+    m_contents -= contains;
+    m_contents += p->m_contains_r();
+
+    if(p->m_contains_r()==0) {
+      drop(p);
+    } else if(!p->is_sparse() && is_sparse_pool() && (p->m_contains_r() <= Sparse::CAPACITY/2)) {
+      demote((Page*)p);
+    }
+  }
+  return result;
+}
+
+
+// copy a page of a snapshot, as the most recently used.
+template<int N> void DatabaseShardOf<N>::restore(const CachePageBase& page)
+{
+  CachePageBase* p;
+  if(!page.is_sparse()) {
+    Page* dp = (Page*)m_pool->alloc();
+    dp->copy((const Page&)page);
+    p = dp;
+  } else if(is_sparse_pool()) {
+    Sparse* sp = (Sparse*)m_pool->alloc_unit();
+    sp->copy((const Sparse&)page);
+    p = sp;
+  } else {
+    Page* dp = (Page*)m_pool->alloc();
+    dp->assign((const Sparse&)page);
+    p = dp;
+  }
+  if(!m_table->insert(p->m_magic_r(), p)) {
     m_pool->drop(p);
-    m_table.erase(it);
     return;
   }
+  m_contents += p->m_contains_r();
+  if(!index(p)) drop(p);
+}
 
-  // update peer status.
-  update_peer(peer);
+
+// replace the full sparse page by a dense page, NULL if failed.
+template<int N> CachePage<N>* DatabaseShardOf<N>::promote(Sparse* page)
+{
+  Sparse src;
+  src.copy(*page);
+  drop(page);
+
+  Page* p = (Page*)m_pool->alloc();
+  p->assign(src);
+  if(!m_table->insert(p->m_magic_r(), p)) {
+    m_pool->drop(p);
+    return NULL;
+  }
+  m_contents += p->m_contains_r();
+  if(!index(p)) {
+    drop(p);
+    return NULL;
+  }
+  return p;
 }
 
 
-void Database::find(uint64_t content_id, uint32_t type, uint32_t revision, ArrayOfId& result, bool& removed)
+// replace the dense page by a sparse page.
+template<int N> void DatabaseShardOf<N>::demote(Page* page)
 {
-  m_requests++;
+  Sparse src;
+  if(!src.assign(*page)) return;
+  drop(page);
 
-  ContentIdWithType ct(content_id, type);
-  
-  CachePageMap::iterator it = m_table.find(ct);
-  if(it==m_table.end()) return; // nothing to do.
-
-  CachePage* p = (*it).second;
-  ArrayOfId peers;
-  if(!(p->find(content_id, type, revision, peers, removed))) {
-    // drop page because of page is brocken.
+  Sparse* p = (Sparse*)m_pool->alloc_unit();
+  p->copy(src);
+  if(!m_table->insert(p->m_magic_r(), p)) {
     m_pool->drop(p);
-    m_table.erase(it);
     return;
   }
-  for(unsigned int idx=0; idx<peers.size(); idx++) {
-    ID peer = toID(peers.at(idx));
-    PeerStatusMap::iterator pi = m_status.find(peer);
-    if((pi!=m_status.end()) && (*pi).second.is_readable()) {
-      result.push_back(peer);
+  m_contents += p->m_contains_r();
+  if(!index(p)) drop(p);
+}
+
+
+
+//
+// class Database
+//
+Database::Database(size_t pages, int pool_flags, size_t shards, size_t slots)
+{
+  m_expire = 15;
+  m_slots = slots;
+  m_seed = ((uint64_t)time(NULL) << 20) ^ (uint64_t)(uintptr_t)this;
+  init_rwlock(&m_lock);
+
+  // split pages into shards.
+  if(shards<1) shards = 1;
+  if(shards>pages) shards = pages;
+  m_shard_count = shards;
+  m_shards = (DatabaseShard**)ruby_xmalloc(sizeof(DatabaseShard*) * shards);
+  for(size_t i=0; i<shards; i++) {
+    size_t n = pages/shards + ((i < pages%shards) ? 1 : 0);
+    m_shards[i] = DatabaseShard::create(slots, n, pool_flags);
+  }
+}
+
+Database::~Database()
+{
+  try {
+    for(size_t i=0; i<m_shard_count; i++) {
+      DatabaseShard::destroy(m_shards[i]);
     }
+    ruby_xfree((void*)m_shards);
+    pthread_rwlock_destroy(&m_lock);
+  }
+  catch(...) {}
+}
+
+
+// insert
+void Database::insert(uint64_t content_id, uint32_t type, uint32_t revision, ID peer)
+{
+  LatencyTimer t(m_histograms[DHIST_INSERT]);
+  PEERH h = fromID(peer);
+
+  DatabaseShard* sh = shard(content_id, type);
+  sh->wrlock();
+  bool inserted = sh->insert(content_id, type, revision, h);
+  bool nomem = sh->nomem();
+  sh->unlock();
+  if(nomem) rb_memerror();
+  if(!inserted) return;
+
+  // update peer status.
+  update_peer(h);
+}
+
+
+// find may run concurrently, without GVL.
+void Database::find(uint64_t content_id, uint32_t type, uint32_t revision, FoundIds& result, bool& removed)
+{
+  LatencyTimer t(m_histograms[DHIST_FIND]);
+  PeerSlotArray peers;
+  DatabaseShard* sh = shard(content_id, type);
+  sh->rdlock();
+  bool found = sh->find(content_id, type, revision, peers, removed);
+  sh->unlock();
+  if(!found) {
+    sh->count(false);
+    return;
   }
-  if(result.size()>0) m_hits++;
+
+  rdlock();
+  m_status.refresh(CoarseClock::now());
+  for(unsigned int idx=0; idx<peers.size(); idx++) {
+    PEERH h = peers.at(idx);
+    if(m_status.is_readable(h)) result.push_back(m_peerh.toID(h), h);
+  }
+  unlock();
+  sh->count(result.size()>0);
 }
 
 
 void Database::remove(uint64_t content_id, uint32_t type, uint32_t revision, ID peer)
 {
-  ContentIdWithType ct(content_id, type);
+  LatencyTimer t(m_histograms[DHIST_REMOVE]);
+  rdlock();
+  PEERH h = m_peerh.find(peer);
+  unlock();
+  if(h==0) return; // never inserted.
 
-  CachePageMap::iterator it = m_table.find(ct);
-  if(it==m_table.end()) return; // nothing to do.
+  DatabaseShard* sh = shard(content_id, type);
+  sh->wrlock();
+  sh->remove(content_id, type, revision, h);
+  bool nomem = sh->nomem();
+  sh->unlock();
 
-  CachePage* p = (*it).second;
-  if(!(p->remove(content_id, type, revision, fromID(peer)))) {
-    // drop page because of page is empty.
-    m_pool->drop(p);
-    m_table.erase(it);
+  // update peer status.
+  update_peer(h);
+  if(nomem) rb_memerror();
+}
+
+
+// negative caches of ttl for each shard, entries are split into shards.
+void Database::set_negative(size_t entries, uint64_t ttl, uint64_t grace)
+{
+  for(size_t i=0; i<m_shard_count; i++) {
+    NegativeCache* nc = NULL;
+    if(ttl>0) {
+      nc = (NegativeCache*)ruby_xmalloc(sizeof(NegativeCache));
+      new( (void*)nc ) NegativeCache(entries / m_shard_count, ttl, grace);
+    }
+    m_shards[i]->wrlock();
+    m_shards[i]->set_negative(nc);
+    m_shards[i]->unlock();
   }
+}
+
+
+// true if the missed Get should be relayed. The first relay of a key is
+// marked, and the key is negative after grace unless it is inserted.
+// Relays in grace are not marked again, so that the grace never extends.
+bool Database::relay(uint64_t content_id, uint32_t type, uint32_t revision)
+{
+  DatabaseShard* sh = shard(content_id, type);
+  NegativeCache* nc = sh->m_negative_r();
+  if(!nc) return true;
+
+  uint64_t key = NegativeCache::key(content_id, type, revision);
+  uint64_t now = LatencyClock::now();
+  sh->rdlock();
+  NegativeCache::State state = nc->lookup(key, now);
+  sh->unlock();
+  if(state==NegativeCache::NC_NEGATIVE) {
+    nc->suppressed();
+    return false;
+  }
+  if(state==NegativeCache::NC_RELAYED) return true;
+
+  sh->wrlock();
+  nc->mark(key, now);
+  sh->unlock();
+  return true;
+}
+
+
+// insert elements, shard by shard.
+void Database::insert(const ArrayOfElement& elements)
+{
+  LatencyTimer t(m_histograms[DHIST_INSERT]);
+  ArrayOfPeerH handles;
+  fromIDs(elements, true, handles);
+
+  ArrayOfIndex idx;
+  order(elements, idx);
+
+  ArrayOfPeerH peers;
+  DatabaseShard* sh = NULL;
+  bool nomem = false;
+  for(ArrayOfIndex::iterator it=idx.begin(); it!=idx.end(); it++) {
+    const Element& e = elements[*it];
+    DatabaseShard* s = shard(e.content_id, e.type);
+    if(s!=sh) {
+      if(sh) { nomem |= sh->nomem(); sh->unlock(); }
+      sh = s;
+      sh->wrlock();
+    }
+    if(sh->insert(e.content_id, e.type, e.revision, handles[*it])) peers.push_back(handles[*it]);
+  }
+  if(sh) { nomem |= sh->nomem(); sh->unlock(); }
 
   // update peer status.
-  update_peer(peer);
+  update_peers(peers);
+  if(nomem) rb_memerror();
 }
 
 
-void Database::set_status(ID peer, const PeerStatus& status)
+// indexes of elements grouped by shard, in the original order in each shard.
+void Database::order(const ArrayOfElement& elements, ArrayOfIndex& result) const
 {
-  struct timeval tv = { 0, 0 };
-  gettimeofday(&tv, NULL);
+  ArrayOfIndex shards(elements.size());
+  ArrayOfIndex offsets(m_shard_count+1, 0);
+  for(size_t i=0; i<elements.size(); i++) {
+    shards[i] = shard_index(elements[i].content_id, elements[i].type);
+    offsets[shards[i]+1]++;
+  }
+  for(size_t si=0; si<m_shard_count; si++) offsets[si+1] += offsets[si];
 
+  result.resize(elements.size());
+  for(size_t i=0; i<elements.size(); i++) result[offsets[shards[i]]++] = i;
+}
+
+
+// find elements, may run concurrently without GVL.
+void Database::find(const ArrayOfElement& elements, const ArrayOfIndex& order, ArrayOfFound& result)
+{
+  LatencyTimer t(m_histograms[DHIST_FIND]);
+  DatabaseShard* sh = NULL;
+  for(ArrayOfIndex::const_iterator it=order.begin(); it!=order.end(); it++) {
+    const Element& e = elements[*it];
+    DatabaseShard* s = shard(e.content_id, e.type);
+    if(s!=sh) {
+      if(sh) sh->unlock();
+      sh = s;
+      sh->rdlock();
+    }
+    FoundElement& f = result[*it];
+    f.found = sh->find(e.content_id, e.type, e.revision, f.handles, f.removed);
+  }
+  if(sh) sh->unlock();
+
+  rdlock();
+  m_status.refresh(CoarseClock::now());
+  for(size_t i=0; i<elements.size(); i++) {
+    FoundElement& f = result[i];
+    if(!f.found) continue;
+    for(unsigned int idx=0; idx<f.handles.size(); idx++) {
+      PEERH h = f.handles.at(idx);
+      if(m_status.is_readable(h)) f.peers.push_back(m_peerh.toID(h), h);
+    }
+  }
+  unlock();
+
+  for(size_t i=0; i<elements.size(); i++) {
+    shard(elements[i].content_id, elements[i].type)->count(result[i].peers.size()>0);
+  }
+}
+
+
+// remove elements, shard by shard.
+void Database::remove(const ArrayOfElement& elements)
+{
+  LatencyTimer t(m_histograms[DHIST_REMOVE]);
+  ArrayOfPeerH handles;
+  fromIDs(elements, false, handles);
+
+  ArrayOfIndex idx;
+  order(elements, idx);
+
+  ArrayOfPeerH peers;
+  DatabaseShard* sh = NULL;
+  bool nomem = false;
+  for(ArrayOfIndex::iterator it=idx.begin(); it!=idx.end(); it++) {
+    if(handles[*it]==0) continue; // never inserted.
+    const Element& e = elements[*it];
+    DatabaseShard* s = shard(e.content_id, e.type);
+    if(s!=sh) {
+      if(sh) { nomem |= sh->nomem(); sh->unlock(); }
+      sh = s;
+      sh->wrlock();
+    }
+    sh->remove(e.content_id, e.type, e.revision, handles[*it]);
+    peers.push_back(handles[*it]);
+  }
+  if(sh) { nomem |= sh->nomem(); sh->unlock(); }
+
+  // update peer status.
+  update_peers(peers);
+  if(nomem) rb_memerror();
+}
+
+
+// the peer is registered to PeerHash, so that its status is kept by PEERH.
+void Database::set_status(ID peer, const PeerStatus& status)
+{
   PeerStatus s = status;
-  s.expire = m_expire + tv.tv_sec;
+  s.expire = m_expire + CoarseClock::now();
 
-  PeerStatusMap::iterator it = m_status.find(peer);
-  if(it==m_status.end()) {
-    m_status.insert(std::make_pair(peer, s));
-  } else {
-    (*it).second = s;
+  // std::bad_alloc is raised as NoMemoryError after unlock().
+  bool nomem = false;
+  wrlock();
+  try {
+    m_status.set(m_peerh.fromID(peer), s);
   }
+  catch(std::bad_alloc&) {
+    nomem = true;
+  }
+  unlock();
+  if(nomem) rb_memerror();
 }
 
 
 bool Database::get_status(ID peer, PeerStatus& status)
 {
-  PeerStatusMap::iterator it = m_status.find(peer);
-  if(m_status.end()==it) return false;
-
-  status = (*it).second;
-  return true;
+  rdlock();
+  PEERH h = m_peerh.find(peer);
+  bool result = (h!=0) && m_status.get(h, status);
+  unlock();
+  return result;
 }
 
 
+// peers which have status, in order of registration.
 void Database::find(ArrayOfId& result)
 {
-  for(PeerStatusMap::iterator it = m_status.begin(); it != m_status.end(); it++) {
-    result.push_back((*it).first);
+  rdlock();
+  for(PEERH h=1; h<m_status.end(); h++) {
+    if(m_status.has(h)) result.push_back(m_peerh.toID(h));
   }
+  unlock();
+}
+
+
+// all peers which have PEERH, in order of PEERH.
+void Database::known_peers(ArrayOfId& result)
+{
+  rdlock();
+  for(PEERH h=1; h<m_peerh.m_next_r(); h++) result.push_back(m_peerh.toID(h));
+  unlock();
 }
 
 
 void Database::find(uint64_t require_space, ArrayOfId& result)
 {
-  PeerStatusMap::iterator it = m_status.begin();
-  for(; it!=m_status.end(); it++) {
-    PeerStatus s = (*it).second;
-    if(s.is_enough_spaces(require_space)) result.push_back((*it).first);
+  rdlock();
+  m_status.refresh(CoarseClock::now());
+  for(PEERH h=1; h<m_status.end(); h++) {
+    if(m_status.is_writable(h) && (m_status.at(h).available>=require_space)) {
+      result.push_back(m_peerh.toID(h));
+    }
   }
+  unlock();
+}
+
+
+// writable peers for new contents, weighted by available spaces.
+// candidates are peer IDs to select from, or NULL for all peers.
+void Database::select(uint64_t require_space, size_t count, const ArrayOfId* candidates, ArrayOfId& result)
+{
+  ArrayOfPeerH allowed, selected;
+  PeerStatusTable::SelectKeys keys;
+  uint64_t seed = __sync_add_and_fetch(&m_seed, 0x2545F4914F6CDD1DULL);
+
+  // allocated before the lock, by peers known now. count may be of a
+  // caller, and a NoMemoryError must not leave the lock held.
+  size_t known = m_status.size();
+  if(count>known) count = known;
+  if(candidates) allowed.reserve(candidates->size());
+  keys.reserve(count+1);
+  selected.reserve(count);
+  result.reserve(result.size()+count);
+
+  rdlock();
+  if(candidates) {
+    for(ArrayOfId::const_iterator it=candidates->begin(); it!=candidates->end(); it++) {
+      PEERH h = m_peerh.find(*it);
+      if(h!=0) allowed.push_back(h);
+    }
+    std::sort(allowed.begin(), allowed.end());
+  }
+  m_status.refresh(CoarseClock::now());
+  m_status.select(require_space, count, seed, candidates ? &allowed : NULL, keys, selected);
+  for(ArrayOfPeerH::iterator it=selected.begin(); it!=selected.end(); it++) {
+    result.push_back(m_peerh.toID(*it));
+  }
+  unlock();
 }
 
 
 void Database::remove(ID peer)
 {
-  m_status.erase(peer);
+  wrlock();
+  PEERH h = m_peerh.find(peer);
+  if(h!=0) m_status.remove(h);
+  unlock();
 }
 
 
-void Database::update_peer(ID peer)
+PeerStatusMap Database::get_peer_status_map()
 {
-  PeerStatusMap::iterator it = m_status.find(peer);
-  if(m_status.end()==it) return;
+  PeerStatusMap result;
+  rdlock();
+  for(PEERH h=1; h<m_status.end(); h++) {
+    if(m_status.has(h)) result.insert(std::make_pair(m_peerh.toID(h), m_status.at(h)));
+  }
+  unlock();
+  return result;
+}
+
 
-  struct timeval tv = { 0, 0 };
-  gettimeofday(&tv, NULL);
-  (*it).second.expire = tv.tv_sec + m_expire;
+PEERH Database::fromID(ID id)
+{
+  rdlock();
+  PEERH h = m_peerh.find(id);
+  unlock();
+  if(h!=0) return h;
+
+  // register new peer, NoMemoryError after unlock().
+  bool nomem = false;
+  wrlock();
+  try {
+    h = m_peerh.fromID(id);
+  }
+  catch(std::bad_alloc&) {
+    nomem = true;
+  }
+  unlock();
+  if(nomem) rb_memerror();
+  return h;
+}
+
+
+// PEERHs of elements, new peers are registered under one wrlock() if regist.
+void Database::fromIDs(const ArrayOfElement& elements, bool regist, ArrayOfPeerH& result)
+{
+  bool missing = false;
+  result.resize(elements.size());
+
+  rdlock();
+  for(size_t i=0; i<elements.size(); i++) {
+    result[i] = m_peerh.find(elements[i].peer);
+    if(result[i]==0) missing = true;
+  }
+  unlock();
+  if(!missing || !regist) return;
+
+  // register new peers, NoMemoryError after unlock().
+  bool nomem = false;
+  wrlock();
+  try {
+    for(size_t i=0; i<elements.size(); i++) {
+      if(result[i]==0) result[i] = m_peerh.fromID(elements[i].peer);
+    }
+  }
+  catch(std::bad_alloc&) {
+    nomem = true;
+  }
+  unlock();
+  if(nomem) rb_memerror();
+}
+
+
+// update expire under rdlock(), the status itself is not changed.
+void Database::update_peer(PEERH peer)
+{
+  time_t expire = CoarseClock::now() + m_expire;
+
+  rdlock();
+  m_status.touch(peer, expire);
+  unlock();
+}
+
+
+// update expire of each peer once.
+void Database::update_peers(ArrayOfPeerH& peers)
+{
+  if(peers.empty()) return;
+  std::sort(peers.begin(), peers.end());
+  peers.erase(std::unique(peers.begin(), peers.end()), peers.end());
+
+  time_t expire = CoarseClock::now() + m_expire;
+
+  rdlock();
+  for(ArrayOfPeerH::iterator p=peers.begin(); p!=peers.end(); p++) {
+    m_status.touch(*p, expire);
+  }
+  unlock();
 }
 
 
 uint64_t Database::stat(DatabaseStat key)
 {
   uint64_t result = 0;
+  uint64_t requests = 0, hits = 0;
 
   switch(key) {
   // Global
@@ -200,42 +1062,146 @@ uint64_t Database::stat(DatabaseStat key)
     return m_expire;
 
   case DSTAT_CACHE_REQUESTS:
-    return m_requests;
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_requests_r();
+    return result;
 
   case DSTAT_CACHE_HITS:
-    return m_hits;
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_hits_r();
+    return result;
 
   case DSTAT_CACHE_COUNT_CLEAR:
-    result = (m_requests>0) ? ((m_hits * 1000)/m_requests): 0;
-    m_requests = m_hits = 0;
-    return result;
+    for(size_t i=0; i<m_shard_count; i++) {
+      requests += m_shards[i]->clear_requests();
+      hits += m_shards[i]->clear_hits();
+    }
+    if(hits>requests) hits = requests; // counted by finds in between.
+    return (requests>0) ? ((hits * 1000)/requests): 0;
+
+  case DSTAT_SHARDS:
+    return m_shard_count;
+
+  case DSTAT_PEER_SLOTS:
+    return m_slots;
 
   // CachePagePool
   case DSTAT_ALLOCATE_PAGES:
-    return m_pool->m_pages_r();
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_pages_r();
+    return result;
 
   case DSTAT_FREE_PAGES:
-    return m_pool->m_free_pages_r()->size();
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->free_pages();
+    return result;
 
   case DSTAT_ACTIVE_PAGES:
-    return m_pool->m_alloc_pages_r()->size();
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_active_r();
+    return result;
+
+  case DSTAT_EVICTED_PAGES:
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_evicted_r();
+    return result;
+
+  case DSTAT_ARENA_BYTES:
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_arena_size_r();
+    return result;
+
+  case DSTAT_ARENA_HUGEPAGES:
+    // the least one of shards.
+    result = m_shards[0]->m_pool_r()->m_arena_pages_r();
+    for(size_t i=1; i<m_shard_count; i++) {
+      if(m_shards[i]->m_pool_r()->m_arena_pages_r() < result) result = m_shards[i]->m_pool_r()->m_arena_pages_r();
+    }
+    return result;
+
+  case DSTAT_SPARSE_PAGES:
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_sparse_r();
+    return result;
+
+  case DSTAT_DENSE_PAGES:
+    for(size_t i=0; i<m_shard_count; i++) {
+      result += m_shards[i]->m_pool_r()->m_active_r() - m_shards[i]->m_pool_r()->m_sparse_r();
+    }
+    return result;
+
+  case DSTAT_CONTENTS:
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_contents_r();
+    return result;
+
+  case DSTAT_PAGE_OCCUPANCY:
+    // average contents per active page.
+    for(size_t i=0; i<m_shard_count; i++) {
+      result += m_shards[i]->m_contents_r();
+      requests += m_shards[i]->m_pool_r()->m_active_r();
+    }
+    return (requests>0) ? (result/requests) : 0;
 
   // Peers
   case DSTAT_HAVE_STATUS_PEERS:
-    return m_status.size();
+    rdlock();
+    result = m_status.size();
+    unlock();
+    return result;
 
   case DSTAT_ACTIVE_PEERS:
-    for(PeerStatusMap::iterator it=m_status.begin(); it!=m_status.end(); it++) {
-      if((*it).second.is_writable()) result++;
-    }
+    rdlock();
+    m_status.refresh(CoarseClock::now());
+    result = m_status.count_writable();
+    unlock();
     return result;
 
   case DSTAT_READABLE_PEERS:
-    for(PeerStatusMap::iterator it=m_status.begin(); it!=m_status.end(); it++) {
-      if((*it).second.is_readable()) result++;
+    rdlock();
+    m_status.refresh(CoarseClock::now());
+    result = m_status.count_readable();
+    unlock();
+    return result;
+
+  // NegativeCache
+  case DSTAT_NEGATIVE_TTL:
+    // by msec.
+    return m_shards[0]->m_negative_r() ? m_shards[0]->m_negative_r()->m_ttl_r() / 1000000 : 0;
+
+  case DSTAT_NEGATIVE_ENTRIES:
+    for(size_t i=0; i<m_shard_count; i++) {
+      if(!m_shards[i]->m_negative_r()) continue;
+      m_shards[i]->rdlock();
+      result += m_shards[i]->m_negative_r()->size(LatencyClock::now());
+      m_shards[i]->unlock();
     }
     return result;
 
+  case DSTAT_NEGATIVE_RELAYS:
+    for(size_t i=0; i<m_shard_count; i++) {
+      if(m_shards[i]->m_negative_r()) result += m_shards[i]->m_negative_r()->m_relays_r();
+    }
+    return result;
+
+  case DSTAT_NEGATIVE_SUPPRESSED:
+    for(size_t i=0; i<m_shard_count; i++) {
+      if(m_shards[i]->m_negative_r()) result += m_shards[i]->m_negative_r()->m_suppressed_r();
+    }
+    return result;
+
+  case DSTAT_NEGATIVE_CLEARED:
+    for(size_t i=0; i<m_shard_count; i++) {
+      if(m_shards[i]->m_negative_r()) result += m_shards[i]->m_negative_r()->m_cleared_r();
+    }
+    return result;
+
+  // Replacement
+  case DSTAT_REPLACEMENT:
+    return m_shards[0]->m_pool_r()->replacement();
+
+  case DSTAT_ADMISSION:
+    return m_shards[0]->m_pool_r()->counting() ? 1 : 0;
+
+  case DSTAT_PROTECTED_PAGES:
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_protected_r();
+    return result;
+
+  case DSTAT_REJECTED_PAGES:
+    for(size_t i=0; i<m_shard_count; i++) result += m_shards[i]->m_pool_r()->m_rejected_r();
+    return result;
+
   default:
     break;
   }
@@ -244,29 +1210,143 @@ uint64_t Database::stat(DatabaseStat key)
 }
 
 
+// a copy of the histogram, lock waits are summed up over shards.
+// Records made while clearing may be lost.
+void Database::histogram(DatabaseHistogram h, LatencyHistogram& result, bool clear)
+{
+  result.add(m_histograms[h]);
+  if(clear) m_histograms[h].clear();
+  if(h!=DHIST_LOCK_WAIT) return;
+  for(size_t i=0; i<m_shard_count; i++) {
+    result.add(*(m_shards[i]->m_lock_wait_r()));
+    if(clear) m_shards[i]->m_lock_wait_r()->clear();
+  }
+}
+
+
+// copy of an element for dump().
+class DumpElement {
+public:
+  uint64_t  cid;
+  uint32_t  typ;
+  uint32_t  rev;
+  PEERH     peerh;
+  ID        peer;
+};
+typedef std::vector<DumpElement> DumpElements;  // not by ruby, for dump without GVL.
+
+
 bool Database::dump(CacheDumperAbstract& dumper)
 {
-  std::list<CachePage*, RbAllocator<CachePage*> >* acvive_pages = m_pool->m_alloc_pages_r();
-  std::list<CachePage*, RbAllocator<CachePage*> >::iterator it = acvive_pages->begin();
-
-  for(; it!=acvive_pages->end(); it++) {
-    CachePage* cp = *it;
-    uint8_t*  revisions = cp->m_revision_hash_r();
-    ID3*      peers = cp->m_peers_r();
-    ContentIdWithType magic = cp->m_magic_r();
-    for(size_t ofs = 0; ofs<CACHEPAGE_SIZE; ofs++) {
-      ArrayOfId ids;  peers[ofs].pushall(ids);
-      uint64_t  cid = magic.content_id;
-      uint32_t  typ = magic.type;
-      uint32_t  rev = revisions[ofs];
-      for(size_t pi=0; pi<ids.size(); pi++) {
-        ID peer = toID(ids.at(pi));
-        if(!dumper(cid+ofs, typ, rev, peer)) return false;
+  return dump_pages(dumper, NULL);
+}
+
+bool Database::dump(CacheDumperAbstract& dumper, const ArrayOfId& peers)
+{
+  return dump_pages(dumper, &peers);
+}
+
+
+// dump page by page, the dumper is called without locks.
+// With peers, only pages which PeerPageIndex has for the peers are visited,
+// by their keys so that pages promoted or demoted meanwhile are followed.
+bool Database::dump_pages(CacheDumperAbstract& dumper, const ArrayOfId* peers)
+{
+  DumpElements elements;
+  std::vector<PEERH> only;
+  std::vector<PAGEH> pages;
+  std::vector<ContentIdWithType> keys;
+
+  if(peers) {
+    rdlock();
+    for(ArrayOfId::const_iterator it=peers->begin(); it!=peers->end(); it++) {
+      PEERH h = m_peerh.find(*it);
+      if(h!=0) only.push_back(h);
+    }
+    unlock();
+    std::sort(only.begin(), only.end());
+    if(only.empty()) return true;
+  }
+
+  for(size_t si=0; si<m_shard_count; si++) {
+    DatabaseShard* sh = m_shards[si];
+    CachePagePool* pool = sh->m_pool_r();
+    if(peers) {
+      pages.clear();
+      keys.clear();
+      sh->rdlock();
+      for(size_t i=0; i<only.size(); i++) sh->m_peers_r()->pages(only[i], pages);
+      std::sort(pages.begin(), pages.end());
+      pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+      for(size_t i=0; i<pages.size(); i++) {
+        CachePageBase* cp = pool->at(pages[i]);
+        if(sh->is_active(cp)) keys.push_back(cp->m_magic_r());
+      }
+      sh->unlock();
+    }
+
+    for(size_t i=0; ; i++) {
+      // copy the page, i is a unit of the arena or a key.
+      elements.clear();
+      sh->rdlock();
+      if(i >= (peers ? keys.size() : pool->units_used())) {
+        sh->unlock();
+        break;
+      }
+      CachePageBase* cp = peers ? sh->m_table_r()->find(keys[i]) : pool->at(i);
+      if(cp && sh->is_active(cp)) {
+        ContentIdWithType magic = cp->m_magic_r();
+        uint32_t ofs, rev;
+        bool exact;
+        PeerSlotArray ids;
+        for(size_t idx = 0; sh->entry(cp, idx, ofs, rev, exact, ids); idx++) {
+          // an overflowed revision is skipped, not to be dumped as another.
+          for(size_t pi=0; exact && pi<ids.size(); pi++) {
+            if(peers && !std::binary_search(only.begin(), only.end(), ids.at(pi))) continue;
+            DumpElement e = { magic.content_id+ofs, magic.type, rev, ids.at(pi), 0 };
+            elements.push_back(e);
+          }
+          ids.clear();
+        }
+      }
+      sh->unlock();
+
+      // dump the page.
+      rdlock();
+      for(DumpElements::iterator it=elements.begin(); it!=elements.end(); it++) {
+        (*it).peer = m_peerh.toID((*it).peerh);
+      }
+      unlock();
+      for(DumpElements::iterator it=elements.begin(); it!=elements.end(); it++) {
+        if(!dumper((*it).cid, (*it).typ, (*it).rev, (*it).peer)) return false;
       }
     }
   }
   return true;
 }
 
+
+// removes the peer from all contents, returns the entries.
+// Shards are locked one by one, only the pages which may have the peer
+// are visited.
+size_t Database::purge(ID peer)
+{
+  rdlock();
+  PEERH h = m_peerh.find(peer);
+  unlock();
+  if(h==0) return 0;
+
+  size_t result = 0;
+  bool nomem = false;
+  for(size_t si=0; si<m_shard_count; si++) {
+    DatabaseShard* sh = m_shards[si];
+    sh->wrlock();
+    result += sh->purge(h);
+    nomem |= sh->nomem();
+    sh->unlock();
+  }
+  if(nomem) rb_memerror();
+  return result;
+}
 }
 } 
@@ -24,6 +24,8 @@
 #include "basetypes.hxx"
 #include "mapping.hxx"
 #include "page.hxx"
+#include "index.hxx"
+#include "histogram.hxx"
 
 
 namespace Castoro {
@@ -37,16 +39,15 @@ namespace Gateway {
       status = s;
     };
     inline ~PeerStatus() {}; // NOT virtual.
-    inline bool is_valid() const {
-      struct timeval tv = { 0, 0 };
-      gettimeofday(&tv, NULL);
-      return (expire >= tv.tv_sec);
-    };
-    inline bool is_readable() const { return is_valid() && ((status/10)>=2); };
-    inline bool is_writable() const { return is_valid() && ((status/10)>=3); };
+    inline bool is_valid(time_t now) const { return (expire >= now); };
+    inline bool is_valid() const { return is_valid(CoarseClock::now()); };
+    inline bool is_readable() const { return is_valid() && readable_status(); };
+    inline bool is_writable() const { return is_valid() && writable_status(); };
     inline bool is_enough_spaces(uint64_t require) const {
       return is_writable() && (available>=require);
     };
+    inline bool readable_status() const { return ((status/10)>=2); };
+    inline bool writable_status() const { return ((status/10)>=3); };
 
   public:
     uint64_t  available;      // Disk availables by byte.
@@ -56,6 +57,131 @@ namespace Gateway {
   typedef std::map<ID, PeerStatus, std::less<ID>, RbAllocator<std::pair<const ID, PeerStatus> > > PeerStatusMap;
 
 
+  typedef std::vector<PEERH, RbAllocator<PEERH> > ArrayOfPeerH;
+
+
+  // { peer code } => PeerStatus table.
+  //
+  // Statuses are kept in a flat array indexed by PEERH, with bitmaps of
+  // readable and writable peers, so that filtering peers is a bit test.
+  // Bits are set by set() and touch(), and cleared by refresh() once a
+  // second for expired peers. Peers are also kept in order of available
+  // spaces for select(). set() and remove() are called under the writer
+  // lock of Database, the others under the reader lock.
+  class PeerStatusTable {
+  public:
+    PeerStatusTable();
+    inline ~PeerStatusTable() {}; // NOT virtual.
+
+    void set(PEERH h, const PeerStatus& status);  // throws std::bad_alloc.
+    void remove(PEERH h);
+    bool get(PEERH h, PeerStatus& status) const;
+    void touch(PEERH h, time_t expire);   // extends the expire.
+    void refresh(time_t now);             // clears bits of expired peers.
+
+    inline bool has(PEERH h) const { return test(m_present, h); };
+    inline bool is_readable(PEERH h) const { return test(m_readable, h); };
+    inline bool is_writable(PEERH h) const { return test(m_writable, h); };
+    inline const PeerStatus& at(PEERH h) const { return m_status[h]; };
+    inline PEERH end() const { return (PEERH)m_status.size(); };  // PEERHs are below this.
+    inline size_t size() const { return m_count; };
+    size_t count_readable() const;
+    size_t count_writable() const;
+
+    // writable peers which have require_space, at most count of them,
+    // sampled at random weighted by available spaces, without replacement.
+    // Only PEERHs in allowed, sorted, are selected unless it is NULL.
+    // keys and result are reserved by the caller before the lock, count is
+    // cut to fit them so that nothing is allocated under the lock.
+    typedef std::vector<std::pair<double, PEERH>, RbAllocator<std::pair<double, PEERH> > > SelectKeys;
+    void select(uint64_t require_space, size_t count, uint64_t seed,
+                const ArrayOfPeerH* allowed, SelectKeys& keys, ArrayOfPeerH& result) const;
+    inline void select(uint64_t require_space, size_t count, uint64_t seed,
+                       const ArrayOfPeerH* allowed, ArrayOfPeerH& result) const {
+      SelectKeys keys;
+      if(count>size()) count = size();
+      keys.reserve(count+1);
+      result.reserve(result.size()+count);
+      select(require_space, count, seed, allowed, keys, result);
+    };
+
+  private:
+    // modified under the lock, by MallocAllocator.
+    typedef std::vector<PeerStatus, MallocAllocator<PeerStatus> > STATUS_VECTOR;
+    typedef std::vector<uint64_t, MallocAllocator<uint64_t> > BITMAP;
+    typedef std::vector<PEERH, MallocAllocator<PEERH> > PEERH_VECTOR;
+
+    STATUS_VECTOR m_status;
+    BITMAP    m_present;
+    BITMAP    m_readable;
+    BITMAP    m_writable;
+    PEERH_VECTOR  m_by_space; // peers which have status, by available descending.
+    size_t    m_count;      // peers which have status.
+    time_t    m_refreshed;  // refresh() was done in this second.
+
+    static inline bool test(const BITMAP& bits, PEERH h) {
+      return ((h/64)<bits.size()) && ((bits[h/64] >> (h%64)) & 1);
+    };
+    static size_t count(const BITMAP& bits);
+    void mark(PEERH h);   // sets bits by the status.
+    void link_space(PEERH h);
+    void unlink_space(PEERH h);
+  };
+
+
+  // for Result of Database#find(content).
+  // Keeps PEERH of each peer as well, for the peer name table of Cache.
+  class FoundIds :public FixedArray<ID, PEER_SLOTS_MAX> {
+  public:
+    inline FoundIds() {};
+    inline ~FoundIds() {}; // NOT virtual.
+    inline void push_back(ID id, PEERH h) {
+      FixedArray<ID, PEER_SLOTS_MAX>::push_back(id);
+      m_handles.push_back(h);
+    };
+    inline void clear() { FixedArray<ID, PEER_SLOTS_MAX>::clear(); m_handles.clear(); };
+    inline PEERH handle(size_t idx) const { return m_handles.at(idx); };
+
+  private:
+    PeerSlotArray m_handles;
+  };
+
+
+  // an element of batched content handlings.
+  class Element {
+  public:
+    inline Element(uint64_t c=0, uint32_t t=0, uint32_t r=0, ID p=0) {
+      content_id = c;
+      type = t;
+      revision = r;
+      peer = p;
+    };
+    inline ~Element() {}; // NOT virtual.
+
+  public:
+    uint64_t  content_id;
+    uint32_t  type;
+    uint32_t  revision;
+    ID        peer;       // ignored by find.
+  };
+  typedef std::vector<Element, RbAllocator<Element> > ArrayOfElement;
+  typedef std::vector<size_t, RbAllocator<size_t> > ArrayOfIndex;
+
+  // for Result of Database#find(elements).
+  class FoundElement {
+  public:
+    inline FoundElement() { found = false; removed = false; };
+    inline ~FoundElement() {}; // NOT virtual.
+
+  public:
+    PeerSlotArray handles;  // found peers in the page.
+    FoundIds  peers;      // readable peers of them.
+    bool      found;
+    bool      removed;
+  };
+  typedef std::vector<FoundElement, RbAllocator<FoundElement> > ArrayOfFound;
+
+
   class CacheDumperAbstract {
   public:
     inline CacheDumperAbstract() {};
@@ -64,30 +190,175 @@ namespace Gateway {
   };
 
 
+  // a shard of Database, owns pages of some { content_id, type }.
+  //
+  // Each shard has its own pool, index, lock and counters, so that
+  // writers of different shards never contend.
+  // Pages are handled by DatabaseShardOf<N> for N peer slots, which is
+  // made by create().
+  class DatabaseShard :public CachePageListenerAbstract {
+  public:
+    static DatabaseShard* create(size_t slots, size_t pages, int pool_flags = 0);
+    static void destroy(DatabaseShard* shard);
+
+    DatabaseShard(size_t pages, size_t page_bytes, int pool_flags = 0, size_t units = 1);
+    virtual ~DatabaseShard();
+
+    // content handlings, callers hold the lock.
+    virtual bool insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer) = 0;
+    virtual bool find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed) = 0;
+    virtual void remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer) = 0;
+    virtual bool entry(const CachePageBase* page, size_t idx, uint32_t& offset, uint32_t& revision, bool& exact, PeerSlotArray& result) const = 0;
+    virtual size_t purge(PEERH peer) = 0;
+    bool is_active(CachePageBase* page) const;
+
+    // relayed misses, NULL unless enabled. Callers hold the lock.
+    void set_negative(NegativeCache* negative);
+
+    // restoring pages from a snapshot, callers hold the lock.
+    bool restore(int fd, off_t offset, size_t pages, const PAGEH* lru, size_t count);
+    virtual void restore(const CachePageBase& page) = 0;
+
+    // CachePageListenerAbstract.
+    virtual void evicted(CachePageBase* page);
+
+    // locking, waits are recorded by m_lock_wait. Uncontended locks are
+    // recorded as 0 without reading the clock.
+    inline void rdlock() {
+      if(pthread_rwlock_tryrdlock(&m_lock)==0) { m_lock_wait.record(0); return; }
+      LatencyTimer t(m_lock_wait);
+      pthread_rwlock_rdlock(&m_lock);
+    };
+    inline void wrlock() {
+      if(pthread_rwlock_trywrlock(&m_lock)==0) { m_lock_wait.record(0); return; }
+      LatencyTimer t(m_lock_wait);
+      pthread_rwlock_wrlock(&m_lock);
+    };
+    inline void unlock() { pthread_rwlock_unlock(&m_lock); };
+    // true once if pages were dropped because their peers could not be
+    // indexed, callers hold the lock and raise NoMemoryError after unlock().
+    inline bool nomem() { bool result = m_nomem; m_nomem = false; return result; };
+    inline void lock_lru() { pthread_mutex_lock(&m_lru_lock); };
+    inline bool trylock_lru() { return (pthread_mutex_trylock(&m_lru_lock)==0); };
+    inline void unlock_lru() { pthread_mutex_unlock(&m_lru_lock); };
+
+    // statistics.
+    inline void count(bool hit) {
+      __sync_fetch_and_add(&m_requests, 1);
+      if(hit) __sync_fetch_and_add(&m_hits, 1);
+    };
+    inline uint64_t clear_requests() { return __sync_lock_test_and_set(&m_requests, 0); };
+    inline uint64_t clear_hits() { return __sync_lock_test_and_set(&m_hits, 0); };
+
+    attr_reader(CachePagePool*, m_pool);
+    attr_reader(CachePageIndex*, m_table);
+    attr_reader(PeerPageIndex*, m_peers);
+    attr_reader(NegativeCache*, m_negative);
+    attr_reader(uint64_t, m_requests);
+    attr_reader(uint64_t, m_hits);
+    attr_reader(uint64_t, m_contents);
+    attr_reader_ref(LatencyHistogram, m_lock_wait);
+
+  protected:
+    CachePagePool*  m_pool;     // Page pool.
+    CachePageIndex* m_table;    // Active cache pages.
+    PeerPageIndex*  m_peers;    // Active cache pages of each peer.
+    NegativeCache*  m_negative; // Relayed misses which got no answers.
+    uint64_t        m_contents; // entries which have peers, of active pages.
+    bool            m_nomem;    // pages were dropped by out of memory.
+
+    void drop(CachePageBase* page);
+    bool index(CachePageBase* page);
+
+  private:
+    pthread_rwlock_t  m_lock;     // Shard lock.
+    pthread_mutex_t   m_lru_lock; // LRU lock for find() under rdlock().
+    uint64_t        m_requests; // #find request count.
+    uint64_t        m_hits;     // #find request hit count.
+    LatencyHistogram  m_lock_wait;  // waits for m_lock.
+  };
+
+
+  // DatabaseShard of CachePage<N> and SparsePage<N>.
+  //
+  // New pages are sparse unless the pool is POOL_DENSE. A sparse page is
+  // promoted to dense when it is full, and a dense page is demoted when
+  // its entries come down to the half of a sparse page.
+  template<int N> class DatabaseShardOf :public DatabaseShard {
+  public:
+    typedef CachePage<N> Page;
+    typedef SparsePage<N> Sparse;
+
+    DatabaseShardOf(size_t pages, int pool_flags = 0);
+    virtual ~DatabaseShardOf();
+
+    virtual bool insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
+    virtual bool find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed);
+    virtual void remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
+    virtual bool entry(const CachePageBase* page, size_t idx, uint32_t& offset, uint32_t& revision, bool& exact, PeerSlotArray& result) const;
+    virtual size_t purge(PEERH peer);
+    virtual void restore(const CachePageBase& page);
+
+  private:
+    inline bool is_sparse_pool() const { return m_pool->m_units_r()>1; };
+    Page* promote(Sparse* page);
+    void demote(Page* page);
+  };
+
+
+  // Database of { content_id, type, revision } => { peer } with peer status.
+  //
+  // Contents are sharded by ContentIdWithType::hash(), peer status is
+  // shared by all shards and guarded by another lock. Each method takes
+  // the locks it needs, and never holds two locks at once.
+  // No lock is held over calling ruby, so that waiting for a lock with
+  // GVL never deadlocks. find(content) neither allocates memory nor
+  // calls ruby, so that it can run without GVL.
   class Database {
+    friend class DatabaseSnapshot;
   public:
-    Database(size_t pages);
+    Database(size_t pages, int pool_flags = 0, size_t shards = 1, size_t slots = PEER_SLOTS_DEFAULT);
     virtual ~Database();
 
     // content handlings.
     void insert(uint64_t content_id, uint32_t type, uint32_t revision, ID peer);
-    void find(uint64_t content_id, uint32_t type, uint32_t revision, ArrayOfId& result, bool& removed);
+    void find(uint64_t content_id, uint32_t type, uint32_t revision, FoundIds& result, bool& removed);
     void remove(uint64_t content_id, uint32_t type, uint32_t revision, ID peer);
 
+    // negative cache of relayed misses. relay() is called when find()
+    // missed, and false if the relay should be suppressed. It neither
+    // allocates memory nor calls ruby. Disabled when ttl is 0, set before
+    // the database is used.
+    void set_negative(size_t entries, uint64_t ttl, uint64_t grace);  // by nsec.
+    bool relay(uint64_t content_id, uint32_t type, uint32_t revision);
+
+    // batched content handlings, each shard is locked once per batch.
+    // find(elements) neither allocates memory nor calls ruby, the order
+    // must be made by order(elements) in advance.
+    void insert(const ArrayOfElement& elements);
+    void order(const ArrayOfElement& elements, ArrayOfIndex& result) const;
+    void find(const ArrayOfElement& elements, const ArrayOfIndex& order, ArrayOfFound& result);
+    void remove(const ArrayOfElement& elements);
+
     // peer handlings.
     void set_status(ID peer, const PeerStatus& status);
     bool get_status(ID peer, PeerStatus& status);
     void find(ArrayOfId& result);
+    void known_peers(ArrayOfId& result);
     void find(uint64_t require_space, ArrayOfId& result);
+    void select(uint64_t require_space, size_t count, const ArrayOfId* candidates, ArrayOfId& result);
     void remove(ID peer);
-    PeerStatusMap get_peer_status_map() { return m_status; };
+    size_t purge(ID peer);
+    PeerStatusMap get_peer_status_map();
 
     // global settings.
     inline void set_expire(uint32_t expires) { m_expire = expires; };
     inline uint32_t get_expire() const { return m_expire; };
 
-    // dump cache.
+    // dump cache, page by page. Neither allocates ruby objects nor calls
+    // ruby but the dumper, so that it can run without GVL.
     bool dump(CacheDumperAbstract& dumper);
+    bool dump(CacheDumperAbstract& dumper, const ArrayOfId& peers);  // pages of the peers only.
 
     // statistics
     typedef enum {
@@ -95,37 +366,92 @@ namespace Gateway {
       DSTAT_CACHE_REQUESTS,
       DSTAT_CACHE_HITS,
       DSTAT_CACHE_COUNT_CLEAR,
+      DSTAT_SHARDS,
+      DSTAT_PEER_SLOTS,
 
       // CachePagePool
       DSTAT_ALLOCATE_PAGES = 10,
       DSTAT_FREE_PAGES,
       DSTAT_ACTIVE_PAGES,
+      DSTAT_EVICTED_PAGES,
+      DSTAT_ARENA_BYTES,
+      DSTAT_ARENA_HUGEPAGES,
+      DSTAT_SPARSE_PAGES,
+      DSTAT_DENSE_PAGES,
+      DSTAT_CONTENTS,
+      DSTAT_PAGE_OCCUPANCY,
 
       // Peers
       DSTAT_HAVE_STATUS_PEERS = 20,
       DSTAT_ACTIVE_PEERS,
-      DSTAT_READABLE_PEERS
+      DSTAT_READABLE_PEERS,
+
+      // NegativeCache
+      DSTAT_NEGATIVE_TTL = 30,
+      DSTAT_NEGATIVE_ENTRIES,
+      DSTAT_NEGATIVE_RELAYS,
+      DSTAT_NEGATIVE_SUPPRESSED,
+      DSTAT_NEGATIVE_CLEARED,
+
+      // Replacement
+      DSTAT_REPLACEMENT = 40,
+      DSTAT_ADMISSION,
+      DSTAT_PROTECTED_PAGES,
+      DSTAT_REJECTED_PAGES
     } DatabaseStat;
     uint64_t stat(DatabaseStat s);
 
+    // latencies by nsec, of each call of a content or a batch.
+    typedef enum {
+      DHIST_FIND = 0,
+      DHIST_INSERT,
+      DHIST_REMOVE,
+      DHIST_LOCK_WAIT,    // waits for the locks of shards and peers.
+      DHIST_COUNT
+    } DatabaseHistogram;
+    void histogram(DatabaseHistogram h, LatencyHistogram& result, bool clear = false);
+
+    inline size_t shard_index(uint64_t content_id, uint32_t type) const {
+      return (ContentIdWithType::hash(content_id, type) >> 32) % m_shard_count;
+    };
+    inline DatabaseShard* shard(uint64_t content_id, uint32_t type) const {
+      return m_shards[shard_index(content_id, type)];
+    };
+    inline DatabaseShard* shard_at(size_t idx) const { return m_shards[idx]; };
+
     attr_reader(uint32_t, m_expire);
-    attr_reader(CachePagePool*, m_pool);
-    attr_reader_ref(CachePageMap, m_table);
-    attr_reader_ref(PeerStatusMap, m_status);
+    attr_reader(size_t, m_shard_count);
+    attr_reader(size_t, m_slots);
+    attr_reader_ref(PeerStatusTable, m_status);
     attr_reader_ref(PeerHash, m_peerh);
 
   private:
     uint32_t        m_expire;   // Cache expires by sec.
-    CachePagePool*  m_pool;     // Page pool.
-    CachePageMap    m_table;    // Active cache pages.
-    PeerStatusMap   m_status;   // peer ID => PeerStatus
+    size_t          m_shard_count;
+    size_t          m_slots;    // peer slots of each content.
+    DatabaseShard** m_shards;
+    PeerStatusTable m_status;   // PEERH => PeerStatus
     PeerHash        m_peerh;    // peer ID => PeerH
-    uint64_t        m_requests; // #find request count.
-    uint64_t        m_hits;     // #find request hit count.
+    pthread_rwlock_t  m_lock;   // Lock of m_status and m_peerh.
+    uint64_t        m_seed;     // of select().
+    LatencyHistogram  m_histograms[DHIST_COUNT];
 
-    inline PEERH fromID(ID id) { return m_peerh.fromID(id); };
-    inline ID toID(PEERH h) const { return m_peerh.toID(h); };
-    void update_peer(ID peer);
+    inline void rdlock() {
+      if(pthread_rwlock_tryrdlock(&m_lock)==0) { m_histograms[DHIST_LOCK_WAIT].record(0); return; }
+      LatencyTimer t(m_histograms[DHIST_LOCK_WAIT]);
+      pthread_rwlock_rdlock(&m_lock);
+    };
+    inline void wrlock() {
+      if(pthread_rwlock_trywrlock(&m_lock)==0) { m_histograms[DHIST_LOCK_WAIT].record(0); return; }
+      LatencyTimer t(m_histograms[DHIST_LOCK_WAIT]);
+      pthread_rwlock_wrlock(&m_lock);
+    };
+    inline void unlock() { pthread_rwlock_unlock(&m_lock); };
+    PEERH fromID(ID id);
+    void fromIDs(const ArrayOfElement& elements, bool regist, ArrayOfPeerH& result);
+    void update_peer(PEERH peer);
+    void update_peers(ArrayOfPeerH& peers);
+    bool dump_pages(CacheDumperAbstract& dumper, const ArrayOfId* peers);
   };
     
 }
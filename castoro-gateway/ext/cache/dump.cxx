@@ -0,0 +1,164 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include "dump.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+static const char DUMP_MAGIC[8] = { 'C', 'S', 'T', 'R', 'D', 'U', 'M', 'P' };
+
+
+//
+// class DumpWriter
+//
+DumpWriter::DumpWriter(int fd, Format format, size_t buffer_bytes)
+{
+  m_fd = fd;
+  m_format = format;
+  m_bytes = (buffer_bytes < 4096) ? 4096 : buffer_bytes;
+  m_buffer = (char*)ruby_xmalloc(m_bytes);
+  m_used = 0;
+  m_records = 0;
+  m_errno = 0;
+  m_interrupted = false;
+}
+
+DumpWriter::~DumpWriter()
+{
+  ruby_xfree(m_buffer);
+}
+
+
+// peers are numbered in order of addition.
+void DumpWriter::add_peer(ID peer, const std::string& name)
+{
+  if(m_peers.find(peer)!=m_peers.end()) return;
+  Peer& p = m_peers[peer];
+  p.name = name;
+  p.number = m_peers.size();
+  p.defined = false;
+}
+
+
+bool DumpWriter::begin()
+{
+  if(m_format!=FORMAT_BINARY) return true;
+
+  DumpHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+  header.version = VERSION;
+  header.record_bytes = sizeof(DumpRecord);
+  return put(&header, sizeof(header));
+}
+
+
+bool DumpWriter::operator()(uint64_t cid, uint32_t typ, uint32_t rev, ID peer)
+{
+  if(interrupted()) return false;
+  Peers::iterator it = m_peers.find(peer);
+  if(it==m_peers.end()) return true;
+  Peer& p = (*it).second;
+
+  if(m_format==FORMAT_TEXT) {
+    // "  " + name + ": " + 20 + "." + 10 + "." + 10 + "\n"
+    char line[64];
+    int n = snprintf(line, sizeof(line), ": %llu.%u.%u\n", (unsigned long long)cid, typ, rev);
+    if(!put("  ", 2) || !put(p.name.data(), p.name.size()) || !put(line, n)) return false;
+  } else {
+    DumpRecord r;
+    if(!p.defined) {
+      r.content_id = p.number;
+      r.type = p.name.size();
+      r.revision = 0;
+      r.peer = DUMP_PEER_NAME;
+      if(!put(&r, sizeof(r)) || !put(p.name.data(), p.name.size())) return false;
+      p.defined = true;
+    }
+    r.content_id = cid;
+    r.type = typ;
+    r.revision = rev;
+    r.peer = p.number;
+    if(!put(&r, sizeof(r))) return false;
+  }
+  m_records++;
+  return true;
+}
+
+
+// an empty line terminates a text dump, as Cache#dump with member_puts.
+bool DumpWriter::finish()
+{
+  if((m_format==FORMAT_TEXT) && !put("\n", 1)) return false;
+  return flush();
+}
+
+
+bool DumpWriter::put(const void* p, size_t bytes)
+{
+  const char* c = (const char*)p;
+  while(bytes>0) {
+    if(m_used==m_bytes && !flush()) return false;
+    size_t n = m_bytes - m_used;
+    if(n>bytes) n = bytes;
+    memcpy(m_buffer+m_used, c, n);
+    m_used += n; c += n; bytes -= n;
+  }
+  return true;
+}
+
+
+// waits a non-blocking fd by poll(), with a timeout to see interrupt().
+bool DumpWriter::flush()
+{
+  const char* c = m_buffer;
+  while(m_used>0) {
+    if(interrupted()) return false;
+    ssize_t n = write(m_fd, c, m_used);
+    if(n<0) {
+      if(errno==EINTR) continue;
+      if(errno==EAGAIN || errno==EWOULDBLOCK) {
+        struct pollfd pfd = { m_fd, POLLOUT, 0 };
+        if(poll(&pfd, 1, 100)>=0 || errno==EINTR) continue;
+      }
+      m_errno = errno;
+      return false;
+    }
+    c += n; m_used -= n;
+  }
+  return true;
+}
+
+
+bool DumpWriter::interrupted()
+{
+  if(!m_interrupted) return false;
+  m_errno = EINTR;
+  return true;
+}
+
+
+}
+}
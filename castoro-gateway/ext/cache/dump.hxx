@@ -0,0 +1,115 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __INCLUDE_GATEWAY_DUMP_H__
+#define __INCLUDE_GATEWAY_DUMP_H__
+
+#include <map>
+#include <string>
+#include "database.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+  // header of a binary dump.
+  class DumpHeader {
+  public:
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  record_bytes;   // sizeof(DumpRecord)
+  };
+
+  // an element of a binary dump, little endian as the host.
+  //
+  // A peer is defined once before its first element, by a record of
+  // peer = DUMP_PEER_NAME, content_id = the peer number, type = bytes
+  // of the name, followed by the name without terminator.
+  class DumpRecord {
+  public:
+    uint64_t  content_id;
+    uint32_t  type;
+    uint32_t  revision;
+    uint32_t  peer;           // number of the peer, from 1.
+  } __attribute__((packed));
+
+
+  // native writer for Database::dump(), writes elements straight to a
+  // file descriptor through a buffer, neither allocates ruby objects nor
+  // calls ruby, so that Database::dump() can run without GVL.
+  //
+  // Peer names are given by add_peer() in advance. Elements of the other
+  // peers are skipped, they were inserted after the dump began.
+  //
+  // A non-blocking fd is waited by poll() while it is full. interrupt()
+  // may be called from another thread, as the unblocking function of
+  // rb_thread_call_without_gvl(), then the dump fails with EINTR.
+  class DumpWriter :public CacheDumperAbstract {
+  public:
+    typedef enum {
+      FORMAT_TEXT = 0,        // "  peer: content_id.type.revision" as Cache.member_puts.
+      FORMAT_BINARY = 1
+    } Format;
+    static const uint32_t VERSION = 1;
+    static const uint32_t DUMP_PEER_NAME = 0xffffffff;
+    static const size_t BUFFER_BYTES = 1024*1024;
+
+    DumpWriter(int fd, Format format, size_t buffer_bytes = BUFFER_BYTES);
+    virtual ~DumpWriter();
+
+    void add_peer(ID peer, const std::string& name);
+    bool begin();
+    virtual bool operator()(uint64_t cid, uint32_t typ, uint32_t rev, ID peer);
+    bool finish();            // writes the rest of the buffer.
+    inline void interrupt() { m_interrupted = true; };
+
+    attr_reader(uint64_t, m_records);
+    attr_reader(int, m_errno);
+
+  private:
+    class Peer {
+    public:
+      std::string name;
+      uint32_t    number;
+      bool        defined;
+    };
+    typedef std::map<ID, Peer> Peers;
+
+    bool put(const void* p, size_t bytes);
+    bool flush();
+    bool interrupted();
+
+    int       m_fd;
+    Format    m_format;
+    char*     m_buffer;
+    size_t    m_bytes;
+    size_t    m_used;
+    Peers     m_peers;
+    uint64_t  m_records;
+    int       m_errno;
+    volatile bool m_interrupted;
+  };
+
+
+}
+}
+
+
+#endif //__INCLUDE_GATEWAY_DUMP_H__
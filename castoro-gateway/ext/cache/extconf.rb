@@ -20,4 +20,14 @@
 require 'mkmf'
 $CFLAGS="-g -Wall -DRUBY_VERSION=\\\"#{RUBY_VERSION.split('.')[0,2].join('.')}\\\""
 $LDFLAGS="-lstdc++"
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_ary_new_capa')
+
+# bits of revisions kept in cache pages, 8, 16 or 32.
+revision_bits = with_config('revision-bits', '16')
+unless %w(8 16 32).include?(revision_bits.to_s)
+  abort "--with-revision-bits must be 8, 16 or 32."
+end
+$defs.push("-DCACHEPAGE_REVISION_BITS=#{revision_bits}")
 create_makefile('castoro-gateway/cache')
@@ -0,0 +1,88 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include "histogram.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+//
+// class LatencyHistogram
+//
+void LatencyHistogram::clear()
+{
+  memset(m_counts, 0, sizeof(m_counts));
+  m_sum = 0;
+  m_max = 0;
+}
+
+
+void LatencyHistogram::add(const LatencyHistogram& other)
+{
+  for(size_t i=0; i<BUCKETS; i++) m_counts[i] += other.m_counts[i];
+  m_sum += other.m_sum;
+  if(other.m_max > m_max) m_max = other.m_max;
+}
+
+
+uint64_t LatencyHistogram::count() const
+{
+  uint64_t result = 0;
+  for(size_t i=0; i<BUCKETS; i++) result += m_counts[i];
+  return result;
+}
+
+
+// the upper bound of the bucket which has the p percent value,
+// never over the max.
+uint64_t LatencyHistogram::percentile(double p) const
+{
+  uint64_t total = count();
+  if(total==0) return 0;
+  uint64_t rank = (uint64_t)(total * p / 100.0 + 0.5);
+  if(rank < 1) rank = 1;
+  if(rank > total) rank = total;
+
+  uint64_t seen = 0;
+  for(size_t i=0; i<BUCKETS; i++) {
+    seen += m_counts[i];
+    if(seen >= rank) return (upper(i) < m_max) ? upper(i) : m_max;
+  }
+  return m_max;
+}
+
+
+uint64_t LatencyHistogram::lower(size_t bucket)
+{
+  if(bucket < SUB_BUCKETS) return bucket;
+  size_t shift = bucket / SUB_BUCKETS - 1;
+  return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+
+uint64_t LatencyHistogram::upper(size_t bucket)
+{
+  return (bucket+1 < BUCKETS) ? lower(bucket+1) - 1 : ~0ULL;
+}
+
+}
+}
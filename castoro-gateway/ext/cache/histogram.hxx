@@ -0,0 +1,102 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __INCLUDE_GATEWAY_HISTOGRAM_H__
+#define __INCLUDE_GATEWAY_HISTOGRAM_H__
+
+#include "basetypes.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+  // monotonic clock by nsec, read from vDSO without a syscall.
+  class LatencyClock {
+  public:
+    static inline uint64_t now() {
+      struct timespec ts = { 0, 0 };
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    };
+  };
+
+
+  // log-linear histogram of latencies by nsec.
+  //
+  // A value is counted in the bucket of its highest bit and the next
+  // SUB_BITS bits, so that a bucket is within 1/SUB_BUCKETS of its values.
+  // Values under SUB_BUCKETS have their own buckets. Counters are updated
+  // atomically without locks, neither allocates memory nor calls ruby.
+  class LatencyHistogram {
+  public:
+    enum {
+      SUB_BITS = 3,
+      SUB_BUCKETS = 1 << SUB_BITS,
+      BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS
+    };
+
+    inline LatencyHistogram() { clear(); };
+    inline ~LatencyHistogram() {}; // NOT virtual.
+
+    inline void record(uint64_t nsec) {
+      __sync_fetch_and_add(&m_counts[bucket(nsec)], 1);
+      if(nsec==0) return;
+      __sync_fetch_and_add(&m_sum, nsec);
+      for(uint64_t m = m_max; nsec > m; m = m_max) {
+        if(__sync_bool_compare_and_swap(&m_max, m, nsec)) break;
+      }
+    };
+    void clear();
+    void add(const LatencyHistogram& other);  // not atomically, for summaries.
+
+    uint64_t count() const;
+    uint64_t percentile(double p) const;      // upper bound of the bucket, p in [0, 100].
+    attr_reader(uint64_t, m_sum);
+    attr_reader(uint64_t, m_max);
+
+    static inline size_t bucket(uint64_t nsec) {
+      if(nsec < SUB_BUCKETS) return (size_t)nsec;
+      int shift = 63 - __builtin_clzll(nsec) - SUB_BITS;
+      return (size_t)(shift + 1) * SUB_BUCKETS + ((nsec >> shift) & (SUB_BUCKETS - 1));
+    };
+    static uint64_t lower(size_t bucket);
+    static uint64_t upper(size_t bucket);
+
+  private:
+    uint64_t  m_counts[BUCKETS];
+    uint64_t  m_sum;
+    uint64_t  m_max;
+  };
+
+
+  // records the time from construction to destruction.
+  class LatencyTimer {
+  public:
+    inline LatencyTimer(LatencyHistogram& h) :m_histogram(h) { m_start = LatencyClock::now(); };
+    inline ~LatencyTimer() { m_histogram.record(LatencyClock::now() - m_start); }; // NOT virtual.
+
+  private:
+    LatencyHistogram& m_histogram;
+    uint64_t  m_start;
+  };
+}
+}
+
+#endif // __INCLUDE_GATEWAY_HISTOGRAM_H__
@@ -0,0 +1,318 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "index.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+
+//
+// class CachePageIndex
+//
+CachePageIndex::CachePageIndex(size_t pages, CachePageBase* arena, size_t page_bytes)
+{
+  m_arena = (char*)arena;
+  m_page_bytes = page_bytes;
+  m_capacity = 16;
+  while(m_capacity < pages*2) m_capacity <<= 1;
+  m_size = 0;
+  m_buckets = (Bucket*)ruby_xmalloc(sizeof(Bucket) * m_capacity);
+  clear();
+}
+
+CachePageIndex::~CachePageIndex()
+{
+  try {
+    ruby_xfree((void*)m_buckets);
+  }
+  catch(...) {}
+}
+
+
+void CachePageIndex::clear()
+{
+  memset(m_buckets, 0, sizeof(Bucket) * m_capacity);
+  m_size = 0;
+}
+
+
+// find bucket position, m_capacity if not found.
+size_t CachePageIndex::lookup(const ContentIdWithType& key) const
+{
+  size_t mask = m_capacity-1;
+  for(size_t pos = home(key.content_id, key.type); m_buckets[pos].page; pos = (pos+1) & mask) {
+    if(m_buckets[pos].match(key)) return pos;
+  }
+  return m_capacity;
+}
+
+
+CachePageBase* CachePageIndex::find(const ContentIdWithType& key) const
+{
+  size_t pos = lookup(key);
+  if(pos==m_capacity) return NULL;
+  return page_at(pos);
+}
+
+
+// insert page, false if the key is already exists or table is full.
+bool CachePageIndex::insert(const ContentIdWithType& key, CachePageBase* page)
+{
+  if(!page || (m_size*2 >= m_capacity)) return false;
+
+  size_t mask = m_capacity-1;
+  size_t pos = home(key.content_id, key.type);
+  for(; m_buckets[pos].page; pos = (pos+1) & mask) {
+    if(m_buckets[pos].match(key)) return false;
+  }
+  m_buckets[pos].content_id = key.content_id;
+  m_buckets[pos].type = key.type;
+  m_buckets[pos].page = (uint32_t)(((char*)page - m_arena) / m_page_bytes) + 1;
+  m_size++;
+  return true;
+}
+
+
+bool CachePageIndex::erase(const ContentIdWithType& key)
+{
+  size_t pos = lookup(key);
+  if(pos==m_capacity) return false;
+
+  erase_at(pos);
+  return true;
+}
+
+
+// erase key only when it points the page.
+bool CachePageIndex::erase(const ContentIdWithType& key, const CachePageBase* page)
+{
+  size_t pos = lookup(key);
+  if((pos==m_capacity) || (page_at(pos)!=page)) return false;
+
+  erase_at(pos);
+  return true;
+}
+
+
+// backward shift deletion.
+void CachePageIndex::erase_at(size_t pos)
+{
+  size_t mask = m_capacity-1;
+  size_t hole = pos;
+  for(size_t next = (hole+1) & mask; m_buckets[next].page; next = (next+1) & mask) {
+    // move the entry into the hole unless its home lies in (hole, next].
+    size_t h = home(m_buckets[next].content_id, m_buckets[next].type);
+    if(((next - h) & mask) >= ((next - hole) & mask)) {
+      m_buckets[hole] = m_buckets[next];
+      hole = next;
+    }
+  }
+  m_buckets[hole].page = 0;
+  m_size--;
+}
+
+
+
+//
+// class PeerPageIndex
+//
+PeerPageIndex::PeerPageIndex(size_t units)
+{
+  m_block_count = (units + BLOCK_PAGES - 1) / BLOCK_PAGES;
+  if(m_block_count==0) m_block_count = 1;
+  m_blocks = NULL;
+  m_size = 0;
+  m_allocated = 0;
+}
+
+PeerPageIndex::~PeerPageIndex()
+{
+  for(size_t i=0; i<m_size; i++) free((void*)m_blocks[i]);
+  free((void*)m_blocks);
+}
+
+
+// callers hold the shard lock, so that memory is allocated by malloc
+// and the failure is returned, instead of raising NoMemoryError.
+bool PeerPageIndex::set(PEERH peer, PAGEH page)
+{
+  size_t i = (size_t)peer * m_block_count + page / BLOCK_PAGES;
+  if(i >= m_size) {
+    size_t size = ((size_t)peer+1) * m_block_count;
+    Block** blocks = (Block**)realloc((void*)m_blocks, sizeof(Block*) * size);
+    if(!blocks) return false;
+    memset((void*)(blocks + m_size), 0, sizeof(Block*) * (size - m_size));
+    m_blocks = blocks;
+    m_size = size;
+  }
+
+  Block* b = m_blocks[i];
+  if(!b) {
+    b = (Block*)calloc(1, sizeof(Block));
+    if(!b) return false;
+    m_blocks[i] = b;
+    m_allocated++;
+  }
+  uint64_t bit = 1ULL << (page % 64);
+  uint64_t& w = b->bits[(page % BLOCK_PAGES) / 64];
+  if(!(w & bit)) {
+    w |= bit;
+    b->count++;
+  }
+  return true;
+}
+
+
+bool PeerPageIndex::test(PEERH peer, PAGEH page) const
+{
+  Block* b = block_at(peer, page);
+  return b && (b->bits[(page % BLOCK_PAGES) / 64] & (1ULL << (page % 64)));
+}
+
+
+// O(peers), for each page dropped.
+void PeerPageIndex::erase_page(PAGEH page)
+{
+  uint64_t bit = 1ULL << (page % 64);
+  size_t word = (page % BLOCK_PAGES) / 64;
+  for(size_t i = page / BLOCK_PAGES; i < m_size; i += m_block_count) {
+    Block* b = m_blocks[i];
+    if(!b || !(b->bits[word] & bit)) continue;
+    b->bits[word] &= ~bit;
+    if(--b->count==0) {
+      free((void*)b);
+      m_blocks[i] = NULL;
+      m_allocated--;
+    }
+  }
+}
+
+
+void PeerPageIndex::erase_peer(PEERH peer)
+{
+  size_t first = (size_t)peer * m_block_count;
+  for(size_t i = first; i < first + m_block_count && i < m_size; i++) {
+    if(!m_blocks[i]) continue;
+    free((void*)m_blocks[i]);
+    m_blocks[i] = NULL;
+    m_allocated--;
+  }
+}
+
+
+size_t PeerPageIndex::count(PEERH peer) const
+{
+  size_t result = 0;
+  size_t first = (size_t)peer * m_block_count;
+  for(size_t i = first; i < first + m_block_count && i < m_size; i++) {
+    if(m_blocks[i]) result += m_blocks[i]->count;
+  }
+  return result;
+}
+
+
+
+//
+// class NegativeCache
+//
+NegativeCache::NegativeCache(size_t entries, uint64_t ttl, uint64_t grace)
+{
+  size_t buckets = 16;
+  while(buckets * WAYS < entries) buckets <<= 1;
+  m_capacity = buckets * WAYS;
+  m_entries = (Entry*)ruby_xmalloc(sizeof(Entry) * m_capacity);
+  m_ttl = ttl;
+  m_grace = grace;
+  clear();
+}
+
+NegativeCache::~NegativeCache()
+{
+  try {
+    ruby_xfree((void*)m_entries);
+  }
+  catch(...) {}
+}
+
+
+void NegativeCache::clear()
+{
+  memset(m_entries, 0, sizeof(Entry) * m_capacity);
+  m_relays = 0;
+  m_suppressed = 0;
+  m_cleared = 0;
+}
+
+
+NegativeCache::State NegativeCache::lookup(uint64_t key, uint64_t now) const
+{
+  const Entry* b = bucket(key);
+  for(size_t i=0; i<WAYS; i++) {
+    if(b[i].key!=key) continue;
+    if(!is_live(b[i], now)) return NC_NONE;
+    return (now - b[i].relayed < m_grace) ? NC_RELAYED : NC_NEGATIVE;
+  }
+  return NC_NONE;
+}
+
+
+// (re)start ttl of the key, in its own, an expired or the oldest entry.
+void NegativeCache::mark(uint64_t key, uint64_t now)
+{
+  Entry* b = bucket(key);
+  Entry* victim = b;
+  for(size_t i=0; i<WAYS; i++) {
+    if(b[i].key==key) { victim = &b[i]; break; }
+    if(!is_live(*victim, now)) continue;
+    if(!is_live(b[i], now) || (b[i].relayed < victim->relayed)) victim = &b[i];
+  }
+  victim->key = key;
+  victim->relayed = now;
+  m_relays++;
+}
+
+
+bool NegativeCache::erase(uint64_t key)
+{
+  Entry* b = bucket(key);
+  for(size_t i=0; i<WAYS; i++) {
+    if(b[i].key!=key) continue;
+    b[i].key = 0;
+    m_cleared++;
+    return true;
+  }
+  return false;
+}
+
+
+size_t NegativeCache::size(uint64_t now) const
+{
+  size_t result = 0;
+  for(size_t i=0; i<m_capacity; i++) {
+    if(is_live(m_entries[i], now)) result++;
+  }
+  return result;
+}
+
+
+}
+}
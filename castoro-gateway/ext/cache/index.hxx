@@ -0,0 +1,216 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __INCLUDE_GATEWAY_INDEX_H__
+#define __INCLUDE_GATEWAY_INDEX_H__
+
+#include "basetypes.hxx"
+#include "page.hxx"
+#include "allocator.hxx"
+#include <vector>
+
+
+namespace Castoro {
+namespace Gateway {
+
+  // { content_id, type } => { cache page } open-addressing hash table.
+  //
+  // The table is sized once from the page count of CachePagePool,
+  // so that it never holds more than half of its buckets.
+  // Pages are kept as PAGEH of the pool's arena, 16 bytes per bucket,
+  // pages are page_bytes apart in the arena.
+  // Collisions are resolved by linear probing, and erase() shifts
+  // the following entries back instead of leaving tombstones.
+  class CachePageIndex {
+  public:
+    CachePageIndex(size_t pages, CachePageBase* arena, size_t page_bytes);
+    virtual ~CachePageIndex();
+
+    CachePageBase* find(const ContentIdWithType& key) const;
+    bool insert(const ContentIdWithType& key, CachePageBase* page);
+    bool erase(const ContentIdWithType& key);
+    bool erase(const ContentIdWithType& key, const CachePageBase* page);
+    void clear();
+
+    inline size_t size() const { return m_size; };
+    attr_reader(size_t, m_capacity);
+
+  private:
+    class Bucket {
+    public:
+      uint64_t  content_id;
+      uint32_t  type;
+      uint32_t  page;       // PAGEH+1, 0 means empty bucket.
+      inline bool match(const ContentIdWithType& key) const {
+        return (content_id==key.content_id) && (type==key.type);
+      };
+    };
+
+    size_t      m_capacity; // Must be 2^n
+    size_t      m_size;
+    Bucket*     m_buckets;
+    char*       m_arena;
+    size_t      m_page_bytes;
+
+    inline size_t home(uint64_t content_id, uint32_t type) const {
+      return (size_t)(ContentIdWithType::hash(content_id, type) & (m_capacity-1));
+    };
+    inline CachePageBase* page_at(size_t pos) const {
+      return (CachePageBase*)(m_arena + (size_t)(m_buckets[pos].page-1) * m_page_bytes);
+    };
+    size_t lookup(const ContentIdWithType& key) const;
+    void erase_at(size_t pos);
+  };
+
+
+  typedef std::vector<PAGEH, RbAllocator<PAGEH> > ArrayOfPageH;
+
+
+  // { peer } => { cache pages } bitmaps, pages which may have the peer.
+  //
+  // Each peer has a bitmap of PAGEH, in blocks of BLOCK_PAGES bits which
+  // are allocated when the first bit is set and freed when the last bit
+  // is cleared, so that a peer on a few pages costs a few blocks.
+  // A bit is set when the peer is inserted into the page, and cleared
+  // when the page is dropped or the peer is purged, not when the peer is
+  // removed from an entry. So a set bit may be stale, a clear bit never.
+  class PeerPageIndex {
+  public:
+    enum { BLOCK_PAGES = 4096 };
+
+    PeerPageIndex(size_t units);
+    virtual ~PeerPageIndex();
+
+    bool set(PEERH peer, PAGEH page); // false if out of memory, never raises.
+    bool test(PEERH peer, PAGEH page) const;
+    void erase_page(PAGEH page);      // of all peers.
+    void erase_peer(PEERH peer);      // all pages of the peer.
+    template<class A> void pages(PEERH peer, A& result) const {  // in order of PAGEH.
+      size_t first = (size_t)peer * m_block_count;
+      for(size_t i = first; i < first + m_block_count && i < m_size; i++) {
+        const Block* b = m_blocks[i];
+        if(!b) continue;
+        PAGEH base = (PAGEH)((i - first) * BLOCK_PAGES);
+        for(size_t w=0; w<BLOCK_PAGES/64; w++) {
+          for(uint64_t bits = b->bits[w]; bits; bits &= bits-1) {
+            result.push_back(base + w*64 + __builtin_ctzll(bits));
+          }
+        }
+      }
+    };
+    size_t count(PEERH peer) const;
+
+    attr_reader(size_t, m_allocated);
+
+  private:
+    class Block {
+    public:
+      uint32_t  count;
+      uint64_t  bits[BLOCK_PAGES/64];
+    };
+
+    size_t  m_block_count;  // blocks of a peer.
+    Block** m_blocks;       // [peer * m_block_count + block], NULL if no bits.
+    size_t  m_size;         // slots of m_blocks.
+    size_t  m_allocated;    // allocated blocks.
+
+    inline Block* block_at(PEERH peer, PAGEH page) const {
+      size_t i = (size_t)peer * m_block_count + page / BLOCK_PAGES;
+      return (i < m_size) ? m_blocks[i] : NULL;
+    };
+  };
+
+
+  // { content_id, type, revision } set of relayed misses, with TTL.
+  //
+  // A Get which missed the cache is relayed to peers, and the peers which
+  // have the basket answer with Insert, which erases the key. So a key
+  // still in the set after grace has got no answers, and its relays are
+  // suppressed until ttl from the relay.
+  // Keys are kept as 64bit fingerprints in buckets of WAYS entries, and
+  // the oldest entry of a full bucket is replaced, so that the set never
+  // allocates memory after construction.
+  class NegativeCache {
+  public:
+    enum { WAYS = 4 };
+    typedef enum {
+      NC_NONE = 0,    // not relayed, or expired.
+      NC_RELAYED,     // relayed within grace, answers may be coming.
+      NC_NEGATIVE     // relayed and no answers, until ttl.
+    } State;
+
+    NegativeCache(size_t entries, uint64_t ttl, uint64_t grace);  // ttl and grace by nsec.
+    virtual ~NegativeCache();
+
+    State lookup(uint64_t key, uint64_t now) const;
+    void mark(uint64_t key, uint64_t now);
+    bool erase(uint64_t key);
+    void clear();
+    size_t size(uint64_t now) const;  // entries within ttl.
+
+    inline void suppressed() { __sync_fetch_and_add(&m_suppressed, 1); };
+
+    // fingerprint of the key, never 0.
+    static inline uint64_t key(uint64_t content_id, uint32_t type, uint32_t revision) {
+      uint64_t h = content_id ^ ((((uint64_t)type << 32) | revision) * 0x9e3779b97f4a7c15ULL);
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return h ? h : 1;
+    };
+
+    attr_reader(size_t, m_capacity);
+    attr_reader(uint64_t, m_ttl);
+    attr_reader(uint64_t, m_grace);
+    attr_reader(uint64_t, m_relays);
+    attr_reader(uint64_t, m_suppressed);
+    attr_reader(uint64_t, m_cleared);
+
+  private:
+    class Entry {
+    public:
+      uint64_t  key;      // 0 means empty entry.
+      uint64_t  relayed;  // by LatencyClock.
+    };
+
+    size_t    m_capacity; // WAYS * buckets, buckets must be 2^n
+    Entry*    m_entries;
+    uint64_t  m_ttl;
+    uint64_t  m_grace;
+    uint64_t  m_relays;     // keys marked.
+    uint64_t  m_suppressed; // relays suppressed.
+    uint64_t  m_cleared;    // keys erased by insert.
+
+    inline Entry* bucket(uint64_t key) const {
+      return m_entries + (size_t)(key & (m_capacity/WAYS - 1)) * WAYS;
+    };
+    inline bool is_live(const Entry& e, uint64_t now) const {
+      return e.key && (now - e.relayed < m_ttl);
+    };
+  };
+
+
+}
+}
+
+
+#endif //__INCLUDE_GATEWAY_INDEX_H__
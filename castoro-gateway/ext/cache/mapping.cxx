@@ -34,17 +34,31 @@ PeerHash::PeerHash()
   m_hash2id.push_back((ID)-1);
 }
 
+// nothing is changed if std::bad_alloc is thrown.
 PEERH PeerHash::fromID(ID id)
 {
-  std::map<ID, PEERH, std::less<ID>, RbAllocator<std::pair<const ID, PEERH> > >::iterator h = m_id2hash.find(id);
+  PEERH_MAP::iterator h = m_id2hash.find(id);
   if(h==m_id2hash.end()) {
-    m_id2hash.insert(std::make_pair(id, m_next));
     m_hash2id.push_back(id);
+    try {
+      m_id2hash.insert(std::make_pair(id, m_next));
+    }
+    catch(std::bad_alloc&) {
+      m_hash2id.pop_back();
+      throw;
+    }
     return m_next++;
   }
   return (*h).second;
 }
 
+PEERH PeerHash::find(ID id) const
+{
+  PEERH_MAP::const_iterator h = m_id2hash.find(id);
+  if(h==m_id2hash.end()) return 0;
+  return (*h).second;
+}
+
 ID PeerHash::toID(PEERH h) const
 {
   if(m_hash2id.size()<=h) return ((ID)-1);
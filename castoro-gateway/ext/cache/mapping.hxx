@@ -30,13 +30,14 @@ namespace Gateway {
   // { peer } <=> { peer code } mapping.
   typedef uint16_t  PEERH;
   class PeerHash {
-    typedef std::vector<ID, RbAllocator<ID> >     ID_VECTOR;
-    typedef std::map<ID, PEERH, std::less<ID>, RbAllocator<std::pair<const ID, PEERH> > > PEERH_MAP; 
+    typedef std::vector<ID, MallocAllocator<ID> >     ID_VECTOR;
+    typedef std::map<ID, PEERH, std::less<ID>, MallocAllocator<std::pair<const ID, PEERH> > > PEERH_MAP; 
 
   public:
     PeerHash();
     inline virtual ~PeerHash() {};
-    PEERH fromID(ID id);
+    PEERH fromID(ID id);  // under the lock, throws std::bad_alloc.
+    PEERH find(ID id) const;  // 0 if not registered.
     ID toID(PEERH h) const;
 
     attr_reader(PEERH, m_next);
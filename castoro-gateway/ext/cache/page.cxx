@@ -25,43 +25,62 @@ namespace Castoro {
 namespace Gateway {
 
 //
-// class ID3
+// class PageSlot
 //
-void ID3::append(PEERH id)
+template<int N> void PageSlot<N>::append(PEERH id)
 {
-  if((at(0)==0) || (at(0)==id)) {
-    at(0, id);
-    return;
-  }
-  if((at(1)==0) || (at(1)==id)) {
-    at(1, id);
-    return;
-  }
-  if((at(2)==0) || (at(2)==id)) {
-    at(2, id);
-    return;
+  for(int idx=0; idx<N; idx++) {
+    if((at(idx)==0) || (at(idx)==id)) {
+      at(idx, id);
+      return;
+    }
   }
-  at(0, id);
+
+  // all slots are used, push out the earliest one.
+  for(int idx=0; idx<N-1; idx++) at(idx, at(idx+1));
+  at(N-1, id);
 }
 
-void ID3::remove(PEERH id)
+template<int N> void PageSlot<N>::remove(PEERH id)
 {
-  if(at(0)==id) {       at(0, at(1)); goto at_1; }
-  if(at(1)==id) { at_1: at(1, at(2)); goto at_2; }
-  if(at(2)==id) { at_2: at(2, 0);
-    if(empty()) set_removed();
+  for(int idx=0; idx<N; idx++) {
+    if(at(idx)!=id) continue;
+    for(; idx<N-1; idx++) at(idx, at(idx+1));
+    at(N-1, 0);
+    if(empty()) m_peers[N-1] = PEERH_REMOVED;
+    return;
   }
 }
 
-bool ID3::empty() const
+
+//
+// class CachePageBase
+//
+size_t CachePageBase::size_of(size_t slots)
 {
-  return ((at(0)==0) && (at(1)==0) && (at(2)==0));
+  switch(slots) {
+  case 2: return PageLayout<2>::PAGE_BYTES;
+  case 3: return PageLayout<3>::PAGE_BYTES;
+  case 4: return PageLayout<4>::PAGE_BYTES;
+  case 5: return PageLayout<5>::PAGE_BYTES;
+  case 6: return PageLayout<6>::PAGE_BYTES;
+  case 7: return PageLayout<7>::PAGE_BYTES;
+  case 8: return PageLayout<8>::PAGE_BYTES;
+  default: return 0;
+  }
 }
 
-void ID3::pushall(ArrayOfId& dest) const
+size_t CachePageBase::sparse_entries(size_t slots)
 {
-  for(int idx=0; idx<3 && at(idx)!=0; idx++) {
-    dest.push_back(at(idx));
+  switch(slots) {
+  case 2: return PageLayout<2>::SPARSE_ENTRIES;
+  case 3: return PageLayout<3>::SPARSE_ENTRIES;
+  case 4: return PageLayout<4>::SPARSE_ENTRIES;
+  case 5: return PageLayout<5>::SPARSE_ENTRIES;
+  case 6: return PageLayout<6>::SPARSE_ENTRIES;
+  case 7: return PageLayout<7>::SPARSE_ENTRIES;
+  case 8: return PageLayout<8>::SPARSE_ENTRIES;
+  default: return 0;
   }
 }
 
@@ -69,77 +88,244 @@ void ID3::pushall(ArrayOfId& dest) const
 //
 // class CachePage
 //
-void CachePage::init(uint64_t content_id, uint32_t type)
+template<int N> void CachePage<N>::init(uint64_t content_id, uint32_t type)
 {
-  memset(m_revision_hash, 0, sizeof(m_revision_hash));
-  memset(m_peers, 0, sizeof(m_peers));
-  m_contains = 0;
-  m_magic.content_id = content_id & (~(CACHEPAGE_SIZE-1));
-  m_magic.type = type;
+  memset((void*)m_slots, 0, sizeof(m_slots));
+  init_magic(content_id, type, CACHEPAGE_SIZE);
 }
 
 
 // insert revision into page.
-bool CachePage::insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
+template<int N> bool CachePage<N>::insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
 {
   if(!validate(content_id, type)) return false; // invalid page.
 
-  content_id &= (CACHEPAGE_SIZE-1);
-  uint8_t rev = (uint8_t)revision;
+  Slot& slot = m_slots[content_id & (CACHEPAGE_SIZE-1)];
+  REVH rev = RevisionHash::from(revision);
 
   // check revision.
-  if((m_revision_hash[content_id]!=rev) && !m_peers[content_id].empty()) {
+  if((slot.revision()!=rev) && !slot.empty()) {
     m_contains--;
-    m_peers[content_id].clear();
+    slot.clear();
   }
 
   // mark.
-  if(m_peers[content_id].empty()) m_contains++;
-  m_peers[content_id].append(peer);
-  m_revision_hash[content_id] = rev;
+  if(slot.empty()) m_contains++;
+  slot.append(peer);
+  slot.revision(rev);
 
   return true;
 }
 
 
 // find revision from page.
-bool CachePage::find(uint64_t content_id, uint32_t type, uint32_t revision, ArrayOfId& result, bool& removed)
+template<int N> bool CachePage<N>::find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed) const
 {
   removed = false;
   if(!validate(content_id, type)) return false; // invalid page.
 
-  content_id &= (CACHEPAGE_SIZE-1);
-  uint8_t rev = (uint8_t)revision;
+  const Slot& slot = m_slots[content_id & (CACHEPAGE_SIZE-1)];
+  REVH rev = RevisionHash::from(revision);
 
   // check 'removed'.
-  if(m_peers[content_id].removed()) {
+  if(slot.removed()) {
     removed = true;
     return true;
   }
 
-  // check revision.
-  if(m_revision_hash[content_id]!=rev) return true;
+  // check revision, overflowed one can't be verified.
+  if((slot.revision()!=rev) || !RevisionHash::is_exact(rev)) return true;
 
   // build result.
-  m_peers[content_id].pushall(result);
+  slot.pushall(result);
   return true;
 }
 
 
 // remove revision from page.
-bool CachePage::remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
+template<int N> bool CachePage<N>::remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
 {
   if(!validate(content_id, type)) return false; // invalid page.
 
-  content_id &= (CACHEPAGE_SIZE-1);
-  uint8_t rev = (uint8_t)revision;
+  Slot& slot = m_slots[content_id & (CACHEPAGE_SIZE-1)];
+  REVH rev = RevisionHash::from(revision);
 
-  // check revision.
-  if(m_revision_hash[content_id]!=rev) return true;
+  // check revision, and the entry which has no peers.
+  if(slot.revision()!=rev) return true;
+  if(slot.empty()) return true;
+
+  // remove.
+  slot.remove(peer);
+  if(slot.empty()) {
+    m_contains--;
+    if(m_contains==0) return false; // empty page.
+  }
+  return true;  // succeeded;
+}
+
+
+
+template<int N> size_t CachePage<N>::purge(PEERH peer)
+{
+  size_t result = 0;
+  for(size_t ofs=0; ofs<CACHEPAGE_SIZE; ofs++) {
+    Slot& slot = m_slots[ofs];
+    if(!slot.has(peer)) continue;
+    slot.remove(peer);
+    if(slot.empty()) m_contains--;
+    result++;
+  }
+  return result;
+}
+
+
+// copy contents of the page.
+template<int N> void CachePage<N>::copy(const CachePage& src)
+{
+  m_magic = src.m_magic;
+  m_contains = src.m_contains;
+  m_capacity = src.m_capacity;
+  memcpy((void*)m_slots, (const void*)src.m_slots, sizeof(m_slots));
+}
+
+
+// copy entries of the sparse page.
+template<int N> void CachePage<N>::assign(const SparsePage<N>& src)
+{
+  SparsePage<N>& page = (SparsePage<N>&)src;
+  init(page.m_magic_r().content_id, page.m_magic_r().type);
+  for(size_t idx=0; idx<page.m_entries_r(); idx++) {
+    m_slots[page.offset_at(idx)] = page.slot_at(idx);
+  }
+  m_contains = page.m_contains_r();
+}
+
+
+
+//
+// class SparsePage
+//
+template<int N> void SparsePage<N>::init(uint64_t content_id, uint32_t type)
+{
+  init_magic(content_id, type, CAPACITY);
+  m_entries = 0;
+}
+
+
+// binary search.
+template<int N> size_t SparsePage<N>::lookup(uint16_t offset) const
+{
+  size_t lo = 0, hi = m_entries;
+  while(lo<hi) {
+    size_t mid = (lo+hi)/2;
+    if(m_offsets[mid]<offset) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+
+// forget 'removed' entries.
+template<int N> void SparsePage<N>::reclaim()
+{
+  size_t to = 0;
+  for(size_t from=0; from<m_entries; from++) {
+    if(m_slots[from].empty()) continue;
+    if(to!=from) {
+      m_offsets[to] = m_offsets[from];
+      m_slots[to] = m_slots[from];
+    }
+    to++;
+  }
+  m_entries = to;
+}
+
+
+// insert revision into page, false if the page is full.
+template<int N> bool SparsePage<N>::insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
+{
+  if(!validate(content_id, type)) return false; // invalid page.
+
+  uint16_t ofs = content_id & (CACHEPAGE_SIZE-1);
+  REVH rev = RevisionHash::from(revision);
+  size_t idx = lookup(ofs);
+
+  if((idx<m_entries) && (m_offsets[idx]==ofs)) {
+    // check revision.
+    if((m_slots[idx].revision()!=rev) && !m_slots[idx].empty()) {
+      m_contains--;
+      m_slots[idx].clear();
+    }
+  } else {
+    // new entry.
+    if(full()) {
+      reclaim();
+      if(full()) return false;
+      idx = lookup(ofs);
+    }
+    size_t n = m_entries - idx;
+    memmove(m_offsets+idx+1, m_offsets+idx, sizeof(m_offsets[0])*n);
+    memmove((void*)(m_slots+idx+1), (void*)(m_slots+idx), sizeof(m_slots[0])*n);
+    m_offsets[idx] = ofs;
+    m_slots[idx].clear();
+    m_entries++;
+  }
+
+  // mark.
+  Slot& slot = m_slots[idx];
+  if(slot.empty()) m_contains++;
+  slot.append(peer);
+  slot.revision(rev);
+
+  return true;
+}
+
+
+// find revision from page.
+template<int N> bool SparsePage<N>::find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed) const
+{
+  removed = false;
+  if(!validate(content_id, type)) return false; // invalid page.
+
+  uint16_t ofs = content_id & (CACHEPAGE_SIZE-1);
+  REVH rev = RevisionHash::from(revision);
+  size_t idx = lookup(ofs);
+  if((idx>=m_entries) || (m_offsets[idx]!=ofs)) return true;
+
+  // check 'removed'.
+  const Slot& slot = m_slots[idx];
+  if(slot.removed()) {
+    removed = true;
+    return true;
+  }
+
+  // check revision, overflowed one can't be verified.
+  if((slot.revision()!=rev) || !RevisionHash::is_exact(rev)) return true;
+
+  // build result.
+  slot.pushall(result);
+  return true;
+}
+
+
+// remove revision from page, the entry is kept as 'removed'.
+template<int N> bool SparsePage<N>::remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer)
+{
+  if(!validate(content_id, type)) return false; // invalid page.
+
+  uint16_t ofs = content_id & (CACHEPAGE_SIZE-1);
+  REVH rev = RevisionHash::from(revision);
+  size_t idx = lookup(ofs);
+  if((idx>=m_entries) || (m_offsets[idx]!=ofs)) return true;
+
+  // check revision, and the entry which has no peers.
+  Slot& slot = m_slots[idx];
+  if(slot.revision()!=rev) return true;
+  if(slot.empty()) return true;
 
   // remove.
-  m_peers[content_id].remove(peer);
-  if(m_peers[content_id].empty()) {
+  slot.remove(peer);
+  if(slot.empty()) {
     m_contains--;
     if(m_contains==0) return false; // empty page.
   }
@@ -147,60 +333,573 @@ bool CachePage::remove(uint64_t content_id, uint32_t type, uint32_t revision, PE
 }
 
 
+// emptied entries are kept as 'removed', as remove() does.
+template<int N> size_t SparsePage<N>::purge(PEERH peer)
+{
+  size_t result = 0;
+  for(size_t idx=0; idx<m_entries; idx++) {
+    Slot& slot = m_slots[idx];
+    if(!slot.has(peer)) continue;
+    slot.remove(peer);
+    if(slot.empty()) m_contains--;
+    result++;
+  }
+  return result;
+}
+
+
+// copy contents of the page.
+template<int N> void SparsePage<N>::copy(const SparsePage& src)
+{
+  m_magic = src.m_magic;
+  m_contains = src.m_contains;
+  m_capacity = src.m_capacity;
+  m_entries = src.m_entries;
+  memcpy(m_offsets, src.m_offsets, sizeof(m_offsets[0])*m_entries);
+  memcpy((void*)m_slots, (const void*)src.m_slots, sizeof(m_slots[0])*m_entries);
+}
+
+
+// copy entries which have peers of the dense page.
+template<int N> bool SparsePage<N>::assign(const CachePage<N>& src)
+{
+  CachePage<N>& page = (CachePage<N>&)src;
+  if(page.m_contains_r()>CAPACITY) return false;
+
+  init(page.m_magic_r().content_id, page.m_magic_r().type);
+  for(size_t ofs=0; ofs<CACHEPAGE_SIZE; ofs++) {
+    if(page.slot_at(ofs).empty()) continue;
+    m_offsets[m_entries] = ofs;
+    m_slots[m_entries] = page.slot_at(ofs);
+    m_entries++;
+  }
+  m_contains = m_entries;
+  return true;
+}
+
+
+template class PageSlot<2>;
+template class PageSlot<3>;
+template class PageSlot<4>;
+template class PageSlot<5>;
+template class PageSlot<6>;
+template class PageSlot<7>;
+template class PageSlot<8>;
+template class CachePage<2>;
+template class CachePage<3>;
+template class CachePage<4>;
+template class CachePage<5>;
+template class CachePage<6>;
+template class CachePage<7>;
+template class CachePage<8>;
+template class SparsePage<2>;
+template class SparsePage<3>;
+template class SparsePage<4>;
+template class SparsePage<5>;
+template class SparsePage<6>;
+template class SparsePage<7>;
+template class SparsePage<8>;
+
+
+
+//
+// class FrequencySketch
+//
+FrequencySketch::FrequencySketch(size_t width)
+{
+  m_width = 8;
+  while(m_width < width) m_width <<= 1;
+  m_sample = (uint64_t)m_width * 10;
+  m_counters = (uint8_t*)ruby_xmalloc(DEPTH * m_width);
+  clear();
+}
+
+FrequencySketch::~FrequencySketch()
+{
+  try {
+    ruby_xfree((void*)m_counters);
+  }
+  catch(...) {}
+}
+
+
+void FrequencySketch::clear()
+{
+  memset(m_counters, 0, DEPTH * m_width);
+  m_additions = 0;
+}
+
+
+// conservative update, only the least counters are incremented.
+void FrequencySketch::increment(uint64_t hash)
+{
+  uint8_t least = estimate(hash);
+  if(least==0xff) return;
+  for(size_t row=0; row<DEPTH; row++) {
+    uint8_t& c = m_counters[index(hash, row)];
+    if(c==least) c++;
+  }
+  if(++m_additions >= m_sample) age();
+}
+
+
+uint8_t FrequencySketch::estimate(uint64_t hash) const
+{
+  uint8_t result = 0xff;
+  for(size_t row=0; row<DEPTH; row++) {
+    uint8_t c = m_counters[index(hash, row)];
+    if(c < result) result = c;
+  }
+  return result;
+}
+
+
+// halve all counters, 8 at once.
+void FrequencySketch::age()
+{
+  uint64_t* words = (uint64_t*)m_counters;
+  for(size_t i=0; i<DEPTH * m_width / 8; i++) {
+    words[i] = (words[i] >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+  }
+  m_additions /= 2;
+}
+
+
 
 //
 // class CachePagePool
 //
-CachePagePool::CachePagePool(size_t pages)
+CachePagePool::CachePagePool(size_t pages, size_t page_bytes, int flags, size_t units)
 {
+  if(units<1) units = 1;
+  if(units>64) units = 64;
   m_pages = pages;
+  m_units = units;
+  m_unit_bytes = page_bytes / units;
+  m_page_bytes = m_unit_bytes * units;
+  m_flags = flags;
+  m_used = 0;
+  m_active = 0;
+  m_sparse = 0;
+  m_evicted = 0;
+  m_protected = 0;
+  m_rejected = 0;
+  m_arena = NULL;
+  m_arena_size = 0;
+  m_arena_pages = ARENA_NORMAL_PAGES;
+  m_chunks = NULL;
+  m_marks = NULL;
+  m_sketch = NULL;
+  m_head = m_tail = m_middle = m_free = m_partial = PAGEH_NONE;
+  m_unused = 0;
+  m_listener = NULL;
 }
 
 CachePagePool::~CachePagePool()
 {
-  for(CachePagePointerList::iterator it = m_alloc_pages.begin(); it != m_alloc_pages.end(); it++) {
-    if (*it) ruby_xfree((void*)(*it));
-  }
-  for(CachePagePointerVector::iterator it = m_free_pages.begin(); it != m_free_pages.end(); it++) {
-    if (*it) ruby_xfree((void*)(*it));
+  if(m_arena) munmap((void*)m_arena, m_arena_size);
+  if(m_chunks) ruby_xfree((void*)m_chunks);
+  if(m_marks) ruby_xfree((void*)m_marks);
+  if(m_sketch) {
+    m_sketch->~FrequencySketch();
+    ruby_xfree((void*)m_sketch);
   }
 }
 
 void CachePagePool::init()
 {
-  // init free list
-  m_free_pages.reserve(m_pages);
-  for(size_t idx=0; idx<m_pages; idx++) {
-    CachePage* p = (CachePage*)ruby_xmalloc(sizeof(CachePage));
-    new( (void*)p ) CachePage;
-    m_free_pages.push_back(p);
+  if(m_pages * m_units >= PAGEH_NONE) rb_raise(rb_eArgError, "Too many cache pages.");
+
+  // map arena.
+  size_t bytes = m_page_bytes * m_pages;
+  int populate = 0;
+#ifdef MAP_POPULATE
+  if(m_flags & POOL_PREFAULT) populate = MAP_POPULATE;
+#endif
+  void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if(m_flags & POOL_HUGEPAGES) {
+    m_arena_size = (bytes + CACHEPOOL_HUGEPAGE_SIZE-1) & (~(CACHEPOOL_HUGEPAGE_SIZE-1));
+    p = mmap(NULL, m_arena_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|populate, -1, 0);
+    if(p!=MAP_FAILED) m_arena_pages = ARENA_HUGETLB_PAGES;
+  }
+#endif
+  if(p==MAP_FAILED) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    m_arena_size = (bytes + pagesize-1) & (~(pagesize-1));
+    p = mmap(NULL, m_arena_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|populate, -1, 0);
+    if(p==MAP_FAILED) {
+      m_arena_size = 0;
+      rb_memerror();
+    }
+#ifdef MADV_HUGEPAGE
+    if((m_flags & POOL_HUGEPAGES) && (madvise(p, m_arena_size, MADV_HUGEPAGE)==0)) {
+      m_arena_pages = ARENA_TRANSPARENT_HUGEPAGES;
+    }
+#endif
   }
+  m_arena = (char*)p;
+  m_chunks = (Chunk*)ruby_xmalloc(sizeof(Chunk) * (m_pages>0 ? m_pages : 1));
+  m_marks = (uint8_t*)ruby_xmalloc(m_pages>0 ? m_pages * m_units : 1);
+  memset(m_marks, 0, m_pages * m_units);
+  if(m_flags & POOL_ADMISSION) {
+    m_sketch = (FrequencySketch*)ruby_xmalloc(sizeof(FrequencySketch));
+    new( (void*)m_sketch ) FrequencySketch((m_pages * m_units > 64) ? m_pages * m_units : 64);
+  }
+
+  // pages are taken lazily at alloc(), free-list is empty.
+  m_free = m_partial = PAGEH_NONE;
+  m_unused = 0;
 }
 
 
-// alloc page.
-CachePage* CachePagePool::alloc()
+// alloc dense page.
+CachePageBase* CachePagePool::alloc()
 {
-  if(m_free_pages.empty()) {
-    // drop page, forcely.
-    m_free_pages.push_back(m_alloc_pages.back());
-    m_alloc_pages.pop_back();
+  PAGEH c;
+  while((c = take())==PAGEH_NONE) {
+    // evict the tail page, and the others in the same page.
+    PAGEH t = victim() / m_units;
+    for(size_t u=0; u<m_units; u++) {
+      if(m_chunks[t].used & (1ULL << u)) evict(at(t * m_units + u));
+    }
   }
 
-  // get page from free-list.
-  CachePage* result = m_free_pages.back();
-  m_free_pages.pop_back();
-  m_alloc_pages.push_front(result);
+  m_chunks[c].used = 1;
+  m_chunks[c].split = false;
+  CachePageBase* result = at(c * m_units);
+  link_new(result);
+
+  return result;
+}
+
+
+// alloc a unit for a sparse page.
+CachePageBase* CachePagePool::alloc_unit()
+{
+  while(m_partial==PAGEH_NONE) {
+    PAGEH c = take();
+    if(c!=PAGEH_NONE) {
+      m_chunks[c].used = 0;
+      m_chunks[c].split = true;
+      link_partial(c);
+      break;
+    }
+    evict(at(victim()));
+  }
+
+  // the lowest free unit of the page.
+  PAGEH c = m_partial;
+  Chunk& k = m_chunks[c];
+  size_t u = 0;
+  while(k.used & (1ULL << u)) u++;
+  k.used |= (1ULL << u);
+  if(k.used==full_mask()) unlink_partial(c);
+
+  CachePageBase* result = at(c * m_units + u);
+  link_new(result);
+  m_sparse++;
 
   return result;
 }
 
 
 // drop page.
-void CachePagePool::drop(CachePage*& page)
+void CachePagePool::drop(CachePageBase* page)
+{
+  unlink(page);
+  release(page);
+}
+
+
+// the page is found, by the replacement policy.
+void CachePagePool::touch(CachePageBase* page)
+{
+  PAGEH h = handle(page);
+  if(m_sketch) m_sketch->increment(page->m_magic.hash());
+
+  switch(replacement()) {
+  case REPLACE_CLOCK:
+    m_marks[h] |= MARK_REFERENCED;
+    break;
+
+  case REPLACE_SLRU:
+    // the page leaves probationary.
+    if(h==m_middle) m_middle = page->m_next;
+    if(h!=m_head) {
+      unlink(page);
+      link(page);
+    }
+    if(!(m_marks[h] & MARK_PROTECTED)) {
+      m_marks[h] |= MARK_PROTECTED;
+      m_protected++;
+    }
+    // push back the last protected pages to probationary.
+    while(m_protected > m_active*4/5) {
+      PAGEH last = (m_middle!=PAGEH_NONE) ? at(m_middle)->m_prev : m_tail;
+      if(last==PAGEH_NONE) break;
+      m_marks[last] &= ~MARK_PROTECTED;
+      m_protected--;
+      m_middle = last;
+    }
+    break;
+
+  default:
+    if(h==m_head) return;
+    unlink(page);
+    link(page);
+    break;
+  }
+}
+
+
+// entries of the page are changed, as found by LRU.
+// CLOCK and SLRU ignore it, so that inserts never keep pages.
+void CachePagePool::update(CachePageBase* page)
+{
+  if(replacement()!=REPLACE_LRU || handle(page)==m_head) return;
+  unlink(page);
+  link(page);
+}
+
+
+// the page of the key is not found, counted for admit().
+void CachePagePool::missed(const ContentIdWithType& key)
+{
+  if(m_sketch) m_sketch->increment(key.hash());
+}
+
+
+// whether a new page of the key may replace the tail page, by TinyLFU.
+// true without POOL_ADMISSION or while the arena has room for it.
+bool CachePagePool::admit(const ContentIdWithType& key, bool dense)
+{
+  if(!m_sketch || m_tail==PAGEH_NONE) return true;
+  if(m_free!=PAGEH_NONE || m_unused<m_pages) return true;
+  if(!dense && m_partial!=PAGEH_NONE) return true;
+
+  CachePageBase* v = at(victim());
+  if(m_sketch->estimate(key.hash()) > m_sketch->estimate(v->m_magic.hash())) return true;
+  m_rejected++;
+  return false;
+}
+
+
+// map pages of a file to the head of the arena, copy-on-write.
+bool CachePagePool::map(int fd, off_t offset, size_t pages)
+{
+  if(m_unused!=0 || pages>m_pages) return false;
+  if(m_arena_pages==ARENA_HUGETLB_PAGES) return false; // can't map a file over hugetlb.
+
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  if(offset & (pagesize-1)) return false;
+  size_t bytes = (m_page_bytes*pages + pagesize-1) & (~(pagesize-1));
+  if(bytes==0) return true;
+  if(bytes>m_arena_size) return false;
+
+  void* p = mmap((void*)m_arena, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, offset);
+  return (p==(void*)m_arena);
+}
+
+
+// mark pages in the first pages of the arena as allocated, in LRU order.
+// false if they are inconsistent, and the pool is left empty.
+bool CachePagePool::restore(size_t pages, const PAGEH* lru, size_t count)
+{
+  if(m_unused!=0 || pages>m_pages) return false;
+
+  for(size_t c=0; c<pages; c++) {
+    m_chunks[c].used = 0;
+    m_chunks[c].split = false;
+  }
+  bool ok = true;
+  size_t sparse = 0;
+  for(size_t i=0; ok && i<count; i++) {
+    PAGEH h = lru[i];
+    if(h >= pages * m_units) { ok = false; break; }
+    Chunk& k = m_chunks[h / m_units];
+    uint64_t bit = 1ULL << (h % m_units);
+    if(at(h)->is_sparse()) {
+      ok = (m_units>1) && (k.split || !k.used) && !(k.used & bit);
+      k.split = true;
+      k.used |= bit;
+      sparse++;
+    } else {
+      ok = ((h % m_units)==0) && !k.used;
+      k.used = 1;
+    }
+  }
+  if(!ok) return false;
+
+  // LRU.
+  for(size_t i=0; i<count; i++) {
+    CachePageBase* page = at(lru[i]);
+    page->m_prev = (i==0) ? PAGEH_NONE : lru[i-1];
+    page->m_next = (i+1==count) ? PAGEH_NONE : lru[i+1];
+  }
+  m_head = (count>0) ? lru[0] : PAGEH_NONE;
+  m_tail = (count>0) ? lru[count-1] : PAGEH_NONE;
+  m_active = count;
+  m_sparse = sparse;
+
+  // all pages are unmarked and probationary.
+  memset(m_marks, 0, m_pages * m_units);
+  m_protected = 0;
+  m_middle = (replacement()==REPLACE_SLRU) ? m_head : PAGEH_NONE;
+
+  // free pages and units.
+  m_free = m_partial = PAGEH_NONE;
+  m_used = pages;
+  m_unused = pages;
+  for(size_t c=pages; c>0; c--) {
+    Chunk& k = m_chunks[c-1];
+    if(!k.used) {
+      k.split = false;
+      k.next = m_free;
+      m_free = c-1;
+      m_used--;
+    } else if(k.split && (k.used!=full_mask())) {
+      link_partial(c-1);
+    }
+  }
+  return true;
+}
+
+
+// take a free page of the arena, PAGEH_NONE if all are used.
+PAGEH CachePagePool::take()
+{
+  PAGEH c = PAGEH_NONE;
+  if(m_free!=PAGEH_NONE) {
+    c = m_free;
+    m_free = m_chunks[c].next;
+  } else if(m_unused<m_pages) {
+    c = m_unused++;
+  } else {
+    return PAGEH_NONE;
+  }
+  m_used++;
+  return c;
+}
+
+
+// drop page forcely.
+void CachePagePool::evict(CachePageBase* page)
+{
+  unlink(page);
+  m_evicted++;
+  if(m_listener) m_listener->evicted(page);
+  release(page);
+}
+
+
+// return the unit, or the page of the arena.
+void CachePagePool::release(CachePageBase* page)
+{
+  PAGEH h = handle(page);
+  PAGEH c = h / m_units;
+  Chunk& k = m_chunks[c];
+
+  if(k.split) {
+    m_sparse--;
+    bool was_full = (k.used==full_mask());
+    k.used &= ~(1ULL << (h % m_units));
+    if(k.used) {
+      if(was_full) link_partial(c);
+      return;
+    }
+    if(!was_full) unlink_partial(c);
+    k.split = false;
+  }
+  k.used = 0;
+  k.next = m_free;
+  m_free = c;
+  m_used--;
+}
+
+
+void CachePagePool::link_partial(PAGEH c)
+{
+  m_chunks[c].prev = PAGEH_NONE;
+  m_chunks[c].next = m_partial;
+  if(m_partial!=PAGEH_NONE) m_chunks[m_partial].prev = c;
+  m_partial = c;
+}
+
+
+void CachePagePool::unlink_partial(PAGEH c)
+{
+  Chunk& k = m_chunks[c];
+  if(k.prev!=PAGEH_NONE) m_chunks[k.prev].next = k.next;
+  else m_partial = k.next;
+  if(k.next!=PAGEH_NONE) m_chunks[k.next].prev = k.prev;
+  k.prev = k.next = PAGEH_NONE;
+}
+
+
+// the page to be replaced next. By CLOCK, marked pages at the tail are
+// moved to the head unmarked, at most once for each page.
+PAGEH CachePagePool::victim()
+{
+  if(replacement()==REPLACE_CLOCK) {
+    for(size_t n=m_active; n>0 && (m_marks[m_tail] & MARK_REFERENCED); n--) {
+      CachePageBase* page = tail();
+      unlink(page);
+      link(page);
+    }
+  }
+  return m_tail;
+}
+
+
+// link page to the head of the list.
+void CachePagePool::link(CachePageBase* page)
+{
+  link_before(page, m_head);
+}
+
+
+// link a new page, to the head of probationary by SLRU.
+void CachePagePool::link_new(CachePageBase* page)
+{
+  if(replacement()!=REPLACE_SLRU) {
+    link(page);
+    return;
+  }
+  link_before(page, m_middle);
+  m_middle = handle(page);
+}
+
+
+// link page before next, or to the tail if next is PAGEH_NONE.
+void CachePagePool::link_before(CachePageBase* page, PAGEH next)
+{
+  PAGEH h = handle(page);
+  page->m_next = next;
+  page->m_prev = (next!=PAGEH_NONE) ? at(next)->m_prev : m_tail;
+  if(page->m_prev!=PAGEH_NONE) at(page->m_prev)->m_next = h;
+  else m_head = h;
+  if(next!=PAGEH_NONE) at(next)->m_prev = h;
+  else m_tail = h;
+  m_active++;
+}
+
+
+// unlink page from the list, and clear its marks.
+void CachePagePool::unlink(CachePageBase* page)
 {
-  m_alloc_pages.remove(page);
-  m_free_pages.push_back(page);
+  PAGEH h = handle(page);
+  if(h==m_middle) m_middle = page->m_next;
+  if(m_marks[h] & MARK_PROTECTED) m_protected--;
+  m_marks[h] = 0;
+
+  if(page->m_prev!=PAGEH_NONE) at(page->m_prev)->m_next = page->m_next;
+  else m_head = page->m_next;
+  if(page->m_next!=PAGEH_NONE) at(page->m_next)->m_prev = page->m_prev;
+  else m_tail = page->m_prev;
+  page->m_prev = page->m_next = PAGEH_NONE;
+  m_active--;
 }
 
 
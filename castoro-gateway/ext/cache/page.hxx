@@ -28,80 +28,417 @@
 namespace Castoro {
 namespace Gateway {
 
-  // { peer code }[3] array.
-  class ID3 {
+  // supported counts of peer slots, a slot for each replica of a content.
+  #define PEER_SLOTS_MIN      (2)
+  #define PEER_SLOTS_MAX      (8)
+  #define PEER_SLOTS_DEFAULT  (3)
+
+
+  // { revision } hash kept in cache pages.
+#if CACHEPAGE_REVISION_BITS == 32
+  typedef uint32_t  REVH;
+#elif CACHEPAGE_REVISION_BITS == 16
+  typedef uint16_t  REVH;
+#elif CACHEPAGE_REVISION_BITS == 8
+  typedef uint8_t   REVH;
+#else
+# error "CACHEPAGE_REVISION_BITS must be 8, 16 or 32."
+#endif
+
+  // { revision } <=> REVH.
+  //
+  // Unless REVH has 32 bits, the most significant bit marks revisions
+  // which don't fit in the rest of bits. They are kept but never found,
+  // so that revision 1 and 257 are never confused as a false hit.
+  class RevisionHash {
   public:
-    inline ID3() { clear(); };
-    inline ~ID3() {}; // NOT virtual.
+    static inline REVH from(uint32_t revision) {
+      if(sizeof(REVH)>=sizeof(uint32_t)) return (REVH)revision;
+      return (revision>MASK) ? (REVH)((revision & MASK) | OVERFLOWED) : (REVH)revision;
+    };
+    static inline bool is_exact(REVH h) {
+      return (sizeof(REVH)>=sizeof(uint32_t)) || !(h & OVERFLOWED);
+    };
+    static inline uint32_t to_revision(REVH h) {  // of an exact one.
+      if(sizeof(REVH)>=sizeof(uint32_t)) return h;
+      return h & MASK;
+    };
+
+  private:
+    static const uint32_t OVERFLOWED = (uint32_t)1 << (sizeof(REVH)*8-1);
+    static const uint32_t MASK = OVERFLOWED-1;
+  };
+
+
+  // marks a slot whose peers are all removed, in the last peer.
+  #define PEERH_REMOVED  ((Castoro::Gateway::PEERH)-1)
+
+
+  // { revision, peer code[N] } packed slot of a content.
+  //
+  // Peers and revision of a content are kept in one record of BYTES
+  // without padding, so that a page grows by only the peer code with N
+  // and a lookup reads a single cache line unless the slot straddles one.
+  // A slot whose peers are all removed keeps its revision, and is marked
+  // by PEERH_REMOVED in the last peer, which is unused while the first
+  // one is empty.
+  // Peers are packed from the first one. When all of them are used, the
+  // earliest appended peer is pushed out, so that the N most recent
+  // replicas are kept.
+  template<int N> class PageSlot {
+  public:
+    enum {
+      BYTES = sizeof(PEERH)*N + sizeof(REVH)
+    };
+
+    inline PageSlot() { clear(); };
+    inline ~PageSlot() {}; // NOT virtual.
     void append(PEERH id);
     void remove(PEERH id);
-    inline void clear() { memset(array, 0, sizeof(array)); };
-    bool empty() const;
-    inline bool removed() { return !!(array[0] & 0x8000); }
-    void pushall(ArrayOfId& dest) const;
-    inline PEERH at(int idx) const { return array[idx] & 0x7FFF; };
+    inline void clear() {
+      for(int idx=0; idx<N; idx++) m_peers[idx] = 0;
+      m_revision = 0;
+    };
+    inline bool empty() const { return (m_peers[0]==0); };
+    inline bool removed() const { return (m_peers[0]==0) && (m_peers[N-1]==PEERH_REMOVED); };
+    inline bool has(PEERH id) const {
+      for(int idx=0; idx<N && m_peers[idx]!=0; idx++) if(m_peers[idx]==id) return true;
+      return false;
+    };
+    template<class A> inline void pushall(A& dest) const {
+      for(int idx=0; idx<N && m_peers[idx]!=0; idx++) dest.push_back(m_peers[idx]);
+    };
+    inline PEERH at(int idx) const { return m_peers[idx]; };  // PEERH_REMOVED at the last if removed().
     inline void at(int idx, PEERH value) {
-      array[idx] = (value & 0x7FFF);
-      array[0] &= 0x7FFF;
+      if(removed()) m_peers[N-1] = 0;
+      m_peers[idx] = value;
     };
+    inline REVH revision() const { return m_revision; };
+    inline void revision(REVH value) { m_revision = value; };
 
   private:
-    PEERH array[3];
-    inline void set_removed() { array[0] |= 0x8000; };
-  };
+    PEERH     m_peers[N];
+    REVH      m_revision;
+  } __attribute__((packed));
+
+
+  typedef FixedArray<PEERH, PEER_SLOTS_MAX> PeerSlotArray;
+
 
+  // { cache page } handle, index of CachePagePool's arena.
+  typedef uint32_t  PAGEH;
+  #define PAGEH_NONE  ((Castoro::Gateway::PAGEH)-1)
 
-  // { content_id, type, revision } <=> { peer code } cache page.
-  class CachePage {
+
+  // { content_id, type } part of a cache page, independent of peer slots.
+  // CachePagePool, CachePageIndex and snapshots handle pages by this.
+  //
+  // A page is dense, CachePage<N> which has all of CACHEPAGE_SIZE entries,
+  // or sparse, SparsePage<N> which has a few entries in a unit of a page.
+  class CachePageBase {
+    friend class CachePagePool;
   public:
-    inline CachePage() {};
-    inline virtual ~CachePage() {};
+    inline CachePageBase() { m_prev = m_next = PAGEH_NONE; };
+    inline ~CachePageBase() {}; // NOT virtual.
 
-    void init(uint64_t content_id, uint32_t type);
-    bool insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
-    bool find(uint64_t content_id, uint32_t type, uint32_t revision, ArrayOfId& result, bool& removed);
-    bool remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
+    static size_t size_of(size_t slots);  // bytes of a dense page of slots, 0 if not supported.
+    static size_t sparse_entries(size_t slots);  // entries of a sparse page of slots.
+
+    inline bool is_sparse() const { return m_capacity < CACHEPAGE_SIZE; };
 
     attr_reader(ContentIdWithType, m_magic);
     attr_reader(uint16_t, m_contains);
-    attr_reader(uint8_t*, m_revision_hash);
-    attr_reader(ID3*, m_peers);
+    attr_reader(uint16_t, m_capacity);
 
-  private:
+  protected:
+    PAGEH     m_prev;     // LRU link to more recently used page.
+    PAGEH     m_next;     // LRU link to less recently used page.
     ContentIdWithType m_magic;
-    uint16_t  m_contains;
-    uint8_t   m_revision_hash[CACHEPAGE_SIZE];
-    ID3       m_peers[CACHEPAGE_SIZE];
+    uint16_t  m_contains; // entries which have peers.
+    uint16_t  m_capacity; // entries the page can have.
+    uint32_t  m_reserved; // fills the tail, slots of a page start 16 bytes aligned.
+    inline void init_magic(uint64_t content_id, uint32_t type, uint16_t capacity) {
+      m_magic.content_id = content_id & (~(CACHEPAGE_SIZE-1));
+      m_magic.type = type;
+      m_contains = 0;
+      m_capacity = capacity;
+      m_reserved = 0;
+    };
     inline bool validate(uint64_t content_id, uint32_t type) const {
       uint64_t ch = content_id & (~(CACHEPAGE_SIZE-1));
       return ((ch==m_magic.content_id) && (type==m_magic.type));
     };
   };
-  typedef std::map<ContentIdWithType, CachePage*, std::less<ContentIdWithType>, RbAllocator<std::pair<const ContentIdWithType, CachePage*> > > CachePageMap;
+
+
+  // bytes of pages of N peer slots.
+  //
+  // A dense page is CACHEPAGE_UNITS units, and a sparse page is a unit,
+  // so that both are carved from the same arena. Units are 16 bytes
+  // aligned, and slots follow the header of a page, so that slots of
+  // 2^n bytes never cross a cache line.
+  template<int N> class PageLayout {
+  public:
+    enum {
+      SLOT_BYTES    = PageSlot<N>::BYTES,
+      UNIT_BYTES    = (((sizeof(CachePageBase) + CACHEPAGE_SIZE*SLOT_BYTES + CACHEPAGE_UNITS-1) / CACHEPAGE_UNITS) + 15) & ~15,
+      PAGE_BYTES    = UNIT_BYTES * CACHEPAGE_UNITS,
+      // the rest of the header, and paddings of arrays.
+      SPARSE_ENTRIES = (UNIT_BYTES - sizeof(CachePageBase) - 16) / (sizeof(uint16_t) + SLOT_BYTES)
+    };
+  };
+
+
+  template<int N> class SparsePage;
+
+
+  // { content_id, type, revision } <=> { peer code }[N] dense cache page.
+  template<int N> class CachePage :public CachePageBase {
+  public:
+    typedef PageSlot<N> Slot;
+
+    inline CachePage() {};
+    inline ~CachePage() {}; // NOT virtual.
+
+    void init(uint64_t content_id, uint32_t type);
+    bool insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
+    bool find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed) const;
+    bool remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
+    size_t purge(PEERH peer);  // removes the peer from all entries, returns the entries.
+    void copy(const CachePage& src);  // contents only, not LRU links.
+    void assign(const SparsePage<N>& src);  // promote.
+
+    inline const Slot& slot_at(size_t offset) const { return m_slots[offset]; };
+
+  private:
+    Slot      m_slots[CACHEPAGE_SIZE];
+  };
+
+
+  // { content_id, type, revision } <=> { peer code }[N] sparse cache page.
+  //
+  // Entries are kept in order of offset, and looked up by binary search.
+  // An entry whose peers are all removed is kept as 'removed' until the
+  // page is full, then it is reclaimed before the page is promoted.
+  template<int N> class SparsePage :public CachePageBase {
+  public:
+    typedef PageSlot<N> Slot;
+    enum { CAPACITY = PageLayout<N>::SPARSE_ENTRIES };
+
+    inline SparsePage() {};
+    inline ~SparsePage() {}; // NOT virtual.
+
+    void init(uint64_t content_id, uint32_t type);
+    bool insert(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer); // false if full.
+    bool find(uint64_t content_id, uint32_t type, uint32_t revision, PeerSlotArray& result, bool& removed) const;
+    bool remove(uint64_t content_id, uint32_t type, uint32_t revision, PEERH peer);
+    size_t purge(PEERH peer);  // removes the peer from all entries, returns the entries.
+    void copy(const SparsePage& src);  // contents only, not LRU links.
+    bool assign(const CachePage<N>& src);  // demote, false if entries don't fit.
+    inline bool full() const { return m_entries>=CAPACITY; };
+
+    attr_reader(uint16_t, m_entries);
+    inline uint16_t offset_at(size_t idx) const { return m_offsets[idx]; };
+    inline const Slot& slot_at(size_t idx) const { return m_slots[idx]; };
+
+  private:
+    Slot      m_slots[CAPACITY];
+    uint16_t  m_entries;
+    uint16_t  m_offsets[CAPACITY];
+
+    size_t lookup(uint16_t offset) const; // position of offset, or to insert it.
+    void reclaim();
+  };
+
+
+  // notified of pages which are dropped forcely by CachePagePool.
+  class CachePageListenerAbstract {
+  public:
+    inline CachePageListenerAbstract() {};
+    virtual inline ~CachePageListenerAbstract() {};
+    virtual void evicted(CachePageBase* page) = 0;
+  };
+
+
+  // approximate access counts of pages, for TinyLFU admission.
+  //
+  // A count-min sketch of DEPTH rows of 8 bits counters, only the least
+  // counters of a key are incremented. All counters are halved after
+  // width*10 increments, so that counts of old accesses fade away.
+  class FrequencySketch {
+  public:
+    enum { DEPTH = 4 };
+
+    FrequencySketch(size_t width);  // counters of a row, rounded up to 2^n.
+    virtual ~FrequencySketch();
+
+    void increment(uint64_t hash);
+    uint8_t estimate(uint64_t hash) const;
+    void clear();
+
+    attr_reader(size_t, m_width);
+    attr_reader(uint64_t, m_additions);
+
+  private:
+    uint8_t*  m_counters; // DEPTH rows of m_width.
+    size_t    m_width;    // Must be 2^n, >= 8.
+    uint64_t  m_additions;
+    uint64_t  m_sample;   // additions to age.
+
+    inline size_t index(uint64_t hash, size_t row) const {
+      return row * m_width + (size_t)((hash + row * ((hash >> 32) | 1)) & (m_width-1));
+    };
+    void age();
+  };
 
 
   // cache page pool.
+  //
+  // All pages are carved from one anonymous mmap(2) arena, and are
+  // refered by PAGEH, the index of a unit of the arena. Each page of the
+  // arena is a dense page, or is divided into 'units' sparse pages.
+  // Allocated pages are linked in a list through CachePageBase, so that
+  // drop() and touch() are O(1), and pages are replaced from its tail.
+  // The list is kept by the replacement policy of the flags,
+  //   LRU:   found pages and changed pages are moved to the head.
+  //   CLOCK: found pages are marked, and marked pages at the tail are
+  //          moved to the head unmarked instead of being replaced.
+  //   SLRU:  new pages are linked to the head of the probationary
+  //          segment, the rear of the list. Found pages are moved to
+  //          the head as protected, and the last protected pages are
+  //          pushed back to probationary over 4/5 of pages.
+  // so that pages which are only inserted, such as by a scan of peers,
+  // never push out pages which are found with CLOCK and SLRU.
+  // With POOL_ADMISSION, a new page is allocated on the full arena only
+  // when it is missed or found more often than the page to be replaced.
+  // When the arena is full, the tail page is evicted, with the other
+  // sparse pages of the same page if a dense page is needed. The listener
+  // is notified of each evicted page.
+  // The pool doesn't know peer slots, pages are page_bytes apart.
   class CachePagePool {
   public:
-    CachePagePool(size_t pages);
+    typedef enum {
+      POOL_HUGEPAGES = 1,     // back the arena by huge pages if possible.
+      POOL_PREFAULT  = 2,     // prefault the arena at init().
+      POOL_DENSE     = 4,     // never make sparse pages.
+      POOL_CLOCK     = 8,     // replace pages by CLOCK, instead of LRU.
+      POOL_SLRU      = 16,    // replace pages by segmented LRU, instead of LRU.
+      POOL_ADMISSION = 32     // admit new pages by TinyLFU.
+    } PoolFlags;
+
+    typedef enum {
+      REPLACE_LRU = 0,
+      REPLACE_CLOCK,
+      REPLACE_SLRU
+    } Replacement;
+
+    typedef enum {
+      ARENA_NORMAL_PAGES = 0,
+      ARENA_TRANSPARENT_HUGEPAGES,  // madvise(MADV_HUGEPAGE) was accepted.
+      ARENA_HUGETLB_PAGES           // mapped with MAP_HUGETLB.
+    } ArenaPages;
+
+    CachePagePool(size_t pages, size_t page_bytes, int flags = 0, size_t units = 1);
     virtual ~CachePagePool();
 
     void init();
+    inline void listen(CachePageListenerAbstract* listener) { m_listener = listener; };
 
-    CachePage* alloc();
-    void drop(CachePage*& page);
+    CachePageBase* alloc();         // a dense page.
+    CachePageBase* alloc_unit();    // a unit for a sparse page.
+    void drop(CachePageBase* page);
+    void touch(CachePageBase* page);  // the page is found.
+    void update(CachePageBase* page); // entries of the page are changed.
+    void missed(const ContentIdWithType& key);  // the page is not found.
+    bool admit(const ContentIdWithType& key, bool dense); // before alloc() of a new page.
 
-    attr_reader(size_t, m_pages);
+    // for DatabaseSnapshot, on the pool which is never allocated.
+    bool map(int fd, off_t offset, size_t pages);
+    bool restore(size_t pages, const PAGEH* lru, size_t count);
 
-    typedef std::list<CachePage*, RbAllocator<CachePage*> >   CachePagePointerList;
-    typedef std::vector<CachePage*, RbAllocator<CachePage*> > CachePagePointerVector;
-    attr_reader_ref(CachePagePointerList, m_alloc_pages);
-    attr_reader_ref(CachePagePointerVector, m_free_pages);
+    inline CachePageBase* at(PAGEH h) const {
+      return (h==PAGEH_NONE) ? NULL : (CachePageBase*)(m_arena + (size_t)h * m_unit_bytes);
+    };
+    inline PAGEH handle(const CachePageBase* page) const {
+      return page ? (PAGEH)(((const char*)page - m_arena) / m_unit_bytes) : PAGEH_NONE;
+    };
+    inline CachePageBase* head() const { return at(m_head); };
+    inline CachePageBase* tail() const { return at(m_tail); };
+    inline CachePageBase* middle() const { return at(m_middle); };  // the first probationary page, by SLRU.
+    inline CachePageBase* next(const CachePageBase* page) const { return at(page->m_next); };
+    inline size_t free_pages() const { return m_pages - m_used; };
+    inline size_t units_used() const { return m_unused * m_units; }; // units which may have pages.
+    inline Replacement replacement() const {
+      return (m_flags & POOL_SLRU) ? REPLACE_SLRU : (m_flags & POOL_CLOCK) ? REPLACE_CLOCK : REPLACE_LRU;
+    };
+    inline bool counting() const { return (m_sketch!=NULL); }; // missed() is needed.
+    inline bool is_protected(const CachePageBase* page) const { return !!(m_marks[handle(page)] & MARK_PROTECTED); };
+
+    attr_reader(size_t, m_pages);
+    attr_reader(size_t, m_page_bytes);
+    attr_reader(size_t, m_unit_bytes);
+    attr_reader(size_t, m_units);
+    attr_reader(size_t, m_active);
+    attr_reader(size_t, m_sparse);
+    attr_reader(uint64_t, m_evicted);
+    attr_reader(size_t, m_protected);
+    attr_reader(uint64_t, m_rejected);
+    attr_reader(FrequencySketch*, m_sketch);
+    inline CachePageBase* m_arena_r() { return (CachePageBase*)m_arena; };
+    attr_reader(size_t, m_arena_size);
+    attr_reader(ArenaPages, m_arena_pages);
+    attr_reader(PAGEH, m_unused);
 
   private:
-    size_t      m_pages;
-    CachePagePointerList   m_alloc_pages;
-    CachePagePointerVector m_free_pages;
+    // a page of the arena, a dense page or 'units' sparse pages.
+    class Chunk {
+    public:
+      uint64_t  used;   // bits of used units, 1 for a dense page.
+      PAGEH     prev;   // link of m_partial.
+      PAGEH     next;   // link of m_partial or m_free.
+      bool      split;  // divided into sparse pages.
+    };
+    enum {
+      MARK_REFERENCED = 1,  // found since it came to the tail, by CLOCK.
+      MARK_PROTECTED = 2    // in the protected segment, by SLRU.
+    };
+
+    size_t      m_pages;      // pages of the arena.
+    size_t      m_page_bytes; // bytes of a page, m_units * m_unit_bytes.
+    size_t      m_unit_bytes;
+    size_t      m_units;      // units of a page.
+    int         m_flags;
+    size_t      m_used;       // count of pages which have dense or sparse pages.
+    size_t      m_active;     // count of allocated dense and sparse pages.
+    size_t      m_sparse;     // count of allocated sparse pages.
+    uint64_t    m_evicted;    // count of pages dropped forcely.
+    size_t      m_protected;  // count of pages in the protected segment.
+    uint64_t    m_rejected;   // count of new pages not admitted.
+    char*       m_arena;      // mmap(2)ed pages.
+    size_t      m_arena_size; // mmap(2)ed bytes.
+    ArenaPages  m_arena_pages;
+    Chunk*      m_chunks;
+    uint8_t*    m_marks;      // MARK_* of each unit.
+    FrequencySketch* m_sketch; // NULL unless POOL_ADMISSION.
+    PAGEH       m_head;       // most recently used page.
+    PAGEH       m_tail;       // page to be replaced next.
+    PAGEH       m_middle;     // the first probationary page, by SLRU.
+    PAGEH       m_free;       // free pages of the arena.
+    PAGEH       m_partial;    // divided pages which have free units.
+    PAGEH       m_unused;     // pages of the arena at and after this are never used.
+    CachePageListenerAbstract* m_listener;
+
+    inline uint64_t full_mask() const { return (m_units>=64) ? ~0ULL : ((1ULL << m_units) - 1); };
+    PAGEH take();
+    void evict(CachePageBase* page);
+    void release(CachePageBase* page);
+    void link_partial(PAGEH c);
+    void unlink_partial(PAGEH c);
+    PAGEH victim();
+    void link(CachePageBase* page);
+    void link_new(CachePageBase* page);
+    void link_before(CachePageBase* page, PAGEH next);
+    void unlink(CachePageBase* page);
   };
 
 
@@ -0,0 +1,447 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include "snapshot.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+static const char SNAPSHOT_MAGIC[8] = { 'C', 'S', 'T', 'R', 'S', 'N', 'A', 'P' };
+
+
+// 64bit checksum by words, all sections are aligned by 8 bytes.
+class SnapshotChecksum {
+public:
+  inline SnapshotChecksum() { m_sum = 0xcbf29ce484222325ULL; };
+  inline ~SnapshotChecksum() {}; // NOT virtual.
+  inline void update(const void* p, size_t bytes) {
+    const uint64_t* w = (const uint64_t*)p;
+    for(size_t i=0; i<bytes/8; i++) {
+      m_sum = (m_sum ^ w[i]) * 0x100000001b3ULL;
+      m_sum ^= m_sum >> 32;
+    }
+  };
+  attr_reader(uint64_t, m_sum);
+
+private:
+  uint64_t m_sum;
+};
+
+
+// sequential writer with checksum.
+class SnapshotWriter {
+public:
+  inline SnapshotWriter(int fd, off_t offset) { m_fd = fd; m_offset = offset; };
+  inline ~SnapshotWriter() {}; // NOT virtual.
+
+  bool write(const void* p, size_t bytes) {
+    m_checksum.update(p, bytes);
+    const char* c = (const char*)p;
+    while(bytes>0) {
+      ssize_t n = pwrite(m_fd, c, bytes, m_offset);
+      if(n<0) {
+        if(errno==EINTR) continue;
+        return false;
+      }
+      c += n; bytes -= n; m_offset += n;
+    }
+    return true;
+  };
+  bool pad(size_t align) {
+    static const char zero[64] = { 0 };
+    while(m_offset & (align-1)) {
+      size_t n = align - (m_offset & (align-1));
+      if(n>sizeof(zero)) n = sizeof(zero);
+      if(!write(zero, n)) return false;
+    }
+    return true;
+  };
+
+  attr_reader(off_t, m_offset);
+  inline uint64_t checksum() { return m_checksum.m_sum_r(); };
+
+private:
+  int     m_fd;
+  off_t   m_offset;
+  SnapshotChecksum m_checksum;
+};
+
+
+// meta section builder and parser.
+class SnapshotMeta {
+public:
+  inline SnapshotMeta() { m_pos = 0; };
+  inline SnapshotMeta(const char* p, size_t bytes) :m_data(p, bytes) { m_pos = 0; };
+  inline ~SnapshotMeta() {}; // NOT virtual.
+
+  inline void put(const void* p, size_t bytes) { m_data.append((const char*)p, bytes); };
+  inline void put(uint32_t v) { put(&v, sizeof(v)); };
+  inline void put(uint64_t v) { put(&v, sizeof(v)); };
+  inline void put(const std::string& s) { put((uint32_t)s.size()); put(s.data(), s.size()); };
+  inline void pad() { while(m_data.size() & 7) m_data.push_back('\0'); };
+
+  inline bool get(void* p, size_t bytes) {
+    if(m_data.size()-m_pos < bytes) return false;
+    memcpy(p, m_data.data()+m_pos, bytes);
+    m_pos += bytes;
+    return true;
+  };
+  inline bool get(uint32_t& v) { return get(&v, sizeof(v)); };
+  inline bool get(uint64_t& v) { return get(&v, sizeof(v)); };
+  inline bool get(std::string& s) {
+    uint32_t len;
+    if(!get(len) || (m_data.size()-m_pos < len)) return false;
+    s.assign(m_data.data()+m_pos, len);
+    m_pos += len;
+    return true;
+  };
+
+  inline const std::string& data() const { return m_data; };
+
+private:
+  std::string m_data;
+  size_t      m_pos;
+};
+
+
+// a saved peer status.
+class SnapshotStatus {
+public:
+  std::string name;
+  ID          peer;
+  PeerStatus  status;
+};
+typedef std::vector<SnapshotStatus> SnapshotStatuses;
+
+
+//
+// class DatabaseSnapshot
+//
+DatabaseSnapshot::DatabaseSnapshot(Database& db) :m_db(db)
+{
+  m_pages = 0;
+  m_mapped = 0;
+}
+
+DatabaseSnapshot::~DatabaseSnapshot()
+{
+}
+
+
+// save into "path.tmp", and rename it to path.
+bool DatabaseSnapshot::save(const char* path, PeerNameAbstract& names)
+{
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  size_t align = (pagesize < sizeof(SnapshotHeader)) ? CACHEPAGE_SIZE : pagesize;
+  std::string tmp = std::string(path) + ".tmp";
+  m_pages = 0;
+
+  int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd<0) return false;
+
+  // pages and LRU, shard by shard. LRU is locked not to be promoted by find().
+  SnapshotWriter w(fd, align);
+  std::vector<uint64_t> offsets, pages, counts;
+  std::vector<PAGEH> lru;
+  bool ok = true;
+  for(size_t si=0; ok && si<m_db.m_shard_count; si++) {
+    DatabaseShard* sh = m_db.m_shards[si];
+    CachePagePool* pool = sh->m_pool_r();
+    offsets.push_back(w.m_offset_r());
+    lru.clear();
+    sh->rdlock();
+    sh->lock_lru();
+    size_t used = pool->m_unused_r();
+    ok = w.write(pool->m_arena_r(), used * pool->m_page_bytes_r());
+    for(CachePageBase* p=pool->head(); ok && p; p=pool->next(p)) {
+      if(sh->is_active(p)) lru.push_back(pool->handle(p));
+    }
+    sh->unlock_lru();
+    sh->unlock();
+    pages.push_back(used);
+    counts.push_back(lru.size());
+    m_pages += lru.size();
+    if(lru.size() & 1) lru.push_back(PAGEH_NONE); // sections are aligned by 8 bytes.
+    if(ok && !lru.empty()) ok = w.write(&lru[0], sizeof(PAGEH) * lru.size());
+    if(ok) ok = w.pad(pagesize);
+  }
+
+  // meta, peers are copied after pages to cover all PEERHs in pages.
+  SnapshotMeta meta;
+  if(ok) {
+    ArrayOfId ids;
+    m_db.known_peers(ids);
+    meta.put((uint32_t)ids.size());
+    for(ArrayOfId::iterator it=ids.begin(); it!=ids.end(); it++) meta.put(names.name(*it));
+
+    PeerStatusMap status = m_db.get_peer_status_map();
+    meta.put((uint32_t)status.size());
+    for(PeerStatusMap::iterator it=status.begin(); it!=status.end(); it++) {
+      meta.put(names.name((*it).first));
+      meta.put((uint64_t)(*it).second.available);
+      meta.put((uint64_t)(*it).second.expire);
+      meta.put((uint32_t)(*it).second.status);
+    }
+
+    for(size_t si=0; si<m_db.m_shard_count; si++) {
+      meta.put(offsets[si]);
+      meta.put(pages[si]);
+      meta.put(counts[si]);
+    }
+    meta.pad();
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  if(ok) {
+    header.meta_offset = w.m_offset_r();
+    ok = w.write(meta.data().data(), meta.data().size());
+  }
+  if(ok) {
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.page_bytes = CachePageBase::size_of(m_db.m_slots);
+    header.page_entries = CACHEPAGE_SIZE;
+    header.shards = m_db.m_shard_count;
+    header.peer_slots = m_db.m_slots;
+    header.revision_bits = CACHEPAGE_REVISION_BITS;
+    header.page_units = m_db.m_shards[0]->m_pool_r()->m_units_r();
+    header.sparse_entries = CachePageBase::sparse_entries(m_db.m_slots);
+    header.align = align;
+    header.meta_bytes = meta.data().size();
+    header.file_bytes = w.m_offset_r();
+    header.checksum = w.checksum();
+    ok = (pwrite(fd, &header, sizeof(header), 0)==(ssize_t)sizeof(header));
+  }
+  if(ok) ok = (fsync(fd)==0);
+
+  int err = errno;
+  close(fd);
+  if(ok) ok = (rename(tmp.c_str(), path)==0);
+  if(!ok) {
+    err = errno;
+    unlink(tmp.c_str());
+    errno = err;
+  }
+  return ok;
+}
+
+
+// a new empty Database for the snapshot, with twice the pages of the
+// file so that load() maps every shard, the arena is not touched until
+// it is loaded. NULL if the file is missing or not a snapshot of this
+// build, destroy it by ~Database() and ruby_xfree().
+Database* DatabaseSnapshot::create(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd<0) return NULL;
+
+  SnapshotHeader header;
+  bool ok = (pread(fd, &header, sizeof(header), 0)==(ssize_t)sizeof(header));
+  close(fd);
+  ok = ok && (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))==0)
+          && (header.version==VERSION)
+          && (header.peer_slots>=PEER_SLOTS_MIN) && (header.peer_slots<=PEER_SLOTS_MAX)
+          && (header.page_bytes==CachePageBase::size_of(header.peer_slots))
+          && (header.shards>=1) && (header.meta_offset>=header.align);
+  if(!ok) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  size_t pages = (header.meta_offset - header.align) / header.page_bytes;
+  int flags = (header.page_units==1) ? CachePagePool::POOL_DENSE : 0;
+  Database* db = (Database*)ruby_xmalloc(sizeof(Database));
+  new( (void*)db ) Database(pages*2 + header.shards, flags, header.shards, header.peer_slots);
+  return db;
+}
+
+
+// load into the empty Database, false if the file is missing or invalid.
+// errno is ENOMEM if pages were dropped because of out of memory.
+bool DatabaseSnapshot::load(const char* path, PeerNameAbstract& names)
+{
+  m_pages = 0;
+  m_mapped = 0;
+
+  // the Database must be empty, PEERHs in pages are restored as they are.
+  if(m_db.m_peerh.m_next_r()!=1) {
+    errno = EBUSY;
+    return false;
+  }
+  for(size_t si=0; si<m_db.m_shard_count; si++) {
+    if(m_db.m_shards[si]->m_pool_r()->m_unused_r()!=0) {
+      errno = EBUSY;
+      return false;
+    }
+  }
+
+  int fd = open(path, O_RDONLY);
+  if(fd<0) return false;
+
+  // check header.
+  size_t page_bytes = CachePageBase::size_of(m_db.m_slots);
+  size_t units = m_db.m_shards[0]->m_pool_r()->m_units_r();
+  SnapshotHeader header;
+  struct stat st;
+  bool ok = (fstat(fd, &st)==0) && (pread(fd, &header, sizeof(header), 0)==(ssize_t)sizeof(header));
+  ok = ok && (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))==0)
+          && (header.version==VERSION)
+          && (header.page_bytes==page_bytes)
+          && (header.page_entries==CACHEPAGE_SIZE)
+          && (header.peer_slots==m_db.m_slots)
+          && (header.revision_bits==CACHEPAGE_REVISION_BITS)
+          && (header.sparse_entries==CachePageBase::sparse_entries(m_db.m_slots))
+          && (header.page_units>=1) && (header.page_units<=CACHEPAGE_UNITS)
+          && (page_bytes % header.page_units==0)
+          && (header.file_bytes==(uint64_t)st.st_size)
+          && (header.align>=sizeof(header)) && ((header.align & 7)==0)
+          && (header.meta_offset>=header.align)
+          && (header.meta_offset+header.meta_bytes==header.file_bytes)
+          && (((header.file_bytes-header.align) & 7)==0);
+  if(!ok) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  // check checksum.
+  void* base = mmap(NULL, header.file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(base==MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return false;
+  }
+  SnapshotChecksum sum;
+  sum.update((const char*)base + header.align, header.file_bytes - header.align);
+  ok = (sum.m_sum_r()==header.checksum);
+
+  // read meta.
+  SnapshotMeta meta((const char*)base + header.meta_offset, header.meta_bytes);
+  std::vector<std::string> peers;
+  SnapshotStatuses statuses;
+  std::vector<uint64_t> offsets, pages, counts;
+  uint32_t count = 0;
+  ok = ok && meta.get(count);
+  for(uint32_t i=0; ok && i<count; i++) {
+    std::string name;
+    ok = meta.get(name);
+    peers.push_back(name);
+  }
+  ok = ok && (count < (PEERH)-1) && meta.get(count);
+  for(uint32_t i=0; ok && i<count; i++) {
+    SnapshotStatus s;
+    uint64_t available, expire;
+    uint32_t status;
+    ok = meta.get(s.name) && meta.get(available) && meta.get(expire) && meta.get(status);
+    s.status = PeerStatus(available, (time_t)expire, (DetailStatus)status);
+    statuses.push_back(s);
+  }
+  for(uint32_t si=0; ok && si<header.shards; si++) {
+    uint64_t o, n, c;
+    ok = meta.get(o) && meta.get(n) && meta.get(c)
+      && (o>=header.align) && ((o & 7)==0) && (o<=header.meta_offset)
+      && (n <= (header.meta_offset-o)/page_bytes)
+      && (c <= (header.meta_offset-o-n*page_bytes)/sizeof(PAGEH));
+    offsets.push_back(o);
+    pages.push_back(n);
+    counts.push_back(c);
+  }
+  if(!ok) {
+    munmap(base, header.file_bytes);
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  // peers, names are resolved without locks.
+  ArrayOfId ids;
+  for(size_t i=0; i<peers.size(); i++) ids.push_back(names.id(peers[i]));
+  for(size_t i=0; i<statuses.size(); i++) statuses[i].peer = names.id(statuses[i].name);
+
+  bool nomem = false;
+  m_db.wrlock();
+  try {
+    for(size_t i=0; ok && i<ids.size(); i++) {
+      ok = (m_db.m_peerh.fromID(ids[i])==(PEERH)(i+1));
+    }
+    for(size_t i=0; ok && i<statuses.size(); i++) {
+      m_db.m_status.set(m_db.m_peerh.fromID(statuses[i].peer), statuses[i].status);
+    }
+  }
+  catch(std::bad_alloc&) {
+    ok = false;
+    nomem = true;
+  }
+  m_db.unlock();
+
+  // pages, mapped if the shards and the units are the same, or copied.
+  bool same = (header.shards==m_db.m_shard_count) && (header.page_units==units);
+  size_t unit_bytes = page_bytes / header.page_units;
+  for(size_t si=0; ok && si<header.shards; si++) {
+    char* src = (char*)base + offsets[si];
+    const PAGEH* lru = (const PAGEH*)(src + pages[si]*page_bytes);
+    if(same) {
+      DatabaseShard* sh = m_db.m_shards[si];
+      sh->wrlock();
+      bool mapped = sh->restore(fd, offsets[si], pages[si], lru, counts[si]);
+      nomem |= sh->nomem();
+      sh->unlock();
+      if(mapped) {
+        m_pages += counts[si];
+        m_mapped += counts[si];
+        continue;
+      }
+    }
+
+    // least recently used first.
+    for(size_t n=counts[si]; n>0; n--) {
+      if(lru[n-1] >= pages[si]*header.page_units) continue;  // broken.
+      CachePageBase& page = *(CachePageBase*)(src + (size_t)lru[n-1]*unit_bytes);
+      if(page.is_sparse() && (header.page_units==1)) continue;  // broken.
+      ContentIdWithType magic = page.m_magic_r();
+      DatabaseShard* sh = m_db.shard(magic.content_id, magic.type);
+      sh->wrlock();
+      sh->restore(page);
+      nomem |= sh->nomem();
+      sh->unlock();
+      m_pages++;
+    }
+  }
+
+  munmap(base, header.file_bytes);
+  close(fd);
+  if(nomem) {
+    errno = ENOMEM;
+    return false;
+  }
+  if(!ok) errno = EINVAL;
+  return ok;
+}
+
+
+}
+}
@@ -0,0 +1,107 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __INCLUDE_GATEWAY_SNAPSHOT_H__
+#define __INCLUDE_GATEWAY_SNAPSHOT_H__
+
+#include <string>
+#include "database.hxx"
+
+
+namespace Castoro {
+namespace Gateway {
+
+  // { peer } <=> { peer name }, peer IDs are not persistent over processes.
+  class PeerNameAbstract {
+  public:
+    inline PeerNameAbstract() {};
+    virtual inline ~PeerNameAbstract() {};
+    virtual std::string name(ID peer) = 0;
+    virtual ID id(const std::string& name) = 0;
+  };
+
+
+  // header of a snapshot file, at the first system page.
+  class SnapshotHeader {
+  public:
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  page_bytes;     // PageLayout<N>::PAGE_BYTES
+    uint32_t  page_entries;   // CACHEPAGE_SIZE
+    uint32_t  shards;
+    uint32_t  peer_slots;     // N
+    uint32_t  revision_bits;  // CACHEPAGE_REVISION_BITS
+    uint32_t  page_units;     // units of a page, 1 if the pool is POOL_DENSE.
+    uint32_t  sparse_entries; // PageLayout<N>::SPARSE_ENTRIES
+    uint64_t  align;          // offset of the first shard.
+    uint64_t  meta_offset;
+    uint64_t  meta_bytes;
+    uint64_t  file_bytes;
+    uint64_t  checksum;       // of all bytes after align.
+  };
+
+
+  // binary snapshot of Database, for warm restart.
+  //
+  //   +----------------------+ 0
+  //   | SnapshotHeader       |
+  //   +----------------------+ align
+  //   | pages of shard 0     | the arena as it is, dense and sparse pages.
+  //   | LRU of shard 0       | PAGEH[], most recently used first.
+  //   +----------------------+ aligned by system page
+  //   | pages of shard 1 ... |
+  //   +----------------------+ meta_offset
+  //   | peer names           | by PEERH, 1 to n.
+  //   | peer statuses        |
+  //   | shard table          | { offset, pages, count of LRU } of each shard.
+  //   +----------------------+ file_bytes
+  //
+  // Pages are written as they are in the arena, so that load() can map
+  // them to the arena directly when the shards and the page layout are
+  // the same. Otherwise pages are copied one by one in LRU order.
+  // The file is for the same build of this module, it is rejected if the
+  // version, the peer slots, the revision bits, the page layout or the
+  // checksum doesn't match.
+  class DatabaseSnapshot {
+  public:
+    static const uint32_t VERSION = 5;
+
+    DatabaseSnapshot(Database& db);
+    virtual ~DatabaseSnapshot();
+
+    bool save(const char* path, PeerNameAbstract& names);
+    bool load(const char* path, PeerNameAbstract& names);  // into the empty Database.
+    static Database* create(const char* path);              // for load(path).
+
+    attr_reader(size_t, m_pages);
+    attr_reader(size_t, m_mapped);
+
+  private:
+    Database& m_db;
+    size_t  m_pages;    // pages saved or loaded.
+    size_t  m_mapped;   // pages loaded by mmap(2).
+  };
+
+
+}
+}
+
+
+#endif //__INCLUDE_GATEWAY_SNAPSHOT_H__
@@ -0,0 +1,372 @@
+/*
+ *   Copyright 2010 Ricoh Company, Ltd.
+ *
+ *   This file is part of Castoro.
+ *
+ *   Castoro is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Castoro is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with Castoro.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// benchmark of the page cache engine, without ruby.
+// Build by "make bench" in this directory, "./bench -h" for options.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "../basetypes.hxx"
+#include "../database.hxx"
+#include "../mapping.cxx"
+#include "../page.cxx"
+#include "../index.cxx"
+#include "../database.cxx"
+#include "../histogram.cxx"
+
+#ifndef __TEST__
+# error "bench.cxx needs -D__TEST__, to build without ruby."
+#endif
+
+using Castoro::Gateway::Database;
+using Castoro::Gateway::LatencyClock;
+using Castoro::Gateway::LatencyHistogram;
+
+
+typedef enum { WORKLOAD_UNIFORM, WORKLOAD_ZIPF, WORKLOAD_SEQUENTIAL } Workload;
+
+class Options {
+public:
+  Workload  workload;
+  double    theta;      // skew of zipf.
+  uint64_t  contents;   // content id space.
+  uint64_t  ops;        // operations in total.
+  unsigned  mix[3];     // find:insert:remove
+  unsigned  peers;
+  unsigned  threads;
+  size_t    pages;
+  size_t    shards;
+  size_t    slots;
+  uint64_t  fill;       // contents inserted before measuring.
+  int       pool_flags;
+  bool      learn;      // insert contents which are not found.
+  unsigned  scan;       // percent of operations which insert new contents.
+  uint64_t  seed;
+};
+
+
+// splitmix64, for random numbers and scrambling ids.
+static inline uint64_t mix64(uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+class Random {
+public:
+  inline Random(uint64_t seed) { m_state = seed; };
+  inline uint64_t next() { m_state += 0x9E3779B97F4A7C15ULL; return mix64(m_state); };
+  inline double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); };  // [0, 1)
+
+private:
+  uint64_t  m_state;
+};
+
+
+// zipfian ranks in [0, n), by Gray et al. "Quickly generating
+// billion-record synthetic databases", as YCSB does.
+class Zipf {
+public:
+  Zipf(uint64_t n, double theta) {
+    m_n = n;
+    m_theta = theta;
+    m_zetan = zeta(n, theta);
+    m_alpha = 1.0 / (1.0 - theta);
+    m_eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / m_zetan);
+  };
+
+  inline uint64_t next(double u) const {
+    double uz = u * m_zetan;
+    if(uz < 1.0) return 0;
+    if(uz < 1.0 + pow(0.5, m_theta)) return 1;
+    uint64_t r = (uint64_t)(m_n * pow(m_eta * u - m_eta + 1.0, m_alpha));
+    return (r < m_n) ? r : m_n - 1;
+  };
+
+private:
+  uint64_t  m_n;
+  double    m_theta, m_zetan, m_alpha, m_eta;
+
+  static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for(uint64_t i=1; i<=n; i++) sum += 1.0 / pow((double)i, theta);
+    return sum;
+  };
+};
+
+
+class Worker {
+public:
+  const Options* opt;
+  const Zipf*    zipf;
+  Database*      db;
+  unsigned       index;
+  uint64_t       ops;
+  uint64_t       finds, hits;
+  pthread_t      thread;
+};
+
+static inline ID peer_of(uint64_t content_id, unsigned k, const Options& opt)
+{
+  // each content has its own slots peers at most.
+  return 0x1000 + (ID)((mix64(content_id) + k) % opt.peers);
+}
+
+static void* work(void* data)
+{
+  Worker* w = (Worker*)data;
+  const Options& opt = *(w->opt);
+  Random rnd(mix64(opt.seed + w->index + 1));
+  unsigned total = opt.mix[0] + opt.mix[1] + opt.mix[2];
+  uint64_t seq = opt.contents / opt.threads * w->index;
+  uint64_t scan = opt.contents + (1ULL << 40) * w->index;
+  Castoro::Gateway::FoundIds found;
+  bool removed;
+
+  for(uint64_t i=0; i<w->ops; i++) {
+    if(opt.scan>0 && rnd.next() % 100 < opt.scan) {
+      // contents never requested, as by a scan of a peer.
+      uint64_t cid = scan++;
+      w->db->insert(cid, 2, 1, peer_of(cid, 0, opt));
+      continue;
+    }
+
+    uint64_t cid;
+    switch(opt.workload) {
+    case WORKLOAD_ZIPF:
+      cid = mix64(w->zipf->next(rnd.uniform())) % opt.contents;
+      break;
+    case WORKLOAD_SEQUENTIAL:
+      cid = (seq++) % opt.contents;
+      break;
+    default:
+      cid = rnd.next() % opt.contents;
+      break;
+    }
+
+    unsigned op = rnd.next() % total;
+    ID peer = peer_of(cid, rnd.next() % opt.slots, opt);
+    if(op < opt.mix[0]) {
+      found.clear();
+      w->db->find(cid, 2, 1, found, removed);
+      w->finds++;
+      if(!found.empty()) w->hits++;
+      else if(opt.learn) w->db->insert(cid, 2, 1, peer);
+    } else if(op < opt.mix[0] + opt.mix[1]) {
+      w->db->insert(cid, 2, 1, peer);
+    } else {
+      w->db->remove(cid, 2, 1, peer);
+    }
+  }
+  return NULL;
+}
+
+
+// kB of "VmRSS" or "VmHWM" in /proc/self/status, 0 if unknown.
+static uint64_t memory_kb(const char* key)
+{
+  char line[256];
+  uint64_t result = 0;
+  size_t len = strlen(key);
+  FILE* f = fopen("/proc/self/status", "r");
+  if(!f) return 0;
+  while(fgets(line, sizeof(line), f)) {
+    if(strncmp(line, key, len)==0 && line[len]==':') {
+      result = strtoull(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return result;
+}
+
+static void print_histogram(const char* name, LatencyHistogram& h, double elapsed)
+{
+  uint64_t count = h.count();
+  printf("  %-10s %10llu %12.0f %9.0f %9llu %9llu %9llu %9llu\n", name,
+         (unsigned long long)count, count / elapsed, count ? (double)h.m_sum_r() / count : 0.0,
+         (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99),
+         (unsigned long long)h.percentile(99.9), (unsigned long long)h.m_max_r());
+}
+
+static void usage(const char* name)
+{
+  printf("usage: %s [options]\n", name);
+  printf("  -w uniform|zipf|seq  content ids of operations. (uniform)\n");
+  printf("  -z theta             skew of zipf, < 1. (0.99)\n");
+  printf("  -k contents          content id space. (1000000)\n");
+  printf("  -n ops               operations in total. (1000000)\n");
+  printf("  -m F:I:R             ratio of find, insert and remove. (90:9:1)\n");
+  printf("  -p peers             peers, a content has its slots of them. (100)\n");
+  printf("  -t threads           (1)\n");
+  printf("  -P pages             cache pages. (1024)\n");
+  printf("  -s shards            (1)\n");
+  printf("  -S slots             peer slots of a content, %d..%d. (%d)\n", PEER_SLOTS_MIN, PEER_SLOTS_MAX, PEER_SLOTS_DEFAULT);
+  printf("  -f fill              contents inserted before measuring. (contents)\n");
+  printf("  -D                   dense pages only.\n");
+  printf("  -H                   huge pages for the arena.\n");
+  printf("  -R lru|clock|slru    page replacement policy. (lru)\n");
+  printf("  -A                   admission of new pages by TinyLFU.\n");
+  printf("  -l                   insert contents which are not found, as relayed.\n");
+  printf("  -x percent           operations which insert contents never found. (0)\n");
+  printf("  -r seed              (1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+  Options opt;
+  opt.workload = WORKLOAD_UNIFORM;
+  opt.theta = 0.99;
+  opt.contents = 1000000;
+  opt.ops = 1000000;
+  opt.mix[0] = 90; opt.mix[1] = 9; opt.mix[2] = 1;
+  opt.peers = 100;
+  opt.threads = 1;
+  opt.pages = 1024;
+  opt.shards = 1;
+  opt.slots = PEER_SLOTS_DEFAULT;
+  opt.fill = ~0ULL;
+  opt.pool_flags = 0;
+  opt.learn = false;
+  opt.scan = 0;
+  opt.seed = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "w:z:k:n:m:p:t:P:s:S:f:DHR:Alx:r:h")) != -1) {
+    switch(c) {
+    case 'w':
+      if(strcmp(optarg, "uniform")==0) opt.workload = WORKLOAD_UNIFORM;
+      else if(strcmp(optarg, "zipf")==0) opt.workload = WORKLOAD_ZIPF;
+      else if(strcmp(optarg, "seq")==0) opt.workload = WORKLOAD_SEQUENTIAL;
+      else { usage(argv[0]); return 1; }
+      break;
+    case 'z': opt.theta = atof(optarg); break;
+    case 'k': opt.contents = strtoull(optarg, NULL, 10); break;
+    case 'n': opt.ops = strtoull(optarg, NULL, 10); break;
+    case 'm':
+      if(sscanf(optarg, "%u:%u:%u", &opt.mix[0], &opt.mix[1], &opt.mix[2])!=3) { usage(argv[0]); return 1; }
+      break;
+    case 'p': opt.peers = atoi(optarg); break;
+    case 't': opt.threads = atoi(optarg); break;
+    case 'P': opt.pages = strtoull(optarg, NULL, 10); break;
+    case 's': opt.shards = strtoull(optarg, NULL, 10); break;
+    case 'S': opt.slots = strtoull(optarg, NULL, 10); break;
+    case 'f': opt.fill = strtoull(optarg, NULL, 10); break;
+    case 'D': opt.pool_flags |= Castoro::Gateway::CachePagePool::POOL_DENSE; break;
+    case 'H': opt.pool_flags |= Castoro::Gateway::CachePagePool::POOL_HUGEPAGES; break;
+    case 'R':
+      if(strcmp(optarg, "clock")==0) opt.pool_flags |= Castoro::Gateway::CachePagePool::POOL_CLOCK;
+      else if(strcmp(optarg, "slru")==0) opt.pool_flags |= Castoro::Gateway::CachePagePool::POOL_SLRU;
+      else if(strcmp(optarg, "lru")!=0) { usage(argv[0]); return 1; }
+      break;
+    case 'A': opt.pool_flags |= Castoro::Gateway::CachePagePool::POOL_ADMISSION; break;
+    case 'l': opt.learn = true; break;
+    case 'x': opt.scan = atoi(optarg); break;
+    case 'r': opt.seed = strtoull(optarg, NULL, 10); break;
+    default: usage(argv[0]); return (c=='h') ? 0 : 1;
+    }
+  }
+  if(opt.contents<1 || opt.peers<1 || opt.threads<1 || opt.pages<1 ||
+     opt.mix[0]+opt.mix[1]+opt.mix[2]==0 || opt.theta<=0 || opt.theta>=1 ||
+     opt.slots<PEER_SLOTS_MIN || opt.slots>PEER_SLOTS_MAX || opt.scan>100) {
+    usage(argv[0]);
+    return 1;
+  }
+  if(opt.fill > opt.contents) opt.fill = opt.contents;
+
+  // cache, with all peers active.
+  Database db(opt.pages, opt.pool_flags, opt.shards, opt.slots);
+  db.set_expire(24*60*60);
+  for(unsigned i=0; i<opt.peers; i++) {
+    db.set_status(0x1000 + i, Castoro::Gateway::PeerStatus(1ULL << 40, 0, Castoro::Gateway::DS_ACTIVE));
+  }
+  for(uint64_t cid=0; cid<opt.fill; cid++) db.insert(cid, 2, 1, peer_of(cid, 0, opt));
+  Zipf* zipf = (opt.workload==WORKLOAD_ZIPF) ? new Zipf(opt.contents, opt.theta) : NULL;
+  for(int h=0; h<Database::DHIST_COUNT; h++) {
+    LatencyHistogram discard;
+    db.histogram((Database::DatabaseHistogram)h, discard, true);
+  }
+  uint64_t evicted = db.stat(Database::DSTAT_EVICTED_PAGES);
+  uint64_t rejected = db.stat(Database::DSTAT_REJECTED_PAGES);
+
+  // run.
+  Worker* workers = new Worker[opt.threads];
+  uint64_t start = LatencyClock::now();
+  for(unsigned i=0; i<opt.threads; i++) {
+    Worker& w = workers[i];
+    w.opt = &opt;
+    w.zipf = zipf;
+    w.db = &db;
+    w.index = i;
+    w.ops = opt.ops / opt.threads + ((i < opt.ops % opt.threads) ? 1 : 0);
+    w.finds = w.hits = 0;
+    pthread_create(&w.thread, NULL, work, &w);
+  }
+  uint64_t finds = 0, hits = 0;
+  for(unsigned i=0; i<opt.threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    finds += workers[i].finds;
+    hits += workers[i].hits;
+  }
+  double elapsed = (LatencyClock::now() - start) / 1e9;
+
+  // report.
+  static const char* WORKLOADS[] = { "uniform", "zipf", "seq" };
+  printf("workload : %s", WORKLOADS[opt.workload]);
+  if(opt.workload==WORKLOAD_ZIPF) printf("(%.2f)", opt.theta);
+  printf(", %llu contents, %llu filled, %u peers\n", (unsigned long long)opt.contents, (unsigned long long)opt.fill, opt.peers);
+  static const char* REPLACEMENTS[] = { "lru", "clock", "slru" };
+  printf("cache    : %zu pages, %zu shards, %zu slots, %s%s%s%s\n", opt.pages, opt.shards, opt.slots,
+         REPLACEMENTS[db.stat(Database::DSTAT_REPLACEMENT)],
+         db.stat(Database::DSTAT_ADMISSION) ? "+tinylfu" : "",
+         (opt.pool_flags & Castoro::Gateway::CachePagePool::POOL_DENSE) ? ", dense" : "",
+         (opt.pool_flags & Castoro::Gateway::CachePagePool::POOL_HUGEPAGES) ? ", hugepages" : "");
+  printf("ops      : %llu by %u threads, find:insert:remove = %u:%u:%u%s, %u%% scan\n",
+         (unsigned long long)opt.ops, opt.threads, opt.mix[0], opt.mix[1], opt.mix[2],
+         opt.learn ? " (learn)" : "", opt.scan);
+  printf("elapsed  : %.3f sec, %.0f ops/sec\n", elapsed, opt.ops / elapsed);
+  printf("  %-10s %10s %12s %9s %9s %9s %9s %9s [nsec]\n", "", "count", "ops/sec", "mean", "p50", "p99", "p999", "max");
+  static const char* NAMES[] = { "find", "insert", "remove", "lock_wait" };
+  for(int h=0; h<Database::DHIST_COUNT; h++) {
+    LatencyHistogram result;
+    db.histogram((Database::DatabaseHistogram)h, result);
+    print_histogram(NAMES[h], result, elapsed);
+  }
+  printf("hits     : %.2f%% of finds\n", finds ? hits * 100.0 / finds : 0.0);
+  printf("contents : %llu in %llu pages (%llu sparse), %llu pages evicted, %llu rejected\n",
+         (unsigned long long)db.stat(Database::DSTAT_CONTENTS),
+         (unsigned long long)db.stat(Database::DSTAT_ACTIVE_PAGES),
+         (unsigned long long)db.stat(Database::DSTAT_SPARSE_PAGES),
+         (unsigned long long)(db.stat(Database::DSTAT_EVICTED_PAGES) - evicted),
+         (unsigned long long)(db.stat(Database::DSTAT_REJECTED_PAGES) - rejected));
+  printf("memory   : rss %llu kB, peak %llu kB, arena %llu kB\n",
+         (unsigned long long)memory_kb("VmRSS"), (unsigned long long)memory_kb("VmHWM"),
+         (unsigned long long)(db.stat(Database::DSTAT_ARENA_BYTES) / 1024));
+
+  delete[] workers;
+  delete zipf;
+  return 0;
+}
@@ -84,6 +84,12 @@ describe Castoro::Cache do
       @cache.find(1,2,3).should == [PEER1]
     end
 
+    it "should be frozen peer name shared by each find" do
+      @cache.peers[PEER1].status = ACTIVE
+      @cache.find(1,2,3)[0].should be_frozen
+      @cache.find(1,2,3)[0].should equal(@cache.find(1,2,3)[0])
+    end
+
     it "should be one item when mark readonly" do
       @cache.peers[PEER1].status = READONLY
       @cache.find(1,2,3).should == [PEER1]
@@ -223,6 +229,116 @@ describe Castoro::Cache do
     end
   end
 
+
+  context "when purge peer" do
+    before do
+      @cache = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
+      @cache.peers[PEER1].insert(1,2,3)
+      @cache.peers[PEER2].insert(1,2,3)
+      @cache.peers[PEER1].insert(2,2,3)
+      @cache.peers[PEER1].status = ACTIVE
+      @cache.peers[PEER2].status = ACTIVE
+    end
+
+    it "should return the removed items" do
+      @cache.peers[PEER1].purge.should == 2
+      @cache.peers[PEER1].purge.should == 0
+    end
+
+    it "should be found other peers after purge" do
+      @cache.peers[PEER1].purge
+      @cache.find(1,2,3).should == [PEER2]
+      @cache.find(2,2,3).should == nil
+    end
+
+    it "should return 0 for unknown peer" do
+      @cache.peers["unknown"].purge.should == 0
+      @cache.find(1,2,3).should == [PEER1,PEER2]
+    end
+
+    it "should keep the status after purge" do
+      @cache.peers[PEER1].purge
+      @cache.peers[PEER1].status[:status].should == Castoro::Cache::Peer::ACTIVE
+    end
+
+    it "should forget the status and the items by unlink" do
+      @cache.peers[PEER1].unlink
+      @cache.peers[PEER1].status.should be_nil
+      @cache.find_peers.should == [PEER2]
+      @cache.find(1,2,3).should == [PEER2]
+      @cache.find(2,2,3).should == nil
+    end
+
+    it "should be found again after unlink and insert" do
+      @cache.peers[PEER1].unlink
+      @cache.peers[PEER1].insert(1,2,3)
+      @cache.peers[PEER1].status = ACTIVE
+      @cache.find(1,2,3).sort.should == [PEER1,PEER2]
+    end
+
+    after do
+      @cache = nil
+    end
+  end
+
+  context "when peer_size given" do
+    before do
+      @peers = (1..6).map { |i| "std#{200+i}" }
+    end
+
+    it "should keep 5 peers" do
+      c = Castoro::Cache.new(Castoro::Cache.page_size(5) * 10, :peer_size => 5)
+      c.stat(Castoro::Cache::DSTAT_PEER_SLOTS).should == 5
+      c.stat(Castoro::Cache::DSTAT_ALLOCATE_PAGES).should == 10
+      @peers.each { |p| c.peers[p].status = ACTIVE; c.peers[p].insert(1,2,3) }
+      c.find(1,2,3).should == @peers[1..5]
+    end
+
+    it "should keep 2 peers" do
+      c = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10, :peer_size => 2)
+      c.stat(Castoro::Cache::DSTAT_ALLOCATE_PAGES).should > 10
+      @peers[0..2].each { |p| c.peers[p].status = ACTIVE; c.peers[p].insert(1,2,3) }
+      c.find(1,2,3).should == @peers[1..2]
+    end
+
+    it "should be raise exception when out of range" do
+      lambda{ Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10, :peer_size => 1) }.should raise_error(ArgumentError)
+      lambda{ Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10, :peer_size => 9) }.should raise_error(ArgumentError)
+    end
+  end
+
+  context "when batched" do
+    before do
+      @cache = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
+      @cache.peers[PEER1].status = ACTIVE
+      @cache.peers[PEER2].status = ACTIVE
+      @cache.insert_many [[PEER1,1,2,3], [PEER2,1,2,3], [PEER1,4,5,6]]
+    end
+
+    it "should be found by find_many" do
+      @cache.find_many([[1,2,3], [4,5,6], [7,8,9]]).should == [[PEER1,PEER2], [PEER1], []]
+    end
+
+    it "should be found by find as well" do
+      @cache.find(1,2,3).should == [PEER1,PEER2]
+      @cache.find(4,5,6).should == [PEER1]
+    end
+
+    it "should be removed by erase_many" do
+      @cache.erase_many [[PEER1,1,2,3], [PEER1,4,5,6], [PEER3,1,2,3]]
+      @cache.find_many([[1,2,3], [4,5,6]]).should == [[PEER2], []]
+    end
+
+    it "should be raise exception when the tuple is short" do
+      lambda{ @cache.insert_many [[PEER1,1,2]] }.should raise_error(ArgumentError)
+      lambda{ @cache.find_many [[1,2]] }.should raise_error(ArgumentError)
+    end
+
+    after do
+      @cache = nil
+    end
+  end
+
   context "peers matching" do
     before do
       @cache = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
@@ -410,4 +526,61 @@ __RESULT__
       @cache = nil
     end
   end
+
+  context "given insert 1.2.1" do
+    before do
+      @cache = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
+      @cache.peers[PEER1].status = ACTIVE
+      @cache.peers[PEER1].insert(1, 2, 1)
+    end
+
+    it "should NOT find revision 257 which shares the lower 8 bits" do
+      @cache.find(1, 2, 1).should == [PEER1]
+      @cache.find(1, 2, 257).should == []
+    end
+
+    it "should NOT dump a revision which doesn't fit in REVISION_BITS" do
+      if Castoro::Cache::REVISION_BITS < 32
+        @cache.peers[PEER1].insert(3, 2, 1 << Castoro::Cache::REVISION_BITS)
+        io = StringIO.new
+        @cache.dump io
+        io.string.should == "  #{PEER1}: 1.2.1\n\n"
+      end
+    end
+
+    after do
+      @cache = nil
+    end
+  end
+
+  context "when saved to snapshot" do
+    before do
+      @path = "/tmp/castoro_cache_spec_snapshot.#{Process.pid}"
+      @cache = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
+      @cache.peers[PEER1].status = ACTIVE
+      @cache.peers[PEER2].status = ACTIVE
+      @cache.insert_many [[PEER1,1,2,3], [PEER2,1,2,3], [PEER1,4,5,6]]
+      @cache.save(@path).should == 2
+    end
+
+    it "should be restored by load" do
+      c = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
+      c.load(@path).should == true
+      c.find_many([[1,2,3], [4,5,6], [7,8,9]]).should == [[PEER1,PEER2], [PEER1], []]
+    end
+
+    it "should NOT be loaded into non-empty cache" do
+      @cache.load(@path).should == false
+    end
+
+    it "should NOT be loaded from missing file" do
+      c = Castoro::Cache.new(Castoro::Cache::PAGE_SIZE * 10)
+      c.load(@path + ".missing").should == false
+    end
+
+    after do
+      File.unlink(@path) if File.exist?(@path)
+      @cache = nil
+    end
+  end
 end
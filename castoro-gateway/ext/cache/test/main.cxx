@@ -24,14 +24,21 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 //#define __TEST__
 #include "../basetypes.hxx"
 #include "../database.hxx"
 #include "../mapping.cxx"
 #include "../page.cxx"
+#include "../index.cxx"
 #include "../database.cxx"
+#include "../snapshot.cxx"
+#include "../dump.cxx"
+#include "../histogram.cxx"
 
 
+typedef Castoro::Gateway::CachePage<PEER_SLOTS_DEFAULT> TestPage;
+
 int g_testcount = 0;
 char g_description[4096] = "";
 
@@ -96,15 +103,29 @@ void test_PeerHash()
 }
 
 
-void test_ID3()
+// a dense page is its header and slots, and a unit has no more than
+// its share of the page and 16 bytes alignment.
+template<int N> void assert_page_size()
+{
+  const size_t slot = N*sizeof(Castoro::Gateway::PEERH) + sizeof(Castoro::Gateway::REVH);
+  ASSERT_EQ(sizeof(Castoro::Gateway::PageSlot<N>), slot);
+  ASSERT_EQ(sizeof(Castoro::Gateway::CachePage<N>), sizeof(Castoro::Gateway::CachePageBase) + CACHEPAGE_SIZE*slot);
+  ASSERT(Castoro::Gateway::PageLayout<N>::PAGE_BYTES < sizeof(Castoro::Gateway::CachePage<N>) + CACHEPAGE_UNITS*16);
+  ASSERT(sizeof(Castoro::Gateway::SparsePage<N>) <= Castoro::Gateway::PageLayout<N>::UNIT_BYTES);
+}
+
+void test_PageSlot()
 {
-  Castoro::Gateway::ID3 id3;
+  Castoro::Gateway::PageSlot<3> id3;
 
-  DESCRIPTION("ID3 initialize");
+  DESCRIPTION("PageSlot initialize");
   ASSERT(id3.empty());
+  ASSERT_EQ(id3.revision(), 0);
+  ASSERT_EQ(sizeof(id3), Castoro::Gateway::PageSlot<3>::BYTES);
+  ASSERT_EQ(sizeof(id3), 3*sizeof(Castoro::Gateway::PEERH) + sizeof(Castoro::Gateway::REVH));
 
 
-  DESCRIPTION("ID3 insert");
+  DESCRIPTION("PageSlot insert");
   id3.append(1);
   ASSERT_EQ(id3.at(0), 1);
   id3.append(1);
@@ -130,117 +151,463 @@ void test_ID3()
   ASSERT_EQ(id3.at(1), 2);
   ASSERT_EQ(id3.at(2), 3);
 
+  DESCRIPTION("PageSlot insert into full slots");
   id3.append(4);
-  ASSERT_EQ(id3.at(0), 4);
-  ASSERT_EQ(id3.at(1), 2);
-  ASSERT_EQ(id3.at(2), 3);
+  ASSERT_EQ(id3.at(0), 2);
+  ASSERT_EQ(id3.at(1), 3);
+  ASSERT_EQ(id3.at(2), 4);
 
 
-  DESCRIPTION("CachePagePool remove");
+  DESCRIPTION("PageSlot remove");
   id3.remove(1);
-  ASSERT_EQ(id3.at(0), 4);
-  ASSERT_EQ(id3.at(1), 2);
-  ASSERT_EQ(id3.at(2), 3);
+  ASSERT_EQ(id3.at(0), 2);
+  ASSERT_EQ(id3.at(1), 3);
+  ASSERT_EQ(id3.at(2), 4);
   ASSERT_EQ(id3.removed(), false);
 
-  id3.remove(2);
-  ASSERT_EQ(id3.at(0), 4);
-  ASSERT_EQ(id3.at(1), 3);
+  id3.remove(3);
+  ASSERT_EQ(id3.at(0), 2);
+  ASSERT_EQ(id3.at(1), 4);
   ASSERT_EQ(id3.at(2), 0);
   ASSERT_EQ(id3.removed(), false);
 
-  id3.remove(4);
-  ASSERT_EQ(id3.at(0), 3);
+  id3.remove(2);
+  ASSERT_EQ(id3.at(0), 4);
   ASSERT_EQ(id3.at(1), 0);
   ASSERT_EQ(id3.at(2), 0);
   ASSERT_EQ(id3.removed(), false);
 
-  id3.remove(3);
+  id3.remove(4);
   ASSERT_EQ(id3.at(0), 0);
   ASSERT_EQ(id3.at(1), 0);
-  ASSERT_EQ(id3.at(2), 0);
+  ASSERT_EQ(id3.at(2), PEERH_REMOVED);
   ASSERT(id3.empty());
   ASSERT_EQ(id3.removed(), true);
+  ASSERT(!id3.has(PEERH_REMOVED));
+
+  DESCRIPTION("PageSlot insert into removed slots");
+  id3.append(5);
+  ASSERT_EQ(id3.removed(), false);
+  ASSERT_EQ(id3.at(0), 5);
+  ASSERT_EQ(id3.at(2), 0);
+  id3.remove(5);
+  ASSERT_EQ(id3.removed(), true);
+
+
+  DESCRIPTION("PageSlot revision");
+  id3.revision(5);
+  ASSERT_EQ(id3.revision(), 5);
+  ASSERT_EQ(id3.removed(), true);
+  id3.clear();
+  ASSERT_EQ(id3.revision(), 0);
+  ASSERT_EQ(id3.removed(), false);
 
 
-  DESCRIPTION("ID3 pushall");
+  DESCRIPTION("PageSlot pushall");
   Castoro::Gateway::ArrayOfId ids;
   id3.append(1);
   id3.append(2);
   id3.append(3);
+  ASSERT_EQ(id3.removed(), false);
   id3.pushall(ids);
   ASSERT_EQ(ids.size(), 3);
   ASSERT_EQ(ids[0], 1);
   ASSERT_EQ(ids[1], 2);
   ASSERT_EQ(ids[2], 3);
+
+
+  DESCRIPTION("PageSlot of 8 peers");
+  Castoro::Gateway::PageSlot<8> id8;
+  ASSERT_EQ(sizeof(id8), Castoro::Gateway::PageSlot<8>::BYTES);
+  ASSERT_EQ(sizeof(id8), 8*sizeof(Castoro::Gateway::PEERH) + sizeof(Castoro::Gateway::REVH));
+  for(int i=1; i<=8; i++) id8.append(i);
+  Castoro::Gateway::PeerSlotArray found;
+  id8.pushall(found);
+  ASSERT_EQ(found.size(), 8);
+  for(int i=0; i<8; i++) ASSERT_EQ(found[i], i+1);
+  id8.append(9);
+  ASSERT_EQ(id8.at(0), 2);
+  ASSERT_EQ(id8.at(7), 9);
+  for(int i=2; i<=9; i++) id8.remove(i);
+  ASSERT(id8.empty());
+  ASSERT_EQ(id8.removed(), true);
+
+
+  DESCRIPTION("PageSlot of 2 peers");
+  Castoro::Gateway::PageSlot<2> id2;
+  id2.append(1);
+  id2.append(2);
+  id2.append(3);
+  ASSERT_EQ(id2.at(0), 2);
+  ASSERT_EQ(id2.at(1), 3);
+  id2.remove(2);
+  id2.remove(3);
+  ASSERT_EQ(id2.removed(), true);
+  id2.append(4);
+  ASSERT_EQ(id2.removed(), false);
+  ASSERT_EQ(id2.at(0), 4);
+  ASSERT_EQ(id2.at(1), 0);
+
+
+  DESCRIPTION("CachePageBase size_of");
+  ASSERT_EQ(Castoro::Gateway::CachePageBase::size_of(1), 0);
+  ASSERT_EQ(Castoro::Gateway::CachePageBase::size_of(9), 0);
+  ASSERT(Castoro::Gateway::CachePageBase::size_of(3) >= sizeof(TestPage));
+  for(int n=PEER_SLOTS_MIN; n<PEER_SLOTS_MAX; n++) {
+    ASSERT(Castoro::Gateway::CachePageBase::size_of(n) < Castoro::Gateway::CachePageBase::size_of(n+1));
+  }
+
+  DESCRIPTION("CachePage grows by the peer code with N");
+  assert_page_size<2>();
+  assert_page_size<3>();
+  assert_page_size<4>();
+  assert_page_size<5>();
+  assert_page_size<6>();
+  assert_page_size<7>();
+  assert_page_size<8>();
+
+  DESCRIPTION("SparsePage fits in a unit of a page");
+  ASSERT(sizeof(Castoro::Gateway::SparsePage<2>) <= Castoro::Gateway::PageLayout<2>::UNIT_BYTES);
+  ASSERT(sizeof(Castoro::Gateway::SparsePage<3>) <= Castoro::Gateway::PageLayout<3>::UNIT_BYTES);
+  ASSERT(sizeof(Castoro::Gateway::SparsePage<8>) <= Castoro::Gateway::PageLayout<8>::UNIT_BYTES);
+  ASSERT(sizeof(Castoro::Gateway::CachePage<8>) <= Castoro::Gateway::PageLayout<8>::PAGE_BYTES);
+  ASSERT(Castoro::Gateway::SparsePage<3>::CAPACITY >= 64);
+  ASSERT_EQ(Castoro::Gateway::CachePageBase::sparse_entries(3), Castoro::Gateway::SparsePage<3>::CAPACITY);
 }
 
 
 void test_CachePagePool()
 {
-  Castoro::Gateway::CachePagePool pool(4);
-  Castoro::Gateway::CachePage* page, *p[4];
+  Castoro::Gateway::CachePagePool pool(4, sizeof(TestPage));
+  TestPage* page, *p[4];
+  pool.init();
 
   DESCRIPTION("CachePagePool initialize");
   ASSERT_EQ( pool.m_pages_r(), 4 );
-  ASSERT( pool.m_alloc_pages_r()->empty() );
-  ASSERT_EQ( pool.m_free_pages_r()->size(), 4 );
+  ASSERT_EQ( pool.m_active_r(), 0 );
+  ASSERT( !pool.head() );
+  ASSERT_EQ( pool.free_pages(), 4 );
+  ASSERT( pool.m_arena_r() );
+  ASSERT( pool.m_arena_size_r() >= sizeof(TestPage)*4 );
+  ASSERT_EQ( pool.m_arena_pages_r(), Castoro::Gateway::CachePagePool::ARENA_NORMAL_PAGES );
 
 
   DESCRIPTION("CachePagePool allocate");
-  ASSERT( page = pool.alloc() );
-  ASSERT_EQ( pool.m_free_pages_r()->size(), 3 );
-  ASSERT_EQ( pool.m_alloc_pages_r()->size(), 1 );
+  ASSERT( page = (TestPage*)pool.alloc() );
+  ASSERT_EQ( pool.free_pages(), 3 );
+  ASSERT_EQ( pool.m_active_r(), 1 );
+  ASSERT_EQ( pool.head(), page );
+  ASSERT_EQ( pool.tail(), page );
 
 
   DESCRIPTION("CachePagePool drop");
   pool.drop(page);
-  ASSERT_EQ( pool.m_free_pages_r()->size(), 4 );
-  ASSERT_EQ( pool.m_alloc_pages_r()->size(), 0 );
+  ASSERT_EQ( pool.free_pages(), 4 );
+  ASSERT_EQ( pool.m_active_r(), 0 );
+  ASSERT( !pool.head() );
+  ASSERT( !pool.tail() );
 
 
   DESCRIPTION("CachePagePool allocate many pages");
-  ASSERT( p[0] = pool.alloc() );
+  ASSERT( p[0] = (TestPage*)pool.alloc() );
   p[0]->init(0x100010aa, 0);
   ASSERT_EQ( p[0]->m_magic_r().content_id, 0x10001000 );
   ASSERT_EQ( p[0]->m_magic_r().type, 0 );
 
-  ASSERT( p[1] = pool.alloc() );
+  ASSERT( p[1] = (TestPage*)pool.alloc() );
   p[1]->init(0x100020aa, 1);
   ASSERT_EQ( p[1]->m_magic_r().content_id, 0x10002000 );
   ASSERT_EQ( p[1]->m_magic_r().type, 1 );
 
-  ASSERT( p[2] = pool.alloc() );
+  ASSERT( p[2] = (TestPage*)pool.alloc() );
   p[2]->init(0x100030aa, 2);
   ASSERT_EQ( p[2]->m_magic_r().content_id, 0x10003000 );
   ASSERT_EQ( p[2]->m_magic_r().type, 2 );
 
-  ASSERT( p[3] = pool.alloc() );
+  ASSERT( p[3] = (TestPage*)pool.alloc() );
   p[3]->init(0x100040aa, 3);
   ASSERT_EQ( p[3]->m_magic_r().content_id, 0x10004000 );
   ASSERT_EQ( p[3]->m_magic_r().type, 3 );
 
-  ASSERT( page = pool.alloc() );
+  ASSERT( page = (TestPage*)pool.alloc() );
   ASSERT_EQ( page->m_magic_r().content_id, 0x10001000 );
   ASSERT_EQ( page->m_magic_r().type, 0 );
 
-  ASSERT( page = pool.alloc() );
+  ASSERT( page = (TestPage*)pool.alloc() );
   ASSERT_EQ( page->m_magic_r().content_id, 0x10002000 );
   ASSERT_EQ( page->m_magic_r().type, 1 );
 
-  ASSERT( page = pool.alloc() );
+  ASSERT( page = (TestPage*)pool.alloc() );
   ASSERT_EQ( page->m_magic_r().content_id, 0x10003000 );
   ASSERT_EQ( page->m_magic_r().type, 2 );
 
-  ASSERT( page = pool.alloc() );
+  ASSERT( page = (TestPage*)pool.alloc() );
   ASSERT_EQ( page->m_magic_r().content_id, 0x10004000 );
   ASSERT_EQ( page->m_magic_r().type, 3 );
+  ASSERT_EQ( pool.m_evicted_r(), 4 );
+
+
+  DESCRIPTION("CachePagePool touch");
+  pool.drop(p[0]); pool.drop(p[1]); pool.drop(p[2]); pool.drop(p[3]);
+  ASSERT_EQ( pool.m_active_r(), 0 );
+  for(int i=0; i<4; i++) {
+    ASSERT( p[i] = (TestPage*)pool.alloc() );
+    p[i]->init(0x1000 * i, 0);
+  }
+  ASSERT_EQ( pool.head(), p[3] );
+  ASSERT_EQ( pool.tail(), p[0] );
+  pool.touch(p[0]);
+  pool.touch(p[2]);
+  ASSERT_EQ( pool.head(), p[2] );
+  ASSERT_EQ( pool.tail(), p[1] );
+  ASSERT_EQ( pool.m_active_r(), 4 );
+
+  ASSERT_EQ( pool.alloc(), p[1] );
+  ASSERT_EQ( pool.alloc(), p[3] );
+  ASSERT_EQ( pool.alloc(), p[0] );
+  ASSERT_EQ( pool.tail(), p[2] );
+  ASSERT_EQ( pool.m_evicted_r(), 7 );
+
+
+  DESCRIPTION("CachePagePool drop from middle of LRU");
+  pool.drop(p[3]);
+  ASSERT_EQ( pool.m_active_r(), 3 );
+  ASSERT_EQ( pool.head(), p[0] );
+  ASSERT_EQ( pool.next(pool.head()), p[1] );
+  ASSERT_EQ( pool.next(pool.next(pool.head())), p[2] );
+  ASSERT( !pool.next(p[2]) );
+  ASSERT_EQ( pool.alloc(), p[3] );
+  ASSERT_EQ( pool.m_evicted_r(), 7 );
+
+
+  DESCRIPTION("CachePagePool page handles");
+  for(int i=0; i<4; i++) {
+    ASSERT_EQ( pool.at(pool.handle(p[i])), p[i] );
+    ASSERT( pool.handle(p[i]) < 4 );
+  }
+  ASSERT_EQ( pool.handle(NULL), PAGEH_NONE );
+  ASSERT( !pool.at(PAGEH_NONE) );
+
+
+  DESCRIPTION("CachePagePool hugepages/prefault arena");
+  Castoro::Gateway::CachePagePool huge(100, sizeof(TestPage),
+    Castoro::Gateway::CachePagePool::POOL_HUGEPAGES | Castoro::Gateway::CachePagePool::POOL_PREFAULT);
+  huge.init();
+  ASSERT( huge.m_arena_size_r() >= sizeof(TestPage)*100 );
+  printf("\n  arena %zu bytes, hugepages=%d\n", huge.m_arena_size_r(), huge.m_arena_pages_r());
+  for(int i=0; i<100; i++) {
+    ASSERT( page = (TestPage*)huge.alloc() );
+    page->init(0x1000 * i, 0);
+  }
+  ASSERT_EQ( huge.free_pages(), 0 );
+}
+
+
+class CountingListener: public Castoro::Gateway::CachePageListenerAbstract {
+public:
+  inline CountingListener() { count = 0; };
+  virtual void evicted(Castoro::Gateway::CachePageBase* page) { count++; };
+  int count;
+};
+
+void test_CachePagePool_units()
+{
+  typedef Castoro::Gateway::SparsePage<PEER_SLOTS_DEFAULT> TestSparse;
+  const size_t units = CACHEPAGE_UNITS;
+  Castoro::Gateway::CachePagePool pool(2, Castoro::Gateway::CachePageBase::size_of(PEER_SLOTS_DEFAULT), 0, units);
+  CountingListener listener;
+  Castoro::Gateway::CachePageBase* s[CACHEPAGE_UNITS+1];
+  Castoro::Gateway::CachePageBase* d;
+  pool.init();
+  pool.listen(&listener);
+
+  DESCRIPTION("CachePagePool units initialize");
+  ASSERT_EQ( pool.m_units_r(), units );
+  ASSERT_EQ( pool.m_unit_bytes_r() * units, pool.m_page_bytes_r() );
+  ASSERT_EQ( pool.free_pages(), 2 );
+
+  DESCRIPTION("CachePagePool alloc units from a page");
+  for(size_t i=0; i<units; i++) {
+    ASSERT( s[i] = pool.alloc_unit() );
+    ((TestSparse*)s[i])->init(i * CACHEPAGE_SIZE, 0);
+    ASSERT_EQ( pool.handle(s[i]), i );
+  }
+  ASSERT_EQ( pool.m_sparse_r(), units );
+  ASSERT_EQ( pool.m_active_r(), units );
+  ASSERT_EQ( pool.free_pages(), 1 );
+  ASSERT( s[units] = pool.alloc_unit() );
+  ((TestSparse*)s[units])->init(units * CACHEPAGE_SIZE, 0);
+  ASSERT_EQ( pool.handle(s[units]), units );
+  ASSERT_EQ( pool.free_pages(), 0 );
+
+  DESCRIPTION("CachePagePool dropped unit is reused");
+  pool.drop(s[3]);
+  ASSERT_EQ( pool.m_sparse_r(), units );
+  ASSERT_EQ( pool.alloc_unit(), s[3] );
+  ((TestSparse*)s[3])->init(3 * CACHEPAGE_SIZE, 0);
+  ASSERT_EQ( listener.count, 0 );
+
+  DESCRIPTION("CachePagePool evicts sparse pages of a page for a dense page");
+  ASSERT( d = pool.alloc() );
+  ASSERT_EQ( pool.handle(d), 0 );
+  ASSERT_EQ( listener.count, (int)units );
+  ASSERT_EQ( pool.m_evicted_r(), units );
+  ASSERT_EQ( pool.m_sparse_r(), 1 );
+  ASSERT_EQ( pool.m_active_r(), 2 );
+  ASSERT_EQ( pool.head(), d );
+  ASSERT_EQ( pool.tail(), s[units] );
+
+  DESCRIPTION("CachePagePool evicts a dense page for a unit");
+  pool.touch(s[units]);
+  for(size_t i=1; i<units; i++) ASSERT( pool.alloc_unit() );
+  ASSERT_EQ( pool.m_sparse_r(), units );
+  ASSERT_EQ( pool.tail(), d );
+  ASSERT_EQ( pool.handle(pool.alloc_unit()), 0 );
+  ASSERT_EQ( listener.count, (int)units+1 );
+  ASSERT_EQ( pool.m_sparse_r(), units+1 );
+
+  DESCRIPTION("CachePagePool releases the page after all units are dropped");
+  while(pool.head()) pool.drop(pool.head());
+  ASSERT_EQ( pool.free_pages(), 2 );
+  ASSERT_EQ( pool.m_sparse_r(), 0 );
+  ASSERT( d = pool.alloc() );
+  ASSERT( pool.alloc() );
+  ASSERT_EQ( pool.free_pages(), 0 );
+}
+
+
+void test_CachePagePool_replacement()
+{
+  TestPage* p[5];
+
+  DESCRIPTION("CachePagePool CLOCK gives found pages a second chance");
+  Castoro::Gateway::CachePagePool clock(4, sizeof(TestPage), Castoro::Gateway::CachePagePool::POOL_CLOCK);
+  clock.init();
+  ASSERT_EQ( clock.replacement(), Castoro::Gateway::CachePagePool::REPLACE_CLOCK );
+  for(int i=0; i<4; i++) {
+    ASSERT( p[i] = (TestPage*)clock.alloc() );
+    p[i]->init(0x1000 * i, 0);
+  }
+  clock.touch(p[0]);
+  ASSERT_EQ( clock.tail(), p[0] );
+  ASSERT_EQ( clock.alloc(), p[1] );
+  ASSERT_EQ( clock.head(), p[1] );
+  ASSERT_EQ( clock.next(clock.head()), p[0] );
+  ASSERT_EQ( clock.alloc(), p[2] );
+  ASSERT_EQ( clock.alloc(), p[3] );
+  ASSERT_EQ( clock.alloc(), p[0] );
+  ASSERT_EQ( clock.m_evicted_r(), 4 );
+
+  DESCRIPTION("CachePagePool CLOCK ignores updates");
+  clock.update(p[1]);
+  ASSERT_EQ( clock.tail(), p[1] );
+
+  DESCRIPTION("CachePagePool SLRU links new pages to probationary");
+  Castoro::Gateway::CachePagePool slru(5, sizeof(TestPage), Castoro::Gateway::CachePagePool::POOL_SLRU);
+  slru.init();
+  for(int i=0; i<5; i++) {
+    ASSERT( p[i] = (TestPage*)slru.alloc() );
+    p[i]->init(0x1000 * i, 0);
+  }
+  ASSERT_EQ( slru.head(), p[4] );
+  ASSERT_EQ( slru.tail(), p[0] );
+  slru.touch(p[1]);
+  ASSERT( slru.is_protected(p[1]) );
+  ASSERT_EQ( slru.m_protected_r(), 1 );
+  ASSERT_EQ( slru.alloc(), p[0] );
+  ASSERT_EQ( slru.head(), p[1] );
+  ASSERT_EQ( slru.next(slru.head()), p[0] );
+  ASSERT( !slru.is_protected(p[0]) );
+
+  DESCRIPTION("CachePagePool SLRU demotes protected pages over 4/5");
+  slru.touch(p[4]);
+  slru.touch(p[3]);
+  slru.touch(p[2]);
+  ASSERT_EQ( slru.m_protected_r(), 4 );
+  slru.touch(p[0]);
+  ASSERT_EQ( slru.m_protected_r(), 4 );
+  ASSERT( !slru.is_protected(p[1]) );
+  ASSERT_EQ( slru.tail(), p[1] );
+  slru.drop(p[2]);
+  ASSERT_EQ( slru.m_protected_r(), 3 );
+
+  DESCRIPTION("CachePagePool SLRU touches the only page");
+  Castoro::Gateway::CachePagePool one(1, sizeof(TestPage), Castoro::Gateway::CachePagePool::POOL_SLRU);
+  one.init();
+  ASSERT( p[0] = (TestPage*)one.alloc() );
+  p[0]->init(0x1000, 0);
+  ASSERT_EQ( one.middle(), p[0] );
+  one.touch(p[0]);
+  one.touch(p[0]);
+  ASSERT_EQ( one.m_protected_r(), 0 );
+  ASSERT_EQ( one.middle(), p[0] );
+  ASSERT_EQ( one.head(), p[0] );
+  ASSERT_EQ( one.tail(), p[0] );
+
+  DESCRIPTION("CachePagePool SLRU touches the head, which is the middle");
+  Castoro::Gateway::CachePagePool edge(5, sizeof(TestPage), Castoro::Gateway::CachePagePool::POOL_SLRU);
+  edge.init();
+  for(int i=0; i<5; i++) {
+    ASSERT( p[i] = (TestPage*)edge.alloc() );
+    p[i]->init(0x1000 * i, 0);
+  }
+  ASSERT_EQ( edge.head(), p[4] );
+  ASSERT_EQ( edge.middle(), p[4] );
+  edge.touch(p[4]);
+  ASSERT( edge.is_protected(p[4]) );
+  ASSERT_EQ( edge.head(), p[4] );
+  ASSERT_EQ( edge.middle(), p[3] );
+
+  DESCRIPTION("CachePagePool SLRU touches the middle");
+  edge.touch(p[3]);
+  ASSERT( edge.is_protected(p[3]) );
+  ASSERT_EQ( edge.head(), p[3] );
+  ASSERT_EQ( edge.middle(), p[2] );
+  ASSERT_EQ( edge.m_protected_r(), 2 );
+  ASSERT( p[0] = (TestPage*)edge.alloc() );
+  p[0]->init(0x6000, 0);
+  ASSERT_EQ( edge.middle(), p[0] );
+  ASSERT( !edge.is_protected(p[0]) );
+  ASSERT( edge.is_protected(p[4]) );
+  ASSERT_EQ( edge.next(p[4]), p[0] );
+
+  DESCRIPTION("CachePagePool admission");
+  Castoro::Gateway::CachePagePool tiny(2, sizeof(TestPage), Castoro::Gateway::CachePagePool::POOL_ADMISSION);
+  tiny.init();
+  ASSERT( tiny.counting() );
+  ASSERT( tiny.m_sketch_r()->m_width_r() >= 64 );
+  Castoro::Gateway::ContentIdWithType cold(0x3000, 0);
+  ASSERT( tiny.admit(cold, true) );
+  for(int i=0; i<2; i++) {
+    ASSERT( p[i] = (TestPage*)tiny.alloc() );
+    p[i]->init(0x1000 * i, 0);
+  }
+  ASSERT( !tiny.admit(cold, true) );
+  ASSERT_EQ( tiny.m_rejected_r(), 1 );
+  tiny.missed(cold);
+  ASSERT( tiny.admit(cold, true) );
+  for(int i=0; i<2; i++) {
+    tiny.touch(p[0]);
+    tiny.touch(p[1]);
+  }
+  ASSERT( !tiny.admit(cold, true) );
+  ASSERT_EQ( tiny.m_rejected_r(), 2 );
+
+  DESCRIPTION("FrequencySketch counts and ages");
+  Castoro::Gateway::FrequencySketch sketch(10);
+  ASSERT_EQ( sketch.m_width_r(), 16 );
+  for(int i=0; i<20; i++) sketch.increment(12345);
+  ASSERT( sketch.estimate(12345) >= 20 );
+  for(int i=0; i<300; i++) sketch.increment(i * 0x9E3779B97F4A7C15ULL);
+  ASSERT( sketch.estimate(12345) < 20 );
+  sketch.clear();
+  ASSERT_EQ( sketch.estimate(12345), 0 );
 }
 
 
 void test_CachePage()
 {
-  Castoro::Gateway::CachePage page;
+  TestPage page;
   bool removed = false;
 
   DESCRIPTION("CachePage init");
@@ -260,7 +627,7 @@ void test_CachePage()
 
   
   DESCRIPTION("CachePage#find");
-  Castoro::Gateway::ArrayOfId ids;
+  Castoro::Gateway::PeerSlotArray ids;
 
   page.init(0, 0);
   for(int i=0; i<4095; i++) {
@@ -272,9 +639,9 @@ void test_CachePage()
   for(int p=1; p<=3; p++) {
     for(int i=0; i<4096; i++) {
       DESCRIPTION("CachePage#find(id=%d, peer<<%d)", i, p);
-      page.insert(i, 0, i, p);
+      page.insert(i, 0, i & 0x7f, p);
       ids.clear();
-      ASSERT( page.find(i, 0, i, ids, removed) );
+      ASSERT( page.find(i, 0, i & 0x7f, ids, removed) );
       ASSERT_EQ( ids.size(), p );
       for(int q=1; q<ids.size(); q++) {
         ASSERT_EQ( ids[q-1], q);
@@ -289,16 +656,16 @@ void test_CachePage()
     for(int p=1; p<=3; p++) {
       DESCRIPTION("CachePage#remove(%d, %d)", i, p);
       ids.clear();
-      ASSERT( page.find(i, 0, i, ids, removed) );
+      ASSERT( page.find(i, 0, i & 0x7f, ids, removed) );
       ASSERT_EQ( ids.size(), 3-p+1 );
 
       if((i==4095) && (p==3)) {
-        ASSERT( !page.remove(i, 0, i, p) );
+        ASSERT( !page.remove(i, 0, i & 0x7f, p) );
       } else {
-        ASSERT( page.remove(i, 0, i, p) );
+        ASSERT( page.remove(i, 0, i & 0x7f, p) );
       }
       ids.clear();
-      ASSERT( page.find(i, 0, i, ids, removed) );
+      ASSERT( page.find(i, 0, i & 0x7f, ids, removed) );
       ASSERT_EQ( ids.size(), 3-p );
 
       for(int s=1; s<=p; s++) {
@@ -316,10 +683,438 @@ void test_CachePage()
       }
     }
     ids.clear();
-    ASSERT( page.find(i, 0, i, ids, removed) );
+    ASSERT( page.find(i, 0, i & 0x7f, ids, removed) );
     ASSERT( ids.empty() );
     ASSERT_EQ( removed, true );
   }
+
+
+  DESCRIPTION("CachePage revisions which collide in lower bits");
+  page.init(0, 0);
+  ASSERT( page.insert(1, 0, 1, 1) );
+  ids.clear();
+  ASSERT( page.find(1, 0, 257, ids, removed) );
+  ASSERT( ids.empty() );
+  ASSERT( page.insert(2, 0, 257, 1) );
+  ids.clear();
+  ASSERT( page.find(2, 0, 1, ids, removed) );
+  ASSERT( ids.empty() );
+  ids.clear();
+  ASSERT( page.find(2, 0, 257, ids, removed) );
+#if CACHEPAGE_REVISION_BITS == 8
+  ASSERT( ids.empty() );  // overflowed, never found.
+#else
+  ASSERT_EQ( ids.size(), 1 );
+#endif
+  ids.clear();
+  ASSERT( page.insert(3, 0, 0x7f, 1) );
+  ASSERT( page.find(3, 0, 0x7f, ids, removed) );
+  ASSERT_EQ( ids.size(), 1 );
+  ASSERT_EQ( page.remove(2, 0, 257, 1), true );
+  ASSERT_EQ( page.m_contains_r(), 2 );
+}
+
+
+void test_SparsePage()
+{
+  typedef Castoro::Gateway::SparsePage<PEER_SLOTS_DEFAULT> TestSparse;
+  const int capacity = TestSparse::CAPACITY;
+  TestSparse page;
+  Castoro::Gateway::PeerSlotArray ids;
+  bool removed = false;
+
+  DESCRIPTION("SparsePage init");
+  page.init(0x12345, 2);
+  ASSERT_EQ( page.m_magic_r().content_id, 0x12000 );
+  ASSERT( page.is_sparse() );
+  ASSERT_EQ( page.m_entries_r(), 0 );
+
+  DESCRIPTION("SparsePage#insert in any order");
+  ASSERT( !page.insert(0x12345, 1, 0, 1) );
+  for(int i=capacity-1; i>=0; i--) {
+    DESCRIPTION("SparsePage#insert(id=%d)", i);
+    ASSERT( page.insert(0x12000 + i*3, 2, i & 0x7f, 1) );
+    ASSERT( page.insert(0x12000 + i*3, 2, i & 0x7f, 2) );
+  }
+  ASSERT_EQ( page.m_entries_r(), capacity );
+  ASSERT_EQ( page.m_contains_r(), capacity );
+  ASSERT( page.full() );
+  for(int i=1; i<capacity; i++) ASSERT( page.offset_at(i-1) < page.offset_at(i) );
+
+  DESCRIPTION("SparsePage#find");
+  for(int i=0; i<capacity; i++) {
+    ids.clear();
+    ASSERT( page.find(0x12000 + i*3, 2, i & 0x7f, ids, removed) );
+    ASSERT_EQ( ids.size(), 2 );
+    ids.clear();
+    ASSERT( page.find(0x12000 + i*3 + 1, 2, i & 0x7f, ids, removed) );
+    ASSERT( ids.empty() );
+    ASSERT_EQ( removed, false );
+  }
+
+  DESCRIPTION("SparsePage#insert into full page");
+  ASSERT( !page.insert(0x12001, 2, 0, 1) );
+  ASSERT( page.insert(0x12003, 2, 5, 3) );  // existing entry, other revision.
+  ids.clear();
+  ASSERT( page.find(0x12003, 2, 5, ids, removed) );
+  ASSERT_EQ( ids.size(), 1 );
+
+  DESCRIPTION("SparsePage#remove keeps 'removed' until full");
+  ASSERT( page.remove(0x12000, 2, 0, 1) );
+  ASSERT( page.remove(0x12000, 2, 0, 2) );
+  ASSERT( page.remove(0x12000, 2, 0, 2) );  // twice.
+  ASSERT_EQ( page.m_contains_r(), capacity-1 );
+  ids.clear();
+  ASSERT( page.find(0x12000, 2, 0, ids, removed) );
+  ASSERT_EQ( removed, true );
+  ASSERT( page.insert(0x12001, 2, 0, 1) );  // reclaimed.
+  ASSERT_EQ( page.m_entries_r(), capacity );
+  ids.clear();
+  ASSERT( page.find(0x12000, 2, 0, ids, removed) );
+  ASSERT_EQ( removed, false );
+  ids.clear();
+  ASSERT( page.find(0x12001, 2, 0, ids, removed) );
+  ASSERT_EQ( ids.size(), 1 );
+
+  DESCRIPTION("SparsePage <=> CachePage");
+  TestPage dense;
+  dense.assign(page);
+  ASSERT( !dense.is_sparse() );
+  ASSERT_EQ( dense.m_contains_r(), page.m_contains_r() );
+  for(int i=1; i<capacity; i++) {
+    ids.clear();
+    ASSERT( dense.find(0x12000 + i*3, 2, (i==1) ? 5 : (i & 0x7f), ids, removed) );
+    ASSERT_EQ( ids.size(), (i==1) ? 1 : 2 );
+  }
+  TestSparse sparse;
+  ASSERT( sparse.assign(dense) );
+  ASSERT_EQ( sparse.m_contains_r(), page.m_contains_r() );
+  for(int i=1; i<capacity; i++) {
+    ids.clear();
+    ASSERT( sparse.find(0x12000 + i*3, 2, (i==1) ? 5 : (i & 0x7f), ids, removed) );
+    ASSERT_EQ( ids.size(), (i==1) ? 1 : 2 );
+  }
+  dense.insert(0x12002, 2, 0, 1);
+  ASSERT( !sparse.assign(dense) );
+
+  DESCRIPTION("SparsePage#remove the last entry");
+  page.init(0, 0);
+  ASSERT( page.insert(7, 0, 1, 1) );
+  ASSERT( page.remove(8, 0, 1, 1) );
+  ASSERT( !page.remove(7, 0, 1, 1) );
+  ASSERT_EQ( page.m_contains_r(), 0 );
+}
+
+
+void test_RevisionHash()
+{
+  DESCRIPTION("RevisionHash");
+  for(uint32_t r=0; r<0x80; r++) {
+    ASSERT( Castoro::Gateway::RevisionHash::is_exact(Castoro::Gateway::RevisionHash::from(r)) );
+    ASSERT_EQ( Castoro::Gateway::RevisionHash::to_revision(Castoro::Gateway::RevisionHash::from(r)), r );
+  }
+  ASSERT( Castoro::Gateway::RevisionHash::from(1)!=Castoro::Gateway::RevisionHash::from(257) );
+  ASSERT( Castoro::Gateway::RevisionHash::from(0)!=Castoro::Gateway::RevisionHash::from(0x10000) );
+#if CACHEPAGE_REVISION_BITS == 32
+  ASSERT( Castoro::Gateway::RevisionHash::is_exact(Castoro::Gateway::RevisionHash::from(0xffffffff)) );
+  ASSERT_EQ( Castoro::Gateway::RevisionHash::from(0xffffffff), 0xffffffff );
+#else
+  ASSERT( !Castoro::Gateway::RevisionHash::is_exact(Castoro::Gateway::RevisionHash::from(0xffffffff)) );
+  ASSERT( !Castoro::Gateway::RevisionHash::is_exact(Castoro::Gateway::RevisionHash::from(1 << (CACHEPAGE_REVISION_BITS-1))) );
+  ASSERT( Castoro::Gateway::RevisionHash::is_exact(Castoro::Gateway::RevisionHash::from((1 << (CACHEPAGE_REVISION_BITS-1))-1)) );
+#endif
+}
+
+
+void test_CachePageIndex()
+{
+  TestPage* pages = (TestPage*)0x1000;
+  Castoro::Gateway::CachePageIndex index(100, pages, sizeof(TestPage));
+
+  DESCRIPTION("CachePageIndex initialize");
+  ASSERT_EQ( index.size(), 0 );
+  ASSERT_EQ( index.m_capacity_r(), 256 );
+  ASSERT( !index.find(Castoro::Gateway::ContentIdWithType(0, 0)) );
+
+  DESCRIPTION("CachePageIndex insert/find");
+  for(int i=0; i<100; i++) {
+    ASSERT( index.insert(Castoro::Gateway::ContentIdWithType(i*CACHEPAGE_SIZE, i%3), pages+i) );
+  }
+  ASSERT_EQ( index.size(), 100 );
+  ASSERT( !index.insert(Castoro::Gateway::ContentIdWithType(0, 0), pages) );
+  for(int i=0; i<100; i++) {
+    DESCRIPTION("CachePageIndex find(%d)", i);
+    ASSERT_EQ( index.find(Castoro::Gateway::ContentIdWithType(i*CACHEPAGE_SIZE+i, i%3)), pages+i );
+    ASSERT( !index.find(Castoro::Gateway::ContentIdWithType(i*CACHEPAGE_SIZE, i%3+1)) );
+  }
+
+  DESCRIPTION("CachePageIndex overflow");
+  for(int i=100; i<128; i++) {
+    ASSERT( index.insert(Castoro::Gateway::ContentIdWithType(i*CACHEPAGE_SIZE, 0), pages+i) );
+  }
+  ASSERT( !index.insert(Castoro::Gateway::ContentIdWithType(128*CACHEPAGE_SIZE, 0), pages+128) );
+
+  DESCRIPTION("CachePageIndex erase");
+  ASSERT( !index.erase(Castoro::Gateway::ContentIdWithType(CACHEPAGE_SIZE, 1), pages) );
+  ASSERT( index.erase(Castoro::Gateway::ContentIdWithType(CACHEPAGE_SIZE, 1), pages+1) );
+  ASSERT( !index.erase(Castoro::Gateway::ContentIdWithType(CACHEPAGE_SIZE, 1)) );
+  for(int i=0; i<128; i+=2) {
+    ASSERT( index.erase(Castoro::Gateway::ContentIdWithType(i*CACHEPAGE_SIZE, (i<100) ? i%3: 0)) );
+  }
+  ASSERT_EQ( index.size(), 63 );
+  for(int i=2; i<128; i++) {
+    DESCRIPTION("CachePageIndex find(%d) after erase", i);
+    TestPage* expect = (i%2) ? pages+i: NULL;
+    ASSERT_EQ( index.find(Castoro::Gateway::ContentIdWithType(i*CACHEPAGE_SIZE, (i<100) ? i%3: 0)), expect );
+  }
+
+  DESCRIPTION("CachePageIndex insert/erase repeatedly");
+  for(int i=0; i<0x10000; i++) {
+    Castoro::Gateway::ContentIdWithType key((uint64_t)(i+1000)*CACHEPAGE_SIZE, 7);
+    ASSERT( index.insert(key, pages+i) );
+    ASSERT_EQ( index.find(key), pages+i );
+    ASSERT( index.erase(key) );
+  }
+  ASSERT_EQ( index.size(), 63 );
+
+  DESCRIPTION("CachePageIndex clear");
+  index.clear();
+  ASSERT_EQ( index.size(), 0 );
+  ASSERT( !index.find(Castoro::Gateway::ContentIdWithType(CACHEPAGE_SIZE*3, 0)) );
+}
+
+
+void test_PeerPageIndex()
+{
+  Castoro::Gateway::PeerPageIndex index(10000);
+  std::vector<Castoro::Gateway::PAGEH> pages;
+
+  DESCRIPTION("PeerPageIndex initialize");
+  ASSERT_EQ( index.m_allocated_r(), 0 );
+  ASSERT( !index.test(1, 0) );
+  ASSERT_EQ( index.count(1), 0 );
+  index.pages(1, pages);
+  ASSERT_EQ( pages.size(), 0 );
+
+  DESCRIPTION("PeerPageIndex set/test");
+  for(Castoro::Gateway::PAGEH h=0; h<10000; h+=3) index.set(1, h);
+  index.set(2, 5000);
+  index.set(2, 5000);
+  ASSERT_EQ( index.m_allocated_r(), 4 );
+  ASSERT( index.test(1, 9999) );
+  ASSERT( !index.test(1, 9998) );
+  ASSERT( !index.test(2, 9999) );
+  ASSERT( index.test(2, 5000) );
+  ASSERT_EQ( index.count(1), 3334 );
+  ASSERT_EQ( index.count(2), 1 );
+
+  DESCRIPTION("PeerPageIndex pages in order");
+  index.pages(1, pages);
+  ASSERT_EQ( pages.size(), 3334 );
+  for(size_t i=0; i<pages.size(); i++) ASSERT_EQ( pages[i], i*3 );
+
+  DESCRIPTION("PeerPageIndex erase_page");
+  index.erase_page(5001);
+  ASSERT( index.test(2, 5000) );
+  index.erase_page(5000);
+  ASSERT( !index.test(2, 5000) );
+  ASSERT_EQ( index.count(2), 0 );
+  ASSERT_EQ( index.m_allocated_r(), 3 );
+  ASSERT( index.test(1, 4998) );
+  ASSERT( !index.test(1, 5001) );
+  ASSERT_EQ( index.count(1), 3333 );
+
+  DESCRIPTION("PeerPageIndex erase_peer");
+  index.erase_peer(1);
+  ASSERT_EQ( index.count(1), 0 );
+  ASSERT_EQ( index.m_allocated_r(), 0 );
+  pages.clear();
+  index.pages(1, pages);
+  ASSERT_EQ( pages.size(), 0 );
+  index.set(1, 3);
+  ASSERT( index.test(1, 3) );
+  ASSERT_EQ( index.m_allocated_r(), 1 );
+
+  DESCRIPTION("PeerPageIndex set grows for new peers");
+  ASSERT( index.set(300, 9999) );
+  ASSERT( index.set(299, 0) );
+  ASSERT( index.test(300, 9999) );
+  ASSERT( index.test(299, 0) );
+  ASSERT( !index.test(298, 0) );
+  ASSERT( index.test(1, 3) );
+  ASSERT_EQ( index.m_allocated_r(), 3 );
+}
+
+
+void test_LatencyHistogram()
+{
+  typedef Castoro::Gateway::LatencyHistogram H;
+  H h;
+
+  DESCRIPTION("LatencyHistogram buckets");
+  for(uint64_t v=0; v<H::SUB_BUCKETS*2; v++) ASSERT_EQ( H::bucket(v), v );
+  for(size_t b=0; b<H::BUCKETS-1; b++) {
+    ASSERT_EQ( H::bucket(H::lower(b)), b );
+    ASSERT_EQ( H::bucket(H::upper(b)), b );
+    ASSERT_EQ( H::upper(b)+1, H::lower(b+1) );
+  }
+  ASSERT_EQ( H::bucket(~0ULL), H::BUCKETS-1 );
+  for(uint64_t v=H::SUB_BUCKETS; v<(1ULL<<40); v=v*3+1) {
+    ASSERT( (H::upper(H::bucket(v)) - H::lower(H::bucket(v))) * H::SUB_BUCKETS <= v );
+  }
+
+  DESCRIPTION("LatencyHistogram empty");
+  ASSERT_EQ( h.count(), 0 );
+  ASSERT_EQ( h.percentile(99), 0 );
+
+  DESCRIPTION("LatencyHistogram record/percentile");
+  for(uint64_t v=1; v<=1000; v++) h.record(v * 1000);
+  h.record(0);
+  ASSERT_EQ( h.count(), 1001 );
+  ASSERT_EQ( h.m_max_r(), 1000000 );
+  ASSERT_EQ( h.m_sum_r(), 500500000 );
+  ASSERT_EQ( h.percentile(0), 0 );
+  ASSERT( h.percentile(50) >= 500000 && h.percentile(50) < 500000 * 9 / 8 );
+  ASSERT( h.percentile(99) >= 990000 && h.percentile(99) <= 1000000 );
+  ASSERT_EQ( h.percentile(100), 1000000 );
+
+  DESCRIPTION("LatencyHistogram add/clear");
+  H g;
+  g.record(5000000);
+  g.add(h);
+  ASSERT_EQ( g.count(), 1002 );
+  ASSERT_EQ( g.m_max_r(), 5000000 );
+  h.clear();
+  ASSERT_EQ( h.count(), 0 );
+  ASSERT_EQ( h.m_max_r(), 0 );
+}
+
+void bench_CachePageIndex()
+{
+  typedef std::map<Castoro::Gateway::ContentIdWithType, TestPage*,
+                   std::less<Castoro::Gateway::ContentIdWithType>,
+                   Castoro::Gateway::RbAllocator<std::pair<const Castoro::Gateway::ContentIdWithType, TestPage*> > > CachePageMap;
+  const size_t pages = 100000;
+  const size_t lookups = 0x400000;
+  TestPage* base = (TestPage*)0x1000;
+  Castoro::Gateway::ContentIdWithType* keys =
+    (Castoro::Gateway::ContentIdWithType*)malloc(sizeof(Castoro::Gateway::ContentIdWithType) * pages);
+  CachePageMap map;
+  Castoro::Gateway::CachePageIndex index(pages, base, sizeof(TestPage));
+
+  for(size_t i=0; i<pages; i++) {
+    keys[i] = Castoro::Gateway::ContentIdWithType((uint64_t)rand() * CACHEPAGE_SIZE, 2);
+    map.insert(std::make_pair(keys[i], base+i));
+    index.insert(keys[i], base+i);
+  }
+
+  DESCRIPTION("CachePageIndex benchmark");
+  printf("\n");
+  struct timeval tv0 = { 0, 0 }, tv1 = { 0, 0 }, tv2 = { 0, 0 };
+  uintptr_t sum0 = 0, sum1 = 0;
+
+  gettimeofday(&tv0, NULL);
+  for(size_t i=0; i<lookups; i++) {
+    CachePageMap::iterator it = map.find(keys[(i*7919) % pages]);
+    if(it!=map.end()) sum0 += (uintptr_t)(*it).second;
+  }
+  gettimeofday(&tv1, NULL);
+  for(size_t i=0; i<lookups; i++) {
+    sum1 += (uintptr_t)index.find(keys[(i*7919) % pages]);
+  }
+  gettimeofday(&tv2, NULL);
+  ASSERT_EQ( sum0, sum1 );
+
+  double t0 = (tv1.tv_sec - tv0.tv_sec)*1000000.0 + (tv1.tv_usec - tv0.tv_usec);
+  double t1 = (tv2.tv_sec - tv1.tv_sec)*1000000.0 + (tv2.tv_usec - tv1.tv_usec);
+  printf("  %zu pages, %zu lookups\n", pages, lookups);
+  printf("  std::map       : %f[ns/1]\n", t0*1000.0/lookups);
+  printf("  CachePageIndex : %f[ns/1]\n", t1*1000.0/lookups);
+  free(keys);
+}
+
+
+// { revision }[] and { peer code }[N][] arrays of a page, the layout
+// before PageSlot, to compare cache lines touched by a lookup.
+struct SplitPage {
+  Castoro::Gateway::CachePageBase header;
+  Castoro::Gateway::REVH  revision_hash[CACHEPAGE_SIZE];
+  Castoro::Gateway::PEERH peers[CACHEPAGE_SIZE][PEER_SLOTS_DEFAULT];
+};
+
+static inline int lines_of(const void* p, size_t bytes)
+{
+  return (int)(((uintptr_t)p + bytes - 1) / 64 - (uintptr_t)p / 64 + 1);
+}
+
+void bench_PageSlot()
+{
+  const size_t pages = 2048;
+  const size_t lookups = 0x400000;
+  Castoro::Gateway::CachePagePool pool(pages, Castoro::Gateway::PageLayout<PEER_SLOTS_DEFAULT>::PAGE_BYTES);
+  SplitPage* split = NULL;
+  TestPage** packed = (TestPage**)malloc(sizeof(TestPage*) * pages);
+
+  pool.init();
+  ASSERT_EQ(posix_memalign((void**)&split, 64, sizeof(SplitPage) * pages), 0);
+  memset(split, 0, sizeof(SplitPage) * pages);
+  for(size_t i=0; i<pages; i++) {
+    packed[i] = (TestPage*)pool.alloc();
+    packed[i]->init(i * CACHEPAGE_SIZE, 2);
+    for(size_t ofs=0; ofs<CACHEPAGE_SIZE; ofs++) {
+      packed[i]->insert(i * CACHEPAGE_SIZE + ofs, 2, ofs & 0x7f, 1 + (ofs % 3));
+      split[i].revision_hash[ofs] = ofs & 0x7f;
+      split[i].peers[ofs][0] = 1 + (ofs % 3);
+    }
+  }
+
+  DESCRIPTION("PageSlot of 2^n bytes never crosses a cache line");
+  ASSERT_EQ(sizeof(Castoro::Gateway::CachePageBase) % 16, 0);
+  ASSERT_EQ(Castoro::Gateway::PageLayout<PEER_SLOTS_DEFAULT>::UNIT_BYTES % 16, 0);
+  ASSERT_EQ(((uintptr_t)&packed[1]->slot_at(0) - (uintptr_t)packed[1]) % 16, 0);
+  int packed_lines = 0, split_lines = 0;
+  for(size_t ofs=0; ofs<CACHEPAGE_SIZE; ofs++) {
+    const TestPage::Slot& slot = packed[1]->slot_at(ofs);
+    if(64 % sizeof(slot)==0) ASSERT_EQ(lines_of(&slot, sizeof(slot)), 1);
+    packed_lines += lines_of(&slot, sizeof(slot));
+    split_lines += lines_of(&split[1].revision_hash[ofs], sizeof(Castoro::Gateway::REVH))
+                 + lines_of(split[1].peers[ofs], sizeof(split[1].peers[ofs]));
+  }
+
+  DESCRIPTION("PageSlot benchmark");
+  printf("\n");
+  struct timeval tv0 = { 0, 0 }, tv1 = { 0, 0 }, tv2 = { 0, 0 };
+  uint64_t sum0 = 0, sum1 = 0;
+  uint64_t seed = 88172645463325252ULL;
+
+  gettimeofday(&tv0, NULL);
+  for(size_t i=0; i<lookups; i++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    const SplitPage& page = split[(seed >> 12) % pages];
+    size_t ofs = seed & (CACHEPAGE_SIZE-1);
+    if(page.peers[ofs][0] & 0x8000) continue;
+    if(page.revision_hash[ofs] != (ofs & 0x7f)) continue;
+    for(int idx=0; idx<PEER_SLOTS_DEFAULT && page.peers[ofs][idx]!=0; idx++) sum0 += page.peers[ofs][idx] & 0x7FFF;
+  }
+  gettimeofday(&tv1, NULL);
+  seed = 88172645463325252ULL;
+  for(size_t i=0; i<lookups; i++) {
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    const TestPage::Slot& slot = packed[(seed >> 12) % pages]->slot_at(seed & (CACHEPAGE_SIZE-1));
+    if(slot.removed()) continue;
+    if(slot.revision() != ((seed & (CACHEPAGE_SIZE-1)) & 0x7f)) continue;
+    for(int idx=0; idx<PEER_SLOTS_DEFAULT && slot.at(idx)!=0; idx++) sum1 += slot.at(idx);
+  }
+  gettimeofday(&tv2, NULL);
+  ASSERT_EQ( sum0, sum1 );
+
+  double t0 = (tv1.tv_sec - tv0.tv_sec)*1000000.0 + (tv1.tv_usec - tv0.tv_usec);
+  double t1 = (tv2.tv_sec - tv1.tv_sec)*1000000.0 + (tv2.tv_usec - tv1.tv_usec);
+  printf("  %zu pages, %zu lookups\n", pages, lookups);
+  printf("  split arrays : %f[ns/1], %f lines/1\n", t0*1000.0/lookups, (double)split_lines/CACHEPAGE_SIZE);
+  printf("  PageSlot     : %f[ns/1], %f lines/1\n", t1*1000.0/lookups, (double)packed_lines/CACHEPAGE_SIZE);
+  free(split);
+  free(packed);
 }
 
 
@@ -349,12 +1144,141 @@ void test_PeerStatus()
 }
 
 
+void test_PeerStatusTable()
+{
+  Castoro::Gateway::PeerStatusTable table;
+  time_t now = Castoro::Gateway::CoarseClock::now();
+
+  DESCRIPTION("PeerStatusTable init");
+  ASSERT_EQ(table.size(), 0);
+  ASSERT(!table.has(1));
+  ASSERT(!table.is_readable(1));
+  ASSERT(!table.is_writable(1000));
+
+  DESCRIPTION("PeerStatusTable set");
+  table.set(1, Castoro::Gateway::PeerStatus(1000, now+10, Castoro::Gateway::DS_ACTIVE));
+  table.set(70, Castoro::Gateway::PeerStatus(2000, now+20, Castoro::Gateway::DS_READONLY));
+  table.set(3, Castoro::Gateway::PeerStatus(3000, now+10, Castoro::Gateway::DS_MAINTENANCE));
+  ASSERT_EQ(table.size(), 3);
+  ASSERT(table.has(1) && table.has(3) && table.has(70));
+  ASSERT(!table.has(2));
+  ASSERT(table.is_readable(1) && table.is_writable(1));
+  ASSERT(table.is_readable(70) && !table.is_writable(70));
+  ASSERT(!table.is_readable(3) && !table.is_writable(3));
+  ASSERT_EQ(table.count_readable(), 2);
+  ASSERT_EQ(table.count_writable(), 1);
+  Castoro::Gateway::PeerStatus r;
+  ASSERT(table.get(70, r));
+  ASSERT_EQ(r.available, 2000);
+  ASSERT(!table.get(2, r));
+
+  DESCRIPTION("PeerStatusTable expires by refresh");
+  table.refresh(now+15);
+  ASSERT(!table.is_readable(1) && !table.is_writable(1));
+  ASSERT(table.is_readable(70));
+  ASSERT(table.has(1));
+  table.touch(1, now+30);
+  ASSERT(table.is_readable(1) && table.is_writable(1));
+  table.refresh(now+15);  // once a second.
+  table.refresh(now+25);
+  ASSERT(table.is_readable(1));
+  ASSERT(!table.is_readable(70));
+  ASSERT_EQ(table.count_readable(), 1);
+
+  DESCRIPTION("PeerStatusTable set expired status");
+  table.set(5, Castoro::Gateway::PeerStatus(1000, now-1, Castoro::Gateway::DS_ACTIVE));
+  ASSERT(table.has(5));
+  ASSERT(!table.is_readable(5));
+  table.touch(2, now+30);
+  ASSERT(!table.has(2));
+  ASSERT(!table.is_readable(2));
+
+  DESCRIPTION("PeerStatusTable remove");
+  table.remove(1);
+  ASSERT(!table.has(1));
+  ASSERT(!table.is_readable(1));
+  ASSERT_EQ(table.size(), 3);
+  table.remove(1);
+  ASSERT_EQ(table.size(), 3);
+}
+
+
+void test_PeerStatusTable_select()
+{
+  Castoro::Gateway::PeerStatusTable table;
+  Castoro::Gateway::ArrayOfPeerH result, allowed;
+  time_t now = Castoro::Gateway::CoarseClock::now();
+
+  table.set(1, Castoro::Gateway::PeerStatus(1000, now+30, Castoro::Gateway::DS_ACTIVE));
+  table.set(2, Castoro::Gateway::PeerStatus(100000, now+30, Castoro::Gateway::DS_ACTIVE));
+  table.set(3, Castoro::Gateway::PeerStatus(500000, now+30, Castoro::Gateway::DS_READONLY));
+  table.set(4, Castoro::Gateway::PeerStatus(10, now+30, Castoro::Gateway::DS_ACTIVE));
+  table.set(5, Castoro::Gateway::PeerStatus(50000, now+30, Castoro::Gateway::DS_ACTIVE));
+
+  DESCRIPTION("PeerStatusTable select by require space");
+  table.select(1000, 10, 1, NULL, result);
+  ASSERT_EQ(result.size(), 3);
+  std::sort(result.begin(), result.end());
+  ASSERT(result[0]==1 && result[1]==2 && result[2]==5);
+
+  DESCRIPTION("PeerStatusTable select count");
+  result.clear();
+  table.select(0, 2, 2, NULL, result);
+  ASSERT_EQ(result.size(), 2);
+  ASSERT(result[0]!=result[1]);
+  ASSERT(result[0]!=3 && result[1]!=3);
+  result.clear();
+  table.select(0, 0, 3, NULL, result);
+  ASSERT_EQ(result.size(), 0);
+
+  DESCRIPTION("PeerStatusTable select from allowed");
+  allowed.push_back(1);
+  allowed.push_back(3);
+  allowed.push_back(4);
+  result.clear();
+  table.select(0, 10, 4, &allowed, result);
+  ASSERT_EQ(result.size(), 2);
+  std::sort(result.begin(), result.end());
+  ASSERT(result[0]==1 && result[1]==4);
+
+  DESCRIPTION("PeerStatusTable select keeps order by space after update");
+  table.set(4, Castoro::Gateway::PeerStatus(1000000, now+30, Castoro::Gateway::DS_ACTIVE));
+  table.remove(2);
+  result.clear();
+  table.select(60000, 10, 5, NULL, result);
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(result[0], 4);
+
+  DESCRIPTION("PeerStatusTable select weighted by available");
+  int first = 0;
+  for(uint64_t seed=0; seed<1000; seed++) {
+    result.clear();
+    table.select(0, 1, seed*0x9E3779B97F4A7C15ULL, NULL, result);
+    ASSERT_EQ(result.size(), 1);
+    if(result[0]==4) first++;
+  }
+  ASSERT(first>900);
+
+  DESCRIPTION("PeerStatusTable select within reserved keys");
+  Castoro::Gateway::PeerStatusTable::SelectKeys keys;
+  keys.reserve(2);
+  result.clear();
+  result.reserve(10);
+  table.select(0, 10, 6, NULL, keys, result);
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(keys.capacity(), 2);
+  result.clear();
+  table.select(0, (size_t)1 << 40, 7, NULL, result);
+  ASSERT_EQ(result.size(), 3);
+}
+
+
 void test_Database_status()
 {
   Castoro::Gateway::Database db(2);
 
   DESCRIPTION("Database init");
-  ASSERT_EQ(db.m_pool_r()->m_pages_r(), 2);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ALLOCATE_PAGES), 2);
   db.set_expire(10);
   ASSERT_EQ(db.m_expire_r(), 10);
 
@@ -412,17 +1336,22 @@ void test_Database_status()
   db.find(2000, peers);
   ASSERT_EQ(peers.size(), 0);
 
+  DESCRIPTION("Database select more peers than known");
+  peers.clear();
+  db.select(0, (size_t)1 << 40, NULL, peers);
+  ASSERT_EQ(peers.size(), 2);
+  ASSERT_EQ(peers.capacity(), 2);
 }
 
 
 void test_Database()
 {
   const ID PEER1 = 0x12345678, PEER2 = 0x87654321;
-  Castoro::Gateway::Database db(2);
+  Castoro::Gateway::Database db(2, Castoro::Gateway::CachePagePool::POOL_DENSE);
   db.set_expire(100);
   Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
   //Castoro::Gateway::ArrayOfPeerWithBase result;
-  Castoro::Gateway::ArrayOfId result;
+  Castoro::Gateway::FoundIds result;
   bool removed = false;
 
   DESCRIPTION("Database insert/find when no peers activated");
@@ -530,12 +1459,877 @@ void test_Database()
 }
 
 
+void test_Database_lru()
+{
+  const ID PEER1 = 0x12345678;
+  Castoro::Gateway::Database db(2, Castoro::Gateway::CachePagePool::POOL_DENSE);
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+
+  db.set_expire(100);
+  db.set_status(PEER1, s);
+
+  DESCRIPTION("Database keeps the page which was hit");
+  db.insert(0x10001, 2, 3, PEER1);
+  db.insert(0x20001, 2, 3, PEER1);
+  db.find(0x10001, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+
+  db.insert(0x30001, 2, 3, PEER1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_EVICTED_PAGES), 1);
+  ASSERT_EQ(db.shard_at(0)->m_table_r()->size(), 2);
+
+  result.clear();
+  db.find(0x10001, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+  result.clear();
+  db.find(0x20001, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 0);
+  result.clear();
+  db.find(0x30001, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+}
+
+
+void test_Database_replacement()
+{
+  const ID PEER1 = 0x12345678;
+  const int DENSE = Castoro::Gateway::CachePagePool::POOL_DENSE;
+  const int flags[] = {
+    DENSE,
+    DENSE | Castoro::Gateway::CachePagePool::POOL_CLOCK,
+    DENSE | Castoro::Gateway::CachePagePool::POOL_SLRU,
+    DENSE | Castoro::Gateway::CachePagePool::POOL_ADMISSION
+  };
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+
+  for(int f=0; f<4; f++) {
+    DESCRIPTION("Database keeps found pages against a scan, flags=%d", flags[f]);
+    Castoro::Gateway::Database db(4, flags[f]);
+    db.set_expire(100);
+    db.set_status(PEER1, s);
+    for(int i=1; i<=4; i++) db.insert(0x10001 * i, 2, 3, PEER1);
+    db.find(0x10001 * 3, 2, 3, result, removed);
+    db.find(0x10001 * 4, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), 2);
+
+    // pages only inserted.
+    for(int i=5; i<=8; i++) db.insert(0x10001 * i, 2, 3, PEER1);
+    result.clear();
+    db.find(0x10001 * 3, 2, 3, result, removed);
+    db.find(0x10001 * 4, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), (f==0) ? 0 : 2);
+    ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_REPLACEMENT), (f==1) ? 1 : (f==2) ? 2 : 0);
+    ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ADMISSION), (f==3) ? 1 : 0);
+    ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_REJECTED_PAGES), (f==3) ? 4 : 0);
+    result.clear();
+  }
+}
+
+
+class CountingDumper: public Castoro::Gateway::CacheDumperAbstract {
+public:
+  inline CountingDumper() { count = 0; };
+  virtual bool operator()(uint64_t cid, uint32_t typ, uint32_t rev, ID peer) { count++; return true; };
+
+  int count;
+};
+
+void test_Database_sparse()
+{
+  typedef Castoro::Gateway::SparsePage<PEER_SLOTS_DEFAULT> TestSparse;
+  const ID PEER1 = 0x12345678;
+  const int capacity = TestSparse::CAPACITY;
+  Castoro::Gateway::Database db(2);
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+
+  db.set_expire(100);
+  db.set_status(PEER1, s);
+
+  DESCRIPTION("Database keeps sparse pages in units of a page");
+  for(int i=0; i<CACHEPAGE_UNITS*2; i++) db.insert(i * CACHEPAGE_SIZE + 1, 2, 3, PEER1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_SPARSE_PAGES), CACHEPAGE_UNITS*2);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_DENSE_PAGES), 0);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_FREE_PAGES), 0);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_EVICTED_PAGES), 0);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CONTENTS), CACHEPAGE_UNITS*2);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_PAGE_OCCUPANCY), 1);
+
+  DESCRIPTION("Database evicts the least recently used sparse page");
+  db.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+  db.insert(CACHEPAGE_UNITS*2 * CACHEPAGE_SIZE + 1, 2, 3, PEER1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_EVICTED_PAGES), 1);
+  result.clear();
+  db.find(CACHEPAGE_SIZE + 1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 0);
+  result.clear();
+  db.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+
+  DESCRIPTION("Database promotes the full sparse page");
+  for(int i=0; i<=capacity; i++) db.insert(i, 2, 3, PEER1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_DENSE_PAGES), 1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CONTENTS),
+            db.stat(Castoro::Gateway::Database::DSTAT_SPARSE_PAGES) + capacity + 1);
+  ASSERT(db.stat(Castoro::Gateway::Database::DSTAT_EVICTED_PAGES) >= CACHEPAGE_UNITS);
+  for(int i=0; i<=capacity; i++) {
+    result.clear();
+    db.find(i, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), 1);
+  }
+
+  DESCRIPTION("Database demotes the dense page");
+  for(int i=0; i<capacity-capacity/2; i++) db.remove(i, 2, 3, PEER1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_DENSE_PAGES), 1);
+  db.remove(capacity-capacity/2, 2, 3, PEER1);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_DENSE_PAGES), 0);
+  for(int i=0; i<=capacity; i++) {
+    result.clear();
+    db.find(i, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), (i>capacity-capacity/2) ? 1 : 0);
+  }
+
+  DESCRIPTION("Database dumps sparse and dense pages");
+  CountingDumper dumper;
+  ASSERT(db.dump(dumper));
+  ASSERT_EQ(dumper.count, db.stat(Castoro::Gateway::Database::DSTAT_CONTENTS));
+
+  DESCRIPTION("Database of dense pages");
+  Castoro::Gateway::Database dense(2, Castoro::Gateway::CachePagePool::POOL_DENSE);
+  dense.set_expire(100);
+  dense.set_status(PEER1, s);
+  dense.insert(1, 2, 3, PEER1);
+  ASSERT_EQ(dense.stat(Castoro::Gateway::Database::DSTAT_SPARSE_PAGES), 0);
+  ASSERT_EQ(dense.stat(Castoro::Gateway::Database::DSTAT_DENSE_PAGES), 1);
+}
+
+void test_Database_shards()
+{
+  const ID PEER1 = 0x12345678;
+  Castoro::Gateway::Database db(64, 0, 4);
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+
+  DESCRIPTION("Database shards");
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_SHARDS), 4);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ALLOCATE_PAGES), 64);
+  for(size_t i=0; i<4; i++) {
+    ASSERT_EQ(db.shard_at(i)->m_pool_r()->m_pages_r(), 16);
+  }
+
+  db.set_expire(100);
+  db.set_status(PEER1, s);
+  for(int i=0; i<40; i++) db.insert(i * CACHEPAGE_SIZE, 2, 3, PEER1);
+
+  size_t total = 0;
+  for(size_t i=0; i<4; i++) {
+    DESCRIPTION("Database shard(%d) has pages", i);
+    ASSERT(db.shard_at(i)->m_table_r()->size() > 0);
+    total += db.shard_at(i)->m_table_r()->size();
+  }
+  DESCRIPTION("Database shards are aggregated");
+  ASSERT_EQ(total, 40);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 40);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_SPARSE_PAGES), 40);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_FREE_PAGES), 60); // a page of each shard is divided.
+
+  for(int i=0; i<40; i++) {
+    result.clear();
+    db.find(i * CACHEPAGE_SIZE, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), 1);
+  }
+  db.find(40 * CACHEPAGE_SIZE, 2, 3, result, removed);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_REQUESTS), 41);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_HITS), 40);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_COUNT_CLEAR), 975);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_REQUESTS), 0);
+
+  DESCRIPTION("Database dumps all shards");
+  CountingDumper dumper;
+  ASSERT(db.dump(dumper));
+  ASSERT_EQ(dumper.count, 40);
+}
+
+
+void test_Database_many()
+{
+  const ID PEER1 = 0x12345678;
+  const ID PEER2 = 0x23456789;
+  const ID PEER3 = 0x3456789a;
+  Castoro::Gateway::Database db(64, 0, 4);
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::ArrayOfElement elements;
+  Castoro::Gateway::ArrayOfIndex order;
+  Castoro::Gateway::ArrayOfFound found;
+
+  db.set_expire(100);
+  db.set_status(PEER1, s);
+  db.set_status(PEER2, s);
+
+  DESCRIPTION("Database insert many");
+  for(int i=0; i<40; i++) {
+    elements.push_back(Castoro::Gateway::Element(i * CACHEPAGE_SIZE, 2, 3, PEER1));
+    elements.push_back(Castoro::Gateway::Element(i * CACHEPAGE_SIZE, 2, 3, PEER2));
+  }
+  db.insert(elements);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 40);
+
+  DESCRIPTION("Database order groups elements by shard");
+  db.order(elements, order);
+  ASSERT_EQ(order.size(), 80);
+  size_t runs = 1;
+  for(size_t i=1; i<order.size(); i++) {
+    const Castoro::Gateway::Element& x = elements[order[i-1]];
+    const Castoro::Gateway::Element& y = elements[order[i]];
+    if(db.shard_index(x.content_id, x.type)!=db.shard_index(y.content_id, y.type)) runs++;
+    else ASSERT(order[i-1] < order[i]);
+  }
+  ASSERT(runs <= 4);
+
+  DESCRIPTION("Database find many");
+  elements.clear();
+  for(int i=0; i<41; i++) {
+    elements.push_back(Castoro::Gateway::Element(i * CACHEPAGE_SIZE, 2, 3));
+  }
+  db.order(elements, order);
+  found.resize(elements.size());
+  db.find(elements, order, found);
+  for(int i=0; i<40; i++) {
+    ASSERT_EQ(found[i].peers.size(), 2);
+    ASSERT_EQ(found[i].peers.at(0), PEER1);
+    ASSERT_EQ(found[i].peers.at(1), PEER2);
+    ASSERT_EQ(found[i].peers.handle(0), db.m_peerh_r()->find(PEER1));
+    ASSERT_EQ(found[i].peers.handle(1), db.m_peerh_r()->find(PEER2));
+  }
+  ASSERT_EQ(found[40].peers.size(), 0);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_REQUESTS), 41);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_HITS), 40);
+
+  DESCRIPTION("Database remove many");
+  elements.clear();
+  for(int i=0; i<40; i++) {
+    elements.push_back(Castoro::Gateway::Element(i * CACHEPAGE_SIZE, 2, 3, PEER1));
+    elements.push_back(Castoro::Gateway::Element(i * CACHEPAGE_SIZE, 2, 3, PEER3)); // never inserted.
+  }
+  db.remove(elements);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 40);
+  ASSERT_EQ(db.m_peerh_r()->find(PEER3), 0);
+  for(int i=0; i<40; i++) {
+    Castoro::Gateway::FoundIds result;
+    bool removed = false;
+    db.find(i * CACHEPAGE_SIZE, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), 1);
+    ASSERT_EQ(result.at(0), PEER2);
+  }
+
+  elements.clear();
+  for(int i=0; i<40; i++) {
+    elements.push_back(Castoro::Gateway::Element(i * CACHEPAGE_SIZE, 2, 3, PEER2));
+  }
+  db.remove(elements);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 0);
+}
+
+
+class HexPeerName: public Castoro::Gateway::PeerNameAbstract {
+public:
+  virtual std::string name(ID peer) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llx", (unsigned long long)peer);
+    return std::string(buf);
+  };
+  virtual ID id(const std::string& name) {
+    return (ID)strtoull(name.c_str(), NULL, 16);
+  };
+};
+
+void test_Database_snapshot()
+{
+  const ID PEER1 = 0x12345678;
+  const ID PEER2 = 0x23456789;
+  const char* path = "/tmp/castoro_cache_snapshot_test.bin";
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+  HexPeerName names;
+
+  Castoro::Gateway::Database db(64, 0, 4);
+  db.set_expire(100);
+  db.set_status(PEER1, s);
+  db.set_status(PEER2, s);
+  for(int i=0; i<40; i++) db.insert(i * CACHEPAGE_SIZE + 1, 2, 3, PEER1);
+  for(int i=0; i<40; i+=2) db.insert(i * CACHEPAGE_SIZE + 1, 2, 3, PEER2);
+  db.insert(5, 2, 3, PEER1);
+  db.remove(5, 2, 3, PEER1);
+
+  DESCRIPTION("DatabaseSnapshot save");
+  Castoro::Gateway::DatabaseSnapshot saver(db);
+  ASSERT(saver.save(path, names));
+  ASSERT_EQ(saver.m_pages_r(), 40);
+
+  DESCRIPTION("DatabaseSnapshot load by mmap");
+  Castoro::Gateway::Database db2(64, 0, 4);
+  Castoro::Gateway::DatabaseSnapshot loader(db2);
+  ASSERT(loader.load(path, names));
+  ASSERT_EQ(loader.m_pages_r(), 40);
+  ASSERT_EQ(loader.m_mapped_r(), 40);
+  ASSERT_EQ(db2.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 40);
+  ASSERT_EQ(db2.stat(Castoro::Gateway::Database::DSTAT_READABLE_PEERS), 2);
+  DESCRIPTION("DatabaseSnapshot loaded pages are in LRU order");
+  for(size_t i=0; i<4; i++) {
+    Castoro::Gateway::CachePagePool* p1 = db.shard_at(i)->m_pool_r();
+    Castoro::Gateway::CachePagePool* p2 = db2.shard_at(i)->m_pool_r();
+    Castoro::Gateway::CachePageBase* c1 = p1->head();
+    Castoro::Gateway::CachePageBase* c2 = p2->head();
+    for(; c1 && c2; c1=p1->next(c1), c2=p2->next(c2)) {
+      ASSERT_EQ(c1->m_magic_r().content_id, c2->m_magic_r().content_id);
+    }
+    ASSERT(!c1 && !c2);
+  }
+
+  for(int i=0; i<40; i++) {
+    result.clear();
+    db2.find(i * CACHEPAGE_SIZE + 1, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), (i%2) ? 1 : 2);
+    ASSERT_EQ(result.at(0), PEER1);
+  }
+  result.clear();
+  db2.find(5, 2, 3, result, removed);
+  ASSERT_EQ(removed, true);
+
+  DESCRIPTION("DatabaseSnapshot loaded pages are writable");
+  db2.remove(1, 2, 3, PEER2);
+  db2.insert(100 * CACHEPAGE_SIZE, 2, 3, PEER2);
+  result.clear();
+  db2.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+  result.clear();
+  db.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 2);
+
+  DESCRIPTION("DatabaseSnapshot load into other shards by copy");
+  Castoro::Gateway::Database db3(64, 0, 3);
+  Castoro::Gateway::DatabaseSnapshot loader3(db3);
+  ASSERT(loader3.load(path, names));
+  ASSERT_EQ(loader3.m_pages_r(), 40);
+  ASSERT_EQ(loader3.m_mapped_r(), 0);
+  for(int i=0; i<40; i++) {
+    result.clear();
+    db3.find(i * CACHEPAGE_SIZE + 1, 2, 3, result, removed);
+    ASSERT_EQ(result.size(), (i%2) ? 1 : 2);
+  }
+
+  DESCRIPTION("DatabaseSnapshot rejects non-empty Database");
+  ASSERT(!loader3.load(path, names));
+
+  DESCRIPTION("DatabaseSnapshot rejects broken file");
+  FILE* f = fopen(path, "r+b");
+  fseek(f, 5000, SEEK_SET);
+  fputc(0xff, f);
+  fclose(f);
+  Castoro::Gateway::Database db4(64, 0, 4);
+  Castoro::Gateway::DatabaseSnapshot loader4(db4);
+  ASSERT(!loader4.load(path, names));
+  ASSERT_EQ(db4.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 0);
+  unlink(path);
+  ASSERT(!loader4.load(path, names));
+}
+
+
+// reads a pipe until EOF, for a dump to a non-blocking pipe.
+static void* dump_drainer(void* data)
+{
+  int fd = *(int*)data;
+  char buf[4096];
+  usleep(10000);
+  while(read(fd, buf, sizeof(buf))>0);
+  return NULL;
+}
+
+static void* dump_interrupter(void* data)
+{
+  usleep(50000);
+  ((Castoro::Gateway::DumpWriter*)data)->interrupt();
+  return NULL;
+}
+
+// a non-blocking pipe which is full.
+static void full_pipe(int fds[2])
+{
+  char buf[4096] = { 0 };
+  assert(pipe(fds)==0);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  while(write(fds[1], buf, sizeof(buf))>0);
+}
+
+void test_Database_dump()
+{
+  const ID PEER1 = 0x12345678;
+  const ID PEER2 = 0x23456789;
+  const char* path = "/tmp/castoro_cache_dump_test.bin";
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  HexPeerName names;
+  char buf[256];
+
+  Castoro::Gateway::Database db(64, 0, 4);
+  db.set_status(PEER1, s);
+  db.set_status(PEER2, s);
+  for(int i=0; i<1000; i++) db.insert(i * 7 + 1, 2, i % 100, PEER1);
+  for(int i=0; i<500; i++) db.insert(i * 7 + 1, 2, i % 100, PEER2);
+
+  DESCRIPTION("DumpWriter text");
+  FILE* f = tmpfile();
+  Castoro::Gateway::DumpWriter text(fileno(f), Castoro::Gateway::DumpWriter::FORMAT_TEXT, 100);
+  text.add_peer(PEER1, "peer1");
+  text.add_peer(PEER2, "peer2");
+  ASSERT(text.begin() && db.dump(text) && text.finish());
+  ASSERT_EQ(text.m_records_r(), 1500);
+  rewind(f);
+  int lines = 0, peer2 = 0;
+  while(fgets(buf, sizeof(buf), f)) {
+    if(strncmp(buf, "  peer2: ", 9)==0) peer2++;
+    lines++;
+  }
+  ASSERT_EQ(lines, 1501);
+  ASSERT_EQ(peer2, 500);
+  ASSERT(strcmp(buf, "\n")==0);
+  fclose(f);
+
+  DESCRIPTION("DumpWriter binary, only added peers");
+  f = tmpfile();
+  Castoro::Gateway::DumpWriter binary(fileno(f), Castoro::Gateway::DumpWriter::FORMAT_BINARY);
+  binary.add_peer(PEER2, "peer2");
+  ASSERT(binary.begin() && db.dump(binary) && binary.finish());
+  ASSERT_EQ(binary.m_records_r(), 500);
+  rewind(f);
+  Castoro::Gateway::DumpHeader header;
+  Castoro::Gateway::DumpRecord r;
+  ASSERT(fread(&header, sizeof(header), 1, f)==1);
+  ASSERT(memcmp(header.magic, "CSTRDUMP", 8)==0);
+  ASSERT_EQ(header.record_bytes, 20);
+  ASSERT(fread(&r, sizeof(r), 1, f)==1);
+  ASSERT_EQ(r.peer, Castoro::Gateway::DumpWriter::DUMP_PEER_NAME);
+  ASSERT_EQ(r.content_id, 1);
+  ASSERT_EQ(r.type, 5);
+  ASSERT(fread(buf, 5, 1, f)==1);
+  ASSERT(memcmp(buf, "peer2", 5)==0);
+  int records = 0;
+  while(fread(&r, sizeof(r), 1, f)==1) {
+    ASSERT_EQ(r.peer, 1);
+    ASSERT_EQ(r.type, 2);
+    records++;
+  }
+  ASSERT_EQ(records, 500);
+  fclose(f);
+
+  DESCRIPTION("DumpWriter from a snapshot");
+  Castoro::Gateway::DatabaseSnapshot saver(db);
+  ASSERT(saver.save(path, names));
+  db.insert(99999, 2, 3, PEER1);
+  Castoro::Gateway::Database* copy = Castoro::Gateway::DatabaseSnapshot::create(path);
+  ASSERT(copy!=NULL);
+  Castoro::Gateway::DatabaseSnapshot loader(*copy);
+  ASSERT(loader.load(path, names));
+  ASSERT_EQ(loader.m_mapped_r(), loader.m_pages_r());
+  CountingDumper dumper;
+  ASSERT(copy->dump(dumper));
+  ASSERT_EQ(dumper.count, 1500);
+  copy->~Database();
+  ruby_xfree((void*)copy);
+  ASSERT(Castoro::Gateway::DatabaseSnapshot::create("/nonexistent")==NULL);
+  unlink(path);
+
+#if CACHEPAGE_REVISION_BITS < 32
+  DESCRIPTION("Database dump skips overflowed revisions");
+  Castoro::Gateway::Database overflow(64, 0, 4);
+  overflow.set_status(PEER1, s);
+  overflow.insert(5, 1, 0x10001, PEER1);
+  overflow.insert(6, 1, 1, PEER1);
+  f = tmpfile();
+  Castoro::Gateway::DumpWriter skipped(fileno(f), Castoro::Gateway::DumpWriter::FORMAT_TEXT);
+  skipped.add_peer(PEER1, "peer1");
+  ASSERT(skipped.begin() && overflow.dump(skipped) && skipped.finish());
+  ASSERT_EQ(skipped.m_records_r(), 1);
+  rewind(f);
+  ASSERT(fgets(buf, sizeof(buf), f) && strcmp(buf, "  peer1: 6.1.1\n")==0);
+  fclose(f);
+  ASSERT_EQ(overflow.purge(PEER1), 2);
+#endif
+
+  DESCRIPTION("DumpWriter to a non-blocking pipe");
+  int fds[2];
+  pthread_t thread;
+  full_pipe(fds);
+  pthread_create(&thread, NULL, dump_drainer, &fds[0]);
+  Castoro::Gateway::DumpWriter nonblock(fds[1], Castoro::Gateway::DumpWriter::FORMAT_TEXT, 100);
+  nonblock.add_peer(PEER1, "peer1");
+  ASSERT(nonblock.begin() && db.dump(nonblock) && nonblock.finish());
+  ASSERT_EQ(nonblock.m_records_r(), 1001);
+  close(fds[1]);
+  pthread_join(thread, NULL);
+  close(fds[0]);
+
+  DESCRIPTION("DumpWriter interrupted while the pipe is full");
+  full_pipe(fds);
+  Castoro::Gateway::DumpWriter blocked(fds[1], Castoro::Gateway::DumpWriter::FORMAT_TEXT, 100);
+  blocked.add_peer(PEER1, "peer1");
+  pthread_create(&thread, NULL, dump_interrupter, &blocked);
+  ASSERT(!(blocked.begin() && db.dump(blocked) && blocked.finish()));
+  ASSERT_EQ(blocked.m_errno_r(), EINTR);
+  pthread_join(thread, NULL);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+
+void test_Database_purge()
+{
+  const ID PEER1 = 0x12345678;
+  const ID PEER2 = 0x23456789;
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  Castoro::Gateway::ArrayOfId peers;
+  bool removed = false;
+
+  Castoro::Gateway::Database db(256, 0, 4);
+  db.set_status(PEER1, s);
+  db.set_status(PEER2, s);
+  for(int i=0; i<3000; i++) db.insert(i * 7 + 1, 2, 3, PEER1);
+  for(int i=0; i<100; i++) db.insert(i * 7 + 1, 2, 3, PEER2);
+  for(int i=0; i<100; i++) db.insert(1000000 + i, 2, 3, PEER2);
+
+  DESCRIPTION("Database dump of peers");
+  CountingDumper all;
+  ASSERT(db.dump(all));
+  ASSERT_EQ(all.count, 3200);
+  CountingDumper some;
+  peers.push_back(PEER2);
+  ASSERT(db.dump(some, peers));
+  ASSERT_EQ(some.count, 200);
+  CountingDumper none;
+  peers.clear();
+  peers.push_back(0x999);
+  ASSERT(db.dump(none, peers));
+  ASSERT_EQ(none.count, 0);
+
+  DESCRIPTION("Database purge");
+  ASSERT_EQ(db.purge(0x999), 0);
+  uint64_t pages = db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES);
+  ASSERT_EQ(db.purge(PEER2), 200);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CONTENTS), 3000);
+  ASSERT(db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES) < pages);
+  ASSERT_EQ(db.purge(PEER2), 0);
+  result.clear();
+  db.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(result[0], PEER1);
+  result.clear();
+  db.find(1000000, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 0);
+  CountingDumper purged;
+  peers.clear();
+  peers.push_back(PEER2);
+  ASSERT(db.dump(purged, peers));
+  ASSERT_EQ(purged.count, 0);
+
+  DESCRIPTION("Database purge all");
+  ASSERT_EQ(db.purge(PEER1), 3000);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CONTENTS), 0);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_ACTIVE_PAGES), 0);
+
+  DESCRIPTION("Database insert after purge");
+  db.insert(1, 2, 3, PEER2);
+  result.clear();
+  db.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(result[0], PEER2);
+  CountingDumper again;
+  ASSERT(db.dump(again, peers));
+  ASSERT_EQ(again.count, 1);
+}
+
+
+void test_Database_histograms()
+{
+  typedef Castoro::Gateway::Database D;
+  const ID PEER1 = 0x12345678;
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+
+  D db(64, 0, 4);
+  db.set_status(PEER1, s);
+  for(int i=0; i<100; i++) db.insert(i * 7 + 1, 2, 3, PEER1);
+  for(int i=0; i<300; i++) db.find(i * 7 + 1, 2, 3, result, removed);
+  db.remove(1, 2, 3, PEER1);
+
+  DESCRIPTION("Database histograms");
+  Castoro::Gateway::LatencyHistogram find, insert, remove, wait;
+  db.histogram(D::DHIST_FIND, find);
+  db.histogram(D::DHIST_INSERT, insert);
+  db.histogram(D::DHIST_REMOVE, remove, true);
+  db.histogram(D::DHIST_LOCK_WAIT, wait);
+  ASSERT_EQ( find.count(), 300 );
+  ASSERT_EQ( insert.count(), 100 );
+  ASSERT_EQ( remove.count(), 1 );
+  ASSERT( find.m_max_r() > 0 );
+  ASSERT( find.percentile(50) <= find.percentile(99) );
+  ASSERT( wait.count() >= 802 );
+
+  DESCRIPTION("Database histograms clear");
+  Castoro::Gateway::LatencyHistogram cleared, waits;
+  db.histogram(D::DHIST_REMOVE, cleared);
+  ASSERT_EQ( cleared.count(), 0 );
+  db.histogram(D::DHIST_LOCK_WAIT, waits, true);
+  db.histogram(D::DHIST_LOCK_WAIT, cleared);
+  ASSERT_EQ( cleared.count(), 0 );
+}
+
+
+void test_NegativeCache()
+{
+  typedef Castoro::Gateway::NegativeCache N;
+  N nc(100, 1000, 100);
+  uint64_t k1 = N::key(1, 2, 3);
+  uint64_t k2 = N::key(1, 2, 4);
+
+  DESCRIPTION("NegativeCache initialize");
+  ASSERT_EQ( nc.m_capacity_r(), 128 );
+  ASSERT( k1 != k2 );
+  ASSERT( k1 != N::key(4097, 2, 3) );
+  ASSERT( k1 != N::key(1, 3, 3) );
+  ASSERT_EQ( nc.lookup(k1, 5000), N::NC_NONE );
+  ASSERT_EQ( nc.size(5000), 0 );
+
+  DESCRIPTION("NegativeCache mark/lookup");
+  nc.mark(k1, 5000);
+  ASSERT_EQ( nc.lookup(k1, 5000), N::NC_RELAYED );
+  ASSERT_EQ( nc.lookup(k1, 5099), N::NC_RELAYED );
+  ASSERT_EQ( nc.lookup(k1, 5100), N::NC_NEGATIVE );
+  ASSERT_EQ( nc.lookup(k1, 5999), N::NC_NEGATIVE );
+  ASSERT_EQ( nc.lookup(k1, 6000), N::NC_NONE );
+  ASSERT_EQ( nc.lookup(k2, 5500), N::NC_NONE );
+  ASSERT_EQ( nc.size(5500), 1 );
+  ASSERT_EQ( nc.size(6000), 0 );
+  nc.mark(k1, 6000);
+  ASSERT_EQ( nc.lookup(k1, 6500), N::NC_NEGATIVE );
+  ASSERT_EQ( nc.size(6500), 1 );
+  ASSERT_EQ( nc.m_relays_r(), 2 );
+
+  DESCRIPTION("NegativeCache erase");
+  ASSERT( nc.erase(k1) );
+  ASSERT( !nc.erase(k1) );
+  ASSERT_EQ( nc.lookup(k1, 6500), N::NC_NONE );
+  ASSERT_EQ( nc.m_cleared_r(), 1 );
+
+  DESCRIPTION("NegativeCache replaces the oldest");
+  for(uint32_t r=0; r<10000; r++) nc.mark(N::key(1, 2, r), 10000 + r);
+  ASSERT_EQ( nc.size(10000 + 9999), 128 );
+  ASSERT_EQ( nc.lookup(N::key(1, 2, 9999), 10000 + 9999), N::NC_RELAYED );
+  ASSERT_EQ( nc.lookup(N::key(1, 2, 0), 10000 + 999), N::NC_NONE );
+
+  DESCRIPTION("NegativeCache clear");
+  nc.suppressed();
+  ASSERT_EQ( nc.m_suppressed_r(), 1 );
+  nc.clear();
+  ASSERT_EQ( nc.size(10000 + 9999), 0 );
+  ASSERT_EQ( nc.m_relays_r(), 0 );
+  ASSERT_EQ( nc.m_suppressed_r(), 0 );
+}
+
+
+void test_Database_negative()
+{
+  typedef Castoro::Gateway::Database D;
+  const ID PEER1 = 0x12345678;
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+
+  D db(64, 0, 4);
+  db.set_status(PEER1, s);
+
+  DESCRIPTION("Database relay without negative cache");
+  for(int i=0; i<3; i++) ASSERT( db.relay(1, 2, 3) );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_TTL), 0 );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_RELAYS), 0 );
+
+  DESCRIPTION("Database relay in grace");
+  db.set_negative(1000, 60000000000ULL, 60000000000ULL);
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_TTL), 60000 );
+  for(int i=0; i<3; i++) ASSERT( db.relay(1, 2, 3) );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_RELAYS), 1 );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_SUPPRESSED), 0 );
+
+  DESCRIPTION("Database relay suppressed");
+  db.set_negative(1000, 60000000000ULL, 0);
+  ASSERT( db.relay(1, 2, 3) );
+  ASSERT( !db.relay(1, 2, 3) );
+  ASSERT( !db.relay(1, 2, 3) );
+  ASSERT( db.relay(1, 2, 4) );
+  ASSERT( db.relay(4097, 2, 3) );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_ENTRIES), 3 );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_RELAYS), 3 );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_SUPPRESSED), 2 );
+
+  DESCRIPTION("Database relay after insert");
+  db.insert(1, 2, 3, PEER1);
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_CLEARED), 1 );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_ENTRIES), 2 );
+  ASSERT( db.relay(1, 2, 3) );
+  Castoro::Gateway::ArrayOfElement elements;
+  elements.push_back(Castoro::Gateway::Element(1, 2, 4, PEER1));
+  elements.push_back(Castoro::Gateway::Element(4097, 2, 3, PEER1));
+  db.insert(elements);
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_CLEARED), 3 );
+  ASSERT( db.relay(4097, 2, 3) );
+
+  DESCRIPTION("Database relay after ttl");
+  db.set_negative(1000, 1000000, 0);
+  ASSERT( db.relay(1, 2, 3) );
+  ASSERT( !db.relay(1, 2, 3) );
+  usleep(2000);
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_ENTRIES), 0 );
+  ASSERT( db.relay(1, 2, 3) );
+
+  DESCRIPTION("Database relay disabled");
+  db.set_negative(1000, 0, 0);
+  ASSERT( db.relay(1, 2, 3) );
+  ASSERT( db.relay(1, 2, 3) );
+  ASSERT_EQ( db.stat(D::DSTAT_NEGATIVE_ENTRIES), 0 );
+}
+
+
+void test_Database_slots()
+{
+  const ID PEERS[] = { 0x1001, 0x1002, 0x1003, 0x1004, 0x1005, 0x1006 };
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+  Castoro::Gateway::FoundIds result;
+  bool removed = false;
+
+  DESCRIPTION("Database of 5 peer slots");
+  Castoro::Gateway::Database db5(16, 0, 2, 5);
+  ASSERT_EQ(db5.stat(Castoro::Gateway::Database::DSTAT_PEER_SLOTS), 5);
+  ASSERT_EQ(db5.shard_at(0)->m_pool_r()->m_page_bytes_r(), Castoro::Gateway::CachePageBase::size_of(5));
+  db5.set_expire(100);
+  for(int i=0; i<6; i++) db5.set_status(PEERS[i], s);
+  for(int i=0; i<5; i++) db5.insert(1, 2, 3, PEERS[i]);
+  db5.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 5);
+  for(int i=0; i<5; i++) ASSERT_EQ(result.at(i), PEERS[i]);
+
+  DESCRIPTION("Database of 5 peer slots keeps the most recent peers");
+  db5.insert(1, 2, 3, PEERS[5]);
+  result.clear();
+  db5.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 5);
+  ASSERT_EQ(result.at(0), PEERS[1]);
+  ASSERT_EQ(result.at(4), PEERS[5]);
+  for(int i=1; i<6; i++) db5.remove(1, 2, 3, PEERS[i]);
+  result.clear();
+  db5.find(1, 2, 3, result, removed);
+  ASSERT(result.empty());
+
+  DESCRIPTION("Database of 2 peer slots");
+  Castoro::Gateway::Database db2(16, 0, 1, 2);
+  ASSERT_EQ(db2.stat(Castoro::Gateway::Database::DSTAT_PEER_SLOTS), 2);
+  ASSERT(db2.stat(Castoro::Gateway::Database::DSTAT_ARENA_BYTES) < db5.stat(Castoro::Gateway::Database::DSTAT_ARENA_BYTES));
+  db2.set_expire(100);
+  for(int i=0; i<3; i++) db2.set_status(PEERS[i], s);
+  for(int i=0; i<3; i++) db2.insert(1, 2, 3, PEERS[i]);
+  result.clear();
+  db2.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 2);
+  ASSERT_EQ(result.at(0), PEERS[1]);
+  ASSERT_EQ(result.at(1), PEERS[2]);
+
+  DESCRIPTION("DatabaseSnapshot rejects other peer slots");
+  const char* path = "/tmp/castoro_cache_slots_test.bin";
+  HexPeerName names;
+  Castoro::Gateway::DatabaseSnapshot saver(db2);
+  ASSERT(saver.save(path, names));
+  Castoro::Gateway::Database db3(16, 0, 1, 3);
+  Castoro::Gateway::DatabaseSnapshot loader3(db3);
+  ASSERT(!loader3.load(path, names));
+  Castoro::Gateway::Database db2b(16, 0, 1, 2);
+  Castoro::Gateway::DatabaseSnapshot loader2(db2b);
+  ASSERT(loader2.load(path, names));
+  result.clear();
+  db2b.find(1, 2, 3, result, removed);
+  ASSERT_EQ(result.size(), 2);
+  unlink(path);
+}
+
+
+class ConcurrentReader {
+public:
+  Castoro::Gateway::Database* db;
+  ID peer;
+  int loops;
+  int errors;
+};
+
+void* concurrent_reader(void* data)
+{
+  ConcurrentReader* r = (ConcurrentReader*)data;
+  for(int i=0; i<r->loops; i++) {
+    Castoro::Gateway::FoundIds result;
+    bool removed = false;
+    r->db->find((i % 50) * CACHEPAGE_SIZE, 2, 3, result, removed);
+    if((result.size()!=1) || (result.at(0)!=r->peer) || removed) r->errors++;
+  }
+  return NULL;
+}
+
+void test_Database_concurrent()
+{
+  const ID PEER1 = 0x12345678;
+  const int READERS = 4, LOOPS = 200000;
+  Castoro::Gateway::Database db(400, 0, 4);
+  Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
+
+  db.set_expire(100);
+  db.set_status(PEER1, s);
+  for(int i=0; i<50; i++) db.insert(i * CACHEPAGE_SIZE, 2, 3, PEER1);
+
+  DESCRIPTION("Database#find while writing");
+  pthread_t threads[READERS];
+  ConcurrentReader readers[READERS];
+  for(int i=0; i<READERS; i++) {
+    readers[i].db = &db;
+    readers[i].peer = PEER1;
+    readers[i].loops = LOOPS;
+    readers[i].errors = 0;
+    pthread_create(&threads[i], NULL, concurrent_reader, &readers[i]);
+  }
+  for(int i=0; i<20000; i++) {
+    if(i & 1) {
+      db.remove((i % 50) * CACHEPAGE_SIZE + 1, 2, 3, PEER1);
+    } else {
+      db.insert((i % 50) * CACHEPAGE_SIZE + 1, 2, 3, PEER1);
+    }
+  }
+  for(int i=0; i<READERS; i++) {
+    pthread_join(threads[i], NULL);
+    ASSERT_EQ(readers[i].errors, 0);
+  }
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_REQUESTS), READERS * LOOPS);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_CACHE_HITS), READERS * LOOPS);
+  ASSERT_EQ(db.stat(Castoro::Gateway::Database::DSTAT_EVICTED_PAGES), 0);
+}
+
+
 void test_Database_random()
 {
   Castoro::Gateway::Database db(1000);
   Castoro::Gateway::PeerStatus s(1000, 0, Castoro::Gateway::DS_ACTIVE);
   //Castoro::Gateway::ArrayOfPeerWithBase result;
-  Castoro::Gateway::ArrayOfId result;
+  Castoro::Gateway::FoundIds result;
   ID bases[100];
   bool removed;
 
@@ -578,7 +2372,7 @@ void test_Database_random()
       found++;
     }
     if((count & 0xFFFF)==0) {
-      printf("  m_table :%4u", db.m_table_r()->size());
+      printf("  m_table :%4zu", db.shard_at(0)->m_table_r()->size());
       printf("  m_status :%4u", db.m_status_r()->size());
       printf("  m_peerh.v :%4u", db.m_peerh_r()->m_hash2id_r()->size());
       printf("  m_peerh.m :%4u", db.m_peerh_r()->m_id2hash_r()->size());
@@ -598,26 +2392,51 @@ void test_Database_random()
 int main(int argc, char* argv[])
 {
   test_PeerHash();
-  test_ID3();
+  test_PageSlot();
   test_CachePagePool();
+  test_CachePagePool_units();
+  test_CachePagePool_replacement();
   test_CachePage();
+  test_SparsePage();
+  test_RevisionHash();
+  test_CachePageIndex();
+  test_PeerPageIndex();
+  test_NegativeCache();
+  test_LatencyHistogram();
+  test_PeerStatusTable();
+  test_PeerStatusTable_select();
   if((argc>1) && (strcmp(argv[1], "all")==0)) {
     test_PeerStatus();
     test_Database_status();
   }
   test_Database();
+  test_Database_lru();
+  test_Database_replacement();
+  test_Database_sparse();
+  test_Database_shards();
+  test_Database_many();
+  test_Database_snapshot();
+  test_Database_dump();
+  test_Database_purge();
+  test_Database_histograms();
+  test_Database_negative();
+  test_Database_slots();
+  test_Database_concurrent();
 
   test_Database_random();
+  bench_CachePageIndex();
+  bench_PageSlot();
 
   printf("\n%d test(s) passed.\n", g_testcount);
 
-  Castoro::Gateway::CachePage cp;
-  printf("sizeof(CachePage) = %d\n", sizeof(cp));
-  uint64_t  page = 1024*1024*1024;  // 1GB
-  page /= sizeof(cp);
-  page *= 4096;
-  page /= 1024*1024;
-  printf("%lld Mega contents per GiB.\n", page);
+  for(int n=PEER_SLOTS_MIN; n<=PEER_SLOTS_MAX; n++) {
+    uint64_t  page = 1024*1024*1024;  // 1GB
+    page /= Castoro::Gateway::CachePageBase::size_of(n);
+    page *= 4096;
+    page /= 1024*1024;
+    printf("sizeof(CachePage<%d>) = %d, %llu Mega contents per GiB.\n",
+           n, (int)Castoro::Gateway::CachePageBase::size_of(n), (unsigned long long)page);
+  }
   
   return 0;
 }
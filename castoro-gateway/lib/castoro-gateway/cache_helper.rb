@@ -24,7 +24,8 @@ module Castoro
     def initialize logger, config
       @logger             = logger
       @return_peer_number = config["return_peer_number"]
-      @filter             = eval(config["filter"].to_s) || Proc.new{ |peers| peers }
+      @custom_filter      = eval(config["filter"].to_s)
+      @filter             = @custom_filter || Proc.new{ |peers| peers }
 
       # converter
       converter_options = {}.tap { |opt|
@@ -35,6 +36,7 @@ module Castoro
       # cache options.
       options = {}.tap { |h| (config["options"] || {}).each { |k,v| h[k.to_sym] = v } }
       options[:watchdog_limit] = config["watchdog_limit"] if config["watchdog_limit"]
+      options[:peer_size] ||= peer_size(config["replication_count"]) if config["replication_count"]
       options[:logger] = @logger
 
       klass    = ::Castoro::Cache
@@ -46,6 +48,9 @@ module Castoro
       rescue NoMemoryError
         raise GatewayError, $!.message
       end
+      @snapshot = config["snapshot"]
+      load_snapshot if @snapshot
+
 
       @weight  = weighting_coefficient @return_peer_number
     end
@@ -85,6 +90,19 @@ module Castoro
       }
     end
 
+    ##
+    # whether the Get of basket which missed the cache should be relayed.
+    # false while the relay of basket got no answers, when the cache has
+    # the negative cache of relayed misses.
+    #
+    def relay? basket
+      raise "Nil cannot be set to basket." if basket.nil?
+      return true unless @cache.respond_to?(:relay)
+      basket = basket.to_basket
+
+      @cache.relay(basket.content, basket.type, basket.revision)
+    end
+
     ##
     # fetch satisfied Peer.
     #
@@ -97,9 +115,15 @@ module Castoro
     # fetch satisfied Peer
     # and return the array that preferentially sorted by capacity.
     #
+    # peers are sampled natively weighted by capacity when the cache has
+    # #select_peers, the filter only narrows down the candidates.
     #
     def preferentially_find_peers hints = {}
-      preferentially_sort_by_capacity find_peers(hints)
+      return preferentially_sort_by_capacity(find_peers(hints)) unless @cache.respond_to?(:select_peers)
+
+      length = hints["length"].to_i
+      candidates = @filter.call(@cache.find_peers(length), hints["class"]) if @custom_filter
+      @cache.select_peers(length, @return_peer_number, candidates)
     end
 
     ##
@@ -136,12 +160,34 @@ module Castoro
         :CACHE_ALLOCATE_PAGES    => @cache.stat(::Castoro::Cache::DSTAT_ALLOCATE_PAGES),
         :CACHE_FREE_PAGES        => @cache.stat(::Castoro::Cache::DSTAT_FREE_PAGES),
         :CACHE_ACTIVE_PAGES      => @cache.stat(::Castoro::Cache::DSTAT_ACTIVE_PAGES),
+        :CACHE_EVICTED_PAGES     => @cache.stat(::Castoro::Cache::DSTAT_EVICTED_PAGES),
+        :CACHE_SPARSE_PAGES      => @cache.stat(::Castoro::Cache::DSTAT_SPARSE_PAGES),
+        :CACHE_DENSE_PAGES       => @cache.stat(::Castoro::Cache::DSTAT_DENSE_PAGES),
+        :CACHE_CONTENTS          => @cache.stat(::Castoro::Cache::DSTAT_CONTENTS),
+        :CACHE_PAGE_OCCUPANCY    => @cache.stat(::Castoro::Cache::DSTAT_PAGE_OCCUPANCY),
         :CACHE_HAVE_STATUS_PEERS => @cache.stat(::Castoro::Cache::DSTAT_HAVE_STATUS_PEERS),
         :CACHE_ACTIVE_PEERS      => @cache.stat(::Castoro::Cache::DSTAT_ACTIVE_PEERS),
         :CACHE_READABLE_PEERS    => @cache.stat(::Castoro::Cache::DSTAT_READABLE_PEERS),
+      }.tap { |h|
+        next unless @cache.respond_to?(:relay)
+        h[:CACHE_NEGATIVE_TTL]        = @cache.stat(::Castoro::Cache::DSTAT_NEGATIVE_TTL)
+        h[:CACHE_NEGATIVE_ENTRIES]    = @cache.stat(::Castoro::Cache::DSTAT_NEGATIVE_ENTRIES)
+        h[:CACHE_NEGATIVE_RELAYS]     = @cache.stat(::Castoro::Cache::DSTAT_NEGATIVE_RELAYS)
+        h[:CACHE_NEGATIVE_SUPPRESSED] = @cache.stat(::Castoro::Cache::DSTAT_NEGATIVE_SUPPRESSED)
+        h[:CACHE_NEGATIVE_CLEARED]    = @cache.stat(::Castoro::Cache::DSTAT_NEGATIVE_CLEARED)
       }
     end
 
+    ##
+    # The latency histograms of the cache are returned,
+    # percentile summaries by usec. Empty when the cache has no histograms.
+    #
+    def histograms clear = false
+      @logger.info { "histograms request accepted." }
+      return {} unless @cache.respond_to?(:histograms)
+      @cache.histograms clear
+    end
+
     ##
     # The status of hash representation is returned.
     #
@@ -178,6 +224,21 @@ module Castoro
       end
     end
     
+    ##
+    # the peer is removed from all cache records.
+    # the number of removed records is returned,
+    # nil when the cache cannot purge by itself.
+    #
+    # === Args
+    #
+    # +peer+ :: peer name.
+    #
+    def purge peer
+      return nil unless @cache.respond_to?(:peers)
+      @logger.info { "purge request accepted. - #{peer}" }
+      @cache.peers[peer].purge
+    end
+
     ##
     # get count of active peers.
     #
@@ -206,8 +267,40 @@ module Castoro
       }
     end
 
+    ##
+    # cache records is saved to the snapshot file.
+    #
+    def save_snapshot
+      return nil unless @snapshot and @cache.respond_to?(:save)
+      pages = @cache.save @snapshot
+      @logger.info { "cache snapshot saved. - [#{@snapshot}] #{pages} pages" }
+      pages
+    rescue => e
+      @logger.warn { "cache snapshot could not be saved. - [#{@snapshot}] #{e.message}" }
+      nil
+    end
+
     private
 
+    ##
+    # cache records is restored from the snapshot file.
+    #
+    def load_snapshot
+      return unless @cache.respond_to?(:load)
+      if @cache.load @snapshot
+        @logger.info { "cache snapshot loaded. - [#{@snapshot}]" }
+      else
+        @logger.info { "cache snapshot was not loaded. - [#{@snapshot}]" }
+      end
+    end
+
+    ##
+    # peers kept for each content, as many as replicas within the range of cache.
+    #
+    def peer_size replication_count
+      [[replication_count.to_i, ::Castoro::Cache::PEER_SLOTS_MIN].max, ::Castoro::Cache::PEER_SLOTS_MAX].min
+    end
+
     ##
     # weighting coefficient for #preferentially_find_peers is returned.
     #
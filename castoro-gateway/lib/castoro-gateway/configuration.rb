@@ -41,6 +41,7 @@ module Castoro; class Gateway
       "filter" => nil,
       "basket_basedir" => "/expdsk",
       "options" => {},
+      "snapshot" => nil,
     }.freeze
     CONVERTER_SETTINGS = {
       "Dec40Seq" => "0-65535",
@@ -139,14 +139,23 @@ module Castoro
         @repository.peers_status
       end
 
+      def histograms clear = false
+        @repository.histograms clear
+      end
+
       def dump io
         dump_internal io
       end
 
       def purge *peers
+        results = {}.tap { |r| peers.each { |p| r[p] = @repository.purge p } }
+        peers = peers.select { |p| results[p].nil? }
+        return results if peers.empty?
+
+        # the cache cannot purge by itself, records are dropped one by one.
         io = StringIO.new
         dump_internal io, peers
-        results = {}.tap { |r| peers.each { |p| r[p] = 0 } }
+        peers.each { |p| results[p] = 0 }
         io.string.split(/\n/).each { |line|
           p, b = line.split(":", 2).map(&:strip)
           if b and p
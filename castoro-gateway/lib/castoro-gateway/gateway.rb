@@ -181,6 +181,7 @@ module Castoro
         @watchdog_sender.stop if @watchdog_sender
         @watchdog_sender = nil
 
+        @repository.save_snapshot if @repository.respond_to?(:save_snapshot)
         @repository = nil
         @islandStatus = nil # It should already be stopped by workers.stop(). 
 
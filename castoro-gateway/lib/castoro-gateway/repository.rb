@@ -102,6 +102,20 @@ module Castoro
         @cache.erase_by_peer_and_key peer, basket
       end
 
+      ##
+      # purge cache records of the peer.
+      # the number of removed records is returned,
+      # nil when the cache cannot purge by itself.
+      #
+      # === Args
+      #
+      # +peer+   :: hostname for peer.
+      #
+      def purge peer
+        @logger.info { "purge cache <#{peer}>" }
+        @cache.purge peer
+      end
+
       ##
       # update watchdog status for cache.
       #
@@ -121,6 +135,17 @@ module Castoro
         @cache.status
       end
 
+      ##
+      # The latency histograms of the cache are returned.
+      #
+      # === Args
+      #
+      # +clear+ :: histograms are cleared after read, when true.
+      #
+      def histograms clear = false
+        @cache.histograms clear
+      end
+
       ## 
       # The status of array representation is returned.
       #
@@ -140,6 +165,13 @@ module Castoro
         @cache.dump io, peers
       end 
 
+      ##
+      # cache records is saved to the snapshot file.
+      #
+      def save_snapshot
+        @cache.save_snapshot
+      end
+
       ##
       # get storables.
       #
@@ -167,6 +199,21 @@ module Castoro
         end
       end
 
+      ##
+      # unless relays of the basket got no answers, block is evaluated.
+      #
+      # === Args
+      #
+      # +command+ :: get command instance which missed the cache.
+      #
+      def if_relay_is_needed command
+        if @cache.relay? command.basket
+          yield
+        else
+          @logger.info { "[key:#{command.basket}] relay suppressed by negative cache" }
+        end
+      end
+
     private
 
       ##
@@ -185,6 +185,24 @@ module Castoro
         exit(1)
       end
 
+      def self.histograms options
+        ret = connect_to_console(options[:ip].to_s, options[:port].to_i) { |obj|
+          obj.histograms options[:clear]
+        }
+
+        columns = [:count, :mean, :p50, :p90, :p99, :p999, :max]
+        width = (ret.keys.map { |k| k.to_s.length } + [9]).max
+        STDOUT.puts "#{"%-#{width}s" % "(usec)"} #{columns.map { |c| "%10s" % c }.join(" ")}"
+        ret.each { |k, v|
+          values = columns.map { |c| c == :count ? "%10d" % v[c] : "%10.3f" % v[c] }
+          STDOUT.puts "#{"%-#{width}s" % k} #{values.join(" ")}"
+        }
+      rescue => e
+        STDERR.puts "--- Castoro::Gateway error! - #{e.message}"
+        STDERR.puts e.backtrace.join("\n\t") if options[:verbose]
+        exit(1)
+      end
+
       def self.dump options
         connect_to_console(options[:ip].to_s, options[:port].to_i) { |obj| obj.dump STDOUT }
   
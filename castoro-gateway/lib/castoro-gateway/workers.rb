@@ -64,7 +64,7 @@ module Castoro
                       # A packet relay is carried out when peers is less than the specified number.
                       @repository.if_replication_is_insufficient(res.paths.keys) { s.multicast h, d }
                     else
-                      s.multicast h, d
+                      @repository.if_relay_is_needed(d) { s.multicast h, d }
                     end
                   end
 
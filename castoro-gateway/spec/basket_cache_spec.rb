@@ -83,6 +83,7 @@ describe Castoro::BasketCache do
       res[:CACHE_ALLOCATE_PAGES].should    == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
       res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
       res[:CACHE_ACTIVE_PAGES].should      == 0 
+      res[:CACHE_EVICTED_PAGES].should     == 0
       res[:CACHE_HAVE_STATUS_PEERS].should == 1
       res[:CACHE_ACTIVE_PEERS].should      == 1
       res[:CACHE_READABLE_PEERS].should    == 1
@@ -117,7 +118,8 @@ describe Castoro::BasketCache do
       res[:CACHE_HITS].should              == 0
       res[:CACHE_COUNT_CLEAR].should       == 0
       res[:CACHE_ALLOCATE_PAGES].should    == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
-      res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - res[:CACHE_ACTIVE_PAGES]
+      # three sparse pages share one page.
+      res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - 1
       res[:CACHE_ACTIVE_PAGES].should      == 3 
       res[:CACHE_HAVE_STATUS_PEERS].should == 0
       res[:CACHE_ACTIVE_PEERS].should      == 0
@@ -133,6 +135,15 @@ describe Castoro::BasketCache do
       io.read.should == "  peer102: 1357902.0.3\n  peer101: 4567890.1.2\n  peer100: 291.1.3\n\n"
     end
 
+    it "purge should remove items of the peer." do
+      @cache.purge("peer100").should == 1
+      @cache.purge("peer100").should == 0
+      io = StringIO.new
+      @cache.dump io
+      io.rewind
+      io.read.should == "  peer102: 1357902.0.3\n  peer101: 4567890.1.2\n\n"
+    end
+
     context "and remove it with 1 storage is active" do
       before do
         @cache.set_status "peer100", ACTIVE, available
@@ -191,7 +202,8 @@ describe Castoro::BasketCache do
         res[:CACHE_HITS].should              == 0
         res[:CACHE_COUNT_CLEAR].should       == 0
         res[:CACHE_ALLOCATE_PAGES].should    == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
-        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - res[:CACHE_ACTIVE_PAGES]
+        # three sparse pages share one page.
+        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - 1
         res[:CACHE_ACTIVE_PAGES].should      == 3 
         res[:CACHE_HAVE_STATUS_PEERS].should == 0
         res[:CACHE_ACTIVE_PEERS].should      == 0
@@ -235,13 +247,27 @@ describe Castoro::BasketCache do
         res[:CACHE_HITS].should              == 3
         res[:CACHE_COUNT_CLEAR].should       == 1000
         res[:CACHE_ALLOCATE_PAGES].should    == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
-        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - res[:CACHE_ACTIVE_PAGES]
+        # three sparse pages share one page.
+        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - 1
         res[:CACHE_ACTIVE_PAGES].should      == 3 
         res[:CACHE_HAVE_STATUS_PEERS].should == 3
         res[:CACHE_ACTIVE_PEERS].should      == 3
         res[:CACHE_READABLE_PEERS].should    == 3
       end
 
+      it "#histograms return the latencies after #find_by_key." do
+        @cache.find_by_key(keys[0])
+        @cache.find_by_key(keys[1])
+
+        res = @cache.histograms
+        res.keys.should == [:find, :insert, :remove, :lock_wait]
+        res[:find][:count].should == 2
+        res[:insert][:count].should == 3
+        res[:find][:p50].should <= res[:find][:max]
+        @cache.histograms(true)[:find][:count].should == 2
+        @cache.histograms[:find][:count].should == 0
+      end
+
       it "#peersStatus return the available and active status" do
         res = @cache.peers_status
         res.length.should == 3
@@ -281,7 +307,8 @@ describe Castoro::BasketCache do
         res[:CACHE_HITS].should              == 3
         res[:CACHE_COUNT_CLEAR].should       == 1000
         res[:CACHE_ALLOCATE_PAGES].should    == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
-        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - res[:CACHE_ACTIVE_PAGES]
+        # three sparse pages share one page.
+        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - 1
         res[:CACHE_ACTIVE_PAGES].should      == 3 
         res[:CACHE_HAVE_STATUS_PEERS].should == 3
         res[:CACHE_ACTIVE_PEERS].should      == 0
@@ -321,7 +348,8 @@ describe Castoro::BasketCache do
         res[:CACHE_HITS].should              == 0
         res[:CACHE_COUNT_CLEAR].should       == 0
         res[:CACHE_ALLOCATE_PAGES].should    == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE
-        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - res[:CACHE_ACTIVE_PAGES]
+        # three sparse pages share one page.
+        res[:CACHE_FREE_PAGES].should        == CACHE_SETTINGS["cache_size"] / Castoro::Cache::PAGE_SIZE - 1
         res[:CACHE_ACTIVE_PAGES].should      == 3 
         res[:CACHE_HAVE_STATUS_PEERS].should == 3
         res[:CACHE_ACTIVE_PEERS].should      == 0
@@ -342,6 +370,45 @@ describe Castoro::BasketCache do
     end
   end
 
+  context "relays of missed baskets" do
+    it "should always relay without negative cache." do
+      @cache = Castoro::BasketCache.new Logger.new(nil), CACHE_SETTINGS
+      3.times { @cache.relay?(keys[0]).should be_true }
+      @cache.status[:CACHE_NEGATIVE_TTL].should == 0
+    end
+
+    context "with negative cache" do
+      before do
+        settings = CACHE_SETTINGS.merge("options" => { "negative_ttl" => 60, "negative_grace" => 0 })
+        @cache = Castoro::BasketCache.new Logger.new(nil), settings
+      end
+
+      it "should suppress relays of the basket until it is inserted." do
+        @cache.relay?(keys[0]).should be_true
+        @cache.relay?(keys[0]).should be_false
+        @cache.relay?(keys[1]).should be_true
+        @cache.insert keys[0], "peer100"
+        @cache.relay?(keys[0]).should be_true
+      end
+
+      it "#status should return the negative cache counters." do
+        @cache.relay?(keys[0])
+        @cache.relay?(keys[0])
+        @cache.insert keys[0], "peer100"
+        res = @cache.status
+        res[:CACHE_NEGATIVE_TTL].should        == 60000
+        res[:CACHE_NEGATIVE_ENTRIES].should    == 0
+        res[:CACHE_NEGATIVE_RELAYS].should     == 1
+        res[:CACHE_NEGATIVE_SUPPRESSED].should == 1
+        res[:CACHE_NEGATIVE_CLEARED].should    == 1
+      end
+    end
+
+    after do
+      @cache = nil
+    end
+  end
+
   context "peers matching" do
     before do
       logger = Logger.new nil
@@ -416,7 +483,7 @@ describe Castoro::BasketCache do
         }
         rank = rank.sort { |x, y| y[1] <=> x[1] }.map{ |x| x[0] }
         rank.first.should == "peer104"
-        rank.last.should  == "peer100"
+        rank.index("peer100").should > rank.index("peer103")
         res =  @cache.preferentially_find_peers({"length" => 50})
         res =~ ["peer104", "peer103", "peer102", "peer101", "peer100"]
       end
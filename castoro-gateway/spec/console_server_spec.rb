@@ -50,6 +50,11 @@ describe Castoro::Gateway::IslandConsoleServer do
         "peer3" => {:status=>30, :available=>10}
       }
     }
+    @r.stub!(:histograms).and_return {
+      {
+        :find => {:count=>3, :mean=>0.5, :p50=>0.4, :p90=>0.9, :p99=>0.9, :p999=>0.9, :max=>0.9},
+      }
+    }
     @r.stub!(:dump).and_return { |io, peers|
       cached.each { |c|
         io.puts "  #{c[:p]}: #{c[:b]}" if peers.nil? or peers.include?(c[:p])
@@ -60,6 +65,7 @@ describe Castoro::Gateway::IslandConsoleServer do
     @r.stub!(:drop).and_return { |b, p|
       cached.delete :b => b, :p => p
     }
+    @r.stub!(:purge).and_return(nil)
 
     @c = Castoro::Gateway::IslandConsoleServer.new @logger, @r, @ip, @port
   end
@@ -86,6 +92,15 @@ describe Castoro::Gateway::IslandConsoleServer do
     end
   end
 
+  describe "#histograms" do
+    it "repository should receive histograms" do
+      @r.should_receive(:histograms).with(true)
+      @c.histograms(true).should == {
+        :find => {:count=>3, :mean=>0.5, :p50=>0.4, :p90=>0.9, :p99=>0.9, :p999=>0.9, :max=>0.9},
+      }
+    end
+  end
+
   describe "#dump" do
     it "repository should receive dump" do
       io = StringIO.new
@@ -124,6 +139,16 @@ EOF
 EOF
       end
     end
+
+    context "when the cache purges by itself" do
+      it "repository should receive purge, not drop" do
+        @r.should_receive(:purge).with("peer1").exactly(1).and_return(2)
+        @r.should_receive(:purge).with("peer3").exactly(1).and_return(2)
+        @r.should_not_receive(:drop)
+        @r.should_not_receive(:dump)
+        @c.purge("peer1", "peer3").should == { "peer1" => 2, "peer3" => 2 }
+      end
+    end
   end
 
   context "when start" do
@@ -215,6 +215,40 @@ describe Castoro::Gateway::Repository do
       end
     end 
 
+    context "when get histograms" do
+      it "cache#histograms should be called once." do
+        @cache.stub!(:histograms).and_return({:find => {:count=>1}})
+        @cache.should_receive(:histograms).with(false).exactly(1)
+
+        repository = Castoro::Gateway::Repository.new @logger, @config
+        repository.histograms.should == {:find => {:count=>1}}
+      end
+    end
+
+    context "when relay the missed get command" do
+      it "should evaluate yield unless relays are suppressed." do
+        key     = Castoro::BasketKey.new 1, 2, 3
+        command = Castoro::Protocol::Command::Get.new key
+        @cache.should_receive(:relay?).with(command.basket).exactly(1).and_return(true)
+
+        evaluated = false
+        repository = Castoro::Gateway::Repository.new @logger, @config
+        repository.if_relay_is_needed(command) { evaluated = true }
+        evaluated.should == true
+      end
+
+      it "should not evaluate yield when relays are suppressed." do
+        key     = Castoro::BasketKey.new 1, 2, 3
+        command = Castoro::Protocol::Command::Get.new key
+        @cache.should_receive(:relay?).with(command.basket).exactly(1).and_return(false)
+
+        evaluated = false
+        repository = Castoro::Gateway::Repository.new @logger, @config
+        repository.if_relay_is_needed(command) { evaluated = true }
+        evaluated.should == false
+      end
+    end
+
     context "when dump the cache" do
       it "cache#dump should be called once." do
         @cache.stub!(:dump)
@@ -226,6 +260,15 @@ describe Castoro::Gateway::Repository do
       end
     end
 
+    context "when purge the cache" do
+      it "cache#purge should be called once." do
+        @cache.should_receive(:purge).with("peer1").exactly(1).and_return(3)
+
+        repository = Castoro::Gateway::Repository.new @logger, @config
+        repository.purge("peer1").should == 3
+      end
+    end
+
     describe "multicast expectation" do
       before do
         @config["replication_count"] = 3
@@ -37,6 +37,7 @@ describe Castoro::Gateway::Workers do
 
     # mock for Castoro::Gateway::Repository
     @repository = mock(Castoro::Gateway::Repository)
+    @repository.stub!(:if_relay_is_needed).and_yield()
 
     # mock for Castoro::Sender::UDP::Multicast
     @sender = mock(Castoro::Sender::UDP::Multicast)
@@ -183,6 +184,23 @@ describe Castoro::Gateway::Workers do
         end
       end
 
+      context "When 8 GET commands is received, and relays of it got no answers" do
+        it "should not execute multicast to 8 GET commands" do
+          key = Castoro::BasketKey.new(1, 2, 3)
+          get = Castoro::Protocol::Command::Get.new(key)
+
+          commands = [ [@header, get] ] * 8
+          @facade.should_receive(:recv).at_least(1).and_return { commands.shift }
+
+          @repository.should_receive(:query).exactly(8).with(get).and_return(nil)
+          @repository.should_receive(:if_relay_is_needed).exactly(8).with(get)
+          @sender.should_not_receive(:multicast)
+
+          @w.start
+          sleep 1
+        end
+      end
+
       context "When 8 GET commands is received, and it exist in the cache" do
         it "should execute query and send the result to 8 GET commands" do
           key = Castoro::BasketKey.new(1, 2, 3)